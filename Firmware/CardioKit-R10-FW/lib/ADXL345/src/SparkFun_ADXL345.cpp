@@ -27,6 +27,12 @@ Arduino Uno
 #define ADXL345_DEVICE (0x53)    // Device Address for ADXL345
 #define ADXL345_TO_READ (6)      // Number of Bytes Read - Two Bytes Per Axis
 
+#define ADXL345_JOB_READ  (0)
+#define ADXL345_JOB_WRITE (1)
+#define ADXL345_JOB_ACCEL (2)
+#define ADXL345_JOB_FIFO  (3)
+#define ADXL345_JOB_BURST (4)
+
 ADXL345::ADXL345() {
 	status = ADXL345_OK;
 	error_code = ADXL345_NO_ERROR;
@@ -46,11 +52,11 @@ ADXL345::ADXL345(int CS) {
 	gains[2] = 0.00349265;
 	_CS = CS;
 	I2C = false;
-	SPI.begin();
-	SPI.setDataMode(SPI_MODE3);
-    SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE3));
+	SPI.begin();					// Every transfer runs in its own SPI transaction
 	pinMode(_CS, OUTPUT);
 	digitalWrite(_CS, HIGH);
+	_event.setContext(this);
+	_event.attachImmediate(asyncEvent);	// Steps the running job from the SPI DMA interrupt
 }
 
 void ADXL345::powerOn() {
@@ -127,6 +133,26 @@ int ADXL345::getFifoStatusSampleCount(){
     return (_b & B00111111);
 }
 
+/*************************** FIFO BURST *****************************/
+/*    Pops every queued entry into xyz (x, y, z per sample), up to    */
+/*    maxSamples. Returns the number of samples read                  */
+int ADXL345::readFifo(int16_t *xyz, int maxSamples){
+	int entries = getFifoStatusSampleCount();
+	if(entries > maxSamples){
+		entries = maxSamples;
+	}
+	for(int i = 0; i < entries; i++){
+		if(i > 0){
+			delayMicroseconds(5);	// FIFO needs 5us from the end of one entry to the next read
+		}
+		readFrom(ADXL345_DATAX0, ADXL345_TO_READ, _buff);	// Each multi-byte read of the data registers pops one entry
+		xyz[3 * i + 0] = (int16_t)((((int)_buff[1]) << 8) | _buff[0]);
+		xyz[3 * i + 1] = (int16_t)((((int)_buff[3]) << 8) | _buff[2]);
+		xyz[3 * i + 2] = (int16_t)((((int)_buff[5]) << 8) | _buff[4]);
+	}
+	return entries;
+}
+
 void ADXL345::get_Gxyz(double *xyz){
 	int i;
 	int xyz_int[3];
@@ -137,7 +163,23 @@ void ADXL345::get_Gxyz(double *xyz){
 }
 
 /***************** WRITES VALUE TO ADDRESS REGISTER *****************/
+/*    Configuration registers go through the shadow                 */
 void ADXL345::writeTo(byte address, byte val) {
+	if(isShadowed(address)) {
+		if(!_shadowValid) {
+			loadConfig();			// Before the write, the load would overwrite it
+		}
+		_shadow[address - ADXL345_SHADOW_FIRST] = val;
+		_dirty |= 1UL << (address - ADXL345_SHADOW_FIRST);
+		if(!_batch) {
+			commitConfig();
+		}
+		return;
+	}
+	writeToDevice(address, val);
+}
+
+void ADXL345::writeToDevice(byte address, byte val) {
 	if(I2C) {
 		writeToI2C(address, val);
 	}
@@ -148,7 +190,19 @@ void ADXL345::writeTo(byte address, byte val) {
 
 /************************ READING NUM BYTES *************************/
 /*    Reads Num Bytes. Starts from Address Reg to _buff Array        */
+/*    A single configuration register comes from the shadow         */
 void ADXL345::readFrom(byte address, int num, byte _buff[]) {
+	if(num == 1 && isShadowed(address)) {
+		if(!_shadowValid) {
+			loadConfig();
+		}
+		_buff[0] = _shadow[address - ADXL345_SHADOW_FIRST];
+		return;
+	}
+	readFromDevice(address, num, _buff);
+}
+
+void ADXL345::readFromDevice(byte address, int num, byte _buff[]) {
 	if(I2C) {
 		readFromI2C(address, num, _buff);	// If I2C Communication
 	}
@@ -157,6 +211,122 @@ void ADXL345::readFrom(byte address, int num, byte _buff[]) {
 	}
 }
 
+/************************** MULTI-BYTE WRITE ************************/
+/*      Consecutive registers from address in one transaction        */
+void ADXL345::writeBurst(byte address, int num, const byte buff[]) {
+	if(I2C) {
+		Wire.beginTransmission(ADXL345_DEVICE);
+		Wire.write(address);
+		for(int i = 0; i < num; i++) {
+			Wire.write(buff[i]);
+		}
+		Wire.endTransmission();
+		return;
+	}
+	while(_asyncBusy) {}
+	SPI.beginTransaction(SPISettings(SPIfreq, MSBFIRST, SPI_MODE3));
+	digitalWrite(_CS, LOW);
+	SPI.transfer(num > 1 ? (0x40 | address) : address);	// Multi-Byte: Bit 6 Set
+	for(int i = 0; i < num; i++) {
+		SPI.transfer(buff[i]);
+	}
+	digitalWrite(_CS, HIGH);
+	SPI.endTransaction();
+}
+
+/*************************** REGISTER SHADOW ************************/
+bool ADXL345::isShadowed(byte address) {
+	return address >= ADXL345_SHADOW_FIRST && address < ADXL345_SHADOW_FIRST + ADXL345_SHADOW_LEN &&
+		(ADXL345_SHADOW_MASK & (1UL << (address - ADXL345_SHADOW_FIRST)));
+}
+
+// Reads the device's configuration into the shadow, drops anything not committed
+void ADXL345::loadConfig() {
+	readFromDevice(ADXL345_THRESH_TAP, ADXL345_INT_MAP - ADXL345_THRESH_TAP + 1, _shadow);	// Stops short of INT_SOURCE, reading it clears the interrupts
+	readFromDevice(ADXL345_DATA_FORMAT, 1, &_shadow[ADXL345_DATA_FORMAT - ADXL345_SHADOW_FIRST]);
+	readFromDevice(ADXL345_FIFO_CTL, 1, &_shadow[ADXL345_FIFO_CTL - ADXL345_SHADOW_FIRST]);
+	_dirty = 0;
+	_shadowValid = true;
+}
+
+void ADXL345::beginConfig() {
+	if(!_shadowValid) {
+		loadConfig();
+	}
+	_batch = true;
+}
+
+// Takes the next contiguous block with dirty registers, from its first to its last dirty one
+// Returns the number of registers, 0 when nothing is dirty
+int ADXL345::takeDirtyRun(byte *address) {
+	if(_dirty == 0) {
+		return 0;
+	}
+	int first = __builtin_ctz(_dirty);
+	int end = first;
+	int last = first;
+	while(end < ADXL345_SHADOW_LEN && (ADXL345_SHADOW_MASK & (1UL << end))) {
+		if(_dirty & (1UL << end)) {
+			last = end;
+		}
+		end++;
+	}
+	for(int i = first; i <= last; i++) {
+		_dirty &= ~(1UL << i);
+	}
+	*address = ADXL345_SHADOW_FIRST + first;
+	return last - first + 1;
+}
+
+void ADXL345::commitConfig() {
+	byte address;
+	int num;
+	_batch = false;
+	while((num = takeDirtyRun(&address)) > 0) {
+		writeBurst(address, num, &_shadow[address - ADXL345_SHADOW_FIRST]);
+	}
+}
+
+// The bursts go to the DMA SPI engine, done runs after the last one with the bytes written
+bool ADXL345::commitConfigAsync(ADXL345Callback done, void *context) {
+	byte address[4];
+	int num[4];
+	int runs = 0;
+	int bytes = 0;
+	_batch = false;
+	while(runs < 4 && (num[runs] = takeDirtyRun(&address[runs])) > 0) {
+		bytes += num[runs];
+		runs++;
+	}
+	if(runs == 0) {
+		if(done) {
+			done(context, 0);
+		}
+		return true;
+	}
+	bool queued = true;
+	for(int i = 0; i < runs; i++) {
+		AsyncJob job = { ADXL345_JOB_BURST, address[i], (byte) num[i], 0, &_shadow[address[i] - ADXL345_SHADOW_FIRST], 0,
+			(i == runs - 1) ? done : NULL, context };
+		if(i == runs - 1) {
+			job.maxSamples = bytes;		// Reported to done
+		}
+		if(!queueJob(job)) {
+			if(i < runs - 1 && done) {
+				done(context, -1);		// The last job never got queued to report it
+			}
+			for(int r = i; r < runs; r++) {
+				for(int b = 0; b < num[r]; b++) {
+					_dirty |= 1UL << (address[r] - ADXL345_SHADOW_FIRST + b);	// Left for the next commit
+				}
+			}
+			queued = false;
+			break;
+		}
+	}
+	return queued;
+}
+
 /*************************** WRITE TO I2C ***************************/
 /*      Start; Send Register Address; Send Value To Write; End      */
 void ADXL345::writeToI2C(byte _address, byte _val) {
@@ -192,10 +362,13 @@ void ADXL345::readFromI2C(byte address, int num, byte _buff[]) {
 /************************** WRITE FROM SPI **************************/
 /*         Point to Destination; Write Value; Turn Off              */
 void ADXL345::writeToSPI(byte __reg_address, byte __val) {
+  while(_asyncBusy) {}			// Queued jobs go first, don't call from an ISR while they run
+  SPI.beginTransaction(SPISettings(SPIfreq, MSBFIRST, SPI_MODE3));
   digitalWrite(_CS, LOW);
   SPI.transfer(__reg_address);
   SPI.transfer(__val);
   digitalWrite(_CS, HIGH);
+  SPI.endTransaction();
 }
 
 /*************************** READ FROM SPI **************************/
@@ -208,12 +381,197 @@ void ADXL345::readFromSPI(byte __reg_address, int num, byte _buff[]) {
   	_address = _address | 0x40;
   }
 
+  while(_asyncBusy) {}			// Queued jobs go first, don't call from an ISR while they run
+  SPI.beginTransaction(SPISettings(SPIfreq, MSBFIRST, SPI_MODE3));
   digitalWrite(_CS, LOW);
   SPI.transfer(_address);		// Transfer Starting Reg Address To Be Read
   for(int i=0; i<num; i++){
     _buff[i] = SPI.transfer(0x00);
   }
   digitalWrite(_CS, HIGH);
+  SPI.endTransaction();
+}
+
+/***************************** ASYNC SPI ****************************/
+/*    Jobs run one after another on the DMA SPI engine, each in its */
+/*    own transaction. A FIFO burst reads FIFO_STATUS, then one      */
+/*    CS cycle per entry at ADXL345_FIFO_SPI_FREQ                    */
+static void unpackXYZ(const byte *b, int16_t *xyz) {
+	xyz[0] = (int16_t)((((int)b[1]) << 8) | b[0]);
+	xyz[1] = (int16_t)((((int)b[3]) << 8) | b[2]);
+	xyz[2] = (int16_t)((((int)b[5]) << 8) | b[4]);
+}
+
+bool ADXL345::readAsync(byte address, int num, byte *buff, ADXL345Callback done, void *context) {
+	if(num < 1 || num > ADXL345_TO_READ) {
+		status = ADXL345_ERROR;
+		error_code = ADXL345_BAD_ARG;
+		return false;
+	}
+	AsyncJob job = { ADXL345_JOB_READ, address, (byte) num, 0, buff, 0, done, context };
+	return queueJob(job);
+}
+
+bool ADXL345::writeAsync(byte address, byte val, ADXL345Callback done, void *context) {
+	if(isShadowed(address) && _shadowValid) {
+		_shadow[address - ADXL345_SHADOW_FIRST] = val;	// The job writes it, not dirty
+	}
+	AsyncJob job = { ADXL345_JOB_WRITE, address, 1, val, NULL, 0, done, context };
+	return queueJob(job);
+}
+
+bool ADXL345::readAccelAsync(int16_t *xyz, ADXL345Callback done, void *context) {
+	AsyncJob job = { ADXL345_JOB_ACCEL, ADXL345_DATAX0, ADXL345_TO_READ, 0, xyz, 1, done, context };
+	return queueJob(job);
+}
+
+bool ADXL345::readFifoAsync(int16_t *xyz, int maxSamples, ADXL345Callback done, void *context) {
+	AsyncJob job = { ADXL345_JOB_FIFO, ADXL345_DATAX0, ADXL345_TO_READ, 0, xyz, maxSamples, done, context };
+	return queueJob(job);
+}
+
+bool ADXL345::asyncBusy() {
+	return _asyncBusy;
+}
+
+// Returns false when the queue is full, the job is dropped
+bool ADXL345::queueJob(const AsyncJob &job) {
+	if(I2C) {						// No DMA engine on I2C, run it in place
+		runJob(job);
+		return true;
+	}
+	__disable_irq();				// Done callbacks queue from the DMA interrupt
+	uint8_t next = (_jobTail + 1) % (ADXL345_ASYNC_QUEUE + 1);
+	if(next == _jobHead) {
+		__enable_irq();
+		if(job.done) {
+			job.done(job.context, -1);
+		}
+		return false;
+	}
+	_jobs[_jobTail] = job;
+	_jobTail = next;
+	bool idle = !_asyncBusy;
+	_asyncBusy = true;
+	__enable_irq();
+	if(idle) {
+		startJob();
+	}
+	return true;
+}
+
+void ADXL345::runJob(const AsyncJob &job) {
+	int result;
+	switch(job.kind) {
+		case ADXL345_JOB_READ:
+			readFrom(job.address, job.num, (byte *) job.dest);
+			result = job.num;
+			break;
+		case ADXL345_JOB_WRITE:
+			writeTo(job.address, job.val);
+			result = 1;
+			break;
+		case ADXL345_JOB_ACCEL:
+			readFrom(ADXL345_DATAX0, ADXL345_TO_READ, _buff);
+			unpackXYZ(_buff, (int16_t *) job.dest);
+			result = 1;
+			break;
+		case ADXL345_JOB_BURST:
+			writeBurst(job.address, job.num, (const byte *) job.dest);
+			result = job.maxSamples;
+			break;
+		default:
+			result = readFifo((int16_t *) job.dest, job.maxSamples);
+	}
+	if(job.done) {
+		job.done(job.context, result);
+	}
+}
+
+void ADXL345::startTransfer(byte address, int num) {
+	_txBuf[0] = address;
+	digitalWrite(_CS, LOW);
+	SPI.transfer(_txBuf, _rxBuf, num + 1, _event);	// Address byte plus num, completes in asyncEvent
+}
+
+// The job at _jobHead, from the caller that found the engine idle or from finishJob
+void ADXL345::startJob() {
+	const AsyncJob &job = _jobs[_jobHead];
+	SPI.beginTransaction(SPISettings(job.kind == ADXL345_JOB_FIFO ? ADXL345_FIFO_SPI_FREQ : SPIfreq, MSBFIRST, SPI_MODE3));
+	memset(_txBuf, 0, sizeof(_txBuf));
+	if(job.kind == ADXL345_JOB_WRITE) {
+		_txBuf[1] = job.val;
+		startTransfer(job.address, 1);
+	}
+	else if(job.kind == ADXL345_JOB_BURST) {
+		memcpy(&_txBuf[1], job.dest, job.num);	// The shadow as it is now, a later change marks it dirty again
+		startTransfer(job.num > 1 ? (0x40 | job.address) : job.address, job.num);
+	}
+	else if(job.kind == ADXL345_JOB_FIFO) {
+		_fifoLeft = -1;				// Entry count still to come
+		_fifoCount = 0;
+		startTransfer(0x80 | ADXL345_FIFO_STATUS, 1);
+	}
+	else {
+		startTransfer(0x80 | (job.num > 1 ? 0x40 : 0) | job.address, job.num);
+	}
+}
+
+void ADXL345::stepJob() {
+	digitalWrite(_CS, HIGH);
+	const AsyncJob &job = _jobs[_jobHead];
+	switch(job.kind) {
+		case ADXL345_JOB_READ:
+			memcpy(job.dest, &_rxBuf[1], job.num);
+			finishJob(job.num);
+			return;
+		case ADXL345_JOB_WRITE:
+			finishJob(1);
+			return;
+		case ADXL345_JOB_BURST:
+			finishJob(job.maxSamples);
+			return;
+		case ADXL345_JOB_ACCEL:
+			unpackXYZ(&_rxBuf[1], (int16_t *) job.dest);
+			finishJob(1);
+			return;
+	}
+	if(_fifoLeft < 0) {
+		_fifoLeft = _rxBuf[1] & B00111111;
+		if(_fifoLeft > job.maxSamples) {
+			_fifoLeft = job.maxSamples;
+		}
+	}
+	else {
+		unpackXYZ(&_rxBuf[1], (int16_t *) job.dest + 3 * _fifoCount);
+		_fifoCount++;
+		_fifoLeft--;
+	}
+	if(_fifoLeft > 0) {
+		memset(_txBuf, 0, sizeof(_txBuf));
+		startTransfer(0x80 | 0x40 | ADXL345_DATAX0, ADXL345_TO_READ);	// Each entry pops on its own CS cycle
+		return;
+	}
+	finishJob(_fifoCount);
+}
+
+void ADXL345::finishJob(int result) {
+	AsyncJob job = _jobs[_jobHead];	// The slot is free once the head moves
+	SPI.endTransaction();
+	_jobHead = (_jobHead + 1) % (ADXL345_ASYNC_QUEUE + 1);
+	if(job.done) {
+		job.done(job.context, result);	// May queue the next job
+	}
+	if(_jobHead != _jobTail) {
+		startJob();
+	}
+	else {
+		_asyncBusy = false;
+	}
+}
+
+void ADXL345::asyncEvent(EventResponderRef event) {
+	((ADXL345 *) event.getContext())->stepJob();
 }
 
 /*************************** RANGE SETTING **************************/
@@ -17,6 +17,7 @@ Arduino Uno
 */
 
 #include "Arduino.h"
+#include <EventResponder.h>
 
 #ifndef ADXL345_h
 #define ADXL345_h
@@ -113,6 +114,25 @@ Arduino Uno
 #define ADXL345_READ_ERROR	1		// Accelerometer Reading Error
 #define ADXL345_BAD_ARG		2		// Bad Argument
 
+ /************************** ASYNC SPI *******************************/
+// Register reads/writes and FIFO bursts queued to the DMA SPI engine (SPI mode only,
+// I2C runs them in place). Each job is one SPI transaction, the done callback runs
+// from the SPI DMA interrupt with the job's result (bytes or samples, -1 if dropped)
+#define ADXL345_ASYNC_QUEUE		6		// Jobs in flight, the running one included
+#define ADXL345_FIFO_SPI_FREQ	1600000	// At or below 1.6MHz the address byte covers the 5us FIFO pop
+
+typedef void (*ADXL345Callback)(void *context, int result);
+
+ /************************ REGISTER SHADOW ***************************/
+// The configuration registers are mirrored in RAM, loaded with one burst on first use.
+// Getters and bit setters don't read the bus. Writes go straight through, or between
+// beginConfig() and commitConfig() only mark the register dirty; the commit writes the
+// dirty span of each contiguous block in one multi-byte burst
+#define ADXL345_SHADOW_FIRST	ADXL345_THRESH_TAP
+#define ADXL345_SHADOW_LEN		(ADXL345_FIFO_CTL - ADXL345_THRESH_TAP + 1)
+#define ADXL345_SHADOW_MASK		0x0817BFFFUL	// Bit per register from THRESH_TAP, not ACT_TAP_STATUS, INT_SOURCE or the data
+#define ADXL345_SHADOW_BURST	14				// Longest block, THRESH_TAP to TAP_AXES
+
 
 class ADXL345
 {
@@ -133,6 +153,18 @@ public:
     void setFifoMode(int mode, int samples, int trigger_int);
     int getFifoMode();
     int getFifoStatusSampleCount();
+    int readFifo(int16_t *xyz, int maxSamples);
+
+	bool readAsync(byte address, int num, byte *buff, ADXL345Callback done, void *context);	// num up to 6
+	bool writeAsync(byte address, byte val, ADXL345Callback done, void *context);
+	bool readAccelAsync(int16_t *xyz, ADXL345Callback done, void *context);
+	bool readFifoAsync(int16_t *xyz, int maxSamples, ADXL345Callback done, void *context);
+	bool asyncBusy();
+
+	void loadConfig();
+	void beginConfig();
+	void commitConfig();
+	bool commitConfigAsync(ADXL345Callback done, void *context);
 	void setTapThreshold(int tapThreshold);
 	int getTapThreshold();
 	void setAxisGains(double *_gains);
@@ -233,6 +265,11 @@ public:
 
 private:
 	void writeTo(byte address, byte val);
+	void writeToDevice(byte address, byte val);
+	void readFromDevice(byte address, int num, byte buff[]);
+	void writeBurst(byte address, int num, const byte buff[]);
+	bool isShadowed(byte address);
+	int takeDirtyRun(byte *address);
 	void writeToI2C(byte address, byte val);
 	void writeToSPI(byte address, byte val);
 	void readFrom(byte address, int num, byte buff[]);
@@ -244,6 +281,38 @@ private:
 	int _CS = 10;
 	bool I2C = true;
 	unsigned long SPIfreq = 5000000;
+
+	typedef struct {
+		byte kind;
+		byte address;
+		byte num;
+		byte val;
+		void *dest;
+		int maxSamples;
+		ADXL345Callback done;
+		void *context;
+	} AsyncJob;
+	bool queueJob(const AsyncJob &job);
+	void runJob(const AsyncJob &job);
+	void startJob();
+	void startTransfer(byte address, int num);
+	void finishJob(int result);
+	void stepJob();
+	static void asyncEvent(EventResponderRef event);
+	AsyncJob _jobs[ADXL345_ASYNC_QUEUE + 1];	// Ring, one slot always free
+	volatile uint8_t _jobHead = 0;		// Running job while _asyncBusy
+	volatile uint8_t _jobTail = 0;
+	volatile bool _asyncBusy = false;
+	byte _txBuf[ADXL345_SHADOW_BURST + 1];
+	byte _rxBuf[7];
+	int _fifoLeft = 0;
+	int _fifoCount = 0;
+	EventResponder _event;
+
+	byte _shadow[ADXL345_SHADOW_LEN];
+	uint32_t _dirty = 0;				// Bit per shadow register
+	bool _shadowValid = false;
+	bool _batch = false;
 };
 void print_byte(byte val);
 #endif
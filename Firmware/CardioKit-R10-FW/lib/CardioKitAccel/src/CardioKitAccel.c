@@ -0,0 +1,307 @@
+/*  *********************************************
+    CardioKitAccel.c
+    Accelerometer samples to posture, fixed point
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitAccel.h"
+#include "CardioKitProfile.h"
+#include <Arduino.h>
+#include <string.h>
+
+#if ADXL_RANGE_G != 2
+#error "The orientation squares assume 2g, 10 bit readings. Shrink MEAN_SHIFT before widening ADXL_RANGE_G"
+#endif
+
+#define CORDIC_STEPS      14
+#define CORDIC_NORM_BITS  23       // inputs are scaled to [2^22, 2^23), the CORDIC gain of 1.65 keeps them clear of 2^31
+#define MDEG_PER_DECIDEG  100
+#define MEAN_SHIFT        4        // per frame means are kept in 1/16 count
+#define MG_PER_LSB_X10    39       // full resolution, 3.9mg per count in every range
+#define ACCEL_REF_SAMPLES 32       // power of two, 640ms at 50Hz
+#define TICKS_PER_SAMPLE  ((ADC_PDB_FREQ_HZ) / (ADXL_ODR_HZ))
+#define TICK_SYNC_SHIFT   3        // a burst's stamp moves the predicted tick by 1/8 of the difference
+#define PERIOD_SYNC_SHIFT 6        // and the sample period by 1/64 of it, per sample
+#define PERIOD_NOMINAL_Q8 ((TICKS_PER_SAMPLE) << 8)
+#define PERIOD_SPAN_Q8    ((PERIOD_NOMINAL_Q8) / 20) // the ADXL's clock is within 5%
+#define INT_QUEUE         8        // power of two, INT1 stays high until the source is read so one is usually enough
+#define INT_RECORD_BYTES  7
+
+// atan(2^-i) in 1/1000 degree
+static const int32_t AtanTable[CORDIC_STEPS] =
+{
+    45000, 26565, 14036, 7125, 3576, 1790, 895, 448, 224, 112, 56, 28, 14, 7
+};
+
+static volatile int32_t SumX = 0, SumY = 0, SumZ = 0;
+static volatile uint16_t SumCount = 0;
+static uint16_t Tilt = 0;
+#if ACCEL_ORIENT_PRESENT
+static uint16_t Orient[3] = {0, 0, 0};
+#endif
+
+static int16_t  RefXyz[ACCEL_REF_SAMPLES][3];
+static uint32_t RefTick[ACCEL_REF_SAMPLES];
+static uint8_t  RefHead = 0;  // next entry written
+static uint8_t  RefCount = 0;
+static uint32_t RefNewestTick = 0;
+static int32_t  RefPeriodQ8 = PERIOD_NOMINAL_Q8; // PDB ticks per ADXL sample, Q8
+
+// Written by the INT1 ISR only at the head, loop() only moves the tail
+static volatile uint32_t IntTicks[INT_QUEUE];
+static volatile uint8_t  IntHead = 0;
+static volatile uint8_t  IntTail = 0;
+static volatile uint8_t  IntDropped = 0;
+
+void initializeAccel()
+{
+    SumX = 0;
+    SumY = 0;
+    SumZ = 0;
+    SumCount = 0;
+    Tilt = 0;
+    RefHead = 0;
+    RefCount = 0;
+    RefPeriodQ8 = PERIOD_NOMINAL_Q8;
+    IntHead = 0;
+    IntTail = 0;
+    IntDropped = 0;
+}
+
+void AccelQueueInterrupt(uint32_t tick)
+{
+    uint8_t head = IntHead;
+    if((uint8_t) (head - IntTail) >= INT_QUEUE)
+    {
+        if(IntDropped < 255) { IntDropped++; }
+        return;
+    }
+    IntTicks[head % INT_QUEUE] = tick;
+    IntHead = head + 1;
+}
+
+uint8_t AccelInterruptsPending()
+{
+    return (uint8_t) (IntHead - IntTail);
+}
+
+uint8_t AccelReportInterrupt(uint8_t edges, uint8_t source, uint8_t tapStatus, uint8_t enabled)
+{
+    if(edges == 0) { return 0; }
+    uint32_t tick = IntTicks[IntTail % INT_QUEUE];
+    IntTail += edges;
+    uint8_t events = source & enabled & ACCEL_EVENT_MASK;
+    if(events == 0) { return 0; } // an edge whose event the read before already cleared
+
+    uint8_t rec[INT_RECORD_BYTES];
+    memcpy(&rec[0], &tick, 4); // little-endian
+    rec[4] = events;
+    rec[5] = tapStatus;
+    rec[6] = IntDropped;
+    IntDropped = 0;
+    QueueEventRecord(EVENT_RECORD_ACCEL, rec, INT_RECORD_BYTES);
+    return 1;
+}
+
+int32_t AccelGetPeriodQ8()
+{
+    return RefPeriodQ8;
+}
+
+void AccelSeedPeriodQ8(int32_t periodQ8)
+{
+    if(periodQ8 > PERIOD_NOMINAL_Q8 + PERIOD_SPAN_Q8 || periodQ8 < PERIOD_NOMINAL_Q8 - PERIOD_SPAN_Q8) { return; }
+    RefPeriodQ8 = periodQ8;
+}
+
+static void AddRefSamples(const int16_t * xyz, uint8_t count, uint32_t tick)
+{
+    uint32_t stamped = tick - TICKS_PER_SAMPLE / 2; // the newest entry was latched within the last sample period
+    uint32_t predicted = RefNewestTick + (uint32_t) ((count * RefPeriodQ8) >> 8);
+    int32_t err = (int32_t) (stamped - predicted);
+    if(RefCount == 0 || err > 4 * TICKS_PER_SAMPLE || err < -4 * TICKS_PER_SAMPLE)
+    { // first burst, or samples were lost to a FIFO overrun. Restart so the stamps stay in order
+        RefNewestTick = stamped;
+        RefCount = 0;
+    }
+    else
+    { // second order, the period term takes out the lag a clock offset would leave
+        RefNewestTick = predicted + err / (1 << TICK_SYNC_SHIFT);
+        RefPeriodQ8 += (err * (256 >> PERIOD_SYNC_SHIFT)) / count;
+        if(RefPeriodQ8 > PERIOD_NOMINAL_Q8 + PERIOD_SPAN_Q8) { RefPeriodQ8 = PERIOD_NOMINAL_Q8 + PERIOD_SPAN_Q8; }
+        if(RefPeriodQ8 < PERIOD_NOMINAL_Q8 - PERIOD_SPAN_Q8) { RefPeriodQ8 = PERIOD_NOMINAL_Q8 - PERIOD_SPAN_Q8; }
+    }
+    for(uint8_t i = 0; i < count; i++)
+    {
+        RefXyz[RefHead][0] = xyz[3 * i + 0];
+        RefXyz[RefHead][1] = xyz[3 * i + 1];
+        RefXyz[RefHead][2] = xyz[3 * i + 2];
+        RefTick[RefHead] = RefNewestTick - (uint32_t) (((count - 1 - i) * RefPeriodQ8) >> 8);
+        RefHead = (RefHead + 1) % ACCEL_REF_SAMPLES;
+    }
+    RefCount = (RefCount + count > ACCEL_REF_SAMPLES) ? ACCEL_REF_SAMPLES : RefCount + count;
+}
+
+uint8_t AccelSampleAt(uint32_t tick, int32_t * xyz)
+{
+    if(RefCount == 0) { return 0; }
+    uint8_t newer = (RefHead + ACCEL_REF_SAMPLES - 1) % ACCEL_REF_SAMPLES;
+    uint8_t older = newer;
+    for(uint8_t n = 1; n < RefCount && (int32_t) (tick - RefTick[older]) < 0; n++)
+    { // callers ask for the last frame, a few entries back from the newest
+        newer = older;
+        older = (older + ACCEL_REF_SAMPLES - 1) % ACCEL_REF_SAMPLES;
+    }
+    if(older == newer || (int32_t) (tick - RefTick[older]) < 0)
+    { // past the newest sample or before the oldest one kept
+        for(uint8_t a = 0; a < 3; a++) { xyz[a] = (int32_t) RefXyz[older][a] * (1 << MEAN_SHIFT); }
+        return 1;
+    }
+    int32_t span = (int32_t) (RefTick[newer] - RefTick[older]); // the stamps only ever increase
+    int32_t into = (int32_t) (tick - RefTick[older]);
+    int32_t frac = (into << 8) / span; // Q8
+    for(uint8_t a = 0; a < 3; a++)
+    {
+        int32_t v0 = RefXyz[older][a];
+        int32_t v1 = RefXyz[newer][a];
+        xyz[a] = v0 * (1 << MEAN_SHIFT) + (((v1 - v0) * frac) >> (8 - MEAN_SHIFT));
+    }
+    return 1;
+}
+
+void AccelAddSamples(const int16_t * xyz, uint8_t count, uint32_t tick)
+{
+    if(count == 0) { return; }
+    AddRefSamples(xyz, count, tick);
+    int32_t x = 0, y = 0, z = 0;
+    for(uint8_t i = 0; i < count; i++)
+    {
+        x += xyz[3 * i + 0];
+        y += xyz[3 * i + 1];
+        z += xyz[3 * i + 2];
+    }
+    SumX += x;
+    SumY += y;
+    SumZ += z;
+    SumCount += count;
+}
+
+int16_t AccelAtan2(int32_t y, int32_t x)
+{
+    if(x == 0 && y == 0) { return 0; }
+    int32_t angle = 0;
+    if(x < 0)
+    { // rotate into the right half plane, CORDIC only converges within +-99 degrees
+        x = -x;
+        y = -y;
+        angle = 180000;
+    }
+    uint32_t m = (uint32_t) ((x > (y < 0 ? -y : y)) ? x : (y < 0 ? -y : y));
+    int8_t shift = (int8_t) __builtin_clz(m) - (32 - CORDIC_NORM_BITS);
+    if(shift > 0)
+    {
+        x <<= shift;
+        y <<= shift;
+    }
+    else
+    {
+        x >>= -shift;
+        y >>= -shift;
+    }
+    for(uint8_t i = 0; i < CORDIC_STEPS; i++)
+    { // rotate (x, y) onto the x axis, the rotations add up to the angle
+        int32_t dx = x >> i;
+        int32_t dy = y >> i;
+        if(y > 0)
+        {
+            x += dy;
+            y -= dx;
+            angle += AtanTable[i];
+        }
+        else
+        {
+            x -= dy;
+            y += dx;
+            angle -= AtanTable[i];
+        }
+    }
+    if(angle > 180000) { angle -= 360000; }
+    angle += (angle >= 0) ? (MDEG_PER_DECIDEG / 2) : -(MDEG_PER_DECIDEG / 2);
+    return (int16_t) (angle / MDEG_PER_DECIDEG);
+}
+
+uint16_t AccelTiltAngle(int32_t x, int32_t y)
+{
+    // the tilt convention is atan2 turned by half a turn
+    return (uint16_t) (((1800 + AccelAtan2(y, x) + 5) / 10) % 360);
+}
+
+uint32_t AccelIsqrt(uint32_t v)
+{
+    uint32_t root = 0;
+    uint32_t bit = 1UL << 30;
+    while(bit > v) { bit >>= 2; }
+    while(bit != 0)
+    {
+        if(v >= root + bit)
+        {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+void AccelFillFrame(SampleFrame_t * frame)
+{
+    __disable_irq(); // AccelAddSamples runs from the SPI DMA interrupt
+    int32_t x = SumX, y = SumY, z = SumZ;
+    uint16_t count = SumCount;
+    SumX = 0;
+    SumY = 0;
+    SumZ = 0;
+    SumCount = 0;
+    __enable_irq();
+
+    if(count > 0)
+    {
+        PROFILE_BEGIN(PROFILE_SITE_ACCEL_ANGLE);
+        Tilt = AccelTiltAngle(x, y); // the angle of the sum is the angle of the mean
+#if ACCEL_ORIENT_PRESENT
+        // at 2g the readings are 10 bit, |mean| <= 2^9 counts, 2^13 in 1/16 count, so the sum of three squares stays below 2^28
+        int32_t mx = (x * (1 << MEAN_SHIFT)) / count;
+        int32_t my = (y * (1 << MEAN_SHIFT)) / count;
+        int32_t mz = (z * (1 << MEAN_SHIFT)) / count;
+        uint32_t yz = AccelIsqrt((uint32_t) (my * my + mz * mz));
+        uint32_t mag = AccelIsqrt((uint32_t) (mx * mx + my * my + mz * mz));
+        Orient[ORIENT_WORD_PITCH]     = (uint16_t) AccelAtan2(-mx, (int32_t) yz);
+        Orient[ORIENT_WORD_ROLL]      = (uint16_t) AccelAtan2(my, mz);
+        Orient[ORIENT_WORD_MAGNITUDE] = (uint16_t) ((mag * MG_PER_LSB_X10 + (10 << MEAN_SHIFT) / 2) / (10 << MEAN_SHIFT));
+#endif
+        PROFILE_END(PROFILE_SITE_ACCEL_ANGLE);
+    }
+#if ACCEL_PRESENT
+    for(uint8_t i = 0; i < ACCEL_SAMPLES_PER_FRAME; i++)
+    {
+        frame->accel[i] = Tilt;
+    }
+#endif
+#if ACCEL_ORIENT_PRESENT
+    for(uint8_t w = 0; w < 3; w++)
+    {
+        for(uint8_t i = 0; i < ORIENT_SAMPLES_PER_FRAME; i++)
+        {
+            frame->orient[w][i] = Orient[w];
+        }
+    }
+#endif
+}
@@ -0,0 +1,112 @@
+/*  *********************************************
+    CardioKitAccel.h
+    Accelerometer samples to posture, fixed point
+
+    The ADXL345 FIFO is burst read at every frame end, the samples are
+    summed as they arrive and averaged into one reading per frame. At
+    ADXL_ODR_HZ every frame has 5 or 6 of them. Angles come from a 14 step CORDIC atan2 in
+    integer math, accurate to the 0.1 degree it reports. The M4F has
+    no double precision FPU, the atan() it replaces ran as software
+    double emulation and divided by zero at x == 0.
+    PROFILE_SITE_ACCEL_ANGLE times the angles of each frame.
+
+    STREAM_ID_ACCEL, tilt in the board plane, 0-359 degrees: 0 towards
+    the left shoulder, 90 towards the feet, 270 towards the head.
+
+    STREAM_ID_ORIENT (ACCEL_ORIENT_PRESENT), width 3, one per frame:
+        int16  pitch         0.1 degree, atan2(-x, sqrt(y^2 + z^2))
+        int16  roll          0.1 degree, atan2(y, z)
+        uint16 magnitude     mg, ~1000 at rest, off from 1000 while moving
+
+    The last ACCEL_REF_SAMPLES samples are also kept with the PDB tick
+    they were taken at, for CardioKitMotion. A burst is stamped when it
+    completes, the newest entry was latched up to one ADXL sample
+    earlier. That jitter is smoothed out by predicting each burst from
+    the last one and pulling the prediction 1/8 of the way to the stamp.
+    The sample period is tracked the same way, the ADXL runs off its
+    own clock and a fixed ADXL_ODR_HZ would leave the stamps lagging.
+
+    Tap, double tap, activity and free fall raise INT1. Its ISR only
+    queues the PDB tick of the edge, loop() reads ACT_TAP_STATUS to
+    INT_SOURCE in one async burst once the bus is free, and
+    AccelReportInterrupt turns them into an annotation record stamped
+    with that tick.
+
+    EVENT_RECORD_ACCEL:
+        uint32 tick          PDB tick of the INT1 edge, the DAC record timebase
+        uint8  events        ACCEL_EVENT_* that fired, INT_SOURCE bits
+        uint8  tapStatus     ACT_TAP_STATUS, the axes that saw the tap or activity
+        uint8  dropped       edges lost to a full queue since the last record
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_ACCEL_H
+#define CARDIOKIT_ACCEL_H
+#include <WProgram.h>
+#include "hwsettings.h"
+#include "CardioKitFrame.h"
+
+#define ORIENT_WORD_PITCH     0
+#define ORIENT_WORD_ROLL      1
+#define ORIENT_WORD_MAGNITUDE 2
+
+// EVENT_RECORD_ACCEL events, the ADXL345 INT_SOURCE bit positions
+#define ACCEL_EVENT_SINGLE_TAP 0x40
+#define ACCEL_EVENT_DOUBLE_TAP 0x20
+#define ACCEL_EVENT_ACTIVITY   0x10
+#define ACCEL_EVENT_INACTIVITY 0x08
+#define ACCEL_EVENT_FREE_FALL  0x04
+#define ACCEL_EVENT_MASK       0x7C
+
+// call this in setup before the accelerometer FIFO is drained
+void initializeAccel();
+
+// Add a burst of samples, x, y, z interleaved, read out of the FIFO by PDB tick tick
+// Called from the SPI DMA interrupt
+void AccelAddSamples(const int16_t * xyz, uint8_t count, uint32_t tick);
+
+// Reading at a PDB tick in 1/16 count, linearly interpolated between the samples around it
+// Ticks past the newest sample hold it, ones before the oldest kept sample hold that
+// Returns 0 before any sample arrived. Call while no burst is in flight
+uint8_t AccelSampleAt(uint32_t tick, int32_t * xyz);
+
+// The ADXL sample period tracked against the PDB, in Q8 PDB ticks
+// Seeding it after initializeAccel saves the tracking loop the first few seconds, values outside +-5% of nominal are ignored
+int32_t AccelGetPeriodQ8();
+void AccelSeedPeriodQ8(int32_t periodQ8);
+
+// Note an INT1 edge at PDB tick tick, from the pin interrupt. Nothing but the queue is touched
+void AccelQueueInterrupt(uint32_t tick);
+
+// Edges queued whose source has not been reported yet
+uint8_t AccelInterruptsPending();
+
+// Queue the annotation from what loop() read of ACT_TAP_STATUS and INT_SOURCE, stamped with the oldest edge
+// The read clears every latched event, edges is AccelInterruptsPending() from when it was started
+// enabled is INT_ENABLE, events it doesn't enable are not reported. Returns 1 if a record was queued
+uint8_t AccelReportInterrupt(uint8_t edges, uint8_t source, uint8_t tapStatus, uint8_t enabled);
+
+// Average of the samples added since the last frame into the accelerometer streams
+// Once per frame from loop() after the frame end burst, only a frame without new samples (a failed burst) repeats the last reading
+void AccelFillFrame(SampleFrame_t * frame);
+
+// atan2(y, x) in 0.1 degree, -1800 to 1800. 0 for (0, 0)
+int16_t AccelAtan2(int32_t y, int32_t x);
+
+// Tilt of (x, y) in whole degrees 0-359, the STREAM_ID_ACCEL convention
+uint16_t AccelTiltAngle(int32_t x, int32_t y);
+
+// floor(sqrt(v))
+uint32_t AccelIsqrt(uint32_t v);
+
+#endif //CARDIOKIT_ACCEL_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,53 @@
+/*  *********************************************
+    CardioKitBoot.c
+    Boot stage timestamps
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitBoot.h"
+#include <Arduino.h>
+#include <string.h>
+#include "CardioKitFrame.h"
+
+#define BOOT_RECORD_BYTES (1 + 4 * (NUM_BOOT_STAGES))
+
+static uint32_t BootMicros[NUM_BOOT_STAGES];
+
+static const char * const BootStageNames[NUM_BOOT_STAGES] =
+{
+    [BOOT_STAGE_SETUP]       = "setup",
+    [BOOT_STAGE_ESP]         = "ESP enable",
+    [BOOT_STAGE_ACCEL]       = "ADXL",
+    [BOOT_STAGE_FRONTEND]    = "mux/DAC",
+    [BOOT_STAGE_ADC]         = "ADC",
+    [BOOT_STAGE_ACQUISITION] = "acquisition",
+    [BOOT_STAGE_SETUP_DONE]  = "setup done",
+    [BOOT_STAGE_LINK]        = "Start Ack",
+};
+
+void BootMark(BootStage_t stage)
+{
+    BootMicros[stage] = micros();
+}
+
+uint32_t GetBootMicros(BootStage_t stage)
+{
+    return BootMicros[stage];
+}
+
+const char * GetBootStageName(BootStage_t stage)
+{
+    return BootStageNames[stage];
+}
+
+uint8_t QueueBootRecord()
+{
+    uint8_t rec[BOOT_RECORD_BYTES];
+    rec[0] = NUM_BOOT_STAGES;
+    memcpy(&rec[1], BootMicros, sizeof(BootMicros)); // little-endian
+    return QueueEventRecord(EVENT_RECORD_BOOT, rec, BOOT_RECORD_BYTES);
+}
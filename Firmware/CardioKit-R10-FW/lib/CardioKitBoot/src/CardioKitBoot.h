@@ -0,0 +1,57 @@
+/*  *********************************************
+    CardioKitBoot.h
+    Boot stage timestamps
+
+    setup() marks each stage as it completes with micros() since reset,
+    which starts counting in the core's reset handler before setup().
+    Nothing in setup() waits on a fixed delay: the ESP12 is enabled
+    first and boots while the rest comes up, both ADCs calibrate in
+    hardware from the ADC library's constructor until CalibrateAdc needs
+    them, the LED display runs from a timer and the host's Start Ack is
+    picked up by loop() while acquisition already runs.
+
+    EVENT_RECORD_BOOT, once the Start Ack arrived:
+        uint8  numStages
+        uint32 micros[numStages]  since reset, BootStage_t order, 0 if not reached
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_BOOT_H
+#define CARDIOKIT_BOOT_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+typedef enum
+{
+    BOOT_STAGE_SETUP = 0,    // setup() entered, the core's startup is before it
+    BOOT_STAGE_ESP,          // ESP12 enabled, it boots in parallel from here
+    BOOT_STAGE_ACCEL,        // ADXL345 configured
+    BOOT_STAGE_FRONTEND,     // mux, DAC and scan slots
+    BOOT_STAGE_ADC,          // both ADCs calibrated or restored and configured
+    BOOT_STAGE_ACQUISITION,  // PDB started, samples are coming in
+    BOOT_STAGE_SETUP_DONE,
+    BOOT_STAGE_LINK,         // Start Ack from the host, frames go out from here
+    NUM_BOOT_STAGES
+} BootStage_t;
+
+// Stamp a stage with micros() since reset
+void BootMark(BootStage_t stage);
+
+uint32_t GetBootMicros(BootStage_t stage);
+
+const char * GetBootStageName(BootStage_t stage);
+
+// Queue EVENT_RECORD_BOOT, returns 0 if it did not fit and should be tried again once the event frame went out
+uint8_t QueueBootRecord();
+
+#endif //CARDIOKIT_BOOT_H
+#ifdef __cplusplus
+}
+#endif
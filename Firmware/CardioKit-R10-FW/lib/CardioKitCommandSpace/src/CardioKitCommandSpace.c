@@ -5,20 +5,139 @@
 */
 #include "CardioKitCommandSpace.h"
 #include <Arduino.h>
+#include <string.h>
+#include "CardioKitFrame.h"
 #include "CardioKitLEDS.h"
+#include "CardioKitFilter.h"
+#include "CardioKitProfile.h"
+#include "CardioKitDac.h"
+#include "qcepMux.h"
+#include "CardioKitScan.h"
+#include "CardioKitMotion.h"
+#include "CardioKitMonitor.h"
+#include "CardioKitWarmStart.h"
 
 typedef enum
 {
     NO_OP = 0x00,
     CKCMD_LED_ON = 0x01,
     CKCMD_LED_OFF = 0x02,
-    CKCMD_LED_FLASH = 0x03
+    CKCMD_LED_FLASH = 0x03,     // value bits 0-15: period in ms, 16-23: flashes
+    CKCMD_FILTER_SELECT = 0x04, // value bit 0: filtered ECG, bit 1: filtered PCG
+    CKCMD_FILTER_NOTCH = 0x05,  // value: mains notch in Hz, 0 removes it. CKARG_FLOAT for 50.0 or 59.94
+    CKCMD_PROFILE_DUMP = 0x06,  // value bit 0: reset the profile once it has been sent
+    CKCMD_MUX_LEAD = 0x07,      // value bits 0-2: channel, 3-5: U6 (-) input, 6-8: U7 (+) input, 9-11: settle ticks (below PDB_TICKS_PER_ECG_SLOT)
+    CKCMD_SCAN_FOCUS = 0x08,    // value: leads the scan layout keeps, 0 every live lead
+    CKCMD_MOTION_MODE = 0x09,   // value: MOTION_MODE_OFF, _LEARN or _CANCEL
+    CKCMD_PING = 0x0A,          // answers with value, for the host to time the round trip
+    CKCMD_GET_CONFIG = 0x0B,    // index: CKCFG_*, answers with the parameter
+    CKCMD_LINK_PACING = 0x0C,   // value: microseconds between packets, answers with the pacing in effect
+    CKCMD_DAC_OVERRIDE = 0x0D,  // index: channel, value: DAC code, answers with the code it replaced
+    CKCMD_DAC_RELEASE = 0x0E,   // index: channel, hands it back to the offset loop
+    CKCMD_FILTER_COEF = 0x0F,   // index bits 0-3: b0, b1, b2, a1, a2, 4-7: stage, 8: chain. value: the coefficient, CKARG_FLOAT
+    CKCMD_FILTER_LOAD = 0x10    // index: chain, value: stages. Loads the coefficients staged so far, resets the chain
 } HostCommand_t;
 
-void HandleCloudCommand(uint32_t cmd)
+#define BIQUAD_COEFFS 5
+
+// CKCMD_FILTER_COEF fills these one coefficient at a time, CKCMD_FILTER_LOAD swaps them in whole
+static BiquadCoeffs_t StagedCoeffs[NUM_FILTER_CHAINS][FILTER_MAX_STAGES];
+
+static void QueueResponse(const CkCommand_t * cmd, uint8_t status, uint32_t value, uint32_t startMicros)
+{
+    uint8_t rec[CKCMD_RESPONSE_BYTES];
+    uint32_t elapsed = micros() - startMicros;
+    uint16_t execMicros = (elapsed > 0xFFFF) ? 0xFFFF : (uint16_t) elapsed;
+    uint32_t waitMicros = startMicros - cmd->receivedMicros;
+    memcpy(&rec[0], &cmd->id, 2); // little-endian
+    rec[2] = cmd->opcode;
+    rec[3] = status;
+    memcpy(&rec[4], &value, 4);
+    memcpy(&rec[8], &execMicros, 2);
+    memcpy(&rec[10], &waitMicros, 4);
+    rec[14] = cmd->droppedBefore;
+    QueueEventRecord(EVENT_RECORD_RESPONSE, rec, CKCMD_RESPONSE_BYTES);
+    FlushEventFrame(); // the host is waiting on it
+}
+
+// The value as a float whatever type it was sent as
+static float ArgFloat(const CkCommand_t * cmd)
+{
+    if(cmd->argType == CKARG_FLOAT)
+    {
+        float f;
+        memcpy(&f, &cmd->value, 4);
+        return f;
+    }
+    if(cmd->argType == CKARG_INT) { return (float) (int32_t) cmd->value; }
+    return (float) cmd->value;
+}
+
+static uint8_t StageFilterCoefficient(uint16_t index, float coeff)
+{
+    uint8_t c     = index & 0xF;
+    uint8_t stage = (index >> 4) & 0xF;
+    uint8_t chain = (index >> 8) & 0x1;
+    if(c >= BIQUAD_COEFFS || stage >= FILTER_MAX_STAGES) { return CKCMD_ERR_ARG; }
+    if(!(coeff > -2.0f && coeff < 2.0f)) { return CKCMD_ERR_ARG; } // the fixed-point formats hold +/-2, NaN fails too
+    float * stageCoeffs = &StagedCoeffs[chain][stage].b0; // b0, b1, b2, a1, a2 in order
+    stageCoeffs[c] = coeff;
+    return CKCMD_OK;
+}
+
+static uint8_t GetConfig(uint16_t param, uint32_t * value)
+{
+    switch(param)
+    {
+        case CKCFG_CORE_SAMPLE_FREQ: *value = CORE_SAMPLE_FREQ;          return CKCMD_OK;
+        case CKCFG_PCG_OUTPUT_FREQ:  *value = PCG_OUTPUT_FREQ_HZ;        return CKCMD_OK;
+        case CKCFG_FRAME_SAMPLES:    *value = FRAME_SAMPLES_PER_CHANNEL; return CKCMD_OK;
+        case CKCFG_LINK_PACING_US:   *value = GetLinkPacingMicros();     return CKCMD_OK;
+        case CKCFG_FILTER_SELECT:
+            *value = IsFilterOutputSelected(FILTER_CHAIN_ECG) | (IsFilterOutputSelected(FILTER_CHAIN_PCG) << 1);
+            return CKCMD_OK;
+#if MOTION_CANCEL_ENABLE
+        case CKCFG_MOTION_MODE:      *value = GetMotionMode();           return CKCMD_OK;
+#endif
+#if MONITOR_MODE_ENABLE
+        case CKCFG_MONITOR_MODE:     *value = GetMonitorMode();          return CKCMD_OK;
+#endif
+        case CKCFG_OUTPUT_BACKLOG:   *value = GetLinkBacklog();          return CKCMD_OK;
+        case CKCFG_COMMANDS_DROPPED: *value = GetLinkDroppedCommands();  return CKCMD_OK;
+        case CKCFG_ECG_VALID_MS:     *value = GetEcgValidMillis();       return CKCMD_OK;
+        default:
+            return CKCMD_ERR_ARG;
+    }
+}
+
+// Commands whose setting an ISR takes up, on its next scan or frame rather than between two processed frames
+static uint8_t UsedByIsr(uint8_t opcode)
 {
-    uint32_t opcode = (cmd >> 16) & 0xFF;
     switch(opcode)
+    {
+        case CKCMD_MUX_LEAD:
+        case CKCMD_SCAN_FOCUS:
+        case CKCMD_LINK_PACING:
+        case CKCMD_DAC_OVERRIDE:
+        case CKCMD_DAC_RELEASE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+uint8_t HandleCloudCommand(const CkCommand_t * cmd)
+{
+    uint32_t start  = micros();
+    uint32_t arg    = cmd->value;
+    uint32_t result = cmd->value; // commands without a result echo what they were given
+    uint8_t  status = CKCMD_OK;
+    if(cmd->batched && UsedByIsr(cmd->opcode))
+    {
+        QueueResponse(cmd, CKCMD_ERR_BATCH, result, start);
+        return CKCMD_ERR_BATCH;
+    }
+    switch(cmd->opcode)
     {
         case NO_OP:
             // this should never be reached
@@ -29,7 +148,74 @@ void HandleCloudCommand(uint32_t cmd)
         case CKCMD_LED_OFF:
             ControlCkLed(CKLED_ALL, LOW);
             break;
+        case CKCMD_LED_FLASH:
+            if((arg & 0xFFFF) == 0) { status = CKCMD_ERR_ARG; break; }
+            FlashCkLed(CKLED_ALL_NO_STAT, arg & 0xFFFF, (arg >> 16) & 0xFF);
+            break;
+        case CKCMD_FILTER_SELECT:
+            SelectFilterOutput(FILTER_CHAIN_ECG, arg & 0x1);
+            SelectFilterOutput(FILTER_CHAIN_PCG, (arg >> 1) & 0x1);
+            break;
+        case CKCMD_FILTER_NOTCH:
+        {
+            float notch = ArgFloat(cmd);
+            if(notch < 0.0f || notch >= (CORE_SAMPLE_FREQ) / 2) { status = CKCMD_ERR_ARG; break; }
+            ConfigureFilterNotch(notch);
+            break;
+        }
+        case CKCMD_PROFILE_DUMP:
+#if PROFILE_ENABLE
+            RequestProfileDump(arg & 0x1);
+#else
+            status = CKCMD_ERR_DISABLED;
+#endif
+            break;
+        case CKCMD_MUX_LEAD:
+            if(!SetMuxChannelLeads(arg & 0x7, (arg >> 3) & 0x7, (arg >> 6) & 0x7, (arg >> 9) & 0x7)) { status = CKCMD_ERR_ARG; }
+            break;
+        case CKCMD_SCAN_FOCUS:
+            SetScanFocus(arg & 0xFF);
+            break;
+        case CKCMD_MOTION_MODE:
+#if MOTION_CANCEL_ENABLE
+            if(arg > MOTION_MODE_CANCEL) { status = CKCMD_ERR_ARG; break; }
+            SetMotionMode(arg);
+#else
+            status = CKCMD_ERR_DISABLED;
+#endif
+            break;
+        case CKCMD_PING:
+            break;
+        case CKCMD_GET_CONFIG:
+            status = GetConfig(cmd->index, &result);
+            break;
+        case CKCMD_LINK_PACING:
+            if(arg < CKCMD_PACING_MIN_US || arg > CKCMD_PACING_MAX_US) { status = CKCMD_ERR_ARG; break; }
+            result = SetLinkPacingMicros(arg);
+            break;
+        case CKCMD_DAC_OVERRIDE:
+            if(cmd->index >= NUM_ECG_CHANNELS || arg > 4095) { status = CKCMD_ERR_ARG; break; }
+            result = getDacValue(cmd->index);
+            overrideDacValue(cmd->index, arg);
+            break;
+        case CKCMD_DAC_RELEASE:
+            if(cmd->index >= NUM_ECG_CHANNELS) { status = CKCMD_ERR_ARG; break; }
+            disableDacValueOverride(cmd->index);
+            result = getDacValue(cmd->index);
+            break;
+        case CKCMD_FILTER_COEF:
+            status = StageFilterCoefficient(cmd->index, ArgFloat(cmd));
+            break;
+        case CKCMD_FILTER_LOAD:
+            if(cmd->index >= NUM_FILTER_CHAINS) { status = CKCMD_ERR_ARG; break; }
+            if(cmd->index == FILTER_CHAIN_PCG && !PCG_PRESENT) { status = CKCMD_ERR_DISABLED; break; }
+            if(arg > FILTER_MAX_STAGES) { status = CKCMD_ERR_ARG; break; }
+            SetFilterCoefficients((FilterChain_t) cmd->index, StagedCoeffs[cmd->index], arg);
+            break;
         default:
+            status = CKCMD_ERR_UNKNOWN;
             break;
     }
+    QueueResponse(cmd, status, result, start);
+    return status;
 }
@@ -2,6 +2,41 @@
     CardioKitCommandSpace.h
     Library for Handling User-Defined Commands from Cloud Host
     Created by Nathan Volman, Feb 24, 2020
+
+    Commands arrive as SimpleTCP command frames: an id, an opcode, a
+    16 bit index (channel or parameter) and a 32 bit value whose type
+    is given by argType. Legacy 0xFE nacks still work, as id 0 with
+    the 16 bit arg in value.
+
+    SimpleTCP queues the frames as they are parsed, with the time they
+    arrived. Setting CKARG_BATCH_MORE on argType holds a command back
+    until one without it closes the batch. loop() then runs the whole
+    batch in one pass between two processed frames, so the filters,
+    the motion canceller and the other settings loop() reads never see
+    half of it. A batch that overflows the queue is dropped whole.
+    Settings the ISRs take up (mux leads, scan focus, DAC, link pacing)
+    would land scans or frames apart from each other and from the rest
+    of the batch, inside a batch they are refused with
+    CKCMD_ERR_BATCH and have to be sent on their own.
+
+    Every command is answered with EVENT_RECORD_RESPONSE, sent without
+    waiting for the event frame to fill:
+        uint16 id            the command's
+        uint8  opcode
+        uint8  status        CKCMD_OK or CKCMD_ERR_*
+        uint32 value         result, what the opcode documents or the value in effect
+        uint16 execMicros    time the command took on the device
+        uint32 waitMicros    time from being parsed to being run
+        uint8  dropped       commands lost to a full queue just before this one
+    The host times the round trip from the frame it sent to this record.
+
+    Filter coefficients are loaded in two steps. CKCMD_FILTER_COEF
+    stages one coefficient of one biquad, as a float in (-2, 2) with the
+    a1/a2 signs of BiquadCoeffs_t. The staged set stays until it is
+    overwritten, so it may take several commands or batches. Then
+    CKCMD_FILTER_LOAD swaps the first value stages of a chain in at once.
+    A later CKCMD_FILTER_NOTCH designs the chains from their corners
+    again and replaces loaded coefficients.
 */
 #ifdef __cplusplus
 extern "C" {
@@ -9,9 +44,61 @@ extern "C" {
 #ifndef CARDIOKITCOMMANDSPACE_H
 #define CARDIOKITCOMMANDSPACE_H
 #include <WProgram.h>
+#include "hwsettings.h"
+
+// argType, how value is read
+#define CKARG_UINT  0 // uint32, and what legacy commands carry
+#define CKARG_INT   1 // int32
+#define CKARG_FLOAT 2 // IEEE 754 single
+#define CKARG_BATCH_MORE 0x80 // flag, more commands of this batch follow. SimpleTCP strips it
+
+#define CKCMD_RESPONSE_BYTES 15 // EVENT_RECORD_RESPONSE payload
+
+// status in the response
+#define CKCMD_OK             0
+#define CKCMD_ERR_UNKNOWN    1 // opcode not known
+#define CKCMD_ERR_ARG        2 // index or value out of range
+#define CKCMD_ERR_DISABLED   3 // compiled out in hwsettings.h
+#define CKCMD_ERR_BATCH      4 // an ISR takes the setting up, not allowed in a batch
+
+// CKCMD_GET_CONFIG parameters, by index
+#define CKCFG_CORE_SAMPLE_FREQ   0 // Hz, set at build time like every rate and the frame geometry
+#define CKCFG_PCG_OUTPUT_FREQ    1 // Hz
+#define CKCFG_FRAME_SAMPLES      2 // scans per frame
+#define CKCFG_LINK_PACING_US     3 // microseconds between two packets
+#define CKCFG_FILTER_SELECT      4 // bit 0: filtered ECG, bit 1: filtered PCG
+#define CKCFG_MOTION_MODE        5
+#define CKCFG_MONITOR_MODE       6
+#define CKCFG_OUTPUT_BACKLOG     7 // packets queued and not yet sent
+#define CKCFG_COMMANDS_DROPPED   8 // commands lost to a full queue since boot
+#define CKCFG_ECG_VALID_MS       9 // millis() since reset when every ECG slot had settled, 0 until then
+
+// Link pacing limits, 35ms between packets already failed in the measurements in SimpleTCP.cpp
+#define CKCMD_PACING_MIN_US  (40000)
+#define CKCMD_PACING_MAX_US  (500000)
+
+typedef struct
+{
+    uint16_t id;
+    uint8_t  opcode;
+    uint8_t  argType;
+    uint16_t index;
+    uint32_t value;
+    uint32_t receivedMicros;
+    uint8_t  droppedBefore;
+    uint8_t  batched;        // one of a batch of more than one command
+} CkCommand_t;
 
 // call this in loop to handle incoming commands from cloud host
-void HandleCloudCommand(uint32_t cmd);
+// Runs the command and queues its response, returns the status
+uint8_t HandleCloudCommand(const CkCommand_t * cmd);
+
+// Implemented by the sketch, which owns the SimpleTCP link and its timer
+// Returns the pacing in effect
+uint32_t SetLinkPacingMicros(uint32_t micros);
+uint32_t GetLinkPacingMicros();
+uint32_t GetLinkBacklog();
+uint32_t GetLinkDroppedCommands();
 
 #endif //CARDIOKITCOMMANDSPACE_H
 #ifdef __cplusplus
@@ -14,27 +14,53 @@
  *  *********************************************/
 #include "CardioKitDac.h"
 #include <Arduino.h>
+#include "CardioKitDacCore.h"
 
-#define MIN_DAC_VAL 0
-#define MAX_DAC_VAL 4095
-#define INITIAL_DAC_VAL 2048
-#define SETTLED_RANGE_UPPER_BOUND 65000
-#define SETTLED_RANGE_LOWER_BOUND 500
-#define SLEW_END_RANGE_UPPER_BOUND 40000
-#define SLEW_END_RANGE_LOWER_BOUND 26000
-#define SETTLED_MIDRANGE 32768
-#define MAX_SLEW_ITERATIONS 11
-static uint8_t IsFastSlewing[NUM_ECG_CHANNELS] = {true};
-static int8_t FastSlewIteration[NUM_ECG_CHANNELS] = {-1};
+#define DAC_RECORD_BYTES 12
+static DacChannel_t Channels[NUM_ECG_CHANNELS];          // the controller of every channel, only touched from loop() in block mode
 static uint8_t OverridingDacValues[NUM_ECG_CHANNELS] = {false};
-static uint16_t SlewStepSize[MAX_SLEW_ITERATIONS] = {1024,512,256,128,64,32,16,8,4,2,1};
 
-static uint16_t dacValues[NUM_ECG_CHANNELS] = {INITIAL_DAC_VAL};
+static volatile uint16_t dacValues[NUM_ECG_CHANNELS] = {INITIAL_DAC_VAL}; // what the ISR writes
+static volatile uint8_t  CurrentDacChannel = 0;
+
+static uint16_t ReportedDac[NUM_ECG_CHANNELS];        // last value sent in an EVENT_RECORD_DAC
+static uint8_t  HoldBlocks[NUM_ECG_CHANNELS];         // blocks still from the lead the channel scanned before dacCopyChannel
+
+#if DAC_HW_SEQUENCE
+#define DAC_SEQUENCE_LENGTH ((NUM_ECG_CHANNELS) * (PDB_TICKS_PER_ECG_SLOT))
+#if DAC_SEQUENCE_LENGTH > 16
+#error "NUM_ECG_CHANNELS * PDB_TICKS_PER_ECG_SLOT doesn't fit the 16 word DAC buffer"
+#endif
+#ifndef DAC_C1_DACBFEN
+#define DAC_C1_DACBFEN ((uint8_t)0x01)
+#endif
+#ifndef DAC_C2_DACBFRP
+#define DAC_C2_DACBFRP(n) ((uint8_t)(((n) & 0x0F) << 4))
+#define DAC_C2_DACBFUP(n) ((uint8_t)((n) & 0x0F))
+#endif
+#define DAC0_BUFFER ((volatile int16_t *) &DAC0_DAT0L)
+static volatile uint8_t DacSequenceRunning = false;
+#endif
+
+// Every change of a channel's drive value goes through here so the DAC0 buffer follows
+static void SetDacValue(uint8_t channel, uint16_t value)
+{
+    dacValues[channel] = value;
+#if DAC_HW_SEQUENCE
+    if(!DacSequenceRunning) { return; } // DAC0 isn't clocked yet, dacStartSequence loads everything
+    for(uint8_t t = 0; t < PDB_TICKS_PER_ECG_SLOT; t++)
+    {
+        DAC0_BUFFER[channel * PDB_TICKS_PER_ECG_SLOT + t] = value;
+    }
+#endif
+}
 
 uint16_t overrideDacValue(uint8_t channel_number, uint16_t new_dac_value)
 {
     OverridingDacValues[channel_number] = true;
-    dacValues[channel_number] = (uint16_t) new_dac_value;
+    Channels[channel_number].value = new_dac_value;
+    Channels[channel_number].pending = new_dac_value;
+    SetDacValue(channel_number, (uint16_t) new_dac_value);
     return dacValues[channel_number];
 }
 
@@ -43,77 +69,186 @@ void disableDacValueOverride(uint8_t channel_number)
     OverridingDacValues[channel_number] = false;
 }
 
+uint16_t getDacValue(uint8_t channel_number)
+{
+    return dacValues[channel_number];
+}
+
+uint8_t getCurrentDacChannel()
+{
+#if DAC_HW_SEQUENCE
+    if(DacSequenceRunning) { return ((DAC0_C2 >> 4) & 0x0F) / PDB_TICKS_PER_ECG_SLOT; } // the read pointer is the channel
+#endif
+    return CurrentDacChannel;
+}
+
+uint16_t getDacControlValue(uint8_t channel)
+{
+    return Channels[channel].baseline;
+}
+
+uint32_t getDacSaturatedSamples(uint8_t channel)
+{
+    return Channels[channel].saturatedSamples;
+}
+
+uint32_t getDacReslews(uint8_t channel)
+{
+    return Channels[channel].reslews;
+}
+
+uint16_t getDacGain(uint8_t channel)
+{
+    return Channels[channel].gain;
+}
+
+uint16_t getDacSettledChannels()
+{
+    uint16_t settled = 0;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        if(!Channels[ch].slewing && !OverridingDacValues[ch]) { settled |= (1 << ch); }
+    }
+    return settled;
+}
+
+uint16_t getDacWarmStartMisses()
+{
+    uint16_t misses = 0;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        if(Channels[ch].warmStartMiss) { misses |= (1 << ch); }
+    }
+    return misses;
+}
+
 void initializeDac()
 {
     pinMode(pinDAC0, OUTPUT);
     analogWriteResolution(12); // 12-bit DAC mode (Does this set resolution for DAC0 and DAC1?)
     for(int i = 0; i < NUM_ECG_CHANNELS; i++)
     {
-        dacValues[i] = INITIAL_DAC_VAL;
+        DacCoreReset(&Channels[i], DAC_PREDICTIVE);
+        dacValues[i] = Channels[i].value;
+        ReportedDac[i] = 0; // the first frame reports the starting value
+        HoldBlocks[i] = 0;
     }
 }
 
-void dacWriteNextChannel(uint8_t channel)
+void dacWarmStart(uint8_t channel, uint16_t value, uint16_t gain)
 {
-    analogWrite(pinDAC0, dacValues[channel]);
+    if(DacCoreWarmStart(&Channels[channel], value, gain)) { SetDacValue(channel, value); }
 }
 
-// helper function to determine if a sample is within the "settled" range
-uint8_t SampleOutOfRange(uint16_t sample)
+void dacWriteNextChannel(uint8_t channel)
 {
-    if(sample >= SETTLED_RANGE_UPPER_BOUND) { return true;}
-    if(sample <= SETTLED_RANGE_LOWER_BOUND) { return true;}
-    return false;
+    CurrentDacChannel = channel;
+    analogWrite(pinDAC0, dacValues[channel]);
 }
 
-// helper function to determine if a sample is within the "settled" range
-uint8_t SampleOutOfSlewDoneRange(uint16_t sample)
+void dacApplyPendingValues()
 {
-    if(sample >= SLEW_END_RANGE_UPPER_BOUND) { return true;}
-    if(sample <= SLEW_END_RANGE_LOWER_BOUND) { return true;}
-    return false;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        if(DacCoreLatch(&Channels[ch])) { SetDacValue(ch, Channels[ch].value); }
+    }
 }
 
-// helper function to restart fast slewing and bring channel back to original state
-void ResetChannel(uint8_t channel)
+void dacStartSequence(uint8_t position)
 {
-    IsFastSlewing[channel] = true;
-    dacValues[channel] = INITIAL_DAC_VAL;
-    FastSlewIteration[channel] = -1;
+#if DAC_HW_SEQUENCE
+    SIM_SCGC2 |= SIM_SCGC2_DAC0;
+    DAC0_C0 = DAC_C0_DACEN | DAC_C0_DACRFS; // 3.3V reference like analogWrite, DACTRGSEL clear so the PDB moves the read pointer
+    DacSequenceRunning = true;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        SetDacValue(ch, dacValues[ch]);
+    }
+    DAC0_C1 = DAC_C1_DACBFEN; // normal mode, the read pointer wraps at the upper limit
+    DAC0_C2 = DAC_C2_DACBFRP(position % DAC_SEQUENCE_LENGTH) | DAC_C2_DACBFUP(DAC_SEQUENCE_LENGTH - 1);
+#else
+    (void) position;
+#endif
 }
 
 // Pass in a new sample for the given channel for handling slewing
 // This should be called before the next time the channel needs to be written
 void HandleNewEcgSampleDac(uint8_t channel, uint16_t sample)
 {
-    if(IsFastSlewing[channel])
+    if(DacCoreSample(&Channels[channel], sample)) { SetDacValue(channel, Channels[channel].value); }
+}
+
+// Only the slewing channels, one step each per block
+// Returns a bitmask of the channels that are still slewing
+uint16_t updateDacControlValuesFastSlew(uint16_t * adc_samples, uint32_t num_samples_per_channel)
+{
+    uint16_t slewing = 0;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
     {
-        FastSlewIteration[channel]++;
-        if(FastSlewIteration[channel] >= MAX_SLEW_ITERATIONS) // check this for off by one
+        if(!Channels[ch].slewing || OverridingDacValues[ch]) { continue; }
+        if(DacCoreBlock(&Channels[ch], &adc_samples[ch * num_samples_per_channel], num_samples_per_channel))
         {
-            if(SampleOutOfSlewDoneRange(sample))
-            {
-                ResetChannel(channel); // This is where the looping happens
-            } else {
-                IsFastSlewing[channel] = false;
-                FastSlewIteration[channel] = -1;
-            }
+            SetDacValue(ch, Channels[ch].value);
         }
-        else if(SampleOutOfSlewDoneRange(sample))
+        if(Channels[ch].slewing) { slewing |= (1 << ch); }
+    }
+    return slewing;
+}
+
+uint16_t updateDacControlValues2(uint16_t * adc_samples, uint32_t num_samples_per_channel)
+{
+    uint16_t changed = 0;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        const uint16_t * samples = &adc_samples[ch * num_samples_per_channel];
+        DacCoreCountSaturated(&Channels[ch], samples, num_samples_per_channel);
+        if(OverridingDacValues[ch]) { continue; }
+        if(HoldBlocks[ch] > 0) { HoldBlocks[ch]--; continue; }
+        if(DacCoreBlock(&Channels[ch], samples, num_samples_per_channel))
         {
-            if(sample >= SETTLED_MIDRANGE)
-            {
-                dacValues[channel] -= SlewStepSize[FastSlewIteration[channel]];
-            } else {
-                dacValues[channel] += SlewStepSize[FastSlewIteration[channel]];
-            }
-        } else {
-            IsFastSlewing[channel] = false;
-            FastSlewIteration[channel] = -1;
+            changed |= (1 << ch);
+            if(dacValues[ch] != Channels[ch].value) { SetDacValue(ch, Channels[ch].value); } // a slew step, tracking steps wait for the frame start
         }
     }
-    else if(SampleOutOfRange(sample))
+    return changed;
+}
+
+void updateDacControlValues(uint16_t * adc_samples, uint32_t num_samples_per_channel)
+{
+    updateDacControlValues2(adc_samples, num_samples_per_channel);
+}
+
+void dacCopyChannel(uint8_t channel, uint8_t from)
+{
+    DacCoreCopy(&Channels[channel], &Channels[from]);
+    HoldBlocks[channel] = 1;
+}
+
+void dacRestartChannel(uint8_t channel)
+{
+    DacCoreRestart(&Channels[channel]);
+    HoldBlocks[channel] = 1;
+}
+
+void QueueDacStepRecords(const SampleFrame_t * frame, uint32_t startTick)
+{
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
     {
-        ResetChannel(channel);
+        uint16_t dac = frame->dac[ch][0];
+        if(dac == ReportedDac[ch]) { continue; }
+        uint8_t rec[DAC_RECORD_BYTES];
+        rec[0]  = startTick & 0xFF;
+        rec[1]  = (startTick >> 8) & 0xFF;
+        rec[2]  = (startTick >> 16) & 0xFF;
+        rec[3]  = startTick >> 24;
+        rec[4]  = ch;
+        rec[5]  = OverridingDacValues[ch] ? DAC_STATE_OVERRIDE : (Channels[ch].slewing ? DAC_STATE_SLEWING : DAC_STATE_TRACKING);
+        rec[6]  = dac & 0xFF;
+        rec[7]  = dac >> 8;
+        rec[8]  = ReportedDac[ch] & 0xFF;
+        rec[9]  = ReportedDac[ch] >> 8;
+        rec[10] = Channels[ch].gain & 0xFF;
+        rec[11] = Channels[ch].gain >> 8;
+        if(QueueEventRecord(EVENT_RECORD_DAC, rec, DAC_RECORD_BYTES)) { ReportedDac[ch] = dac; } // retried next frame if the event frame was full
     }
 }
@@ -8,6 +8,51 @@
     Development Environment Specifics:
     Atom + PlatformIO
 
+    Two ways to run the loop, DAC_BLOCK_CONTROL picks one:
+    0   HandleNewEcgSampleDac slews on every sample inside the ECG ISR,
+        one sample outside SETTLED_RANGE_* restarts the 11 step slew
+    1   updateDacControlValues* run once per completed frame in loop(),
+        the ISR only writes dacValues[channel]. A settled channel is
+        left alone until a block gets near the rails (hysteresis), then
+        its block mean is stepped back to midrange in one move using a
+        learned ADC counts per DAC code. Tracking steps are latched at
+        the next frame start (dacApplyPendingValues) so every frame's
+        DAC stream is the value used for all of it. Only a block that is
+        mostly saturated goes back to slewing, one step per block,
+        applied right away
+
+    The decisions of both are made by CardioKitDacCore, one per channel,
+    this keeps the drive values, DAC0 and the frame side of them. The
+    native test (test/test_native_dac) compares the modes on a
+    simulated front end.
+
+    dacWarmStart seeds a channel with the value and gain it settled on
+    before a reset. The channel stays in the slewing state, so the
+    first block either hands it to tracking right away or, when it is
+    saturated, restarts the slew from INITIAL_DAC_VAL.
+
+    DAC_PREDICTIVE keeps a smoothed slope of each tracking channel's
+    block mean (only across blocks on the same DAC value) and steps when
+    the block extrapolated DAC_PREDICT_BLOCKS frames ahead would leave
+    TRACK_RANGE_*. The step aims half the expected drift past midrange
+    so the baseline wanders through the middle instead of toward a rail.
+
+    EVENT_RECORD_DAC, queued by QueueDacStepRecords for every frame whose
+    DAC value differs from the last one reported, so the host can rebuild
+    the absolute DC level even while sample frames are not sent:
+        uint32 startTick     PDB tick the value applies from, the frame start
+        uint8  channel
+        uint8  state         DAC_STATE_*
+        uint16 dac           new drive value
+        uint16 prevDac
+        uint16 gain          learned ADC counts per DAC code, Q4
+
+    With DAC_HW_SEQUENCE the offsets sit in the DAC0 data buffer, each
+    channel repeated for the PDB_TICKS_PER_ECG_SLOT ticks of its mux
+    slot. The PDB DAC interval trigger steps the read pointer once per
+    tick, so DAC0 follows the mux without the CPU. Buffer entries are
+    only written when a channel's value changes.
+
     Hardware Specifications:
     See schematics for CardioKit R01
  *  *********************************************/
@@ -18,30 +63,73 @@ extern "C" {
 #define CARDIOKIT_DAC_H
 #include <WProgram.h>
 #include "hwsettings.h"
+#include "CardioKitFrame.h"
+
+#define DAC_STATE_TRACKING 0
+#define DAC_STATE_SLEWING  1
+#define DAC_STATE_OVERRIDE 2
 
 // Enable DAC0 pin and set resolution to 12-bits
 void initializeDac();
 
-// Write the drive value for the next channel to DAC0
+// Write the drive value for the next channel to DAC0, not needed with DAC_HW_SEQUENCE
 void dacWriteNextChannel(uint8_t channel);
 
+// Load every channel into the DAC0 buffer and hand it to the PDB, call right before the PDB starts
+// position is the buffer entry for the first PDB tick, channel * PDB_TICKS_PER_ECG_SLOT + tick within the slot
+void dacStartSequence(uint8_t position);
+
 // Pass in a new sample for the given channel for handling slewing
 void HandleNewEcgSampleDac(uint8_t channel, uint16_t sample);
 
 // Pass a sample buffer into this function every time it's available for the DAC to
 // update it's drive values for each channel
+// adc_samples is channel major, num_samples_per_channel raw ECG samples of every channel (SampleFrame_t.ecg)
 void updateDacControlValues(uint16_t * adc_samples, uint32_t num_samples_per_channel);
+// Same, returns a bitmask of the channels whose DAC value changed
 uint16_t updateDacControlValues2(uint16_t * adc_samples, uint32_t num_samples_per_channel);
+// Only step the channels that are slewing, returns a bitmask of the ones still slewing
 uint16_t updateDacControlValuesFastSlew(uint16_t * adc_samples, uint32_t num_samples_per_channel);
 
+// Call from the ECG ISR when a new frame starts, latches the tracking steps made since the last frame
+void dacApplyPendingValues();
+
 uint16_t getDacValue(uint8_t channel_number);
 
 // Return the current DAC Channel
 uint8_t getCurrentDacChannel();
 
 // Get current DAC Control value for given channel
+// The block mean of the channel's ADC samples the controller regulates to midrange
 uint16_t getDacControlValue(uint8_t channel);
 
+// Samples outside SETTLED_RANGE_* and restarts of the slew since initializeDac, in either mode
+uint32_t getDacSaturatedSamples(uint8_t channel);
+uint32_t getDacReslews(uint8_t channel);
+
+// Learned ADC counts per DAC code, Q4
+uint16_t getDacGain(uint8_t channel);
+
+// Bitmask of the channels tracking, neither slewing nor overridden
+uint16_t getDacSettledChannels();
+
+// Start a channel from a cached value and gain instead of INITIAL_DAC_VAL, call between initializeDac and acquisition start
+// The channel still counts as slewing, the first block it is saturated in falls back to the full slew
+void dacWarmStart(uint8_t channel, uint16_t value, uint16_t gain);
+
+// Bitmask of the channels whose dacWarmStart value fell back to the full slew
+uint16_t getDacWarmStartMisses();
+
+// Move a channel (ECG slot) onto a lead another channel is already settled on, its offset and learned state are copied
+// or start it over when no channel has the lead. For CardioKitScan, takes effect with the next frame start
+// like a tracking step and the block acquired before that is skipped
+void dacCopyChannel(uint8_t channel, uint8_t from);
+void dacRestartChannel(uint8_t channel);
+
+// Call once per completed frame, sent or not, with its start tick
+// Queues an EVENT_RECORD_DAC record for each channel whose frame->dac moved since the last call
+void QueueDacStepRecords(const SampleFrame_t * frame, uint32_t startTick);
+
 // Use this to test the DAC and force a certain DAC value
 uint16_t overrideDacValue(uint8_t channel_number, uint16_t new_dac_value);
 
@@ -0,0 +1,330 @@
+/*  *********************************************
+    CardioKitDacCore.c
+    Offset DAC controller of one ECG channel, without Arduino or DAC0
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitDacCore.h"
+#include <string.h>
+
+#define SLEW_END_RANGE_UPPER_BOUND 40000
+#define SLEW_END_RANGE_LOWER_BOUND 26000
+#define SETTLED_MIDRANGE 32768
+#define MAX_SLEW_ITERATIONS 11
+#define TRACK_RANGE_UPPER_BOUND 57344 // block controller leaves the DAC alone while a block stays inside these
+#define TRACK_RANGE_LOWER_BOUND 8192
+#define DAC_GAIN_SEED (16 << DAC_GAIN_SHIFT) // full DAC range ~ full ADC range until a step measures it
+#define DAC_GAIN_MIN  (1 << DAC_GAIN_SHIFT)
+#define DAC_GAIN_MAX  (256 << DAC_GAIN_SHIFT)
+#define DAC_GAIN_MIN_STEP 16          // smaller steps drown in baseline wander, don't learn from them
+#define STEP_SETTLE_BLOCKS 2          // a tracking step is latched at the next frame start, the block after that is the first one fully on it
+#define DAC_SLOPE_SHIFT 4             // block mean slope in Q4 ADC counts per block
+#define DAC_SLOPE_AVG   8             // blocks the slope is smoothed over, QRS complexes move single block means a lot
+static const uint16_t SlewStepSize[MAX_SLEW_ITERATIONS] = {1024,512,256,128,64,32,16,8,4,2,1};
+
+typedef struct
+{
+    uint32_t sum;
+    uint32_t inRangeSum;
+    uint16_t inRange;
+    uint16_t high;
+    uint16_t low;
+    uint16_t min;
+    uint16_t max;
+} BlockStats_t;
+
+void DacCoreReset(DacChannel_t * c, uint8_t predictive)
+{
+    memset(c, 0, sizeof(DacChannel_t));
+    c->value = INITIAL_DAC_VAL;
+    c->pending = INITIAL_DAC_VAL;
+    c->slewing = 1;
+    c->slewIteration = -1;
+    c->predictive = predictive;
+    c->slewLow = MIN_DAC_VAL;
+    c->slewHigh = MAX_DAC_VAL;
+    c->baseline = SETTLED_MIDRANGE;
+    c->gain = DAC_GAIN_SEED;
+    c->stepAge = STEP_SETTLE_BLOCKS;
+    c->lastMean = SETTLED_MIDRANGE;
+}
+
+uint8_t DacCoreWarmStart(DacChannel_t * c, uint16_t value, uint16_t gain)
+{
+    if(value > MAX_DAC_VAL) { return 0; }
+    c->value = value;
+    c->pending = value;
+    if(gain >= DAC_GAIN_MIN && gain <= DAC_GAIN_MAX) { c->gain = gain; }
+    c->warmStarted = 1;
+    return 1;
+}
+
+// helper function to determine if a sample is within the "settled" range
+static uint8_t SampleOutOfRange(uint16_t sample)
+{
+    if(sample >= SETTLED_RANGE_UPPER_BOUND) { return 1; }
+    if(sample <= SETTLED_RANGE_LOWER_BOUND) { return 1; }
+    return 0;
+}
+
+// helper function to determine if a sample is within the range a slew ends in
+static uint8_t SampleOutOfSlewDoneRange(uint16_t sample)
+{
+    if(sample >= SLEW_END_RANGE_UPPER_BOUND) { return 1; }
+    if(sample <= SLEW_END_RANGE_LOWER_BOUND) { return 1; }
+    return 0;
+}
+
+// helper function to restart fast slewing and bring channel back to original state
+static void ResetChannel(DacChannel_t * c)
+{
+    if(!c->slewing) { c->reslews++; }
+    c->slewing = 1;
+    c->value = INITIAL_DAC_VAL;
+    c->slewIteration = -1;
+}
+
+uint8_t DacCoreSample(DacChannel_t * c, uint16_t sample)
+{
+    uint16_t before = c->value;
+    if(SampleOutOfRange(sample)) { c->saturatedSamples++; }
+    if(c->warmStarted)
+    { // the first sample settles it or starts the full slew, the fixed steps below assume they start from INITIAL_DAC_VAL
+        c->warmStarted = 0;
+        if(SampleOutOfSlewDoneRange(sample))
+        {
+            c->warmStartMiss = 1;
+            ResetChannel(c);
+        } else {
+            c->slewing = 0;
+        }
+        return c->value != before;
+    }
+    if(c->slewing)
+    {
+        c->slewIteration++;
+        if(c->slewIteration >= MAX_SLEW_ITERATIONS) // check this for off by one
+        {
+            if(SampleOutOfSlewDoneRange(sample))
+            {
+                ResetChannel(c); // This is where the looping happens
+            } else {
+                c->slewing = 0;
+                c->slewIteration = -1;
+            }
+        }
+        else if(SampleOutOfSlewDoneRange(sample))
+        {
+            if(sample >= SETTLED_MIDRANGE)
+            {
+                c->value -= SlewStepSize[c->slewIteration];
+            } else {
+                c->value += SlewStepSize[c->slewIteration];
+            }
+        } else {
+            c->slewing = 0;
+            c->slewIteration = -1;
+        }
+    }
+    else if(SampleOutOfRange(sample))
+    {
+        ResetChannel(c);
+    }
+    return c->value != before;
+}
+
+static void GetBlockStats(const uint16_t * samples, uint32_t num_samples, BlockStats_t * st)
+{
+    memset(st, 0, sizeof(BlockStats_t));
+    st->min = 0xFFFF;
+    for(uint32_t i = 0; i < num_samples; i++)
+    {
+        uint16_t v = samples[i];
+        st->sum += v;
+        if(v < st->min) { st->min = v; }
+        if(v > st->max) { st->max = v; }
+        if(v >= SETTLED_RANGE_UPPER_BOUND)      { st->high++; }
+        else if(v <= SETTLED_RANGE_LOWER_BOUND) { st->low++; }
+        else { st->inRangeSum += v; st->inRange++; }
+    }
+}
+
+void DacCoreCountSaturated(DacChannel_t * c, const uint16_t * samples, uint32_t num_samples)
+{
+    for(uint32_t i = 0; i < num_samples; i++)
+    {
+        if(SampleOutOfRange(samples[i])) { c->saturatedSamples++; }
+    }
+}
+
+static uint16_t ClampDac(int32_t dac, int32_t low, int32_t high)
+{
+    if(dac < low)  { dac = low; }
+    if(dac > high) { dac = high; }
+    return (uint16_t) dac;
+}
+
+// DAC codes that move the ADC by counts on this channel
+static int32_t CountsToCodes(const DacChannel_t * c, int32_t counts)
+{
+    return (counts * (1 << DAC_GAIN_SHIFT)) / (int32_t) c->gain;
+}
+
+static void StartSlew(DacChannel_t * c)
+{
+    c->slewing = 1;
+    c->slope = 0;
+    c->slewLow = MIN_DAC_VAL;
+    c->slewHigh = MAX_DAC_VAL;
+    c->reslews++;
+}
+
+// One slew step from the second half of the block, the DAC changed early in the first half
+// Returns 1 if the DAC moved
+static uint8_t SlewBlock(DacChannel_t * c, const uint16_t * samples, uint32_t num_samples)
+{
+    BlockStats_t st;
+    GetBlockStats(&samples[num_samples / 2], num_samples - num_samples / 2, &st);
+    int32_t dac = c->value;
+    int32_t next;
+
+    if(c->warmStarted && st.inRange == 0)
+    { // the cached value is off, fall back to the same full slew as a cold start
+        c->warmStarted = 0;
+        c->warmStartMiss = 1;
+        next = INITIAL_DAC_VAL;
+    }
+    else if(st.inRange == 0)
+    { // saturated, only the direction is known, bisect but move at least as far as the saturation implies
+        int32_t minStep = CountsToCodes(c, SETTLED_RANGE_UPPER_BOUND - SETTLED_MIDRANGE);
+        if(st.high > 0)
+        {
+            c->slewHigh = dac;
+            next = (c->slewLow + dac) / 2;
+            if(next > dac - minStep && c->slewLow == MIN_DAC_VAL) { next = dac - minStep; } // once both bounds were seen plain bisection converges
+        } else {
+            c->slewLow = dac;
+            next = (dac + c->slewHigh + 1) / 2;
+            if(next < dac + minStep && c->slewHigh == MAX_DAC_VAL) { next = dac + minStep; }
+        }
+        next = ClampDac(next, c->slewLow, c->slewHigh);
+        if(next == dac)
+        { // bounds collapsed, the offset is past what the DAC can cancel, keep trying from the full range
+            c->slewLow = MIN_DAC_VAL;
+            c->slewHigh = MAX_DAC_VAL;
+        }
+    } else {
+        c->warmStarted = 0; // in range, it only needs the usual correction
+        int32_t mean = st.inRangeSum / st.inRange;
+        if((st.high + st.low) == 0 && mean > SLEW_END_RANGE_LOWER_BOUND && mean < SLEW_END_RANGE_UPPER_BOUND)
+        { // settled, hand over to tracking
+            c->slewing = 0;
+            c->baseline = mean;
+            c->lastMean = mean;
+            c->stepAge = STEP_SETTLE_BLOCKS;
+            return 0;
+        }
+        next = ClampDac(dac - CountsToCodes(c, mean - SETTLED_MIDRANGE), MIN_DAC_VAL, MAX_DAC_VAL);
+    }
+    if(next == dac) { return 0; }
+    // slewing samples are lost anyway, apply now rather than at the frame start
+    c->pending = next;
+    c->value = next;
+    return 1;
+}
+
+// Recentre a settled channel when its block gets near the rails, returns 1 if a step was made
+static uint8_t TrackBlock(DacChannel_t * c, const uint16_t * samples, uint32_t num_samples)
+{
+    BlockStats_t st;
+    GetBlockStats(samples, num_samples, &st);
+    int32_t mean = st.sum / num_samples;
+    c->baseline = mean;
+
+    if((st.high + st.low) > num_samples / 2)
+    { // more than a blip, the baseline itself left the range
+        StartSlew(c);
+        return SlewBlock(c, samples, num_samples);
+    }
+
+    if(c->stepAge < 255) { c->stepAge++; }
+    if((c->stepAge == STEP_SETTLE_BLOCKS) && ((st.high + st.low) == 0) &&
+       (c->stepDelta >= DAC_GAIN_MIN_STEP || c->stepDelta <= -DAC_GAIN_MIN_STEP))
+    { // first block fully on the last step, learn how far a code moves the ADC
+        int32_t g = ((mean - (int32_t) c->meanBeforeStep) * (1 << DAC_GAIN_SHIFT)) / c->stepDelta;
+        if(g >= DAC_GAIN_MIN && g <= DAC_GAIN_MAX)
+        {
+            c->gain = (3 * (int32_t) c->gain + g) / 4;
+        }
+    }
+    if(c->predictive)
+    {
+        if(c->stepAge > STEP_SETTLE_BLOCKS)
+        { // this block and the last one are both fully on the same DAC value, their difference is the baseline moving
+            int32_t d = (mean - (int32_t) c->lastMean) * (1 << DAC_SLOPE_SHIFT);
+            c->slope += (d - c->slope) / DAC_SLOPE_AVG;
+        }
+        c->lastMean = mean;
+    }
+    if(c->stepAge < STEP_SETTLE_BLOCKS) { return 0; } // the last step isn't visible yet
+
+    int32_t target = SETTLED_MIDRANGE;
+    if(c->predictive)
+    {
+        int32_t drift = (c->slope * DAC_PREDICT_BLOCKS) / (1 << DAC_SLOPE_SHIFT); // where the trend takes the block
+        int32_t low  = (int32_t) st.min + ((drift < 0) ? drift : 0);
+        int32_t high = (int32_t) st.max + ((drift > 0) ? drift : 0);
+        if(low > TRACK_RANGE_LOWER_BOUND && high < TRACK_RANGE_UPPER_BOUND) { return 0; } // hysteresis
+        target = ClampDac(SETTLED_MIDRANGE - drift / 2, TRACK_RANGE_LOWER_BOUND, TRACK_RANGE_UPPER_BOUND); // lead the trend
+    }
+    else if(st.min > TRACK_RANGE_LOWER_BOUND && st.max < TRACK_RANGE_UPPER_BOUND) { return 0; } // hysteresis
+
+    int32_t dac = c->pending;
+    int32_t next = ClampDac(dac - CountsToCodes(c, mean - target), MIN_DAC_VAL, MAX_DAC_VAL);
+    if(next == dac) { return 0; }
+    c->stepDelta = next - dac;
+    c->meanBeforeStep = mean;
+    c->stepAge = 0;
+    c->pending = next;
+    return 1;
+}
+
+uint8_t DacCoreBlock(DacChannel_t * c, const uint16_t * samples, uint32_t num_samples)
+{
+    return c->slewing ? SlewBlock(c, samples, num_samples) : TrackBlock(c, samples, num_samples);
+}
+
+uint8_t DacCoreLatch(DacChannel_t * c)
+{
+    if(c->value == c->pending) { return 0; }
+    c->value = c->pending;
+    return 1;
+}
+
+void DacCoreCopy(DacChannel_t * c, const DacChannel_t * from)
+{
+    c->pending = from->pending;
+    c->slewing = from->slewing;
+    c->slewLow = from->slewLow;
+    c->slewHigh = from->slewHigh;
+    c->baseline = from->baseline;
+    c->gain = from->gain;
+    c->slope = from->slope;
+    c->lastMean = from->lastMean;
+    c->warmStarted = from->warmStarted;
+    c->stepAge = 0; // no slope or gain learning across the switch
+    c->stepDelta = 0;
+}
+
+void DacCoreRestart(DacChannel_t * c)
+{
+    c->pending = INITIAL_DAC_VAL;
+    c->warmStarted = 0;
+    StartSlew(c);
+    c->stepAge = 0;
+    c->stepDelta = 0;
+}
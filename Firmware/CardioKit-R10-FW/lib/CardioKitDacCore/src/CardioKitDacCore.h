@@ -0,0 +1,87 @@
+/*  *********************************************
+    CardioKitDacCore.h
+    Offset DAC controller of one ECG channel, without Arduino or DAC0
+
+    The slew and tracking decisions of CardioKitDac, on a channel's
+    state alone. CardioKitDac keeps one per ECG channel and pushes the
+    value it decides on out to DAC0, the native test
+    (test/test_native_dac) runs it against a simulated front end on
+    the build host. Only hwsettings.h is needed.
+
+    A channel drives value now and pending from the next frame start
+    on, DacCoreLatch moves pending into value. Slew steps change both
+    right away, tracking steps only pending.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_DAC_CORE_H
+#define CARDIOKIT_DAC_CORE_H
+#include <stdint.h>
+#include "hwsettings.h"
+
+#define MIN_DAC_VAL 0
+#define MAX_DAC_VAL 4095
+#define INITIAL_DAC_VAL 2048
+#define SETTLED_RANGE_UPPER_BOUND 65000 // a sample past these is saturated
+#define SETTLED_RANGE_LOWER_BOUND 500
+#define DAC_GAIN_SHIFT 4                // ADC counts per DAC code are kept in Q4
+
+typedef struct
+{
+    uint16_t value;            // drive value now
+    uint16_t pending;          // drive value from the next frame start
+    uint8_t  slewing;
+    int8_t   slewIteration;    // per sample slew step, -1 before the first
+    uint8_t  predictive;       // step ahead of the baseline trend, DAC_PREDICTIVE on the device
+    uint8_t  warmStarted;      // slewing from a cached value that no block has confirmed yet
+    uint8_t  warmStartMiss;    // the cached value was saturated and the full slew ran instead
+    uint16_t slewLow;          // bisection bounds while a fully saturated channel slews
+    uint16_t slewHigh;
+    uint16_t baseline;         // block mean of the ADC, what the loop keeps at midrange
+    uint16_t gain;             // ADC counts per DAC code, Q4
+    uint8_t  stepAge;          // blocks since the last tracking step
+    int16_t  stepDelta;
+    uint16_t meanBeforeStep;
+    int32_t  slope;            // baseline trend of a tracking channel, Q4 counts per block
+    uint16_t lastMean;
+    uint32_t saturatedSamples; // samples outside SETTLED_RANGE_*
+    uint32_t reslews;          // restarts of the slew
+} DacChannel_t;
+
+// Start a channel over from INITIAL_DAC_VAL and the seed gain, counters cleared
+void DacCoreReset(DacChannel_t * c, uint8_t predictive);
+
+// Start from a cached value and gain instead, returns 0 if the value is out of range and nothing changed
+uint8_t DacCoreWarmStart(DacChannel_t * c, uint16_t value, uint16_t gain);
+
+// Per sample slew (DAC_BLOCK_CONTROL 0), call with every sample of the channel
+// Returns 1 if value changed
+uint8_t DacCoreSample(DacChannel_t * c, uint16_t sample);
+
+// Count the saturated samples of a block, DacCoreBlock doesn't
+void DacCoreCountSaturated(DacChannel_t * c, const uint16_t * samples, uint32_t num_samples);
+
+// Block controller (DAC_BLOCK_CONTROL 1), call once per frame with the channel's raw ECG of it
+// Returns 1 if value or pending changed
+uint8_t DacCoreBlock(DacChannel_t * c, const uint16_t * samples, uint32_t num_samples);
+
+// Call on the frame start, returns 1 if value changed
+uint8_t DacCoreLatch(DacChannel_t * c);
+
+// Take over another channel's offset and learned state, its own counters are kept
+void DacCoreCopy(DacChannel_t * c, const DacChannel_t * from);
+
+// Slew again from INITIAL_DAC_VAL, from the next frame start
+void DacCoreRestart(DacChannel_t * c);
+
+#endif //CARDIOKIT_DAC_CORE_H
+#ifdef __cplusplus
+}
+#endif
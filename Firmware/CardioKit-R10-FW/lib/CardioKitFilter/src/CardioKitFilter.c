@@ -0,0 +1,273 @@
+/*  *********************************************
+    CardioKitFilter.c
+    Optional on-device filter stage for ECG and PCG
+
+    Stages are designed with the RBJ audio EQ cookbook formulas in double
+    (config time only) and stored halved (FILTER_POST_SHIFT) so that
+    coefficients up to +/-2 fit the fixed-point formats.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitFilter.h"
+#include <Arduino.h>
+#include <arm_math.h>
+#include <math.h>
+#include "CardioKitProfile.h"
+
+#define FILTER_POST_SHIFT 1
+#define BUTTERWORTH_Q     0.70710678
+
+static arm_biquad_cas_df1_32x64_ins_q31 EcgBiquad[NUM_ECG_CHANNELS];
+static q31_t EcgCoeffs[5 * FILTER_MAX_STAGES];
+static q63_t EcgState[NUM_ECG_CHANNELS][4 * FILTER_MAX_STAGES];
+static q31_t EcgBlockIn[FRAME_SAMPLES_PER_CHANNEL];
+static q31_t EcgBlockOut[FRAME_SAMPLES_PER_CHANNEL];
+
+#if PCG_PRESENT
+static arm_biquad_casd_df1_inst_q15 PcgBiquad;
+static q15_t PcgCoeffs[6 * FILTER_MAX_STAGES];
+static q15_t PcgState[4 * FILTER_MAX_STAGES];
+static q15_t __attribute__((aligned(4))) PcgBlockIn[PCG_SAMPLES_PER_FRAME];
+static q15_t __attribute__((aligned(4))) PcgBlockOut[PCG_SAMPLES_PER_FRAME];
+#endif
+
+static uint8_t  ChainStages[NUM_FILTER_CHAINS]      = {0};
+static float    ChainCorners[NUM_FILTER_CHAINS][3]  = {{0}}; // high-pass, low-pass, notch of the last ConfigureFilterChain
+static uint8_t  OutputSelected[NUM_FILTER_CHAINS]   = {false};
+
+static float ChainSampleRate(FilterChain_t chain)
+{
+    return (chain == FILTER_CHAIN_ECG) ? CORE_SAMPLE_FREQ : PCG_OUTPUT_FREQ_HZ;
+}
+
+static q31_t HalvedToQ31(double c)
+{
+    double scaled = (c / (1 << FILTER_POST_SHIFT)) * 2147483648.0;
+    if(scaled >=  2147483647.0) { return 0x7FFFFFFF; }
+    if(scaled <= -2147483648.0) { return (q31_t) 0x80000000; }
+    return (q31_t) lround(scaled);
+}
+
+static q15_t HalvedToQ15(double c)
+{
+    double scaled = (c / (1 << FILTER_POST_SHIFT)) * 32768.0;
+    if(scaled >=  32767.0) { return 0x7FFF; }
+    if(scaled <= -32768.0) { return (q15_t) 0x8000; }
+    return (q15_t) lround(scaled);
+}
+
+// Store one stage in the chain's CMSIS coefficient array, CMSIS wants the feedback terms negated
+static void LoadStage(FilterChain_t chain, uint8_t stage, double b0, double b1, double b2, double a1, double a2)
+{
+    if(chain == FILTER_CHAIN_ECG)
+    {
+        q31_t * c = &EcgCoeffs[5 * stage];
+        c[0] = HalvedToQ31(b0);
+        c[1] = HalvedToQ31(b1);
+        c[2] = HalvedToQ31(b2);
+        c[3] = HalvedToQ31(-a1);
+        c[4] = HalvedToQ31(-a2);
+    }
+#if PCG_PRESENT
+    else
+    {
+        q15_t * c = &PcgCoeffs[6 * stage];
+        c[0] = HalvedToQ15(b0);
+        c[1] = 0; // Q15 layout pads b0 for the dual MAC
+        c[2] = HalvedToQ15(b1);
+        c[3] = HalvedToQ15(b2);
+        c[4] = HalvedToQ15(-a1);
+        c[5] = HalvedToQ15(-a2);
+    }
+#endif
+}
+
+// (Re)initialize the CMSIS instances of a chain, clearing its filter state
+static void ResetChain(FilterChain_t chain)
+{
+    if(chain == FILTER_CHAIN_ECG)
+    {
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            memset(EcgState[ch], 0, sizeof(EcgState[ch]));
+            arm_biquad_cas_df1_32x64_init_q31(&EcgBiquad[ch], ChainStages[chain], EcgCoeffs, EcgState[ch], FILTER_POST_SHIFT);
+        }
+    }
+#if PCG_PRESENT
+    else
+    {
+        memset(PcgState, 0, sizeof(PcgState));
+        arm_biquad_cascade_df1_init_q15(&PcgBiquad, ChainStages[chain], PcgCoeffs, PcgState, FILTER_POST_SHIFT);
+    }
+#endif
+}
+
+typedef enum
+{
+    BIQUAD_HIGHPASS,
+    BIQUAD_LOWPASS,
+    BIQUAD_NOTCH
+} BiquadType_t;
+
+static void DesignStage(FilterChain_t chain, uint8_t stage, BiquadType_t type, double f0, double q)
+{
+    double w0    = 2.0 * M_PI * f0 / ChainSampleRate(chain);
+    double cs    = cos(w0);
+    double alpha = sin(w0) / (2.0 * q);
+    double a0    = 1.0 + alpha;
+    double b0, b1, b2;
+    switch(type)
+    {
+        case BIQUAD_HIGHPASS:
+            b0 =  (1.0 + cs) / 2.0;
+            b1 = -(1.0 + cs);
+            b2 =  (1.0 + cs) / 2.0;
+            break;
+        case BIQUAD_LOWPASS:
+            b0 = (1.0 - cs) / 2.0;
+            b1 = (1.0 - cs);
+            b2 = (1.0 - cs) / 2.0;
+            break;
+        case BIQUAD_NOTCH:
+        default:
+            b0 =  1.0;
+            b1 = -2.0 * cs;
+            b2 =  1.0;
+            break;
+    }
+    LoadStage(chain, stage, b0 / a0, b1 / a0, b2 / a0, (-2.0 * cs) / a0, (1.0 - alpha) / a0);
+}
+
+void initializeFilters()
+{
+    ConfigureFilterChain(FILTER_CHAIN_ECG, FILTER_ECG_HIGHPASS_HZ, FILTER_ECG_LOWPASS_HZ, MAINS_FREQ_HZ);
+#if PCG_PRESENT
+    ConfigureFilterChain(FILTER_CHAIN_PCG, FILTER_PCG_HIGHPASS_HZ, FILTER_PCG_LOWPASS_HZ, MAINS_FREQ_HZ);
+#endif
+}
+
+void ConfigureFilterChain(FilterChain_t chain, float highpass_hz, float lowpass_hz, float notch_hz)
+{
+    float nyquist = ChainSampleRate(chain) / 2;
+    uint8_t stages = 0;
+    ChainCorners[chain][0] = highpass_hz;
+    ChainCorners[chain][1] = lowpass_hz;
+    ChainCorners[chain][2] = notch_hz;
+    if((highpass_hz > 0) && (highpass_hz < nyquist)) { DesignStage(chain, stages++, BIQUAD_HIGHPASS, highpass_hz, BUTTERWORTH_Q); }
+    if((lowpass_hz  > 0) && (lowpass_hz  < nyquist)) { DesignStage(chain, stages++, BIQUAD_LOWPASS,  lowpass_hz,  BUTTERWORTH_Q); }
+    if((notch_hz    > 0) && (notch_hz    < nyquist)) { DesignStage(chain, stages++, BIQUAD_NOTCH,    notch_hz,    FILTER_NOTCH_Q); }
+    ChainStages[chain] = stages;
+    ResetChain(chain);
+}
+
+void ConfigureFilterNotch(float notch_hz)
+{
+    for(uint8_t c = 0; c < NUM_FILTER_CHAINS; c++)
+    {
+        if(((FilterChain_t) c == FILTER_CHAIN_PCG) && !PCG_PRESENT) { continue; }
+        ConfigureFilterChain((FilterChain_t) c, ChainCorners[c][0], ChainCorners[c][1], notch_hz);
+    }
+}
+
+uint8_t SetFilterCoefficients(FilterChain_t chain, const BiquadCoeffs_t * stages, uint8_t num_stages)
+{
+    if(num_stages > FILTER_MAX_STAGES) { return false; }
+    for(uint8_t s = 0; s < num_stages; s++)
+    {
+        LoadStage(chain, s, stages[s].b0, stages[s].b1, stages[s].b2, stages[s].a1, stages[s].a2);
+    }
+    ChainStages[chain] = num_stages;
+    ResetChain(chain);
+    return true;
+}
+
+void SelectFilterOutput(FilterChain_t chain, uint8_t filtered)
+{
+    if(filtered && !OutputSelected[chain])
+    { // don't let stale state from before the selection ring into the new output
+        ResetChain(chain);
+    }
+    OutputSelected[chain] = filtered;
+}
+
+uint8_t IsFilterOutputSelected(FilterChain_t chain)
+{
+    return OutputSelected[chain];
+}
+
+static void FilterEcg(SampleFrame_t * frame)
+{
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        for(uint32_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+        {
+            EcgBlockIn[i] = ((q31_t)(int16_t)(frame->ecg[ch][i] ^ 0x8000)) << 16;
+        }
+        arm_biquad_cas_df1_32x64_q31(&EcgBiquad[ch], EcgBlockIn, EcgBlockOut, FRAME_SAMPLES_PER_CHANNEL);
+        for(uint32_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+        {
+            frame->ecg[ch][i] = ((uint16_t)(EcgBlockOut[i] >> 16)) ^ 0x8000;
+        }
+    }
+}
+
+#if PCG_PRESENT
+static void FilterPcg(SampleFrame_t * frame)
+{
+    for(uint32_t i = 0; i < PCG_SAMPLES_PER_FRAME; i++)
+    {
+        PcgBlockIn[i] = (q15_t)(frame->pcg[i] ^ 0x8000);
+    }
+    arm_biquad_cascade_df1_fast_q15(&PcgBiquad, PcgBlockIn, PcgBlockOut, PCG_SAMPLES_PER_FRAME);
+    for(uint32_t i = 0; i < PCG_SAMPLES_PER_FRAME; i++)
+    {
+        frame->pcg[i] = ((uint16_t) PcgBlockOut[i]) ^ 0x8000;
+    }
+}
+#endif
+
+static void RunChain(FilterChain_t chain, SampleFrame_t * frame)
+{
+    if(chain == FILTER_CHAIN_ECG)
+    {
+        PROFILE_BEGIN(PROFILE_SITE_FILTER_ECG);
+        FilterEcg(frame);
+        PROFILE_END(PROFILE_SITE_FILTER_ECG);
+    }
+#if PCG_PRESENT
+    else
+    {
+        PROFILE_BEGIN(PROFILE_SITE_FILTER_PCG);
+        FilterPcg(frame);
+        PROFILE_END(PROFILE_SITE_FILTER_PCG);
+    }
+#endif
+}
+
+void FilterFrame(SampleFrame_t * frame)
+{
+    for(uint8_t s = 0; s < frame->numStreams; s++)
+    {
+        FrameStreamDescriptor_t * d = &frame->streams[s];
+        uint8_t id = d->streamId & STREAM_ID_MASK;
+        uint8_t flags = d->streamId & ~(STREAM_ID_MASK | STREAM_FLAG_FILTERED); // STREAM_FLAG_MOTION stays
+        FilterChain_t chain;
+        if(id == STREAM_ID_ECG)      { chain = FILTER_CHAIN_ECG; }
+#if PCG_PRESENT
+        else if(id == STREAM_ID_PCG) { chain = FILTER_CHAIN_PCG; }
+#endif
+        else { continue; }
+
+        if(OutputSelected[chain] && (ChainStages[chain] > 0))
+        {
+            RunChain(chain, frame);
+            d->streamId = id | flags | STREAM_FLAG_FILTERED;
+        } else {
+            d->streamId = id | flags;
+        }
+    }
+}
@@ -0,0 +1,67 @@
+/*  *********************************************
+    CardioKitFilter.h
+    Optional on-device filter stage for ECG and PCG
+
+    Each chain is a cascade of biquads (high-pass, low-pass, mains notch)
+    run over every completed frame in loop(). ECG uses the CMSIS-DSP
+    Q31 32x64 biquad since its 0.5Hz high-pass poles sit too close to
+    the unit circle for Q15; PCG uses the Q15 biquad, which runs on the
+    M4 dual 16-bit MAC. Filter state carries over from frame to frame.
+
+    When a chain's output is selected, its samples are replaced in the
+    frame and STREAM_FLAG_FILTERED is set on its stream id so the host
+    knows not to filter again. Raw output is the default.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_FILTER_H
+#define CARDIOKIT_FILTER_H
+#include <WProgram.h>
+#include "hwsettings.h"
+#include "CardioKitFrame.h"
+
+typedef enum
+{
+    FILTER_CHAIN_ECG = 0,
+    FILTER_CHAIN_PCG = 1,
+    NUM_FILTER_CHAINS
+} FilterChain_t;
+
+// Coefficients of one biquad stage, y = b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2
+typedef struct
+{
+    float b0, b1, b2, a1, a2;
+} BiquadCoeffs_t;
+
+// call this in setup, loads the default FILTER_*_HZ chains with raw output selected
+void initializeFilters();
+
+// Redesign a chain as a 2nd order Butterworth high-pass and low-pass plus a notch
+// Pass 0 for any corner to leave that stage out
+void ConfigureFilterChain(FilterChain_t chain, float highpass_hz, float lowpass_hz, float notch_hz);
+
+// Move the notch of every chain to 50/60Hz mains (0 removes it), keeping their other corners
+void ConfigureFilterNotch(float notch_hz);
+
+// Load arbitrary stages into a chain, up to FILTER_MAX_STAGES, resets its filter state
+// Every coefficient must be within (-2, 2)
+uint8_t SetFilterCoefficients(FilterChain_t chain, const BiquadCoeffs_t * stages, uint8_t num_stages);
+
+// Choose whether a chain's filtered samples replace the raw ones in the frame
+void SelectFilterOutput(FilterChain_t chain, uint8_t filtered);
+uint8_t IsFilterOutputSelected(FilterChain_t chain);
+
+// Filter the selected chains of a completed frame in place and flag their streams
+void FilterFrame(SampleFrame_t * frame);
+
+#endif //CARDIOKIT_FILTER_H
+#ifdef __cplusplus
+}
+#endif
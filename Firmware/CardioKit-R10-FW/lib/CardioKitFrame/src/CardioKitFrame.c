@@ -0,0 +1,126 @@
+/*  *********************************************
+    CardioKitFrame.c
+    Self-describing multi-rate sample frames for SimpleTCP
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitFrame.h"
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+
+// The layout is sent as-is, make sure the compiler didn't pad it and it still fits a SimpleTCP buffer
+_Static_assert(sizeof(FrameStreamDescriptor_t) == FRAME_DESCRIPTOR_BYTES, "FrameStreamDescriptor_t is padded");
+_Static_assert(offsetof(SampleFrame_t, streams) == FRAME_HEADER_BYTES, "SampleFrame_t header is padded");
+_Static_assert(sizeof(SampleFrame_t) <= FRAME_MAX_BYTES, "SampleFrame_t does not fit in one SimpleTCP buffer");
+
+static uint16_t FrameCounter = 0;
+
+static uint8_t  EventFrame[EVENT_FRAME_MAX_BYTES];
+static uint16_t EventFrameBytes = EVENT_FRAME_HEADER_BYTES;
+static uint8_t  EventRecordCount = 0;
+static uint32_t EventFirstQueuedMillis = 0;
+static uint8_t  EventFlushRequested = 0;
+static uint16_t DroppedEventRecords = 0;
+
+static void SetDescriptor(FrameStreamDescriptor_t * d, uint8_t streamId, uint8_t width, uint16_t count)
+{
+    d->streamId   = streamId;
+    d->width      = width;
+    d->count      = count;
+    // every stream spans the same stretch of time as the ECG in one frame
+    d->decimation = (FRAME_TICKS) / count;
+}
+
+void InitializeFrame(SampleFrame_t * frame)
+{
+    uint8_t s = 0;
+    frame->frameType    = FRAME_TYPE_SAMPLES;
+    frame->numStreams   = NUM_FRAME_STREAMS;
+    frame->frameBytes   = sizeof(SampleFrame_t);
+    frame->frameCounter = 0;
+    frame->baseRateHz   = ADC_PDB_FREQ_HZ;
+    frame->startTick    = 0;
+
+    // Descriptors must stay in the same order as the arrays in SampleFrame_t
+    SetDescriptor(&frame->streams[s++], STREAM_ID_ECG,     NUM_ECG_CHANNELS, FRAME_SAMPLES_PER_CHANNEL);
+#if PCG_PRESENT
+    SetDescriptor(&frame->streams[s++], STREAM_ID_PCG,     1,                PCG_SAMPLES_PER_FRAME);
+#endif
+#if ACCEL_PRESENT
+    SetDescriptor(&frame->streams[s++], STREAM_ID_ACCEL,   1,                ACCEL_SAMPLES_PER_FRAME);
+#endif
+#if ACCEL_ORIENT_PRESENT
+    SetDescriptor(&frame->streams[s++], STREAM_ID_ORIENT,  3,                ORIENT_SAMPLES_PER_FRAME);
+#endif
+    SetDescriptor(&frame->streams[s++], STREAM_ID_BATTERY, 1,                BATTERY_SAMPLES_PER_FRAME);
+    SetDescriptor(&frame->streams[s++], STREAM_ID_DAC,     NUM_ECG_CHANNELS, DAC_SAMPLES_PER_FRAME);
+    SetDescriptor(&frame->streams[s++], STREAM_ID_SCAN,    NUM_ECG_CHANNELS, SCAN_SAMPLES_PER_FRAME);
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        frame->scan[slot][0] = slot; // every lead once, the ECG ISR stamps the live layout at each frame start
+    }
+}
+
+uint16_t FinalizeFrame(SampleFrame_t * frame, uint32_t startTick)
+{
+    frame->frameCounter = FrameCounter++;
+    frame->startTick    = startTick;
+    return frame->frameBytes;
+}
+
+uint8_t QueueEventRecord(uint8_t recordType, const void * payload, uint8_t payloadBytes)
+{
+    if(EventFrameBytes + EVENT_RECORD_HEADER_BYTES + payloadBytes > EVENT_FRAME_MAX_BYTES)
+    {
+        DroppedEventRecords++;
+        return 0;
+    }
+    if(EventRecordCount == 0) { EventFirstQueuedMillis = millis(); }
+
+    EventFrame[EventFrameBytes++] = recordType;
+    EventFrame[EventFrameBytes++] = payloadBytes;
+    memcpy(&EventFrame[EventFrameBytes], payload, payloadBytes);
+    EventFrameBytes += payloadBytes;
+    EventRecordCount++;
+    return 1;
+}
+
+void FlushEventFrame()
+{
+    EventFlushRequested = 1;
+}
+
+uint8_t EventRecordFits(uint8_t payloadBytes)
+{
+    return (EventFrameBytes + EVENT_RECORD_HEADER_BYTES + payloadBytes) <= EVENT_FRAME_MAX_BYTES;
+}
+
+uint16_t TakeEventFrame(const uint8_t ** data)
+{
+    if(EventRecordCount == 0) { return 0; }
+    // hold records back until the frame is half full or the oldest one has waited long enough
+    if(!EventFlushRequested && (EventFrameBytes < EVENT_FRAME_MAX_BYTES / 2) &&
+       ((millis() - EventFirstQueuedMillis) < EVENT_FLUSH_INTERVAL_MS)) { return 0; }
+
+    uint16_t len = EventFrameBytes;
+    EventFrame[0] = FRAME_TYPE_EVENTS;
+    EventFrame[1] = EventRecordCount;
+    EventFrame[2] = len & 0xFF;
+    EventFrame[3] = len >> 8;
+    // the caller copies the frame out before queueing more
+    EventRecordCount = 0;
+    EventFrameBytes = EVENT_FRAME_HEADER_BYTES;
+    EventFlushRequested = 0;
+    *data = EventFrame;
+    return len;
+}
+
+uint16_t GetDroppedEventRecords()
+{
+    return DroppedEventRecords;
+}
@@ -0,0 +1,136 @@
+/*  *********************************************
+    CardioKitFrame.h
+    Self-describing multi-rate sample frames for SimpleTCP
+
+    Every frame starts with a header and one descriptor per stream,
+    so the host decodes the payload from the frame itself instead of
+    a layout hardcoded on both ends. All fields are little-endian.
+
+    Header (FRAME_HEADER_BYTES):
+        uint8  frameType      FRAME_TYPE_SAMPLES
+        uint8  numStreams     number of descriptors that follow
+        uint16 frameBytes     total length of this frame including header
+        uint16 frameCounter   increments once per frame
+        uint16 baseRateHz     rate that stream decimations are relative to
+        uint32 startTick      baseRateHz (PDB) tick the frame starts at since acquisition started
+    Descriptor (FRAME_DESCRIPTOR_BYTES):
+        uint8  streamId       STREAM_ID_* in hwsettings.h, STREAM_FLAG_* in the top two bits
+        uint8  width          words per sample, stored planar (all of word 0 first)
+        uint16 count          samples of this stream in the frame
+        uint16 decimation     baseRateHz ticks between samples of this stream
+    Stream data follows in descriptor order as uint16 words
+
+    Both ADCs run off one PDB so sample i of a stream is taken at
+    startTick + i * decimation + phase, the same time base for all:
+        ECG channel c   phase = (c + 1) * PDB_TICKS_PER_ECG_SLOT - 1
+                        with the default MUX_SETTLE_TICKS, a lead set to settle
+                        for fewer ticks averages more of its slot and its
+                        sample sits at the centre of the averaged ticks
+        PCG             phase = 0 (filter delay removed, see CardioKitPcg.c)
+        slow streams    read once per frame in loop(), not tick accurate
+    startTick jumps when frames were not sent (monitoring mode)
+
+    Event frames carry small records that are not sampled streams.
+    They share the first four header bytes so a reader can skip any
+    frame type it does not know by frameBytes:
+        uint8  frameType      FRAME_TYPE_EVENTS
+        uint8  numRecords     number of records that follow
+        uint16 frameBytes     total length of this frame including header
+    Record:
+        uint8  recordType     EVENT_RECORD_*
+        uint8  recordBytes    payload length, not counting these two bytes
+        payload
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_FRAME_H
+#define CARDIOKIT_FRAME_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+#define FRAME_TYPE_SAMPLES 0xCF
+#define FRAME_TYPE_EVENTS  0xE5
+
+#define EVENT_FRAME_HEADER_BYTES  4
+#define EVENT_RECORD_HEADER_BYTES 2
+
+// Event record types
+#define EVENT_RECORD_BEAT    0x01 // BeatEvent_t, see CardioKitQrs.h
+#define EVENT_RECORD_SUMMARY 0x02 // see CardioKitMonitor.h
+#define EVENT_RECORD_SNIPPET 0x03 // see CardioKitMonitor.h
+#define EVENT_RECORD_PROFILE 0x04 // uint8 site, int8 headroom %, uint16 load 1/1000, uint32 count, min, mean, max cycles
+#define EVENT_RECORD_POWER   0x05 // see CardioKitPower.h
+#define EVENT_RECORD_DAC     0x06 // see CardioKitDac.h
+#define EVENT_RECORD_SCAN    0x07 // see CardioKitScan.h
+#define EVENT_RECORD_MOTION  0x08 // see CardioKitMotion.h
+#define EVENT_RECORD_ACCEL   0x09 // see CardioKitAccel.h
+#define EVENT_RECORD_RESPONSE 0x0A // see CardioKitCommandSpace.h
+#define EVENT_RECORD_LOG     0x0B // see CardioKitLog.h
+#define EVENT_RECORD_WARMSTART 0x0C // see CardioKitWarmStart.h
+#define EVENT_RECORD_BOOT    0x0D // see CardioKitBoot.h
+
+typedef struct
+{
+    uint8_t  streamId;
+    uint8_t  width;
+    uint16_t count;
+    uint16_t decimation;
+} FrameStreamDescriptor_t;
+
+typedef struct
+{
+    uint8_t  frameType;
+    uint8_t  numStreams;
+    uint16_t frameBytes;
+    uint16_t frameCounter;
+    uint16_t baseRateHz;
+    uint32_t startTick;
+    FrameStreamDescriptor_t streams[NUM_FRAME_STREAMS];
+    uint16_t ecg[NUM_ECG_CHANNELS][FRAME_SAMPLES_PER_CHANNEL];
+#if PCG_PRESENT
+    uint16_t pcg[PCG_SAMPLES_PER_FRAME];
+#endif
+#if ACCEL_PRESENT
+    uint16_t accel[ACCEL_SAMPLES_PER_FRAME];
+#endif
+#if ACCEL_ORIENT_PRESENT
+    uint16_t orient[3][ORIENT_SAMPLES_PER_FRAME];
+#endif
+    uint16_t battery[BATTERY_SAMPLES_PER_FRAME];
+    uint16_t dac[NUM_ECG_CHANNELS][DAC_SAMPLES_PER_FRAME];
+    uint16_t scan[NUM_ECG_CHANNELS][SCAN_SAMPLES_PER_FRAME];
+} SampleFrame_t;
+
+// call this in setup on every frame buffer to write its layout descriptor
+void InitializeFrame(SampleFrame_t * frame);
+
+// Stamp the frame counter and start tick on a completed frame, returns the number of bytes to send
+uint16_t FinalizeFrame(SampleFrame_t * frame, uint32_t startTick);
+
+// Queue a record for the next event frame, returns 0 if it did not fit and was dropped
+uint8_t QueueEventRecord(uint8_t recordType, const void * payload, uint8_t payloadBytes);
+
+// Make the records queued so far due now instead of waiting for the frame to fill
+void FlushEventFrame();
+
+// 1 if a record of payloadBytes still fits the pending event frame
+uint8_t EventRecordFits(uint8_t payloadBytes);
+
+// Returns the length of the pending event frame once it is due to be sent, 0 otherwise
+// *data stays valid until the next QueueEventRecord, the queue is emptied
+uint16_t TakeEventFrame(const uint8_t ** data);
+
+// Records dropped because the event frame was full
+uint16_t GetDroppedEventRecords();
+
+#endif //CARDIOKIT_FRAME_H
+#ifdef __cplusplus
+}
+#endif
@@ -13,7 +13,15 @@
 #include "CardioKitLEDS.h"
 #include <Arduino.h>
 
-#define LED_DELAY_TIME (250) // Delay time for startup led display
+static CKLED_t  FlashLed = CKLED_ALL_NO_STAT;
+static uint16_t FlashHalfPeriodMs = 0;
+static uint16_t FlashToggles = 0; // edges left, the LED is on while it is odd
+static uint32_t FlashLastMillis = 0;
+
+// Startup display, one LED more per step, then only the status LED stays on
+static const CKLED_t SweepOrder[] = { CKLED_STATUS, CKLED_NORTH, CKLED_EAST, CKLED_SOUTH, CKLED_WEST };
+#define SWEEP_STEPS (sizeof(SweepOrder) / sizeof(SweepOrder[0]))
+static volatile uint8_t SweepStep = SWEEP_STEPS + 1;
 
 // call this in setup to initialize CardioKit LEDs
 void InitializeCkLeds()
@@ -28,17 +36,24 @@ void InitializeCkLeds()
     pinMode(pinLED_W, OUTPUT);
     pinMode(pinSTATLED, OUTPUT);
 
-    digitalWriteFast(pinSTATLED, HIGH);
-    delay(LED_DELAY_TIME);
-    digitalWriteFast(pinLED_N, HIGH);
-    delay(LED_DELAY_TIME);
-    digitalWriteFast(pinLED_E, HIGH);
-    delay(LED_DELAY_TIME);
-    digitalWriteFast(pinLED_S, HIGH);
-    delay(LED_DELAY_TIME);
-    digitalWriteFast(pinLED_W, HIGH);
-    delay(LED_DELAY_TIME);
     ControlCkLed(CKLED_ALL, LOW);
+    SweepStep = 0;
+    StepCkLedSweep(); // the first LED goes on right away
+}
+
+uint8_t StepCkLedSweep()
+{
+    if(SweepStep < SWEEP_STEPS)
+    {
+        ControlCkLed(SweepOrder[SweepStep++], HIGH);
+        return 1;
+    }
+    if(SweepStep == SWEEP_STEPS)
+    {
+        ControlCkLed(CKLED_ALL_NO_STAT, LOW);
+        SweepStep++;
+    }
+    return 0;
 }
 
 // control a CardioKit LED
@@ -78,3 +93,20 @@ void ControlCkLed(CKLED_t led, int HIGH_OR_LOW)
             break;
     }
 }
+
+void FlashCkLed(CKLED_t led, uint16_t periodMs, uint8_t count)
+{
+    if(FlashToggles > 0) { ControlCkLed(FlashLed, LOW); } // a new flash replaces a running one
+    FlashLed = led;
+    FlashHalfPeriodMs = (periodMs < 2) ? 1 : periodMs / 2;
+    FlashToggles = 2 * (uint16_t) count;
+    FlashLastMillis = millis() - FlashHalfPeriodMs; // first edge on the next update
+}
+
+void UpdateCkLeds()
+{
+    if(FlashToggles == 0 || (millis() - FlashLastMillis) < FlashHalfPeriodMs) { return; }
+    FlashLastMillis += FlashHalfPeriodMs;
+    ControlCkLed(FlashLed, (FlashToggles & 1) ? LOW : HIGH);
+    FlashToggles--;
+}
@@ -29,12 +29,24 @@ typedef enum
     CKLED_ALL_NO_STAT
 } CKLED_t;
 
+#define CKLED_SWEEP_MS (250) // StepCkLedSweep interval
+
 // call this in setup to initialize CardioKit LEDs
+// Starts the startup display without waiting for it, StepCkLedSweep moves it on
 void InitializeCkLeds();
 
+// One step of the startup display, from a timer every CKLED_SWEEP_MS
+// Returns 0 once it is over, the status LED is left on
+uint8_t StepCkLedSweep();
+
 // control a CardioKit LED
 void ControlCkLed(CKLED_t led, int HIGH_OR_LOW);
 
+// Flash an LED count times, on and off for half of periodMs each, without blocking
+// UpdateCkLeds() in loop() does the switching. Ends off
+void FlashCkLed(CKLED_t led, uint16_t periodMs, uint8_t count);
+void UpdateCkLeds();
+
 #endif //CARDIOKIT_LEDS_H
 #ifdef __cplusplus
 }
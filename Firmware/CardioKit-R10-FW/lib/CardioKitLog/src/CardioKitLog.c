@@ -0,0 +1,93 @@
+/*  *********************************************
+    CardioKitLog.c
+    Binary log ring for ISRs and loop() hot paths
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitLog.h"
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+#include "CardioKitFrame.h"
+
+LogEntry_t LogRing[LOG_RING_ENTRIES];
+volatile uint32_t LogHead = 0;
+volatile uint32_t LogTail = 0;
+volatile uint32_t LogDropped = 0;
+
+static uint32_t LogDroppedReported = 0;
+
+#define LOG_MESSAGE_FORMAT(id, level, format) [id] = format,
+static const char * const LogFormats[NUM_LOG_MESSAGES] = { LOG_MESSAGES(LOG_MESSAGE_FORMAT) };
+#undef LOG_MESSAGE_FORMAT
+
+#define LOG_MESSAGE_LEVEL(id, level, format) [id] = level,
+static const uint8_t LogLevels[NUM_LOG_MESSAGES] = { LOG_MESSAGES(LOG_MESSAGE_LEVEL) };
+#undef LOG_MESSAGE_LEVEL
+
+static const char LogLevelNames[] = "-EWID"; // by LOG_LEVEL_*
+
+uint8_t TakeLogEntry(LogEntry_t * entry)
+{
+    uint32_t tail = LogTail;
+    const LogEntry_t * e = &LogRing[tail & ((LOG_RING_ENTRIES) - 1)];
+    if(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != tail + 1) { return 0; } // empty, or a writer was interrupted before publishing
+
+    memcpy(entry, e, sizeof(LogEntry_t));
+    __atomic_store_n(&LogTail, tail + 1, __ATOMIC_RELEASE); // the slot is free for writers from here
+
+    uint32_t dropped = LogDropped - LogDroppedReported;
+    LogDroppedReported += dropped;
+    entry->dropped = (dropped > 255) ? 255 : dropped;
+    return 1;
+}
+
+uint16_t FormatLogEntry(const LogEntry_t * entry, char * line, uint16_t lineBytes)
+{
+    uint16_t room = lineBytes - 1; // the newline
+    uint8_t level = (entry->id < NUM_LOG_MESSAGES) ? LogLevels[entry->id] : LOG_LEVEL_NONE;
+    int n = snprintf(line, room, "%10lu %c ", (unsigned long) entry->micros, LogLevelNames[level]);
+    if(n < room)
+    {
+        if(entry->id < NUM_LOG_MESSAGES)
+        {
+            n += snprintf(line + n, room - n, LogFormats[entry->id], (int) entry->args[0], (int) entry->args[1], (int) entry->args[2]);
+        }
+        else
+        {
+            n += snprintf(line + n, room - n, "message %u", entry->id);
+        }
+    }
+    if(n < room && entry->dropped > 0)
+    {
+        n += snprintf(line + n, room - n, " (%u entries lost before)", entry->dropped);
+    }
+    if(n > room - 1) { n = room - 1; } // snprintf returns what it would have written
+    line[n++] = '\n';
+    line[n]   = '\0';
+    return n;
+}
+
+uint8_t QueueLogRecord(const LogEntry_t * entry)
+{
+    if(entry->id >= NUM_LOG_MESSAGES || LogLevels[entry->id] > (LOG_INBAND_LEVEL)) { return 0; }
+    uint8_t rec[LOG_RECORD_BYTES];
+    memcpy(&rec[0], &entry->micros, 4); // little-endian
+    memcpy(&rec[4], &entry->id, 2);
+    rec[6] = entry->dropped;
+    memcpy(&rec[7], entry->args, 4 * (LOG_ARGS));
+    return QueueEventRecord(EVENT_RECORD_LOG, rec, LOG_RECORD_BYTES);
+}
+
+uint32_t GetLogDropped()
+{
+    return LogDropped;
+}
+
+#endif // LOG_LEVEL > LOG_LEVEL_NONE
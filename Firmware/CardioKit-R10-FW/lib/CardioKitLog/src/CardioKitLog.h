@@ -0,0 +1,139 @@
+/*  *********************************************
+    CardioKitLog.h
+    Binary log ring for ISRs and loop() hot paths
+
+    CKLOG(LOGMSG_*, args...) stores the micros() timestamp, the message
+    id and up to LOG_ARGS int32 arguments, no formatting and no Serial.
+    A slot is reserved with one LDREX/STREX compare and swap on the
+    head, so any ISR may log over any other and over loop(). The entry
+    is published last through its sequence word, the reader stops at
+    the first slot not yet written. Counted ~45 cycles including the
+    micros() read. When the ring is full the entry is dropped and
+    counted, the writer never waits.
+
+    Messages are declared once in LOG_MESSAGES with their level and
+    format (%d, %u or %x of int32 only). A message above LOG_LEVEL is
+    compiled out, arguments included.
+
+    loop() drains the ring while idle: over USB Serial as text when a
+    terminal is open and has room, and in-band for the messages at or
+    below LOG_INBAND_LEVEL, where the host puts the format strings back.
+
+    EVENT_RECORD_LOG:
+        uint32 micros        device micros() when the entry was written
+        uint16 id            LOGMSG_*, LOG_FORMATS on the host has the same order
+        uint8  dropped       entries lost to a full ring since the last one taken
+        int32  args[3]       unused ones are 0
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_LOG_H
+#define CARDIOKIT_LOG_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+// X(id, level, format), append only, the host decoder indexes its table by id
+#define LOG_MESSAGES(X) \
+    X(LOGMSG_ECG_OVERRUN,          LOG_LEVEL_WARN,  "ECG buffer overrun, frame %u with loop() at %u") \
+    X(LOGMSG_ACCEL_FIFO_OVERRUN,   LOG_LEVEL_WARN,  "ADXL FIFO overrun at tick %u, oldest samples lost") \
+    X(LOGMSG_TCP_OUTPUT_OVERFLOW,  LOG_LEVEL_ERROR, "Output buffer overflow, seq %u len %u not queued") \
+    X(LOGMSG_TCP_SLOTS_EXHAUSTED,  LOG_LEVEL_WARN,  "Packet slots exhausted") \
+    X(LOGMSG_TCP_BAD_LENGTH,       LOG_LEVEL_ERROR, "Unsupported packet length %u") \
+    X(LOGMSG_TCP_NACK,             LOG_LEVEL_DEBUG, "Nack seq %u len %u") \
+    X(LOGMSG_TCP_NACK_MISSING,     LOG_LEVEL_WARN,  "Can't find nack data at seq %u, output buffer head %u tail %u") \
+    X(LOGMSG_TCP_RESENT,           LOG_LEVEL_DEBUG, "Resent seq %u len %u")
+
+#define LOG_MESSAGE_ID(id, level, format) id,
+typedef enum
+{
+    LOG_MESSAGES(LOG_MESSAGE_ID)
+    NUM_LOG_MESSAGES
+} LogMessage_t;
+#undef LOG_MESSAGE_ID
+
+// LOGLVL_<id>, so CKLOG can drop a message at compile time
+#define LOG_MESSAGE_LEVEL(id, level, format) LOGLVL_##id = (level),
+enum { LOG_MESSAGES(LOG_MESSAGE_LEVEL) };
+#undef LOG_MESSAGE_LEVEL
+
+#define LOG_ARGS          3
+#define LOG_RECORD_BYTES  (7 + 4 * (LOG_ARGS))
+#define LOG_LINE_BYTES    128 // one formatted entry with its newline
+
+#if (LOG_RING_ENTRIES) & ((LOG_RING_ENTRIES) - 1)
+#error "LOG_RING_ENTRIES must be a power of two"
+#endif
+
+typedef struct
+{
+    volatile uint32_t seq; // head index + 1 once the entry is complete
+    uint32_t micros;
+    uint16_t id;
+    uint8_t  dropped;      // only filled in by TakeLogEntry
+    int32_t  args[LOG_ARGS];
+} LogEntry_t;
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+
+extern LogEntry_t LogRing[LOG_RING_ENTRIES];
+extern volatile uint32_t LogHead;
+extern volatile uint32_t LogTail;
+extern volatile uint32_t LogDropped;
+
+// Unused arguments default to 0
+#define CKLOG(...) CKLOG_ARGS(__VA_ARGS__, 0, 0, 0)
+#define CKLOG_ARGS(id, a0, a1, a2, ...) \
+    do { if(LOGLVL_##id <= (LOG_LEVEL)) { LogWrite((id), (int32_t) (a0), (int32_t) (a1), (int32_t) (a2)); } } while(0)
+
+// Inline so an ISR doesn't pay for a call
+static inline void LogWrite(LogMessage_t id, int32_t a0, int32_t a1, int32_t a2)
+{
+    uint32_t head = LogHead;
+    do
+    {
+        if((head - LogTail) >= (LOG_RING_ENTRIES))
+        {
+            __atomic_fetch_add(&LogDropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&LogHead, &head, head + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    LogEntry_t * e = &LogRing[head & ((LOG_RING_ENTRIES) - 1)];
+    e->micros  = micros();
+    e->id      = id;
+    e->args[0] = a0;
+    e->args[1] = a1;
+    e->args[2] = a2;
+    __atomic_store_n(&e->seq, head + 1, __ATOMIC_RELEASE);
+}
+
+// Copy out the oldest complete entry, from loop() only. Returns 0 when there is none
+uint8_t TakeLogEntry(LogEntry_t * entry);
+
+// The entry as one line of text with its newline, returns the length
+uint16_t FormatLogEntry(const LogEntry_t * entry, char * line, uint16_t lineBytes);
+
+// Queue EVENT_RECORD_LOG if the message is at or below LOG_INBAND_LEVEL
+// Returns 0 if it was not queued, EventRecordFits(LOG_RECORD_BYTES) first to be sure it goes
+uint8_t QueueLogRecord(const LogEntry_t * entry);
+
+// Entries lost to a full ring since boot
+uint32_t GetLogDropped();
+
+#else
+
+#define CKLOG(...) ((void) 0)
+
+#endif // LOG_LEVEL > LOG_LEVEL_NONE
+
+#endif //CARDIOKIT_LOG_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,234 @@
+/*  *********************************************
+    CardioKitMonitor.c
+    Low-bandwidth monitoring mode for a degraded link
+
+    A raw frame is ~710 bytes every 105ms. In monitoring mode a
+    summary (~16 bytes/s), beat records (~10 bytes per beat) and one
+    delta coded snippet (~60-120 bytes per beat) are sent instead,
+    roughly 2-3% of the raw rate at normal heart rates.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitMonitor.h"
+#include <Arduino.h>
+#include <string.h>
+#include "CardioKitProfile.h"
+
+#define MONITOR_SCANS(ms) (((ms) * (CORE_SAMPLE_FREQ)) / 1000)
+
+#define SNIPPET_PRE_SCANS  MONITOR_SCANS(MONITOR_SNIPPET_PRE_MS)
+#define SNIPPET_POST_SCANS MONITOR_SCANS(MONITOR_SNIPPET_POST_MS)
+#define SNIPPET_SAMPLES    (((SNIPPET_PRE_SCANS) + (SNIPPET_POST_SCANS)) / (MONITOR_SNIPPET_DECIMATION))
+#define SNIPPET_MAX_BYTES  ((EVENT_FRAME_MAX_BYTES - EVENT_FRAME_HEADER_BYTES) / 2 - EVENT_RECORD_HEADER_BYTES)
+#define SUMMARY_BYTES      (11 + (NUM_ECG_CHANNELS))
+#define HISTORY_SCANS      512 // power of two, ~1.3s of every lead
+#define MAX_PENDING_SNIPPETS 4
+
+#if SNIPPET_SAMPLES > 255
+#error "MONITOR_SNIPPET_PRE_MS + MONITOR_SNIPPET_POST_MS too long for the snippet count"
+#endif
+// a beat is reported up to ~250ms after its R peak, one frame later its snippet must still be in the history
+#if ((SNIPPET_PRE_SCANS) + MONITOR_SCANS(250) + 2 * (FRAME_SAMPLES_PER_CHANNEL)) > HISTORY_SCANS
+#error "Monitor history too short for the snippet window"
+#endif
+
+static uint16_t History[NUM_ECG_CHANNELS][HISTORY_SCANS];
+static uint32_t MonitorScan = 0; // scans seen, matches the QRS detector's scan count
+
+static uint8_t  Mode = MONITOR_MODE_RAW;
+static uint32_t LowBacklogSinceMillis = 0;
+static uint32_t ExitHoldMillis = MONITOR_EXIT_HOLD_MS;
+static uint32_t LastExitMillis = 0;
+static uint8_t  HasExited = 0;
+static uint32_t LastSummaryMillis = 0;
+
+static BeatEvent_t PendingSnippets[MAX_PENDING_SNIPPETS];
+static uint8_t     NumPendingSnippets = 0;
+
+static uint16_t PutWord(uint8_t * buf, uint16_t len, uint16_t val)
+{
+    buf[len++] = val & 0xFF;
+    buf[len++] = val >> 8;
+    return len;
+}
+
+static uint16_t PutLong(uint8_t * buf, uint16_t len, uint32_t val)
+{
+    len = PutWord(buf, len, val & 0xFFFF);
+    return PutWord(buf, len, val >> 16);
+}
+
+void initializeMonitor()
+{
+    memset(History, 0, sizeof(History));
+    MonitorScan = 0;
+    Mode = MONITOR_MODE_RAW;
+    ExitHoldMillis = MONITOR_EXIT_HOLD_MS;
+    HasExited = 0;
+    NumPendingSnippets = 0;
+    LastSummaryMillis = millis();
+}
+
+static void QueueSummary(const SampleFrame_t * frame)
+{
+    uint8_t rec[SUMMARY_BYTES];
+    uint16_t len = 0;
+    uint16_t posture = 0;
+#if ACCEL_PRESENT
+    posture = frame->accel[ACCEL_SAMPLES_PER_FRAME - 1];
+#endif
+    len = PutLong(rec, len, MonitorScan);
+    rec[len++] = Mode;
+    rec[len++] = GetQrsActiveLead();
+    len = PutWord(rec, len, GetQrsHeartRateBpm());
+    len = PutWord(rec, len, posture);
+    rec[len++] = NUM_ECG_CHANNELS;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        rec[len++] = GetQrsLeadQuality(ch);
+    }
+    QueueEventRecord(EVENT_RECORD_SUMMARY, rec, len);
+    LastSummaryMillis = millis();
+}
+
+// Box-car decimate the beat's lead out of the history and delta code it
+static void QueueSnippet(const BeatEvent_t * beat)
+{
+    uint8_t rec[SNIPPET_MAX_BYTES];
+    uint32_t start = beat->scan - SNIPPET_PRE_SCANS;
+    uint16_t len = 0;
+
+    len = PutLong(rec, len, start);
+    rec[len++] = beat->lead;
+    rec[len++] = MONITOR_SNIPPET_DECIMATION;
+    rec[len++] = MONITOR_SNIPPET_SHIFT;
+    uint16_t countIndex = len++;
+
+    uint8_t count = 0;
+    int32_t prev = 0;
+    for(uint16_t s = 0; s < SNIPPET_SAMPLES; s++)
+    {
+        uint32_t sum = 0;
+        for(uint8_t d = 0; d < MONITOR_SNIPPET_DECIMATION; d++)
+        {
+            sum += History[beat->lead][(start + s * MONITOR_SNIPPET_DECIMATION + d) % HISTORY_SCANS];
+        }
+        int32_t val = (sum / MONITOR_SNIPPET_DECIMATION) >> MONITOR_SNIPPET_SHIFT;
+        int32_t delta = val - prev;
+        uint8_t small = (count > 0) && (delta > -128) && (delta <= 127);
+
+        // the QRS upstroke can take a few escapes, cut the snippet short rather than overflow
+        if(len + (small ? 1 : 3) > SNIPPET_MAX_BYTES) { break; }
+        if(small)
+        {
+            rec[len++] = (uint8_t) (int8_t) delta;
+        }
+        else
+        {
+            if(count > 0) { rec[len++] = (uint8_t) SNIPPET_ESCAPE; }
+            len = PutWord(rec, len, (uint16_t) val);
+        }
+        prev = val;
+        count++;
+    }
+    rec[countIndex] = count;
+    QueueEventRecord(EVENT_RECORD_SNIPPET, rec, len);
+}
+
+// Send snippets whose window has been fully acquired, drop any that fell out of the history
+static void HandlePendingSnippets()
+{
+    uint8_t kept = 0;
+    for(uint8_t i = 0; i < NumPendingSnippets; i++)
+    {
+        const BeatEvent_t * beat = &PendingSnippets[i];
+        if(beat->scan + SNIPPET_POST_SCANS > MonitorScan)
+        {
+            PendingSnippets[kept++] = *beat;
+        }
+        else if(beat->scan >= SNIPPET_PRE_SCANS &&
+                (MonitorScan - (beat->scan - SNIPPET_PRE_SCANS)) <= HISTORY_SCANS)
+        {
+            QueueSnippet(beat);
+        }
+    }
+    NumPendingSnippets = kept;
+}
+
+static void UpdateMode(uint32_t backlog, const SampleFrame_t * frame)
+{
+    uint32_t now = millis();
+    if(Mode == MONITOR_MODE_RAW)
+    {
+        if(backlog < MONITOR_ENTER_BACKLOG) { return; }
+        // raw frames swamped the link again soon after resuming, hold off longer this time
+        if(HasExited && (now - LastExitMillis) < 2 * ExitHoldMillis)
+        {
+            ExitHoldMillis *= 2;
+            if(ExitHoldMillis > MONITOR_EXIT_HOLD_MAX_MS) { ExitHoldMillis = MONITOR_EXIT_HOLD_MAX_MS; }
+        }
+        else
+        {
+            ExitHoldMillis = MONITOR_EXIT_HOLD_MS;
+        }
+        Mode = MONITOR_MODE_FEATURES;
+        LowBacklogSinceMillis = now;
+        QueueSummary(frame); // tell the host right away
+    }
+    else
+    {
+        if(backlog > MONITOR_EXIT_BACKLOG)
+        {
+            LowBacklogSinceMillis = now;
+        }
+        else if((now - LowBacklogSinceMillis) >= ExitHoldMillis)
+        {
+            Mode = MONITOR_MODE_RAW;
+            LastExitMillis = now;
+            HasExited = 1;
+            NumPendingSnippets = 0;
+            QueueSummary(frame);
+        }
+    }
+}
+
+uint8_t MonitorProcessFrame(const SampleFrame_t * frame, const BeatEvent_t * beats, uint8_t numBeats, uint32_t backlog)
+{
+    PROFILE_BEGIN(PROFILE_SITE_MONITOR);
+    for(uint16_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+    {
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            History[ch][(MonitorScan + i) % HISTORY_SCANS] = frame->ecg[ch][i];
+        }
+    }
+    MonitorScan += FRAME_SAMPLES_PER_CHANNEL;
+
+    UpdateMode(backlog, frame);
+
+    if(Mode == MONITOR_MODE_FEATURES)
+    {
+        for(uint8_t i = 0; i < numBeats; i++)
+        {
+            if(NumPendingSnippets == MAX_PENDING_SNIPPETS) { break; }
+            PendingSnippets[NumPendingSnippets++] = beats[i];
+        }
+        HandlePendingSnippets();
+    }
+
+    if((millis() - LastSummaryMillis) >= MONITOR_SUMMARY_MS)
+    {
+        QueueSummary(frame);
+    }
+    PROFILE_END(PROFILE_SITE_MONITOR);
+    return Mode;
+}
+
+uint8_t GetMonitorMode()
+{
+    return Mode;
+}
@@ -0,0 +1,63 @@
+/*  *********************************************
+    CardioKitMonitor.h
+    Low-bandwidth monitoring mode for a degraded link
+
+    In MONITOR_MODE_RAW every sample frame is sent. When the SimpleTCP
+    backlog reaches MONITOR_ENTER_BACKLOG the device switches to
+    MONITOR_MODE_FEATURES and sample frames are dropped (their frame
+    counters still advance so the host sees the gap). Beats keep
+    flowing and a compressed snippet of the active lead is sent
+    around each one. Raw frames resume once the backlog stayed under
+    MONITOR_EXIT_BACKLOG for the exit hold.
+
+    EVENT_RECORD_SUMMARY, every MONITOR_SUMMARY_MS in both modes:
+        uint32 scan          ECG scans since boot
+        uint8  mode          MONITOR_MODE_*
+        uint8  activeLead    lead beats are detected on
+        uint16 heartRateBpm  0 if unknown
+        uint16 posture       latest accelerometer tilt angle, 0-359
+        uint8  numLeads
+        uint8  quality[numLeads]  QRS signal to noise in 1/16 steps, see GetQrsLeadQuality
+    EVENT_RECORD_SNIPPET, one per beat in MONITOR_MODE_FEATURES:
+        uint32 scan          ECG scan of the first sample
+        uint8  lead
+        uint8  decimation    ECG scans per snippet sample
+        uint8  shift         LSBs dropped from every sample
+        uint8  count         samples in the snippet
+        uint16 first sample
+        count - 1 deltas     int8, or SNIPPET_ESCAPE followed by the uint16 sample
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_MONITOR_H
+#define CARDIOKIT_MONITOR_H
+#include <WProgram.h>
+#include "hwsettings.h"
+#include "CardioKitFrame.h"
+#include "CardioKitQrs.h"
+
+#define MONITOR_MODE_RAW      0
+#define MONITOR_MODE_FEATURES 1
+
+#define SNIPPET_ESCAPE ((int8_t) -128)
+
+// call this in setup after initializeQrsDetector
+void initializeMonitor();
+
+// Call once per completed frame with the beats QrsProcessFrame found in it and the SimpleTCP backlog
+// Queues summary and snippet records, returns the mode the frame should be handled in
+uint8_t MonitorProcessFrame(const SampleFrame_t * frame, const BeatEvent_t * beats, uint8_t numBeats, uint32_t backlog);
+
+uint8_t GetMonitorMode();
+
+#endif //CARDIOKIT_MONITOR_H
+#ifdef __cplusplus
+}
+#endif
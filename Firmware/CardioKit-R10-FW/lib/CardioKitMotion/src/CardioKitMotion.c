@@ -0,0 +1,133 @@
+/*  *********************************************
+    CardioKitMotion.c
+    Accelerometer referenced motion artifact cancellation for the ECG
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitMotion.h"
+
+#if MOTION_CANCEL_ENABLE
+#include <Arduino.h>
+#include "CardioKitAccel.h"
+#include "CardioKitMotionCore.h"
+#include "CardioKitProfile.h"
+
+#define MOTION_RECORD_BYTES (2 + 7 * (NUM_ECG_CHANNELS))
+
+#if !DAC_BLOCK_CONTROL
+#error "MOTION_CANCEL_ENABLE needs DAC_BLOCK_CONTROL, offset steps must land on a frame boundary"
+#endif
+
+static uint8_t  Mode = MOTION_MODE_OFF;
+static MotionCore_t Core;
+static uint8_t  SlotLead[NUM_ECG_CHANNELS];
+static uint32_t LastReportMillis = 0;
+
+static void ResetAll()
+{
+    MotionCoreReset(&Core);
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        SlotLead[slot] = slot;
+    }
+    LastReportMillis = millis();
+}
+
+void initializeMotion()
+{
+    Mode = MOTION_MODE_OFF;
+    ResetAll();
+}
+
+void SetMotionMode(uint8_t mode)
+{
+    if(mode > MOTION_MODE_CANCEL) { return; }
+    if(Mode == MOTION_MODE_OFF && mode != MOTION_MODE_OFF) { ResetAll(); }
+    Mode = mode;
+}
+
+uint8_t GetMotionMode()
+{
+    return Mode;
+}
+
+void GetMotionStats(uint8_t slot, MotionStats_t * stats)
+{
+    stats->reductionDeciDb = MotionCoreReductionDeciDb(&Core, slot);
+    stats->inputRms = (uint16_t) AccelIsqrt(Core.slots[slot].inPower);
+    stats->weightNorm = MotionCoreWeightNorm(&Core, slot);
+    stats->updates = Core.slots[slot].updates;
+}
+
+static void QueueMotionRecord()
+{
+    uint8_t rec[MOTION_RECORD_BYTES];
+    uint16_t len = 0;
+    rec[len++] = Mode;
+    rec[len++] = NUM_ECG_CHANNELS;
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        MotionStats_t s;
+        GetMotionStats(slot, &s);
+        rec[len++] = SlotLead[slot];
+        rec[len++] = (uint16_t) s.reductionDeciDb & 0xFF;
+        rec[len++] = (uint16_t) s.reductionDeciDb >> 8;
+        rec[len++] = s.inputRms & 0xFF;
+        rec[len++] = s.inputRms >> 8;
+        rec[len++] = s.weightNorm & 0xFF;
+        rec[len++] = s.weightNorm >> 8;
+    }
+    QueueEventRecord(EVENT_RECORD_MOTION, rec, len);
+    LastReportMillis = millis();
+}
+
+static void SetEcgStreamFlag(SampleFrame_t * frame, uint8_t on)
+{
+    for(uint8_t s = 0; s < frame->numStreams; s++)
+    {
+        FrameStreamDescriptor_t * d = &frame->streams[s];
+        if((d->streamId & STREAM_ID_MASK) != STREAM_ID_ECG) { continue; }
+        d->streamId = on ? (d->streamId | STREAM_FLAG_MOTION) : (d->streamId & ~STREAM_FLAG_MOTION);
+    }
+}
+
+void MotionProcessFrame(SampleFrame_t * frame, uint32_t startTick)
+{
+    int32_t xyz[FRAME_SAMPLES_PER_CHANNEL][3];
+    if(Mode == MOTION_MODE_OFF || !AccelSampleAt(startTick, xyz[0]))
+    {
+        SetEcgStreamFlag(frame, 0);
+        return;
+    }
+    PROFILE_BEGIN(PROFILE_SITE_MOTION);
+
+    uint16_t dac[NUM_ECG_CHANNELS];
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        uint8_t lead = frame->scan[ch][0];
+        if(lead != SlotLead[ch])
+        { // the artifact of another lead is another filter
+            MotionCoreResetSlot(&Core, ch);
+            SlotLead[ch] = lead;
+        }
+        dac[ch] = frame->dac[ch][0];
+    }
+    for(uint16_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+    { // middle of the scan, within 1.25ms of every slot
+        AccelSampleAt(startTick + i * ECG_SCAN_TICKS + ECG_SCAN_TICKS / 2, xyz[i]);
+    }
+    MotionCoreFrame(&Core, frame->ecg, dac, xyz, Mode == MOTION_MODE_CANCEL);
+    SetEcgStreamFlag(frame, Mode == MOTION_MODE_CANCEL);
+
+    if((millis() - LastReportMillis) >= MOTION_REPORT_MS)
+    {
+        QueueMotionRecord();
+    }
+    PROFILE_END(PROFILE_SITE_MOTION);
+}
+
+#endif //MOTION_CANCEL_ENABLE
@@ -0,0 +1,90 @@
+/*  *********************************************
+    CardioKitMotion.h
+    Accelerometer referenced motion artifact cancellation for the ECG
+
+    Electrode motion shows up in the ECG as a few Hz of baseline that
+    follows the movement of the chest. Each ECG slot runs an NLMS
+    filter that predicts it from the accelerometer: MOTION_TAPS taps
+    per axis, MOTION_TAP_SCANS scans apart, over the XYZ readings
+    interpolated onto the ECG scan times (AccelSampleAt). ECG and
+    reference both go through the same one pole high-pass first so
+    gravity, the electrode offset and DAC steps are not modelled. The
+    prediction of the high-passed artifact has that high-pass swapped
+    for a ~0.06Hz one (MOTION_OUT_SHIFT) before it is subtracted from
+    the raw samples, as is it would leave a quarter of a 2Hz artifact.
+
+    Everything is integer: weights are Q16 ECG counts per 1/16
+    accelerometer count, the prediction is a 64 bit MAC (SMLAL) and
+    the normalisation is one 32 bit divide per scan, shared by every
+    slot since the reference is. The filters only adapt while the
+    reference power is above MOTION_MIN_POWER, at rest it is sensor
+    noise. Counted ~50k cycles per frame for 5 slots, PROFILE_SITE_MOTION
+    has the real figure.
+
+    A slot is not adapted in a frame whose DAC offset stepped or on
+    samples near the ADC rails, and starts over when it changes lead.
+    The filters are in CardioKitMotionCore so the native test
+    (test/test_native_motion) can run them on the build host, this
+    feeds them the frame and the accelerometer and reports.
+
+    Modes (CKCMD_MOTION_MODE):
+        MOTION_MODE_OFF      nothing runs
+        MOTION_MODE_LEARN    the filters adapt and report, the ECG is untouched
+        MOTION_MODE_CANCEL   the prediction is subtracted, STREAM_FLAG_MOTION
+                             is set on the ECG stream id
+    The accelerometer FIFO is read at every frame end and a frame waits
+    for that burst before it is processed, so the reference covers it.
+
+    EVENT_RECORD_MOTION, every MOTION_REPORT_MS outside MOTION_MODE_OFF:
+        uint8  mode
+        uint8  numSlots
+        per slot:
+        uint8  lead
+        int16  reduction     0.1dB, power of the high-passed ECG before over after cancelling
+        uint16 inputRms      counts, the high-passed ECG
+        uint16 weightNorm    sum of |weight|, Q8 counts per 1/16 accelerometer count
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_MOTION_H
+#define CARDIOKIT_MOTION_H
+#include <WProgram.h>
+#include "hwsettings.h"
+#include "CardioKitFrame.h"
+
+#define MOTION_MODE_OFF    0
+#define MOTION_MODE_LEARN  1
+#define MOTION_MODE_CANCEL 2
+
+typedef struct
+{
+    int16_t  reductionDeciDb;
+    uint16_t inputRms;
+    uint16_t weightNorm;
+    uint32_t updates;         // samples adapted on since the slot last started over
+} MotionStats_t;
+
+// call this in setup, starts in MOTION_MODE_OFF
+void initializeMotion();
+
+// Leaving MOTION_MODE_OFF starts every filter over
+void SetMotionMode(uint8_t mode);
+uint8_t GetMotionMode();
+
+// Call once per completed frame after the DAC loop, with the PDB tick the frame started at
+// Every accelerometer sample up to the frame end must have been added
+void MotionProcessFrame(SampleFrame_t * frame, uint32_t startTick);
+
+void GetMotionStats(uint8_t slot, MotionStats_t * stats);
+
+#endif //CARDIOKIT_MOTION_H
+#ifdef __cplusplus
+}
+#endif
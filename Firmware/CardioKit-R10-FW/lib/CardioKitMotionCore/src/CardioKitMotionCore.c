@@ -0,0 +1,191 @@
+/*  *********************************************
+    CardioKitMotionCore.c
+    NLMS motion artifact canceller, without Arduino or the frame
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitMotionCore.h"
+#include <string.h>
+
+#define HP_FRAC_BITS    8    // high-pass state carries 8 bits below its input
+#define REF_MAX         8191 // 1/16 count, 2g in full resolution is 8192
+#define WEIGHT_MAX      (1L << 30)
+#define ADC_RAIL_MARGIN 256
+#define POWER_SHIFT     3    // the power averages move 1/8 of the way per frame
+#define DECIDB_PER_LOG2_Q16 7706 // 10 * 10 * log10(2) / 256 in Q16, for the Q8 log2
+
+// One pole DC blocker, y[n] = (1 - 2^-MOTION_HP_SHIFT) y[n-1] + x[n] - x[n-1], fed x[n] - x[n-1]
+static inline int32_t HighPass(int32_t * state, int32_t delta)
+{
+    *state += delta * (1 << HP_FRAC_BITS) - (*state >> MOTION_HP_SHIFT);
+    return *state >> HP_FRAC_BITS;
+}
+
+static inline int32_t Clamp(int32_t v, int32_t lo, int32_t hi)
+{
+    return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+// log2(v) in Q8, the mantissa taken as linear, within 0.09
+static int32_t Log2Q8(uint32_t v)
+{
+    if(v == 0) { return 0; }
+    int32_t msb = 31 - __builtin_clz(v);
+    uint32_t mant = (msb >= 8) ? (v >> (msb - 8)) : (v << (8 - msb));
+    return msb * 256 + (int32_t) (mant & 0xFF);
+}
+
+void MotionCoreResetSlot(MotionCore_t * m, uint8_t slot)
+{
+    MotionSlot_t * s = &m->slots[slot];
+    memset(s->weights, 0, sizeof(s->weights));
+    s->ecgHp = 0;
+    s->prevPrediction = 0;
+    s->outPrediction = 0;
+    s->primed = 0;
+    s->inPower = 0;
+    s->outPower = 0;
+    s->updates = 0;
+}
+
+void MotionCoreReset(MotionCore_t * m)
+{
+    memset(m->refLine, 0, sizeof(m->refLine));
+    memset(m->refHp, 0, sizeof(m->refHp));
+    m->refPos = 0;
+    m->refPrimed = 0;
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        MotionCoreResetSlot(m, slot);
+    }
+}
+
+// High-pass the reading at the scan into the reference line, returns the taps in r and their power
+static uint32_t PushReference(MotionCore_t * m, const int32_t * xyz, int32_t * r)
+{
+    if(!m->refPrimed)
+    {
+        memcpy(m->refPrev, xyz, sizeof(m->refPrev));
+        m->refPrimed = 1;
+    }
+    m->refPos = (m->refPos + 1) % MOTION_REF_LINE;
+    for(uint8_t a = 0; a < 3; a++)
+    {
+        m->refLine[a][m->refPos] = (int16_t) Clamp(HighPass(&m->refHp[a], xyz[a] - m->refPrev[a]), -REF_MAX, REF_MAX);
+        m->refPrev[a] = xyz[a];
+    }
+    uint32_t power = 0;
+    for(uint8_t a = 0; a < 3; a++)
+    {
+        for(uint8_t t = 0; t < MOTION_TAPS; t++)
+        {
+            int32_t v = m->refLine[a][(m->refPos + MOTION_REF_LINE - t * MOTION_TAP_SCANS) % MOTION_REF_LINE];
+            r[a * MOTION_TAPS + t] = v;
+            power += (uint32_t) (v * v); // 12 taps of 2^26 at most
+        }
+    }
+    return power;
+}
+
+void MotionCoreFrame(MotionCore_t * m, uint16_t ecg[NUM_ECG_CHANNELS][FRAME_SAMPLES_PER_CHANNEL],
+                     const uint16_t dac[NUM_ECG_CHANNELS], int32_t xyz[FRAME_SAMPLES_PER_CHANNEL][3], uint8_t cancel)
+{
+    uint8_t adapt[NUM_ECG_CHANNELS];
+    uint64_t inSum[NUM_ECG_CHANNELS];
+    uint64_t outSum[NUM_ECG_CHANNELS];
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        MotionSlot_t * s = &m->slots[ch];
+        adapt[ch] = s->primed && (dac[ch] == s->dac);
+        if(!s->primed || dac[ch] != s->dac)
+        { // the offset step sits on the frame boundary, keep it out of the high-pass
+            s->ecgPrev = ecg[ch][0];
+            s->primed = 1;
+        }
+        s->dac = dac[ch];
+        inSum[ch] = 0;
+        outSum[ch] = 0;
+    }
+
+    for(uint16_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+    {
+        int32_t r[MOTION_WEIGHTS];
+        uint32_t power = PushReference(m, xyz[i], r);
+        uint32_t inv = 0x80000000UL / (power + MOTION_EPS);
+        uint8_t moving = (power >= MOTION_MIN_POWER); // still, the reference is sensor noise and the ECG would random walk the weights
+
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            MotionSlot_t * s = &m->slots[ch];
+            int32_t x = ecg[ch][i];
+            int32_t d = HighPass(&s->ecgHp, x - s->ecgPrev);
+            s->ecgPrev = x;
+
+            int32_t * w = s->weights;
+            int64_t acc = 0;
+            for(uint8_t j = 0; j < MOTION_WEIGHTS; j++)
+            {
+                acc += (int64_t) w[j] * r[j];
+            }
+            int32_t yq = (int32_t) (acc >> 8);
+            int32_t e = Clamp(d - (yq >> 8), -32767, 32767);
+            inSum[ch]  += (uint64_t) ((int64_t) d * d);
+            outSum[ch] += (uint64_t) ((int64_t) e * e);
+
+            if(moving && adapt[ch] && x > ADC_RAIL_MARGIN && x < 65535 - ADC_RAIL_MARGIN)
+            { // w += mu e r / (|r|^2 + eps), in Q16 that is mu_q15 * e * inv * r >> 30
+                int64_t g = ((int64_t) MOTION_MU_Q15 * e * inv) >> 16;
+                for(uint8_t j = 0; j < MOTION_WEIGHTS; j++)
+                {
+                    w[j] = Clamp(w[j] + (int32_t) ((g * r[j]) >> 14), -WEIGHT_MAX, WEIGHT_MAX);
+                }
+                s->updates++;
+            }
+            // yq predicts the high-passed artifact, 27% of a 2Hz artifact would be left subtracting it as is.
+            // (1 - a/z) / (1 - b/z) swaps the MOTION_HP_SHIFT pole for a MOTION_OUT_SHIFT one
+            int32_t * out = &s->outPrediction;
+            *out += yq - s->prevPrediction + (s->prevPrediction >> MOTION_HP_SHIFT) - (*out >> MOTION_OUT_SHIFT);
+            s->prevPrediction = yq;
+            if(cancel)
+            {
+                ecg[ch][i] = (uint16_t) Clamp(x - (*out >> 8), 0, 65535);
+            }
+        }
+    }
+
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        MotionSlot_t * s = &m->slots[ch];
+        for(uint8_t j = 0; j < MOTION_WEIGHTS; j++)
+        {
+            s->weights[j] -= s->weights[j] >> MOTION_LEAK_SHIFT;
+        }
+        uint64_t in = inSum[ch] / FRAME_SAMPLES_PER_CHANNEL;
+        uint64_t out = outSum[ch] / FRAME_SAMPLES_PER_CHANNEL;
+        if(in > UINT32_MAX) { in = UINT32_MAX; }
+        if(out > UINT32_MAX) { out = UINT32_MAX; }
+        s->inPower  = s->inPower  - (s->inPower  >> POWER_SHIFT) + ((uint32_t) in  >> POWER_SHIFT);
+        s->outPower = s->outPower - (s->outPower >> POWER_SHIFT) + ((uint32_t) out >> POWER_SHIFT);
+    }
+}
+
+int16_t MotionCoreReductionDeciDb(const MotionCore_t * m, uint8_t slot)
+{
+    const MotionSlot_t * s = &m->slots[slot];
+    return (int16_t) (((Log2Q8(s->inPower) - Log2Q8(s->outPower)) * DECIDB_PER_LOG2_Q16) / 65536);
+}
+
+uint16_t MotionCoreWeightNorm(const MotionCore_t * m, uint8_t slot)
+{
+    int32_t norm = 0;
+    for(uint8_t j = 0; j < MOTION_WEIGHTS; j++)
+    {
+        int32_t w = m->slots[slot].weights[j];
+        norm += ((w < 0) ? -w : w) >> 8;
+    }
+    return (uint16_t) ((norm > 0xFFFF) ? 0xFFFF : norm);
+}
@@ -0,0 +1,78 @@
+/*  *********************************************
+    CardioKitMotionCore.h
+    NLMS motion artifact canceller, without Arduino or the frame
+
+    The reference line and the filters of every ECG slot, stepped one
+    frame at a time over readings already interpolated onto the scans.
+    CardioKitMotion feeds it each frame from AccelSampleAt, the native
+    test (test/test_native_motion) feeds it recordings on the build
+    host. Only hwsettings.h is needed, for the MOTION_* settings and
+    the frame size.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_MOTION_CORE_H
+#define CARDIOKIT_MOTION_CORE_H
+#include <stdint.h>
+#include "hwsettings.h"
+
+#define MOTION_WEIGHTS  (3 * (MOTION_TAPS))
+#define MOTION_REF_LINE 32 // power of two, scans of reference kept for the taps
+
+#if ((MOTION_TAPS) - 1) * (MOTION_TAP_SCANS) >= MOTION_REF_LINE
+#error "MOTION_TAPS * MOTION_TAP_SCANS longer than the reference line"
+#endif
+
+typedef struct
+{
+    int32_t  weights[MOTION_WEIGHTS]; // Q16 ECG counts per 1/16 accelerometer count
+    int32_t  ecgPrev;
+    int32_t  ecgHp;
+    int32_t  prevPrediction;          // Q8 counts, high-passed like the ECG
+    int32_t  outPrediction;           // Q8 counts, with only the MOTION_OUT_SHIFT high-pass left
+    uint16_t dac;
+    uint8_t  primed;
+    uint32_t inPower;                 // mean square per scan, counts^2
+    uint32_t outPower;
+    uint32_t updates;                 // samples adapted on since the slot last started over
+} MotionSlot_t;
+
+typedef struct
+{
+    int16_t  refLine[3][MOTION_REF_LINE]; // high-passed reference, 1/16 count, one entry per scan
+    uint8_t  refPos;
+    int32_t  refPrev[3];
+    int32_t  refHp[3];
+    uint8_t  refPrimed;
+    MotionSlot_t slots[NUM_ECG_CHANNELS];
+} MotionCore_t;
+
+// Start the reference and every slot over
+void MotionCoreReset(MotionCore_t * m);
+
+// Start one slot over, when it changes lead
+void MotionCoreResetSlot(MotionCore_t * m, uint8_t slot);
+
+// Run one frame. ecg holds the raw samples and gets the cancelled ones when cancel is set
+// dac is each slot's offset for the frame, a slot whose offset stepped is not adapted in it
+// xyz is the accelerometer at the middle of each scan, in 1/16 count
+void MotionCoreFrame(MotionCore_t * m, uint16_t ecg[NUM_ECG_CHANNELS][FRAME_SAMPLES_PER_CHANNEL],
+                     const uint16_t dac[NUM_ECG_CHANNELS], int32_t xyz[FRAME_SAMPLES_PER_CHANNEL][3], uint8_t cancel);
+
+// Power of the slot's high-passed ECG before over after cancelling, 0.1dB
+int16_t MotionCoreReductionDeciDb(const MotionCore_t * m, uint8_t slot);
+
+// Sum of |weight|, Q8 counts per 1/16 accelerometer count, saturated at 0xFFFF
+uint16_t MotionCoreWeightNorm(const MotionCore_t * m, uint8_t slot);
+
+#endif //CARDIOKIT_MOTION_CORE_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,151 @@
+/*  *********************************************
+    CardioKitPcg.c
+    Anti-aliasing decimation of full-bandwidth PCG from ADC1
+
+    The ADC1 DMA delivers PCG_DMA_BLOCK samples at PCG_ACQ_FREQ_HZ.
+    Each block is low-pass filtered and decimated by PCG_DECIMATION
+    with CMSIS-DSP arm_fir_decimate_fast_q15, which only computes the
+    output phases that are kept (polyphase cost) and uses the M4
+    dual 16-bit MAC (SMLAD) for the taps.
+
+    Filters are Blackman-windowed sinc with the cutoff at the output
+    Nyquist: flat (<0.01dB) to 0.4 * PCG_OUTPUT_FREQ_HZ and >67dB down
+    by 0.6 * PCG_OUTPUT_FREQ_HZ, so nothing aliases below 0.4 * Fout.
+    Stopband of the quantized taps: 69.7dB for D = 2, 70.9dB for 4,
+    69.7dB for 5 and 67.6dB for 10. Unity DC gain.
+
+    Tap counts are multiples of 2 * PCG_DECIMATION so the output lands
+    on the ECG tick grid: ADC1 converts half a PDB tick after ADC0,
+    which puts the centre of output k at tick (k + 1) * D - TAPS / 2.
+    Dropping the first TAPS / 2D - 1 outputs leaves output m centred
+    on tick m * D.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitPcg.h"
+#include <Arduino.h>
+#include <arm_math.h>
+#include "CardioKitProfile.h"
+
+#if PCG_DECIMATION == 2
+#define PCG_FIR_TAPS 56
+static const q15_t PcgFirCoeffs[PCG_FIR_TAPS] =
+{
+         0,      0,      1,      3,     -6,    -11,     17,     25,    -36,    -50,     67,     90,
+      -118,   -152,    194,    245,   -306,   -381,    472,    584,   -724,   -902,   1139,   1470,
+     -1973,  -2853,   4858,  14731,  14731,   4858,  -2853,  -1973,   1470,   1139,   -902,   -724,
+       584,    472,   -381,   -306,    245,    194,   -152,   -118,     90,     67,    -50,    -36,
+        25,     17,    -11,     -6,      3,      1,      0,      0,
+};
+#elif PCG_DECIMATION == 4
+#define PCG_FIR_TAPS 112
+static const q15_t PcgFirCoeffs[PCG_FIR_TAPS] =
+{
+         0,      0,      0,      0,      0,      1,      2,      1,     -2,     -5,     -7,     -4,
+         4,     13,     16,      8,     -9,    -27,    -31,    -15,     18,     49,     57,     27,
+       -31,    -84,    -95,    -45,     50,    137,    153,     71,    -80,   -214,   -239,   -110,
+       122,    328,    365,    168,   -187,   -502,   -560,   -259,    291,    793,    900,    427,
+      -494,  -1402,  -1684,   -864,   1122,   3823,   6405,   7980,   7980,   6405,   3823,   1122,
+      -864,  -1684,  -1402,   -494,    427,    900,    793,    291,   -259,   -560,   -502,   -187,
+       168,    365,    328,    122,   -110,   -239,   -214,    -80,     71,    153,    137,     50,
+       -45,    -95,    -84,    -31,     27,     57,     49,     18,    -15,    -31,    -27,     -9,
+         8,     16,     13,      4,     -4,     -7,     -5,     -2,      1,      2,      1,      0,
+         0,      0,      0,      0,
+};
+#elif PCG_DECIMATION == 5
+#define PCG_FIR_TAPS 140
+static const q15_t PcgFirCoeffs[PCG_FIR_TAPS] =
+{
+         0,      0,      0,      0,      0,      0,      1,      2,      2,      1,     -1,     -3,
+        -5,     -5,     -2,      3,      9,     13,     12,      5,     -6,    -18,    -25,    -23,
+       -10,     11,     33,     46,     42,     18,    -20,    -57,    -78,    -70,    -29,     32,
+        93,    126,    112,     47,    -51,   -146,   -196,   -173,    -72,     78,    223,    300,
+       264,    110,   -119,   -341,   -459,   -406,   -170,    186,    536,    731,    656,    280,
+      -314,   -934,  -1327,  -1253,   -571,    704,   2386,   4150,   5615,   6445,   6445,   5615,
+      4150,   2386,    704,   -571,  -1253,  -1327,   -934,   -314,    280,    656,    731,    536,
+       186,   -170,   -406,   -459,   -341,   -119,    110,    264,    300,    223,     78,    -72,
+      -173,   -196,   -146,    -51,     47,    112,    126,     93,     32,    -29,    -70,    -78,
+       -57,    -20,     18,     42,     46,     33,     11,    -10,    -23,    -25,    -18,     -6,
+         5,     12,     13,      9,      3,     -2,     -5,     -5,     -3,     -1,      1,      2,
+         2,      1,      0,      0,      0,      0,      0,      0,
+};
+#elif PCG_DECIMATION == 10
+#define PCG_FIR_TAPS 280
+static const q15_t PcgFirCoeffs[PCG_FIR_TAPS] =
+{
+         0,      0,
+         0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,
+         1,      1,      1,      1,      0,      0,      0,     -1,     -1,     -2,     -2,     -2,
+        -2,     -2,     -2,     -1,      1,      2,      3,      5,      6,      6,      6,      5,
+         3,      1,     -1,     -4,     -7,    -10,    -11,    -12,    -12,    -10,     -7,     -2,
+         3,      8,     13,     18,     21,     22,     21,     18,     12,      4,     -5,    -14,
+       -24,    -31,    -36,    -38,    -36,    -30,    -20,     -7,      8,     24,     39,     51,
+        59,     62,     59,     49,     33,     12,    -12,    -38,    -61,    -81,    -93,    -98,
+       -92,    -76,    -51,    -18,     19,     58,     94,    124,    144,    150,    141,    117,
+        78,     28,    -29,    -89,   -145,   -191,   -221,   -231,   -217,   -180,   -121,    -44,
+        46,    139,    228,    301,    351,    369,    351,    294,    199,     73,    -77,   -238,
+      -395,   -531,   -631,   -679,   -662,   -571,   -400,   -152,    168,    549,    972,   1417,
+      1861,   2279,   2648,   2946,   3155,   3263,   3263,   3155,   2946,   2648,   2279,   1861,
+      1417,    972,    549,    168,   -152,   -400,   -571,   -662,   -679,   -631,   -531,   -395,
+      -238,    -77,     73,    199,    294,    351,    369,    351,    301,    228,    139,     46,
+       -44,   -121,   -180,   -217,   -231,   -221,   -191,   -145,    -89,    -29,     28,     78,
+       117,    141,    150,    144,    124,     94,     58,     19,    -18,    -51,    -76,    -92,
+       -98,    -93,    -81,    -61,    -38,    -12,     12,     33,     49,     59,     62,     59,
+        51,     39,     24,      8,     -7,    -20,    -30,    -36,    -38,    -36,    -31,    -24,
+       -14,     -5,      4,     12,     18,     21,     22,     21,     18,     13,      8,      3,
+        -2,     -7,    -10,    -12,    -12,    -11,    -10,     -7,     -4,     -1,      1,      3,
+         5,      6,      6,      6,      5,      3,      2,      1,     -1,     -2,     -2,     -2,
+        -2,     -2,     -2,     -1,     -1,      0,      0,      0,      1,      1,      1,      1,
+         0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,      0,
+         0,      0,
+};
+#else
+#error "PCG_DECIMATION must be 2, 4, 5 or 10, see PCG_OUTPUT_FREQ_HZ in hwsettings.h"
+#endif
+
+#if (PCG_FIR_TAPS % (2 * PCG_DECIMATION)) != 0
+#error "PCG_FIR_TAPS must be a multiple of 2 * PCG_DECIMATION to stay on the ECG tick grid"
+#endif
+#define PCG_ALIGN_DROP ((PCG_FIR_TAPS) / (2 * (PCG_DECIMATION)) - 1)
+
+static arm_fir_decimate_instance_q15 PcgDecimator;
+static uint16_t PcgSamplesToDrop = PCG_ALIGN_DROP;
+static q15_t PcgFirState[PCG_FIR_TAPS + PCG_DMA_BLOCK - 1];
+static q15_t __attribute__((aligned(4))) PcgBlockIn[PCG_DMA_BLOCK];
+static q15_t __attribute__((aligned(4))) PcgBlockOut[PCG_SAMPLES_PER_DMA_BLOCK];
+
+void initializePcgDecimator()
+{
+    arm_fir_decimate_init_q15(&PcgDecimator, PCG_FIR_TAPS, PCG_DECIMATION,
+                              (q15_t*) PcgFirCoeffs, PcgFirState, PCG_DMA_BLOCK);
+    PcgSamplesToDrop = PCG_ALIGN_DROP;
+}
+
+uint8_t DecimatePcgBlock(const volatile int16_t * adc_block, uint16_t * pcg_out)
+{
+    PROFILE_BEGIN(PROFILE_SITE_PCG_DECIMATE);
+
+    // ADC samples are offset binary, flipping the MSB makes them q15. Two at a time.
+    const volatile uint32_t * in32 = (const volatile uint32_t*) adc_block;
+    uint32_t * q32 = (uint32_t*) PcgBlockIn;
+    for(uint32_t i = 0; i < (PCG_DMA_BLOCK / 2); i++)
+    {
+        q32[i] = in32[i] ^ 0x80008000;
+    }
+
+    arm_fir_decimate_fast_q15(&PcgDecimator, PcgBlockIn, PcgBlockOut, PCG_DMA_BLOCK);
+
+    uint8_t numOut = 0;
+    for(uint32_t i = 0; i < PCG_SAMPLES_PER_DMA_BLOCK; i++)
+    {
+        if(PcgSamplesToDrop > 0) { PcgSamplesToDrop--; continue; } // still inside the filter delay
+        pcg_out[numOut++] = ((uint16_t) PcgBlockOut[i]) ^ 0x8000;
+    }
+
+    PROFILE_END(PROFILE_SITE_PCG_DECIMATE);
+    return numOut;
+}
@@ -0,0 +1,32 @@
+/*  *********************************************
+    CardioKitPcg.h
+    Anti-aliasing decimation of full-bandwidth PCG from ADC1
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_PCG_H
+#define CARDIOKIT_PCG_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+#define PCG_SAMPLES_PER_DMA_BLOCK ((PCG_DMA_BLOCK) / (PCG_DECIMATION))
+
+// call this in setup before ADC1 DMA starts
+void initializePcgDecimator();
+
+// Filter and decimate PCG_DMA_BLOCK raw ADC1 samples into up to PCG_SAMPLES_PER_DMA_BLOCK samples at PCG_OUTPUT_FREQ_HZ
+// Returns how many were written, fewer while the filter delay is dropped after initializePcgDecimator
+// Output sample m since then is centred on PDB tick m * PCG_DECIMATION
+uint8_t DecimatePcgBlock(const volatile int16_t * adc_block, uint16_t * pcg_out);
+
+#endif //CARDIOKIT_PCG_H
+#ifdef __cplusplus
+}
+#endif
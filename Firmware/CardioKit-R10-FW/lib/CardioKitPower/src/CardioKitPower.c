@@ -0,0 +1,107 @@
+/*  *********************************************
+    CardioKitPower.c
+    Sleep between interrupts and estimate the core's duty and current
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitPower.h"
+#include <Arduino.h>
+#include "CardioKitFrame.h"
+#include "CardioKitMonitor.h"
+
+#define POWER_RECORD_BYTES 11
+
+static uint8_t  Mode = MONITOR_MODE_RAW;
+static uint32_t WindowStartMicros = 0;
+static uint32_t WindowAsleepMicros = 0;
+
+// micros() enables interrupts again on the way out, this reads SysTick the same way and leaves them alone
+static uint32_t MicrosIrqDisabled()
+{
+    uint32_t count   = systick_millis_count;
+    uint32_t current = SYST_CVR;
+    uint32_t reload  = SYST_RVR;
+    if((SCB_ICSR & SCB_ICSR_PENDSTSET) && (current > 50)) { count++; } // wrapped, tick not serviced yet
+    return count * 1000 + ((reload - current) * 1000) / (reload + 1);
+}
+
+static void ResetWindow()
+{
+    __disable_irq();
+    WindowStartMicros = MicrosIrqDisabled();
+    WindowAsleepMicros = 0;
+    __enable_irq();
+}
+
+static void QueuePowerRecord()
+{
+    uint8_t rec[POWER_RECORD_BYTES];
+    uint32_t windowMillis = (micros() - WindowStartMicros) / 1000;
+    uint16_t coreMHz = (F_CPU) / 1000000;
+    uint16_t duty = GetPowerDutyPermille();
+    uint16_t current = GetPowerCoreDeciMa();
+
+    rec[0]  = windowMillis & 0xFF;
+    rec[1]  = (windowMillis >> 8) & 0xFF;
+    rec[2]  = (windowMillis >> 16) & 0xFF;
+    rec[3]  = windowMillis >> 24;
+    rec[4]  = Mode;
+    rec[5]  = coreMHz & 0xFF;
+    rec[6]  = coreMHz >> 8;
+    rec[7]  = duty & 0xFF;
+    rec[8]  = duty >> 8;
+    rec[9]  = current & 0xFF;
+    rec[10] = current >> 8;
+    QueueEventRecord(EVENT_RECORD_POWER, rec, POWER_RECORD_BYTES);
+}
+
+void initializePower()
+{
+    SCB_SCR &= ~SCB_SCR_SLEEPDEEP; // WFI enters WAIT, peripherals and DMA keep running
+    Mode = MONITOR_MODE_RAW;
+    ResetWindow();
+}
+
+void PowerWaitForInterrupt()
+{
+    uint32_t start = MicrosIrqDisabled();
+    __asm__ volatile("wfi");
+    WindowAsleepMicros += MicrosIrqDisabled() - start;
+}
+
+void SetPowerMode(uint8_t mode)
+{
+    if(mode == Mode) { return; }
+    QueuePowerRecord(); // closes the window of the mode being left
+    Mode = mode;
+    ResetWindow();
+}
+
+uint16_t GetPowerDutyPermille()
+{
+    uint32_t elapsed = micros() - WindowStartMicros;
+    if(elapsed == 0) { return 1000; }
+    uint64_t asleep = ((uint64_t) WindowAsleepMicros * 1000) / elapsed;
+    return (asleep > 1000) ? 0 : (uint16_t) (1000 - asleep);
+}
+
+uint16_t GetPowerCoreDeciMa()
+{
+    uint32_t coreMHz = (F_CPU) / 1000000;
+    uint32_t duty = GetPowerDutyPermille();
+    uint32_t microAmps = coreMHz * (duty * POWER_RUN_UA_PER_MHZ + (1000 - duty) * POWER_WAIT_UA_PER_MHZ) / 1000;
+    return microAmps / 100;
+}
+
+void HandlePowerReport()
+{
+    if((micros() - WindowStartMicros) >= (uint32_t) (POWER_REPORT_MS) * 1000)
+    {
+        QueuePowerRecord();
+        ResetWindow();
+    }
+}
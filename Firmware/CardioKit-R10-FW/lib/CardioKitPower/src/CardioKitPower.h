@@ -0,0 +1,61 @@
+/*  *********************************************
+    CardioKitPower.h
+    Sleep between interrupts and estimate the core's duty and current
+
+    PowerWaitForInterrupt is entered with interrupts disabled once
+    loop() found nothing pending, so an ISR that sets a flag between
+    the check and the WFI still wakes it. The core only enters WAIT
+    (SLEEPDEEP clear), wake up is a few cycles and the ISRs run at the
+    same latency as from a spinning loop().
+
+    The time spent in WFI is summed per window, a window runs for
+    POWER_REPORT_MS or until the acquisition mode changes, so the duty
+    of raw streaming and of monitoring mode are reported apart. The
+    core clock stays at F_CPU in both, micros(), delayMicroseconds()
+    and everything timed with them assume it.
+
+    EVENT_RECORD_POWER, every POWER_REPORT_MS and when the mode changes:
+        uint32 windowMillis   length of the window the record covers
+        uint8  mode           MONITOR_MODE_* the window was spent in
+        uint16 coreMHz        F_CPU
+        uint16 dutyPermille   share of the window the core was awake
+        uint16 coreDeciMa     estimated core current, 0.1mA steps
+                              from POWER_RUN/WAIT_UA_PER_MHZ, not measured
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_POWER_H
+#define CARDIOKIT_POWER_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+// call this in setup after the clocks are up
+void initializePower();
+
+// Sleep until the next interrupt, call with interrupts disabled and re-enable them after
+// Counts the time asleep for the duty cycle
+void PowerWaitForInterrupt();
+
+// Tell it the acquisition mode (MONITOR_MODE_*), queues a record for the previous mode if it changed
+void SetPowerMode(uint8_t mode);
+
+// Awake share of the current window in 1/1000
+uint16_t GetPowerDutyPermille();
+
+// Estimated core current over the current window in 0.1mA
+uint16_t GetPowerCoreDeciMa();
+
+// Call once per frame, queues an EVENT_RECORD_POWER record every POWER_REPORT_MS
+void HandlePowerReport();
+
+#endif //CARDIOKIT_POWER_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,170 @@
+/*  *********************************************
+    CardioKitProfile.c
+    DWT cycle counter probes for ISRs and loop() stages
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitProfile.h"
+
+#if PROFILE_ENABLE
+#include <Arduino.h>
+#include <string.h>
+#include "CardioKitFrame.h"
+
+#define SCAN_CYCLES  ((F_CPU) / (CORE_SAMPLE_FREQ))
+#define FRAME_CYCLES ((SCAN_CYCLES) * (FRAME_SAMPLES_PER_CHANNEL))
+#define PROFILE_RECORD_BYTES 20
+
+ProfileStats_t ProfileStats[NUM_PROFILE_SITES];
+
+static uint32_t ProfileResetMillis = 0;
+static volatile uint8_t ProfileDumpRequested = 0;
+static uint8_t  ProfileNextRecordSite = NUM_PROFILE_SITES;
+static uint8_t  ProfileResetAfterDump = 0;
+
+// Every loop() stage has to fit in a frame period for the loop to keep up with acquisition
+static const uint32_t ProfileBudgets[NUM_PROFILE_SITES] =
+{
+    [PROFILE_SITE_DMA0_ISR]     = (F_CPU) / (ADC_PDB_FREQ_HZ),
+    [PROFILE_SITE_DMA1_ISR]     = (F_CPU) / ((PCG_ACQ_FREQ_HZ) / (PCG_DMA_BLOCK)),
+    [PROFILE_SITE_PCG_DECIMATE] = (F_CPU) / ((PCG_ACQ_FREQ_HZ) / (PCG_DMA_BLOCK)),
+    [PROFILE_SITE_ADXL_ISR]     = 0,
+    [PROFILE_SITE_READ_ACCEL]   = FRAME_CYCLES,
+    [PROFILE_SITE_DAC_CONTROL]  = FRAME_CYCLES,
+    [PROFILE_SITE_MOTION]       = FRAME_CYCLES,
+    [PROFILE_SITE_QRS]          = FRAME_CYCLES,
+    [PROFILE_SITE_MONITOR]      = FRAME_CYCLES,
+    [PROFILE_SITE_FILTER_ECG]   = FRAME_CYCLES,
+    [PROFILE_SITE_FILTER_PCG]   = FRAME_CYCLES,
+    [PROFILE_SITE_SEND_SAMPLES] = FRAME_CYCLES,
+    [PROFILE_SITE_HANDLE_NACKS] = FRAME_CYCLES,
+    [PROFILE_SITE_TRANSMIT]     = FRAME_CYCLES,
+    [PROFILE_SITE_ERASE_OLD]    = FRAME_CYCLES,
+    [PROFILE_SITE_ACCEL_ANGLE]  = FRAME_CYCLES,
+};
+
+static const char * const ProfileSiteNames[NUM_PROFILE_SITES] =
+{
+    [PROFILE_SITE_DMA0_ISR]     = "dmaBuffer0_isr",
+    [PROFILE_SITE_DMA1_ISR]     = "dmaBuffer1_isr",
+    [PROFILE_SITE_PCG_DECIMATE] = "DecimatePcgBlock",
+    [PROFILE_SITE_ADXL_ISR]     = "ADXL_ISR",
+    [PROFILE_SITE_READ_ACCEL]   = "AccelFifoDone",
+    [PROFILE_SITE_DAC_CONTROL]  = "updateDacControlValues2",
+    [PROFILE_SITE_MOTION]       = "MotionProcessFrame",
+    [PROFILE_SITE_QRS]          = "QrsProcessFrame",
+    [PROFILE_SITE_MONITOR]      = "MonitorProcessFrame",
+    [PROFILE_SITE_FILTER_ECG]   = "FilterFrame ECG",
+    [PROFILE_SITE_FILTER_PCG]   = "FilterFrame PCG",
+    [PROFILE_SITE_SEND_SAMPLES] = "SendPacketSlot",
+    [PROFILE_SITE_HANDLE_NACKS] = "HandleNacks",
+    [PROFILE_SITE_TRANSMIT]     = "Transmit",
+    [PROFILE_SITE_ERASE_OLD]    = "EraseOldOutputBuffers",
+    [PROFILE_SITE_ACCEL_ANGLE]  = "AccelFillFrame angles",
+};
+
+void initializeProfile()
+{
+    ARM_DEMCR    |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+    ResetProfile();
+}
+
+void ResetProfile()
+{
+    __disable_irq();
+    memset(ProfileStats, 0, sizeof(ProfileStats));
+    for(uint8_t site = 0; site < NUM_PROFILE_SITES; site++)
+    {
+        ProfileStats[site].min = UINT32_MAX;
+    }
+    ProfileResetMillis = millis();
+    __enable_irq();
+}
+
+uint32_t GetProfileBudget(ProfileSite_t site)
+{
+    return ProfileBudgets[site];
+}
+
+uint64_t GetProfileElapsedCycles()
+{
+    return (uint64_t) (millis() - ProfileResetMillis) * ((F_CPU) / 1000);
+}
+
+const char * GetProfileSiteName(ProfileSite_t site)
+{
+    return ProfileSiteNames[site];
+}
+
+void GetProfileSnapshot(ProfileSite_t site, ProfileStats_t * snapshot)
+{
+    __disable_irq();
+    memcpy(snapshot, &ProfileStats[site], sizeof(ProfileStats_t)); // ~30 cycles
+    __enable_irq();
+}
+
+int8_t GetProfileHeadroomPercent(ProfileSite_t site, const ProfileStats_t * snapshot)
+{
+    uint32_t budget = ProfileBudgets[site];
+    if(budget == 0 || snapshot->count == 0) { return 100; }
+    int32_t headroom = 100 - (int32_t) (((uint64_t) snapshot->max * 100) / budget);
+    return (headroom < -128) ? -128 : (int8_t) headroom;
+}
+
+uint16_t GetProfileLoadPermille(const ProfileStats_t * snapshot)
+{
+    uint64_t elapsed = GetProfileElapsedCycles();
+    if(elapsed == 0) { return 0; }
+    uint64_t load = (snapshot->total * 1000) / elapsed;
+    return (load > 1000) ? 1000 : (uint16_t) load;
+}
+
+void RequestProfileDump(uint8_t resetAfter)
+{
+    ProfileDumpRequested = 1;
+    ProfileResetAfterDump = resetAfter;
+    ProfileNextRecordSite = 0;
+}
+
+uint8_t TakeProfileDumpRequest()
+{
+    uint8_t requested = ProfileDumpRequested;
+    ProfileDumpRequested = 0;
+    return requested;
+}
+
+uint8_t QueueProfileRecords(uint8_t maxRecords)
+{
+    while(maxRecords-- > 0 && ProfileNextRecordSite < NUM_PROFILE_SITES)
+    {
+        ProfileSite_t site = (ProfileSite_t) ProfileNextRecordSite++;
+        ProfileStats_t snapshot;
+        GetProfileSnapshot(site, &snapshot);
+        const ProfileStats_t * s = &snapshot;
+        uint32_t count = s->count;
+        uint32_t fields[4] = { count, count ? s->min : 0, count ? (uint32_t) (s->total / count) : 0, s->max };
+        uint8_t rec[PROFILE_RECORD_BYTES];
+        uint16_t load = GetProfileLoadPermille(s);
+
+        rec[0] = site;
+        rec[1] = (uint8_t) GetProfileHeadroomPercent(site, s);
+        rec[2] = load & 0xFF;
+        rec[3] = load >> 8;
+        memcpy(&rec[4], fields, sizeof(fields)); // count, min, mean, max, little-endian
+        QueueEventRecord(EVENT_RECORD_PROFILE, rec, PROFILE_RECORD_BYTES);
+    }
+    if(ProfileNextRecordSite < NUM_PROFILE_SITES) { return 0; }
+    if(ProfileResetAfterDump)
+    {
+        ProfileResetAfterDump = 0;
+        ResetProfile();
+    }
+    return 1;
+}
+
+#endif //PROFILE_ENABLE
@@ -0,0 +1,128 @@
+/*  *********************************************
+    CardioKitProfile.h
+    DWT cycle counter probes for ISRs and loop() stages
+
+    Wrap a site in PROFILE_BEGIN(site) / PROFILE_END(site) in the same
+    scope. Each site keeps count, min, max, total and a histogram of
+    floor(log2(cycles)) buckets. A probe is one CYCCNT read on entry and
+    ~15 cycles on exit (CLZ gives the bucket). With PROFILE_ENABLE 0 the
+    macros are empty and nothing is linked in.
+
+    Loop stages are wall time: ISRs that preempt them are counted in
+    the stage too.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_PROFILE_H
+#define CARDIOKIT_PROFILE_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+typedef enum
+{
+    // ISRs
+    PROFILE_SITE_DMA0_ISR = 0,  // ECG sample, mux and DAC
+    PROFILE_SITE_DMA1_ISR,      // PCG block
+    PROFILE_SITE_PCG_DECIMATE,  // inside PROFILE_SITE_DMA1_ISR
+    PROFILE_SITE_ADXL_ISR,
+    // loop() stages
+    PROFILE_SITE_READ_ACCEL,    // the completion of an accelerometer FIFO burst, in the SPI DMA ISR
+    PROFILE_SITE_DAC_CONTROL,
+    PROFILE_SITE_MOTION,
+    PROFILE_SITE_QRS,
+    PROFILE_SITE_MONITOR,
+    PROFILE_SITE_FILTER_ECG,
+    PROFILE_SITE_FILTER_PCG,
+    PROFILE_SITE_SEND_SAMPLES,
+    PROFILE_SITE_HANDLE_NACKS,
+    PROFILE_SITE_TRANSMIT,
+    PROFILE_SITE_ERASE_OLD,
+    PROFILE_SITE_ACCEL_ANGLE,   // the CORDIC angles of AccelFillFrame, after the others so the site ids stay put
+    NUM_PROFILE_SITES
+} ProfileSite_t;
+
+#define PROFILE_HIST_BUCKETS 24 // bucket b holds 2^b to 2^(b+1)-1 cycles, the last one everything above
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t hist[PROFILE_HIST_BUCKETS];
+} ProfileStats_t;
+
+#if PROFILE_ENABLE
+
+extern ProfileStats_t ProfileStats[NUM_PROFILE_SITES];
+
+#define PROFILE_BEGIN(site) uint32_t profileStart_##site = ARM_DWT_CYCCNT
+#define PROFILE_END(site)   ProfileRecord((site), ARM_DWT_CYCCNT - profileStart_##site)
+
+// Inline so the ISR probes don't pay for a call. Each site is only
+// recorded from one context, so no locking is needed to write it, but
+// loop() reads ISR sites through GetProfileSnapshot
+static inline void ProfileRecord(ProfileSite_t site, uint32_t cycles)
+{
+    ProfileStats_t * s = &ProfileStats[site];
+    uint32_t bucket = 31 - __builtin_clz(cycles | 1);
+    if(bucket >= PROFILE_HIST_BUCKETS) { bucket = PROFILE_HIST_BUCKETS - 1; }
+    s->count++;
+    s->total += cycles;
+    if(cycles < s->min) { s->min = cycles; }
+    if(cycles > s->max) { s->max = cycles; }
+    s->hist[bucket]++;
+}
+
+// call this first thing in setup, enables CYCCNT
+void initializeProfile();
+
+// Clear every site and restart the load measurement window
+void ResetProfile();
+
+// Deadline of a site in cycles (time between two runs), 0 for sporadic sites
+uint32_t GetProfileBudget(ProfileSite_t site);
+
+// Cycles elapsed since the last reset, the denominator of a site's CPU load
+// Kept from millis() since CYCCNT wraps every ~18s at 240MHz
+uint64_t GetProfileElapsedCycles();
+
+const char * GetProfileSiteName(ProfileSite_t site);
+
+// Copy a site's stats with interrupts off, the 64 bit total and the count are
+// two or more stores in ProfileRecord and an ISR site could be read half updated
+void GetProfileSnapshot(ProfileSite_t site, ProfileStats_t * snapshot);
+
+// Headroom of the worst case of a snapshot against the site's deadline in percent, negative when it was missed
+int8_t GetProfileHeadroomPercent(ProfileSite_t site, const ProfileStats_t * snapshot);
+
+// Share of the CPU a snapshot's site took since the last reset, in 1/1000
+uint16_t GetProfileLoadPermille(const ProfileStats_t * snapshot);
+
+// Ask for a dump on the next loop(), from the command handler or USB Serial
+// With resetAfter set, the stats restart once every site has been queued to the host
+void RequestProfileDump(uint8_t resetAfter);
+uint8_t TakeProfileDumpRequest();
+
+// Queue up to maxRecords EVENT_RECORD_PROFILE records, starting where the last call stopped
+// Returns 1 once every site has been queued
+uint8_t QueueProfileRecords(uint8_t maxRecords);
+
+#else
+
+#define PROFILE_BEGIN(site)
+#define PROFILE_END(site)
+
+#endif //PROFILE_ENABLE
+
+#endif //CARDIOKIT_PROFILE_H
+#ifdef __cplusplus
+}
+#endif
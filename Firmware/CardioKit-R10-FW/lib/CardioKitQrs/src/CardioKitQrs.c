@@ -0,0 +1,88 @@
+/*  *********************************************
+    CardioKitQrs.c
+    Streaming integer Pan-Tompkins QRS detector
+
+    One CardioKitQrsCore detector per ECG lead, fed a frame at a time.
+    Beats are reported from the lead with the best signal to noise.
+    A frame whose DAC value moved starts with an offset step, the lead's
+    detector is told so it doesn't take the step for a beat.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitQrs.h"
+#include <Arduino.h>
+#include "CardioKitProfile.h"
+
+static QrsLead_t Leads[NUM_ECG_CHANNELS];
+static uint32_t QrsScan = 0;
+static uint8_t  ActiveLead = 0;
+static uint16_t LeadDac[NUM_ECG_CHANNELS];
+
+void initializeQrsDetector()
+{
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        QrsResetLead(&Leads[ch]);
+        LeadDac[ch] = 0;
+    }
+    QrsScan = 0;
+    ActiveLead = 0;
+}
+
+uint8_t GetQrsLeadQuality(uint8_t lead)
+{
+    return QrsLeadQuality(&Leads[lead], QrsScan);
+}
+
+uint8_t QrsProcessFrame(const SampleFrame_t * frame, BeatEvent_t * beats)
+{
+    PROFILE_BEGIN(PROFILE_SITE_QRS);
+    uint8_t numBeats = 0;
+    BeatEvent_t beat;
+
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    { // DAC values change on frame starts, the raw ECG steps by about gain * delta there
+        if(QrsScan > 0 && frame->dac[ch][0] != LeadDac[ch]) { QrsOffsetStep(&Leads[ch]); }
+        LeadDac[ch] = frame->dac[ch][0];
+    }
+
+    for(uint16_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+    {
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            if(QrsStepLead(&Leads[ch], ch, frame->ecg[ch][i], QrsScan, &beat) &&
+               ch == ActiveLead && numBeats < QRS_MAX_BEATS_PER_FRAME)
+            {
+                beats[numBeats++] = beat;
+            }
+        }
+        QrsScan++;
+    }
+
+    // Switch leads only when another is clearly better, so the beat train doesn't hop around
+    uint8_t best = ActiveLead;
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        if(GetQrsLeadQuality(ch) > GetQrsLeadQuality(best)) { best = ch; }
+    }
+    if(GetQrsLeadQuality(best) > (GetQrsLeadQuality(ActiveLead) * 5) / 4) { ActiveLead = best; }
+
+    PROFILE_END(PROFILE_SITE_QRS);
+    return numBeats;
+}
+
+uint8_t GetQrsActiveLead()
+{
+    return ActiveLead;
+}
+
+uint16_t GetQrsHeartRateBpm()
+{
+    uint32_t rrAvg = Leads[ActiveLead].rrAvg;
+    if(rrAvg == 0) { return 0; }
+    return (uint16_t) ((60 * CORE_SAMPLE_FREQ + rrAvg / 2) / rrAvg);
+}
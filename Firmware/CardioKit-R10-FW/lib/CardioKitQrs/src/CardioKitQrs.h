@@ -0,0 +1,46 @@
+/*  *********************************************
+    CardioKitQrs.h
+    Streaming integer Pan-Tompkins QRS detector
+
+    Every ECG lead runs through the detector so each keeps its own
+    signal/noise estimate, beats are only reported from the lead
+    with the best one.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_QRS_H
+#define CARDIOKIT_QRS_H
+#include <WProgram.h>
+#include "hwsettings.h"
+#include "CardioKitFrame.h"
+#include "CardioKitQrsCore.h"
+
+#define QRS_MAX_BEATS_PER_FRAME 4 // 42 scans at 400Hz is 105ms, at most one beat gets past the 200ms refractory period
+
+// call this in setup before the first frame
+void initializeQrsDetector();
+
+// Run the raw ECG of a completed frame through the detector (before FilterFrame)
+// Writes up to QRS_MAX_BEATS_PER_FRAME beats, returns how many
+uint8_t QrsProcessFrame(const SampleFrame_t * frame, BeatEvent_t * beats);
+
+// ECG channel beats are currently taken from
+uint8_t GetQrsActiveLead();
+
+// Signal to noise of a lead's QRS peaks in 1/16 steps, 0 until the detector has learned the lead
+uint8_t GetQrsLeadQuality(uint8_t lead);
+
+// Average heart rate on the active lead, 0 until two beats were found
+uint16_t GetQrsHeartRateBpm();
+
+#endif //CARDIOKIT_QRS_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,187 @@
+/*  *********************************************
+    CardioKitQrsCore.c
+    Per lead Pan-Tompkins detector, without Arduino or the frame
+
+    Per lead, per ECG scan:
+        5-11Hz bandpass   recursive integer low-pass and moving
+                          average high-pass from the original paper,
+                          delays doubled for 400Hz
+        derivative        5 point, then squared
+        integration       150ms moving window
+    A peak of the integrated signal is a beat when it is above
+    NPKI + (SPKI - NPKI) / 4, SPKI and NPKI being running averages of
+    signal and noise peaks. Peaks inside 200ms of a beat are ignored.
+    When no beat was found for 166% of the average RR interval, the
+    largest noise peak since the last beat is taken if it is above
+    half the threshold (searchback). The first 2s only learn SPKI/NPKI.
+    An offset step is not a beat: for the QRS_STEP_SCANS it takes to
+    pass through the filters no peak is tracked or learned from.
+    The beat is timed at the largest bandpassed sample under the
+    integrator peak, the integrator itself is too flat to time RR.
+
+    Everything is int32, about 60 cycles per lead per scan.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitQrsCore.h"
+#include <string.h>
+
+void QrsResetLead(QrsLead_t * q)
+{
+    memset(q, 0, sizeof(QrsLead_t));
+}
+
+void QrsOffsetStep(QrsLead_t * q)
+{
+    q->hold = QRS_STEP_SCANS;
+    q->peak = 0; // a peak being tracked would grow into the step
+}
+
+static void UpdateThreshold(QrsLead_t * q)
+{
+    q->threshold = q->npki + ((q->spki - q->npki) >> 2);
+}
+
+// Record a beat at the integrator peak, returns 1 so callers can count it
+static uint8_t TakeBeat(QrsLead_t * q, uint8_t lead, int32_t peak, uint32_t peakScan, uint32_t rScan, uint8_t searchback, BeatEvent_t * beat)
+{
+    uint32_t rr = q->haveBeat ? (rScan - q->lastRScan) : 0;
+    if(rr > 0) { q->rrAvg = (q->rrAvg == 0) ? rr : ((7 * q->rrAvg + rr) >> 3); }
+
+    if(searchback)
+    {
+        int32_t confidence = ((int64_t) 127 * peak) / (q->threshold + 1);
+        beat->confidence = (confidence > 127) ? 127 : (uint8_t) confidence;
+        q->spki += (peak - q->spki) >> 2;
+    }
+    else
+    {
+        q->spki += (peak - q->spki) >> 3;
+        beat->confidence = (uint8_t) (128 + ((int64_t) 127 * (peak - q->threshold)) / peak);
+    }
+    UpdateThreshold(q);
+
+    beat->scan     = rScan - QRS_BANDPASS_DELAY;
+    beat->rrMillis = (uint16_t) ((rr * 1000) / CORE_SAMPLE_FREQ);
+    beat->lead     = lead;
+
+    q->lastBeatScan   = peakScan;
+    q->lastRScan      = rScan;
+    q->haveBeat       = 1;
+    q->searchbackPeak = 0;
+    return 1;
+}
+
+uint8_t QrsStepLead(QrsLead_t * q, uint8_t lead, uint16_t raw, uint32_t n, BeatEvent_t * beat)
+{
+    // Low-pass: y[n] = 2y[n-1] - y[n-2] + x[n] - 2x[n-T] + x[n-2T]
+    int32_t x = (int32_t) raw - 32768;
+    q->x[n % QRS_X_RING] = x;
+    int32_t y = 2 * q->lpY1 - q->lpY2 + x
+              - 2 * q->x[(n - QRS_LP_TAP) % QRS_X_RING]
+              + q->x[(n - 2 * QRS_LP_TAP) % QRS_X_RING];
+    q->lpY2 = q->lpY1;
+    q->lpY1 = y;
+    int32_t lp = y >> QRS_LP_SHIFT;
+
+    // High-pass: the centre sample minus the moving average around it
+    q->hpSum += lp - q->lp[(n - QRS_HP_LEN) % QRS_LP_RING];
+    q->lp[n % QRS_LP_RING] = lp;
+    int32_t hp = q->lp[(n - QRS_HP_LEN / 2) % QRS_LP_RING] - q->hpSum / QRS_HP_LEN;
+
+    // Derivative, squaring and moving window integration
+    q->hp[n % QRS_HP_RING] = hp;
+    int32_t d = (2 * hp + q->hp[(n - QRS_DERIV_STEP) % QRS_HP_RING]
+                 - q->hp[(n - 3 * QRS_DERIV_STEP) % QRS_HP_RING]
+                 - 2 * q->hp[(n - 4 * QRS_DERIV_STEP) % QRS_HP_RING]) >> QRS_DERIV_SHIFT;
+    if(d > 32767)  { d = 32767; }
+    if(d < -32767) { d = -32767; }
+    int32_t sq = (d * d) >> QRS_SQUARE_SHIFT;
+    q->mwi += sq - q->sq[(n - QRS_MWI_LEN) % QRS_SQ_RING];
+    q->sq[n % QRS_SQ_RING] = sq;
+
+    int32_t mwi = q->mwi;
+    int32_t prev = q->prevMwi;
+    q->prevMwi = mwi;
+    uint8_t held = (q->hold > 0);
+    if(held) { q->hold--; }
+
+    if(n < QRS_LEARN_SCANS)
+    {
+        if(n >= QRS_HP_LEN && !held) // let the filters settle first
+        {
+            if(mwi > q->learnMax) { q->learnMax = mwi; }
+            q->learnSum += mwi;
+        }
+        if(n == QRS_LEARN_SCANS - 1)
+        {
+            q->spki = q->learnMax / 3;
+            q->npki = (int32_t) (q->learnSum / (QRS_LEARN_SCANS - QRS_HP_LEN)) / 2;
+            UpdateThreshold(q);
+        }
+        return 0;
+    }
+
+    // Track a rising integrator to its maximum, it is complete once it falls to half of it
+    if(!held && mwi > q->peak && (q->peak > 0 || mwi > prev))
+    {
+        if(q->peak == 0) { q->rPeak = 0; }
+        q->peak = mwi;
+        q->peakScan = n;
+    }
+    if(q->peak > 0)
+    {
+        int32_t r = (hp < 0) ? -hp : hp;
+        if(r > q->rPeak)
+        {
+            q->rPeak = r;
+            q->rScan = n;
+        }
+    }
+    if(q->peak > 0 && mwi < (q->peak >> 1))
+    {
+        int32_t peak = q->peak;
+        q->peak = 0;
+        if(!q->haveBeat || (q->peakScan - q->lastBeatScan) >= QRS_REFRACTORY)
+        {
+            if(peak > q->threshold)
+            {
+                return TakeBeat(q, lead, peak, q->peakScan, q->rScan, 0, beat);
+            }
+            q->npki += (peak - q->npki) >> 3;
+            UpdateThreshold(q);
+            if(peak > q->searchbackPeak)
+            {
+                q->searchbackPeak = peak;
+                q->searchbackScan = q->peakScan;
+                q->searchbackRScan = q->rScan;
+            }
+        }
+    }
+
+    if(q->haveBeat)
+    {
+        uint32_t since = n - q->lastBeatScan;
+        if(q->rrAvg > 0 && since > (q->rrAvg * 166) / 100 && q->searchbackPeak > (q->threshold >> 1))
+        {
+            return TakeBeat(q, lead, q->searchbackPeak, q->searchbackScan, q->searchbackRScan, 1, beat);
+        }
+        if(since % QRS_LOST_SCANS == 0)
+        {   // lost the rhythm, lower the bar until it is found again
+            q->spki >>= 1;
+            UpdateThreshold(q);
+        }
+    }
+    return 0;
+}
+
+uint8_t QrsLeadQuality(const QrsLead_t * q, uint32_t n)
+{
+    if(n < QRS_LEARN_SCANS || q->spki <= 0) { return 0; }
+    int32_t quality = (16 * (int64_t) q->spki) / (q->npki + 1);
+    return (quality > 255) ? 255 : (uint8_t) quality;
+}
@@ -0,0 +1,107 @@
+/*  *********************************************
+    CardioKitQrsCore.h
+    Per lead Pan-Tompkins detector, without Arduino or the frame
+
+    The filters, thresholds and searchback of one lead, stepped one
+    scan at a time. CardioKitQrs runs one per ECG channel over every
+    frame, the native test (test/test_native_qrs) runs it over
+    recordings on the build host. Only hwsettings.h is needed, for
+    CORE_SAMPLE_FREQ.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_QRS_CORE_H
+#define CARDIOKIT_QRS_CORE_H
+#include <stdint.h>
+#include "hwsettings.h"
+
+#define QRS_SCANS(ms) (((ms) * (CORE_SAMPLE_FREQ)) / 1000)
+
+#define QRS_LP_TAP       QRS_SCANS(30)   // low-pass zeros, 12 at 400Hz
+#define QRS_HP_LEN       QRS_SCANS(160)  // high-pass moving average
+#define QRS_DERIV_STEP   QRS_SCANS(5)
+#define QRS_MWI_LEN      QRS_SCANS(150)
+#define QRS_REFRACTORY   QRS_SCANS(200)
+#define QRS_LEARN_SCANS  QRS_SCANS(2000)
+#define QRS_LOST_SCANS   QRS_SCANS(3000) // halve SPKI when nothing was found for this long
+#define QRS_BANDPASS_DELAY ((QRS_LP_TAP) - 1 + (QRS_HP_LEN) / 2)
+#define QRS_STEP_SCANS   (2 * (QRS_LP_TAP) + (QRS_HP_LEN) + 4 * (QRS_DERIV_STEP) + (QRS_MWI_LEN)) // an input step is out of the integrator after this
+
+#define QRS_LP_SHIFT     5 // low-pass DC gain is QRS_LP_TAP^2
+#define QRS_DERIV_SHIFT  7 // derivative /8 and headroom so the square fits
+#define QRS_SQUARE_SHIFT 6 // QRS_MWI_LEN squares must sum below 2^31
+
+// Delay line lengths are powers of two so indexing with a wrapping uint32 scan count stays continuous
+#define QRS_X_RING  32  // > 2 * QRS_LP_TAP
+#define QRS_LP_RING 128 // > QRS_HP_LEN
+#define QRS_HP_RING 16  // > 4 * QRS_DERIV_STEP
+#define QRS_SQ_RING 64  // > QRS_MWI_LEN
+
+#if (2 * QRS_LP_TAP >= QRS_X_RING) || (QRS_HP_LEN >= QRS_LP_RING) || (4 * QRS_DERIV_STEP >= QRS_HP_RING) || (QRS_MWI_LEN >= QRS_SQ_RING)
+#error "CORE_SAMPLE_FREQ too high for the QRS detector delay lines"
+#endif
+#if QRS_DERIV_STEP < 1
+#error "CORE_SAMPLE_FREQ too low for the QRS detector"
+#endif
+
+typedef struct
+{
+    int16_t  x[QRS_X_RING];
+    int32_t  lp[QRS_LP_RING];
+    int32_t  hp[QRS_HP_RING];
+    int32_t  sq[QRS_SQ_RING];
+    int32_t  lpY1, lpY2;   // low-pass recursion, unscaled
+    int32_t  hpSum;
+    int32_t  mwi, prevMwi;
+
+    int32_t  peak;         // integrator maximum being tracked, 0 while falling
+    uint32_t peakScan;
+    int32_t  rPeak;        // largest bandpassed sample under the integrator peak
+    uint32_t rScan;
+    int32_t  spki, npki, threshold;
+    int32_t  searchbackPeak;
+    uint32_t searchbackScan;
+    uint32_t searchbackRScan;
+    uint32_t lastBeatScan;
+    uint32_t lastRScan;
+    uint32_t rrAvg;        // scans, 0 until two beats
+    uint8_t  haveBeat;
+    int32_t  learnMax;
+    uint64_t learnSum;
+    uint16_t hold;         // scans the integrator is still ignored for after an offset step
+} QrsLead_t;
+
+// Sent as an EVENT_RECORD_BEAT record, little-endian
+typedef struct
+{
+    uint32_t scan;       // ECG scan (CORE_SAMPLE_FREQ tick) of the R peak since boot
+    uint16_t rrMillis;   // time since the previous beat, 0 for the first beat
+    uint8_t  confidence; // 128-255 above the detection threshold, 0-127 found by searchback
+    uint8_t  lead;       // ECG channel the beat was detected on
+} BeatEvent_t;
+
+// Clear a lead's filters and thresholds, it learns again over the first QRS_LEARN_SCANS
+void QrsResetLead(QrsLead_t * q);
+
+// Push one raw sample (offset binary, 32768 is 0V) through a lead at scan n, counted from 0 after the reset
+// Returns 1 if it completed a beat, written to *beat. beat->scan is on the input's timeline
+uint8_t QrsStepLead(QrsLead_t * q, uint8_t lead, uint16_t raw, uint32_t n, BeatEvent_t * beat);
+
+// The lead's input offset steps (a DAC step) from the next sample on. The step would ring
+// through the bandpass like a QRS, the integrator is ignored for QRS_STEP_SCANS until it has passed
+void QrsOffsetStep(QrsLead_t * q);
+
+// Signal to noise of the lead's QRS peaks in 1/16 steps after n scans, 0 while it is still learning
+uint8_t QrsLeadQuality(const QrsLead_t * q, uint32_t n);
+
+#endif //CARDIOKIT_QRS_CORE_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,228 @@
+/*  *********************************************
+    CardioKitScan.c
+    Adaptive mapping of the ECG scan slots to leads
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitScan.h"
+#include <Arduino.h>
+#include <string.h>
+#include "CardioKitDac.h"
+#include "CardioKitQrs.h"
+
+#define SCAN_STATE_FULL    0 // every lead once, the layout leads are ranked in
+#define SCAN_STATE_FOCUSED 1
+#define SCAN_RECORD_BYTES  (3 + (NUM_ECG_CHANNELS))
+
+static volatile uint8_t SlotLeads[NUM_ECG_CHANNELS]; // live layout, read by the ECG ISR
+static uint8_t  PendingSlotLeads[NUM_ECG_CHANNELS];  // last layout chosen, latched at the next frame start
+static volatile uint8_t LayoutPending = 0;
+static uint8_t  DeadFrames[NUM_ECG_CHANNELS];        // per lead, frames in a row every slot on it was mostly saturated
+static uint32_t LastSaturated[NUM_ECG_CHANNELS];     // per slot, getDacSaturatedSamples at the last frame
+static uint8_t  Focus = SCAN_FOCUS_LEADS;
+static uint8_t  State = SCAN_STATE_FULL;
+static uint32_t StateSinceMillis = 0;
+static uint8_t  Rebuild = 0;
+
+void initializeScan()
+{
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        SlotLeads[slot] = slot;
+        PendingSlotLeads[slot] = slot;
+        DeadFrames[slot] = 0;
+        LastSaturated[slot] = getDacSaturatedSamples(slot);
+    }
+    LayoutPending = 0;
+    Focus = SCAN_FOCUS_LEADS;
+    State = SCAN_STATE_FULL;
+    StateSinceMillis = millis();
+    Rebuild = 0;
+}
+
+void scanApplyPendingLayout(SampleFrame_t * frame)
+{
+    if(LayoutPending)
+    {
+        for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+        {
+            SlotLeads[slot] = PendingSlotLeads[slot];
+        }
+        LayoutPending = 0;
+    }
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        frame->scan[slot][0] = SlotLeads[slot];
+    }
+}
+
+uint8_t GetScanSlotLead(uint8_t slot)
+{
+    return SlotLeads[slot];
+}
+
+void SetScanFocus(uint8_t leads)
+{
+    Focus = (leads > NUM_ECG_CHANNELS) ? NUM_ECG_CHANNELS : leads;
+    Rebuild = 1;
+}
+
+#if SCAN_ADAPTIVE_ENABLE
+// Best QRS signal to noise of the slots currently on the lead
+static uint8_t GetLeadQuality(uint8_t lead)
+{
+    uint8_t quality = 1; // unranked leads keep their order
+#if QRS_DETECT_ENABLE
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        if(PendingSlotLeads[slot] == lead && GetQrsLeadQuality(slot) > quality) { quality = GetQrsLeadQuality(slot); }
+    }
+#endif
+    return quality;
+}
+
+// Kept leads stay on their own slot, the slots of the others go round robin to the kept ones, best first
+// Returns 1 if that is just the full scan
+static uint8_t BuildLayout(uint8_t deadMask, uint8_t * layout)
+{
+    uint8_t ranked[NUM_ECG_CHANNELS];
+    uint8_t quality[NUM_ECG_CHANNELS];
+    uint8_t n = 0;
+    for(uint8_t lead = 0; lead < NUM_ECG_CHANNELS; lead++)
+    {
+        if(deadMask & (1 << lead)) { continue; }
+        uint8_t q = GetLeadQuality(lead);
+        uint8_t i = n++;
+        for(; i > 0 && quality[i - 1] < q; i--)
+        {
+            ranked[i] = ranked[i - 1];
+            quality[i] = quality[i - 1];
+        }
+        ranked[i] = lead;
+        quality[i] = q;
+    }
+    if(Focus > 0 && n > Focus) { n = Focus; }
+
+    uint8_t kept = 0;
+    for(uint8_t i = 0; i < n; i++) { kept |= (1 << ranked[i]); }
+    uint8_t next = 0;
+    uint8_t full = 1;
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        if(n == 0 || (kept & (1 << slot)))
+        { // nothing alive at all is scanned like the full scan so the leads can come back
+            layout[slot] = slot;
+            continue;
+        }
+        layout[slot] = ranked[next];
+        next = (next + 1) % n;
+        full = 0;
+    }
+    return full;
+}
+
+static void QueueScanRecord(uint8_t deadMask)
+{
+    uint8_t rec[SCAN_RECORD_BYTES];
+    rec[0] = Focus;
+    rec[1] = NUM_ECG_CHANNELS;
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        rec[2 + slot] = PendingSlotLeads[slot];
+    }
+    rec[2 + NUM_ECG_CHANNELS] = deadMask;
+    QueueEventRecord(EVENT_RECORD_SCAN, rec, SCAN_RECORD_BYTES);
+}
+
+// Hand the DAC state to every slot that changes lead and queue the layout for the next frame start
+static uint8_t SetLayout(const uint8_t * layout, uint8_t deadMask)
+{
+    if(memcmp(layout, PendingSlotLeads, NUM_ECG_CHANNELS) == 0) { return 0; }
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        if(layout[slot] == PendingSlotLeads[slot]) { continue; }
+        uint8_t from = NUM_ECG_CHANNELS;
+        for(uint8_t s = 0; s < NUM_ECG_CHANNELS; s++)
+        {
+            if(PendingSlotLeads[s] == layout[slot] && layout[s] == layout[slot]) { from = s; break; } // a slot that stays on the lead
+        }
+        if(from < NUM_ECG_CHANNELS)
+        {
+            dacCopyChannel(slot, from);
+        } else {
+            dacRestartChannel(slot);
+        }
+    }
+    __disable_irq(); // the ECG ISR latches the whole layout at once
+    memcpy(PendingSlotLeads, layout, NUM_ECG_CHANNELS);
+    LayoutPending = 1;
+    __enable_irq();
+    QueueScanRecord(deadMask);
+    return 1;
+}
+#endif //SCAN_ADAPTIVE_ENABLE
+
+uint8_t ScanProcessFrame(const SampleFrame_t * frame)
+{
+#if SCAN_ADAPTIVE_ENABLE
+    // a lead is bad in this frame if every slot that scanned it was more than half saturated
+    uint8_t scanned = 0;
+    uint8_t good = 0;
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        uint32_t saturated = getDacSaturatedSamples(slot);
+        uint8_t lead = frame->scan[slot][0];
+        scanned |= (1 << lead);
+        if((saturated - LastSaturated[slot]) <= FRAME_SAMPLES_PER_CHANNEL / 2) { good |= (1 << lead); }
+        LastSaturated[slot] = saturated;
+    }
+    uint8_t deadMask = 0;
+    for(uint8_t lead = 0; lead < NUM_ECG_CHANNELS; lead++)
+    {
+        if(scanned & (1 << lead))
+        {
+            if(good & (1 << lead)) { DeadFrames[lead] = 0; }
+            else if(DeadFrames[lead] < 255) { DeadFrames[lead]++; }
+        }
+        if(DeadFrames[lead] >= SCAN_DEAD_FRAMES) { deadMask |= (1 << lead); }
+    }
+
+    uint32_t now = millis();
+    uint8_t layout[NUM_ECG_CHANNELS];
+    if(State == SCAN_STATE_FULL)
+    {
+        if((now - StateSinceMillis) < SCAN_SETTLE_MS) { return 0; } // slews and QRS learning after a probe look like dead leads
+        Rebuild = 0;
+        if(BuildLayout(deadMask, layout)) { return 0; }
+        State = SCAN_STATE_FOCUSED;
+        StateSinceMillis = now;
+        return SetLayout(layout, deadMask);
+    }
+
+    if((now - StateSinceMillis) >= SCAN_PROBE_MS)
+    { // recheck the dropped leads, they may have been reattached
+        State = SCAN_STATE_FULL;
+        StateSinceMillis = now;
+        memset(DeadFrames, 0, sizeof(DeadFrames));
+        for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++) { layout[slot] = slot; }
+        return SetLayout(layout, 0);
+    }
+    uint8_t kept = 0;
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++) { kept |= (1 << PendingSlotLeads[slot]); }
+    if(!Rebuild && !(deadMask & kept)) { return 0; }
+    Rebuild = 0;
+    if(BuildLayout(deadMask, layout))
+    {
+        State = SCAN_STATE_FULL;
+        StateSinceMillis = now;
+    }
+    return SetLayout(layout, deadMask);
+#else
+    (void) frame;
+    return 0;
+#endif
+}
@@ -0,0 +1,62 @@
+/*  *********************************************
+    CardioKitScan.h
+    Adaptive mapping of the ECG scan slots to leads
+
+    A scan is NUM_ECG_CHANNELS mux slots and every per-channel array
+    (frame->ecg, the DAC loop, QRS, filters) is indexed by slot. By
+    default slot s scans lead s (mux table entry s). A lead whose frames
+    stay more than half saturated for SCAN_DEAD_FRAMES is dropped and
+    its slot is handed to the live leads, best QRS quality first. With a
+    focus of N only the best N live leads are kept, N = 1 puts the whole
+    scan on one lead at NUM_ECG_CHANNELS * CORE_SAMPLE_FREQ.
+
+    A lead keeps its own slot while it is scanned, extra slots take over
+    the DAC offset of a slot already on the lead (dacCopyChannel). Every
+    SCAN_PROBE_MS a focused layout goes back to the full scan for
+    SCAN_SETTLE_MS to recheck the dropped leads.
+
+    The layout changes on a frame boundary. Each sample frame carries
+    the layout it was taken with as STREAM_ID_SCAN, one word per slot.
+    EVENT_RECORD_SCAN, when a new layout is chosen (also while sample
+    frames are dropped in monitoring mode):
+        uint8  focus         leads kept, 0 every live lead
+        uint8  numSlots
+        uint8  lead[numSlots]
+        uint8  deadMask      leads dropped for saturating, bit per lead
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_SCAN_H
+#define CARDIOKIT_SCAN_H
+#include <WProgram.h>
+#include "hwsettings.h"
+#include "CardioKitFrame.h"
+
+// call this in setup after initializeDac, every slot scans its own lead
+void initializeScan();
+
+// Call once per completed frame after the DAC loop and the QRS detector ran on it
+// Returns 1 if a new layout was chosen, it goes live at the next frame start
+uint8_t ScanProcessFrame(const SampleFrame_t * frame);
+
+// Call from the ECG ISR when a new frame starts, latches the layout chosen since the last frame
+// and stamps it into the frame
+void scanApplyPendingLayout(SampleFrame_t * frame);
+
+// Lead (mux table entry) the slot scans in the live layout, called from the ECG ISR
+uint8_t GetScanSlotLead(uint8_t slot);
+
+// Leads to keep when focusing, 0 keeps every live lead
+void SetScanFocus(uint8_t leads);
+
+#endif //CARDIOKIT_SCAN_H
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,256 @@
+/*  *********************************************
+    CardioKitWarmStart.c
+    Cached calibration for a fast start after power-on or reset
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#include "CardioKitWarmStart.h"
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include "CardioKitFrame.h"
+#include "CardioKitDac.h"
+#include "CardioKitScan.h"
+#include "CardioKitAccel.h"
+
+#define WARMSTART_MAGIC        0x434B5753 // "CKWS"
+#define WARMSTART_VERSION      1
+#define WARMSTART_ADC_CAL_REGS 16
+#define WARMSTART_RECORD_BYTES 12
+#define ALL_SLOTS              ((1 << (NUM_ECG_CHANNELS)) - 1)
+#define ADC_CHANNEL_VREFH      29
+#define ADC_CHANNEL_VREFL      30
+#define ADC_CONVERT_TIMEOUT_US 1000
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;    // WARMSTART_VERSION in the top 4 bits, the struct size below, a changed layout is a cold start
+    uint16_t saves;
+    uint16_t dac[NUM_ECG_CHANNELS];
+    uint16_t dacGain[NUM_ECG_CHANNELS];
+    uint16_t adcCal[2][WARMSTART_ADC_CAL_REGS];
+    int32_t  accelPeriodQ8;
+    uint8_t  parts;      // WARMSTART_USED_* bits of what was captured
+    uint8_t  reserved[3];
+    uint32_t checksum;   // FNV-1a of everything before it, written last
+} WarmStartCache_t;
+
+#define CACHE_VERSION ((WARMSTART_VERSION << 12) | (sizeof(WarmStartCache_t) & 0x0FFF))
+
+#define ADC_CAL_REGS(n) { &ADC##n##_CLPD, &ADC##n##_CLPS, &ADC##n##_CLP4, &ADC##n##_CLP3, &ADC##n##_CLP2, &ADC##n##_CLP1, &ADC##n##_CLP0, \
+                          &ADC##n##_CLMD, &ADC##n##_CLMS, &ADC##n##_CLM4, &ADC##n##_CLM3, &ADC##n##_CLM2, &ADC##n##_CLM1, &ADC##n##_CLM0, \
+                          &ADC##n##_PG, &ADC##n##_MG }
+static volatile uint32_t * const AdcCalRegs[2][WARMSTART_ADC_CAL_REGS] = { ADC_CAL_REGS(0), ADC_CAL_REGS(1) };
+static volatile uint32_t * const AdcSc1a[2] = { &ADC0_SC1A, &ADC1_SC1A };
+static volatile uint32_t * const AdcSc3[2]  = { &ADC0_SC3,  &ADC1_SC3 };
+static volatile uint32_t * const AdcCfg1[2] = { &ADC0_CFG1, &ADC1_CFG1 };
+static volatile uint32_t * const AdcRa[2]   = { &ADC0_RA,   &ADC1_RA };
+
+static WarmStartCache_t Cache;          // what was loaded, then what is saved next
+static uint8_t  CacheParts = 0;         // parts of the loaded cache that passed the checksum
+static uint8_t  Used = 0;               // WARMSTART_USED_* and _REJECT_* of this start
+static uint8_t  PowerOn = 0;
+static uint32_t AcqMillis = 0;
+static uint32_t EcgValidMillis = 0;
+static uint8_t  Reported = 0;
+static uint8_t  SettledRun = 0;         // every slot settled on the default layout since SettledMillis
+static uint32_t SettledMillis = 0;
+static uint8_t  Saved = 0;
+static uint32_t SavedMillis = 0;
+static uint16_t WriteOffset = sizeof(WarmStartCache_t); // next EEPROM byte to write, the size when idle
+
+static uint32_t Checksum(const WarmStartCache_t * cache)
+{
+    const uint8_t * bytes = (const uint8_t *) cache;
+    uint32_t hash = 2166136261u;
+    for(uint16_t i = 0; i < offsetof(WarmStartCache_t, checksum); i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void initializeWarmStart()
+{
+    PowerOn = (RCM_SRS0 & RCM_SRS0_POR) ? 1 : 0;
+    Used = 0;
+    CacheParts = 0;
+#if WARMSTART_ENABLE
+    eeprom_read_block(&Cache, (const void *) WARMSTART_EEPROM_ADDR, sizeof(WarmStartCache_t));
+    if(Cache.magic == WARMSTART_MAGIC && Cache.version == CACHE_VERSION && Cache.checksum == Checksum(&Cache))
+    {
+        CacheParts = Cache.parts;
+        return;
+    }
+#endif
+    memset(&Cache, 0, sizeof(WarmStartCache_t)); // blank EEPROM, another layout or a cut short write
+}
+
+void WarmStartSeedAccel()
+{
+    if(!(CacheParts & WARMSTART_USED_ACCEL)) { return; }
+    AccelSeedPeriodQ8(Cache.accelPeriodQ8);
+    Used |= WARMSTART_USED_ACCEL;
+}
+
+void WarmStartSeedDac()
+{
+    if(!(CacheParts & WARMSTART_USED_DAC)) { return; }
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        dacWarmStart(ch, Cache.dac[ch], Cache.dacGain[ch]);
+    }
+    Used |= WARMSTART_USED_DAC;
+}
+
+uint8_t WarmStartAbortAdcCal(uint8_t adc)
+{
+    if(!(CacheParts & (WARMSTART_USED_ADC0 << adc))) { return 0; }
+    *AdcSc3[adc] &= ~ADC_SC3_CAL; // any write to SC3 aborts a running calibration, CALF is set
+    return 1;
+}
+
+// One software triggered conversion, the PDB isn't running yet
+static uint16_t AdcConvert(uint8_t adc, uint8_t channel)
+{
+    uint32_t start = micros();
+    *AdcSc1a[adc] = channel;
+    while(!(*AdcSc1a[adc] & ADC_SC1_COCO))
+    {
+        if((micros() - start) > ADC_CONVERT_TIMEOUT_US) { return 0xFFFF; } // fails the VREFL check
+    }
+    return *AdcRa[adc];
+}
+
+uint8_t WarmStartRestoreAdcCal(uint8_t adc)
+{
+    static const uint16_t FullScale[4] = { 0xFF, 0xFFF, 0x3FF, 0xFFFF }; // by CFG1 MODE
+    for(uint8_t r = 0; r < WARMSTART_ADC_CAL_REGS; r++)
+    {
+        *AdcCalRegs[adc][r] = Cache.adcCal[adc][r];
+    }
+    uint16_t full = FullScale[(*AdcCfg1[adc] >> 2) & 0x3];
+    uint16_t low  = AdcConvert(adc, ADC_CHANNEL_VREFL);
+    uint16_t high = AdcConvert(adc, ADC_CHANNEL_VREFH);
+    if(low > full / 64 || high < full - full / 64)
+    {
+        Used |= WARMSTART_REJECT_ADC0 << adc;
+        CacheParts &= ~(WARMSTART_USED_ADC0 << adc); // the capture after the real calibration replaces it
+        return 0;
+    }
+    Used |= WARMSTART_USED_ADC0 << adc;
+    return 1;
+}
+
+void WarmStartCaptureAdcCal(uint8_t adc)
+{
+    if(*AdcSc3[adc] & ADC_SC3_CALF) { return; } // a failed calibration is not worth keeping
+    for(uint8_t r = 0; r < WARMSTART_ADC_CAL_REGS; r++)
+    {
+        Cache.adcCal[adc][r] = *AdcCalRegs[adc][r];
+    }
+    CacheParts |= WARMSTART_USED_ADC0 << adc;
+}
+
+void WarmStartAcquisitionStarted()
+{
+    AcqMillis = millis();
+    EcgValidMillis = 0;
+    Reported = 0;
+}
+
+uint32_t GetEcgValidMillis()
+{
+    return EcgValidMillis;
+}
+
+static void QueueReport(uint16_t settled)
+{
+    uint8_t rec[WARMSTART_RECORD_BYTES];
+    memcpy(&rec[0], &EcgValidMillis, 4); // little-endian
+    memcpy(&rec[4], &AcqMillis, 4);
+    rec[8]  = PowerOn;
+    rec[9]  = Used;
+    rec[10] = settled;
+    rec[11] = getDacWarmStartMisses();
+    Reported = QueueEventRecord(EVENT_RECORD_WARMSTART, rec, WARMSTART_RECORD_BYTES); // tried again next frame if it didn't fit
+}
+
+// The cache is by slot, it is only meaningful while slot s scans lead s as it does after a start
+static uint8_t DefaultLayout()
+{
+    for(uint8_t slot = 0; slot < NUM_ECG_CHANNELS; slot++)
+    {
+        if(GetScanSlotLead(slot) != slot) { return 0; }
+    }
+    return 1;
+}
+
+static uint8_t DacMovedSinceSave()
+{
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        int32_t moved = (int32_t) getDacValue(ch) - (int32_t) Cache.dac[ch];
+        if(moved > WARMSTART_RESAVE_DAC || moved < -WARMSTART_RESAVE_DAC) { return 1; }
+    }
+    return 0;
+}
+
+static void StartSave(uint32_t now)
+{
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    {
+        Cache.dac[ch]     = getDacValue(ch);
+        Cache.dacGain[ch] = getDacGain(ch);
+    }
+    Cache.accelPeriodQ8 = AccelGetPeriodQ8();
+    Cache.parts    = (CacheParts & (WARMSTART_USED_ADC0 | WARMSTART_USED_ADC1)) | WARMSTART_USED_DAC | (ACCEL_PRESENT ? WARMSTART_USED_ACCEL : 0);
+    Cache.magic    = WARMSTART_MAGIC;
+    Cache.version  = CACHE_VERSION;
+    Cache.saves++;
+    Cache.checksum = Checksum(&Cache);
+    WriteOffset = 0;
+    Saved = 1;
+    SavedMillis = now;
+}
+
+void WarmStartProcessFrame()
+{
+    uint16_t settled = getDacSettledChannels();
+    uint32_t now = millis();
+    if(EcgValidMillis == 0 && settled == ALL_SLOTS) { EcgValidMillis = now; }
+    if(!Reported && (EcgValidMillis != 0 || (now - AcqMillis) >= WARMSTART_REPORT_MS)) { QueueReport(settled); }
+
+#if WARMSTART_ENABLE
+    if(WriteOffset < sizeof(WarmStartCache_t))
+    { // a few bytes per frame, each changed byte holds the loop while the EEPROM is written
+        const uint8_t * bytes = (const uint8_t *) &Cache;
+        uint16_t end = WriteOffset + WARMSTART_WRITE_BYTES;
+        if(end > sizeof(WarmStartCache_t)) { end = sizeof(WarmStartCache_t); }
+        for(; WriteOffset < end; WriteOffset++)
+        {
+            eeprom_write_byte((uint8_t *) (uintptr_t) (WARMSTART_EEPROM_ADDR + WriteOffset), bytes[WriteOffset]); // skips a byte that is already equal
+        }
+        return;
+    }
+    if(settled != ALL_SLOTS || !DefaultLayout())
+    {
+        SettledRun = 0;
+        return;
+    }
+    if(!SettledRun)
+    {
+        SettledRun = 1;
+        SettledMillis = now;
+    }
+    if((now - SettledMillis) < WARMSTART_SAVE_MS) { return; }
+    if(Saved && ((now - SavedMillis) < WARMSTART_RESAVE_MS || !DacMovedSinceSave())) { return; }
+    StartSave(now);
+#endif
+}
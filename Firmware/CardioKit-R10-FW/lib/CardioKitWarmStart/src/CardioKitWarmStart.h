@@ -0,0 +1,88 @@
+/*  *********************************************
+    CardioKitWarmStart.h
+    Cached calibration for a fast start after power-on or reset
+
+    A cold start has every ECG slot slew its DAC offset from midrange,
+    both ADCs run their self calibration and the ADXL clock period is
+    tracked from nominal. The cache keeps what they settled on in
+    EEPROM so the next start, a host reset through CPU_RESTART
+    included, begins from there:
+        DAC         value and learned gain of each slot, saved once every
+                    slot tracked for WARMSTART_SAVE_MS on the default
+                    layout (slot s on lead s, which is how a start scans)
+        ADC0/1      the 16 calibration registers after a real calibration
+        ADXL        the sample period in PDB ticks
+    A checksum over the whole cache is written last, a write cut short
+    by a reset leaves a cache that fails it and the start is cold.
+
+    Each part is checked before it is trusted. A cached DAC value is
+    kept only if the first block on it is not saturated, otherwise that
+    slot falls back to the full slew (dacWarmStart). A restored ADC
+    calibration has to read VREFL and VREFH within 1/64 of full scale
+    of the rails, otherwise the ADC is calibrated as usual. This catches
+    corrupt registers, not drift. The period is range checked.
+
+    EVENT_RECORD_WARMSTART, once every slot settled or WARMSTART_REPORT_MS
+    after acquisition started:
+        uint32 validMillis   millis() since reset when the last slot settled, 0 if one had not
+        uint32 acqMillis     millis() since reset when acquisition started
+        uint8  powerOn       1 after power-on, 0 after any other reset
+        uint8  used          WARMSTART_USED_* parts taken from the cache
+        uint8  settled       slots settled when the record was queued, bit per slot
+        uint8  misses        slots whose cached DAC value fell back to the full slew
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+
+    Hardware Specifications:
+    See schematics for CardioKit R01
+ *  *********************************************/
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifndef CARDIOKIT_WARMSTART_H
+#define CARDIOKIT_WARMSTART_H
+#include <WProgram.h>
+#include "hwsettings.h"
+
+#define WARMSTART_USED_DAC    0x01
+#define WARMSTART_USED_ADC0   0x02
+#define WARMSTART_USED_ADC1   0x04
+#define WARMSTART_USED_ACCEL  0x08
+#define WARMSTART_REJECT_ADC0 0x10 // cached, failed the VREF check
+#define WARMSTART_REJECT_ADC1 0x20
+
+// call this first thing in setup, reads and checks the cache
+void initializeWarmStart();
+
+// Seed the ADXL period, after initializeAccel
+void WarmStartSeedAccel();
+
+// Seed every slot's DAC value and gain, after initializeDac and before acquisition starts
+void WarmStartSeedDac();
+
+// The ADC library starts calibrating when it is constructed. With a cached calibration this aborts it
+// and returns 1, the library must then finish its wait (wait_for_cal) before WarmStartRestoreAdcCal
+uint8_t WarmStartAbortAdcCal(uint8_t adc);
+
+// Write the cached calibration registers and check them against VREFL/VREFH, returns 1 if they passed
+// Call before the PDB starts, it converts by software trigger
+uint8_t WarmStartRestoreAdcCal(uint8_t adc);
+
+// Keep the registers of a calibration that just completed for the next start
+void WarmStartCaptureAdcCal(uint8_t adc);
+
+// Call right after the PDB started, the time to valid ECG is counted from reset and from here
+void WarmStartAcquisitionStarted();
+
+// Call once per completed frame after the DAC loop and ScanProcessFrame
+// Queues the report when it is due and saves the cache, a few EEPROM bytes per frame
+void WarmStartProcessFrame();
+
+// millis() since reset when every slot had settled, 0 until then
+uint32_t GetEcgValidMillis();
+
+#endif //CARDIOKIT_WARMSTART_H
+#ifdef __cplusplus
+}
+#endif
@@ -4,6 +4,7 @@
     Created by Nathan Volman, January 25, 2019
 */
 #include "SimpleTCP.h"
+#include "CardioKitLog.h"
 #include <stdio.h>
 #include <cstdlib>
 
@@ -22,7 +23,7 @@ const uint32_t packetBufferSize = 730;
 uint16_t packetBufferLen;
 uint8_t packetBuffer[packetBufferSize];
 
-const uint32_t ackCircBufferSize = 100;
+const uint32_t ackCircBufferSize = 256; // room for a burst of command frames between two loop() passes
 uint8_t ackCircBuffer[ackCircBufferSize] = {0};
 uint32_t acbHead           = 0;
 uint32_t acbTail           = 0;
@@ -36,6 +37,38 @@ uint32_t outputPtrSequenceBuffer[outputPtrBufferSize]; // for index i, holds seq
 uint32_t outputPtrBufferHead = 0;
 uint32_t outputPtrBufferTail = 0;
 
+const uint8_t commandQueueSize = SIMPLE_TCP_COMMAND_QUEUE;
+const uint8_t COMMAND_BATCH_MORE = 0x80;
+
+// Every queued packet lives in one of these slots until it goes stale, a slot is the 12-byte
+// header followed by up to txBufferLen payload bytes. Sized for microsToKeepPackets of sample
+// frames plus event packets (~11 packets/s * 4s) with room for the ones being filled
+const uint32_t packetSlotCount = 64;
+const uint32_t packetSlotSize  = 732; // 12 + 718 rounded up so every payload stays 4-byte aligned
+uint8_t __attribute__((aligned(4))) packetSlots[packetSlotCount][packetSlotSize];
+bool packetSlotInUse[packetSlotCount] = {false};
+
+// index of the slot a payload (or packet) pointer falls in, packetSlotCount if it isn't one
+uint32_t PacketSlotIndex(uint8_t * ptr)
+{
+    if((ptr < &packetSlots[0][0]) || (ptr >= &packetSlots[packetSlotCount][0])) { return packetSlotCount; }
+    return (uint32_t) (ptr - &packetSlots[0][0]) / packetSlotSize;
+}
+
+// XOR of len bytes, a word at a time over the aligned middle
+uint8_t XorChecksum(const uint8_t * data, uint16_t len)
+{
+    uint8_t  checksum = 0;
+    uint32_t words    = 0;
+    uint16_t i        = 0;
+    for(; (i < len) && (((uintptr_t) &data[i]) & 3); i++) { checksum ^= data[i]; }
+    for(; (i + 4) <= len; i += 4) { words ^= *(const uint32_t*) &data[i]; }
+    for(; i < len; i++) { checksum ^= data[i]; }
+    words ^= words >> 16;
+    words ^= words >> 8;
+    return checksum ^ (uint8_t) words;
+}
+
 void PrintBufferState()
 {
     Serial.println("Buffer State");
@@ -52,13 +85,20 @@ void PrintBufferState()
 }
 
 // add an element to the output buffer at the back to be sent out last
-void AddToOutputPtrBuffer(uint8_t * BufPtr, uint16_t len, uint32_t seqNum)
+// returns false if the buffer was full and the element was not added
+bool AddToOutputPtrBuffer(uint8_t * BufPtr, uint16_t len, uint32_t seqNum)
 {
     if(((outputPtrBufferTail + 1) % outputPtrBufferSize) == outputPtrBufferHead)
     { // buffer Full
-        Serial.println("Output Buffer Overflow!");
+        CKLOG(LOGMSG_TCP_OUTPUT_OVERFLOW, seqNum, len);
+        return false;
     } else {
         // buffer has space, add the element
+        if(outputPtrLenBuffer[outputPtrBufferTail] > 0)
+        { // a sent packet kept for retransmits is pushed out before it went stale, its slot goes back to the pool
+            uint32_t slot = PacketSlotIndex(outputPtrBuffer[outputPtrBufferTail]);
+            if(slot < packetSlotCount) { packetSlotInUse[slot] = false; }
+        }
         outputPtrBuffer[outputPtrBufferTail]         = BufPtr;
         outputPtrLenBuffer[outputPtrBufferTail]      = len;
         outputPtrSequenceBuffer[outputPtrBufferTail] = seqNum;
@@ -67,47 +107,7 @@ void AddToOutputPtrBuffer(uint8_t * BufPtr, uint16_t len, uint32_t seqNum)
     }
     //Serial.println("LowPri");
     //PrintBufferState();
-}
-
-// add an element to the output buffer at the front to be sent out first
-// this does not currently work, overwrites the head and causes it to never be transmitted
-void AddToOutputPtrBufferHighPriority(uint8_t * BufPtr, uint16_t len, uint32_t seqNum)
-{
-    //Serial.println("HighPriBefore");
-    //PrintBufferState();
-    if(((outputPtrBufferTail + 1) % outputPtrBufferSize) == outputPtrBufferHead)
-    { // buffer Full
-        Serial.println("Output Buffer Overflow!");
-    } else {
-        // buffer has space, add the element to the front of the circular buffer
-        if(outputPtrBufferHead==outputPtrBufferTail)
-        {
-            outputPtrBuffer[outputPtrBufferTail]         = BufPtr;
-            outputPtrLenBuffer[outputPtrBufferTail]      = len;
-            outputPtrSequenceBuffer[outputPtrBufferTail] = seqNum;
-            outputPtrTimeBuffer[outputPtrBufferTail++]   = micros();
-            outputPtrBufferTail %= outputPtrBufferSize;
-        } else {
-            outputPtrBufferHead += outputPtrBufferSize - 1;
-            outputPtrBufferHead %= outputPtrBufferSize;
-            // first move the element to be overwritten
-            uint32_t SwapIndex = outputPtrBufferHead + ((uint32_t)(outputPtrBufferSize/2));
-            SwapIndex %= outputPtrBufferSize;
-
-            outputPtrBuffer[SwapIndex]         = outputPtrBuffer[outputPtrBufferHead];
-            outputPtrLenBuffer[SwapIndex]      = outputPtrLenBuffer[outputPtrBufferHead];
-            outputPtrSequenceBuffer[SwapIndex] = outputPtrSequenceBuffer[outputPtrBufferHead];
-            outputPtrTimeBuffer[SwapIndex]     = outputPtrTimeBuffer[outputPtrBufferHead];
-
-            // now add the element to the front of the buffer
-            outputPtrBuffer[outputPtrBufferHead]         = BufPtr;
-            outputPtrLenBuffer[outputPtrBufferHead]      = len;
-            outputPtrSequenceBuffer[outputPtrBufferHead] = seqNum;
-            outputPtrTimeBuffer[outputPtrBufferHead]     = micros();
-        }
-    }
-    //Serial.println("HighPriAfter");
-    //PrintBufferState();
+    return true;
 }
 
 void flattenCircularBuffer(uint8_t * circ, uint32_t circHead, uint32_t bytesToCopy,
@@ -124,7 +124,12 @@ SimpleTCP::SimpleTCP()
     this->microsecondOffset = 0;
     this->StartAckReceived  = false;
     this->lastBufSentMicros = 0;
-    this->AltCommand        = 0;
+    this->commandHead       = 0;
+    this->commandCommitted  = 0;
+    this->commandTail       = 0;
+    this->commandDropping   = false;
+    this->commandsDropped   = 0;
+    this->commandsDroppedTaken = 0;
     SimpleTCP::interBufferTimeMicros = 58000;
     SimpleTCP::usingTimer = true;
     /*
@@ -149,7 +154,12 @@ SimpleTCP::SimpleTCP(bool usingIntervalTimer)
     this->microsecondOffset = 0;
     this->StartAckReceived  = false;
     this->lastBufSentMicros = 0;
-    this->AltCommand        = 0;
+    this->commandHead       = 0;
+    this->commandCommitted  = 0;
+    this->commandTail       = 0;
+    this->commandDropping   = false;
+    this->commandsDropped   = 0;
+    this->commandsDroppedTaken = 0;
     SimpleTCP::interBufferTimeMicros = 58000;
     SimpleTCP::usingTimer = usingIntervalTimer;
     /*
@@ -177,6 +187,11 @@ uint32_t SimpleTCP::GetInterBufferTimeMicros()
     return SimpleTCP::interBufferTimeMicros;
 }
 
+void SimpleTCP::SetInterBufferTimeMicros(uint32_t micros)
+{
+    SimpleTCP::interBufferTimeMicros = micros;
+}
+
 uint32_t SimpleTCP::GetNextByteNum()
 {
     return this->nextByteNum;
@@ -228,25 +243,90 @@ bool SimpleTCP::isNackAlternateCommand(uint32_t NackSequenceNumber)
     return false;
 }
 
-// SimpleTCP allows for 24 bits of ALT command space in the low 24 bits of NackSequenceNumber
-// Return 0 : No Command Waiting
-// Else: User can define list of commands as needed with 24 bits of space
-uint32_t SimpleTCP::ReadAlternateCommand()
+// Return false : No Command Waiting
+// Else: the oldest command of a closed batch is moved to *cmd
+bool SimpleTCP::TakeCommand(struct command * cmd)
 {
-    return (uint32_t) this->AltCommand;
+    if(this->commandHead == this->commandCommitted) { return false; }
+    *cmd = this->commandQueue[this->commandHead];
+    this->commandHead = (this->commandHead + 1) % commandQueueSize;
+    uint32_t dropped = this->commandsDropped - this->commandsDroppedTaken;
+    cmd->droppedBefore = (dropped > 255) ? 255 : (uint8_t) dropped;
+    this->commandsDroppedTaken = this->commandsDropped;
+    return true;
+}
+
+uint32_t SimpleTCP::GetDroppedCommands()
+{
+    return this->commandsDropped;
 }
 
-// Call this in loop after ReadNackAlternateCommand to acknowledge command execution
-// TODO: Handle command incoming while outstanding command present
-void SimpleTCP::ClearAlternateCommand()
+// Append to the open batch, a command without batchMore closes it and makes it readable
+// When the queue is full the whole batch goes, a half applied batch is what batches are there to avoid
+void SimpleTCP::QueueCommand(const struct command * cmd, bool batchMore)
 {
-    this->AltCommand = 0;
+    if(this->commandDropping)
+    {
+        this->commandsDropped++;
+        this->commandDropping = batchMore;
+        return;
+    }
+    uint8_t next = (this->commandTail + 1) % commandQueueSize;
+    if(next == this->commandHead)
+    {
+        this->commandsDropped += 1 + (this->commandTail + commandQueueSize - this->commandCommitted) % commandQueueSize;
+        this->commandTail = this->commandCommitted;
+        this->commandDropping = batchMore;
+        return;
+    }
+    this->commandQueue[this->commandTail] = *cmd;
+    this->commandQueue[this->commandTail].batched = batchMore || (this->commandTail != this->commandCommitted); // or closes an open batch
+    this->commandTail = next;
+    if(!batchMore) { this->commandCommitted = next; }
 }
 
-// Call this to store the Alternate Command to be read by user
+// SimpleTCP allows for 24 bits of ALT command space in the low 24 bits of NackSequenceNumber
+// Kept for old hosts: opcode in bits 16-23, value in the low 16 bits, no id to answer to
 void SimpleTCP::FlagNackAlternateCommand(uint32_t NackSequenceNumber)
 {
-    this->AltCommand = (NackSequenceNumber & 0x00FFFFFF);
+    struct command cmd;
+    cmd.id      = 0;
+    cmd.opcode  = (NackSequenceNumber >> 16) & 0xFF;
+    cmd.argType = 0;
+    cmd.index   = 0;
+    cmd.value   = NackSequenceNumber & 0xFFFF;
+    cmd.receivedMicros = micros();
+    cmd.droppedBefore  = 0;
+    cmd.batched        = false;
+    if(cmd.opcode != 0) { this->QueueCommand(&cmd, false); }
+}
+
+bool SimpleTCP::isCommandSignifier(uint8_t data)
+{
+    return (data == 0xCD);
+}
+
+bool SimpleTCP::isCommand(uint8_t * data)
+{
+    if(data[0] != 0xCD)
+    {
+        return false;
+    }
+    return (this->CalculateCommandChecksum(data) == data[11]);
+}
+
+void SimpleTCP::ParseCommand(uint8_t * data)
+{
+    struct command cmd;
+    cmd.id      = ((uint16_t) data[1] << 8) | data[2];
+    cmd.opcode  = data[3];
+    cmd.argType = data[4] & ~COMMAND_BATCH_MORE;
+    cmd.index   = ((uint16_t) data[5] << 8) | data[6];
+    cmd.value   = ((uint32_t) data[7] << 24) | ((uint32_t) data[8] << 16) | ((uint32_t) data[9] << 8) | data[10];
+    cmd.receivedMicros = micros();
+    cmd.droppedBefore  = 0;
+    cmd.batched        = false;
+    this->QueueCommand(&cmd, (data[4] & COMMAND_BATCH_MORE) != 0);
 }
 
 #define CPU_RESTART_ADDR (uint32_t *)0xE000ED0C
@@ -284,7 +364,7 @@ void SimpleTCP::ParseNack(uint8_t * data, uint32_t txBufLen, bool toPrint)
         } else {
             this->ResendPacketTimer(this->nack.sequenceNumber, this->nack.byteLength);
             if(toPrint)
-                this->PrintNack();
+                CKLOG(LOGMSG_TCP_NACK, this->nack.sequenceNumber, this->nack.byteLength);
         }
     }
 }
@@ -302,20 +382,24 @@ void SimpleTCP::HandleFindingStartAck()
     // wait until Start Ack is received to send data
     // Start Ack also synchronizes world time to internal micros() counter
     // via this->microsecondOffset
+    while(!this->PollStartAck()) { }
+}
+
+// Consume what has arrived so far, returns true once the Start Ack was found
+bool SimpleTCP::PollStartAck()
+{
     while(!this->StartAckReceived)
     {
         //Serial.println("Looking for Start ACK");
         // fill the buffer up to 16 bytes
-        while(validBytesCircBuf < 16)
+        while((validBytesCircBuf < 16) && Serial4.available())
         {
-            if(Serial4.available())
-            {
-                ackCircBuffer[acbTail] = Serial4.read();
-                //Serial.println(ackCircBuffer[acbTail], HEX);
-                acbTail = (acbTail + 1) % ackCircBufferSize;
-                validBytesCircBuf++;
-            }
+            ackCircBuffer[acbTail] = Serial4.read();
+            //Serial.println(ackCircBuffer[acbTail], HEX);
+            acbTail = (acbTail + 1) % ackCircBufferSize;
+            validBytesCircBuf++;
         }
+        if(validBytesCircBuf < 16) { return false; } // the rest of it hasn't arrived yet
         // the circularbuffer has exactly 16 bytes in it check for ack signifier
         if(this->isAckSignifier(ackCircBuffer[acbHead]))
         {
@@ -330,6 +414,7 @@ void SimpleTCP::HandleFindingStartAck()
                 validBytesCircBuf = 0;
                 acbHead           = 0;
                 acbTail           = 0;
+                this->PrintMicroOffset();
             } else {
                 // skip past this byte and restart loop
                 acbHead = (acbHead + 1) % ackCircBufferSize;
@@ -341,7 +426,7 @@ void SimpleTCP::HandleFindingStartAck()
             validBytesCircBuf--;
         }
     }
-    this->PrintMicroOffset();
+    return true;
 }
 
 // process incoming nacks
@@ -372,7 +457,23 @@ void SimpleTCP::HandleNacks()
         // Look for a nack signifier
         while(validBytesCircBuf >= this->GetNacketLength())
         {
-            if(this->isNackSignifier(ackCircBuffer[acbHead]))
+            if(this->isCommandSignifier(ackCircBuffer[acbHead]))
+            {
+                if(validBytesCircBuf < this->GetCommandLength()) { return; } // the rest of it is still on its way
+                uint8_t flattenedBuf[12];
+                flattenCircularBuffer(ackCircBuffer,acbHead,12,ackCircBufferSize,flattenedBuf);
+                if(this->isCommand(flattenedBuf))
+                { // queued, so a burst is taken in one call
+                    this->ParseCommand(flattenedBuf);
+                    acbHead = (acbHead + 12) % ackCircBufferSize;
+                    validBytesCircBuf -= 12;
+                    continue;
+                }
+                // not a command, skip past this byte and restart loop
+                acbHead = (acbHead + 1) % ackCircBufferSize;
+                validBytesCircBuf--;
+            }
+            else if(this->isNackSignifier(ackCircBuffer[acbHead]))
             {   // unroll 8 samples of the circular buffer into a flattened buffer
                 uint8_t flattenedBuf[8];
                 flattenCircularBuffer(ackCircBuffer,acbHead,8,ackCircBufferSize,flattenedBuf);
@@ -421,40 +522,87 @@ bool SimpleTCP::Transmit()
     return false;
 }
 
-// free the buffers pointed to in the output buffer is they are stale
+// release the slots of packets in the output buffer if they are stale
 void SimpleTCP::EraseOldOutputBuffers()
 {
     uint32_t cutoffTime = micros();
     for(uint32_t i=0;i<outputPtrBufferSize;i++)
     {
-        if( (outputPtrLenBuffer[i] > 0) &&
+        // entries from head to tail haven't been transmitted yet, their slot must stay
+        bool pending = ((i + outputPtrBufferSize - outputPtrBufferHead) % outputPtrBufferSize) < this->GetOutputBacklog();
+        if( (outputPtrLenBuffer[i] > 0) && !pending &&
             ((outputPtrTimeBuffer[i] + SimpleTCP::microsToKeepPackets) <= cutoffTime))
         {   // there is a valid packet in this entry and it is stale
-            free((void*)outputPtrBuffer[i]);
+            uint32_t slot = PacketSlotIndex(outputPtrBuffer[i]);
+            if(slot < packetSlotCount) { packetSlotInUse[slot] = false; }
             outputPtrLenBuffer[i] = 0;
         }
     }
 }
 
-void SimpleTCP::HandleSendingSamplesTimer(uint8_t * data, uint32_t dataLen)
+uint8_t * SimpleTCP::AcquirePacketSlot()
 {
-    uint8_t * out;
-    uint16_t outLen;
-
-    // allocate an appropriately sized array to store data while it's being sent out
-    if((dataLen > 0) && (dataLen <= txBufferLen)) {
-        out = (uint8_t*) malloc(dataLen + SimpleTCP::packetHeaderSize);
-    } else {
-        Serial.print("HandleSendingSamplesTimer: Currently Unsupported Length - ");
-        Serial.println(dataLen);
+    for(uint32_t i = 0; i < packetSlotCount; i++)
+    {
+        if(!packetSlotInUse[i])
+        {
+            packetSlotInUse[i] = true;
+            return &packetSlots[i][SimpleTCP::packetHeaderSize];
+        }
     }
+    CKLOG(LOGMSG_TCP_SLOTS_EXHAUSTED);
+    return NULL;
+}
 
-    // packetize the data
+void SimpleTCP::ReleasePacketSlot(uint8_t * payload)
+{
+    uint32_t slot = PacketSlotIndex(payload);
+    if(slot < packetSlotCount) { packetSlotInUse[slot] = false; }
+}
+
+// The payload is already in place behind the header space, only the header is written
+void SimpleTCP::SendPacketSlot(uint8_t * payload, uint32_t dataLen)
+{
+    if((dataLen == 0) || (dataLen > txBufferLen) || (PacketSlotIndex(payload) == packetSlotCount)) {
+        CKLOG(LOGMSG_TCP_BAD_LENGTH, dataLen);
+        ReleasePacketSlot(payload);
+        return;
+    }
+    uint8_t * packet = payload - SimpleTCP::packetHeaderSize;
     uint32_t packetSequenceNumber = this->GetNextByteNum();
-    this->MakePacket(data, dataLen, out, &outLen, packetSequenceNumber, false);
+    this->MakePacketHeader(payload, dataLen, packet, packetSequenceNumber, false);
+    if(!AddToOutputPtrBuffer(packet, dataLen + SimpleTCP::packetHeaderSize, packetSequenceNumber))
+    { // the host will nack the missing bytes and they are logged as LOGMSG_TCP_NACK_MISSING, same as a stale packet
+        ReleasePacketSlot(payload);
+    }
+}
+
+// Retransmissions are queued again, so this grows when the link drops packets
+uint32_t SimpleTCP::GetOutputBacklog()
+{
+    return (outputPtrBufferTail + outputPtrBufferSize - outputPtrBufferHead) % outputPtrBufferSize;
+}
+
+// loop() may sleep until the next interrupt when this is false, the tx timer and UART interrupts change it
+bool SimpleTCP::HasPendingWork()
+{
+    return (SimpleTCP::txReadyFlag && (outputPtrBufferHead != outputPtrBufferTail)) ||
+           ((validBytesCircBuf + Serial4.available()) >= this->GetNacketLength()) ||
+           (this->commandHead != this->commandCommitted);
+}
+
+// Copies data into a packet slot, use AcquirePacketSlot/SendPacketSlot to fill one in place instead
+void SimpleTCP::HandleSendingSamplesTimer(uint8_t * data, uint32_t dataLen)
+{
+    if((dataLen == 0) || (dataLen > txBufferLen)) {
+        CKLOG(LOGMSG_TCP_BAD_LENGTH, dataLen);
+        return;
+    }
 
-    // add it to the transmit buffer
-    AddToOutputPtrBuffer(out, outLen, packetSequenceNumber);
+    uint8_t * payload = SimpleTCP::AcquirePacketSlot();
+    if(payload == NULL) { return; }
+    memcpy((void*) payload, (void*) data, dataLen);
+    this->SendPacketSlot(payload, dataLen);
 }
 
 void SimpleTCP::HandleSendingSamples()
@@ -481,6 +629,10 @@ uint32_t SimpleTCP::GetAcketLength()
 {
     return (uint32_t) 16;
 }
+uint32_t SimpleTCP::GetCommandLength()
+{
+    return (uint32_t) 12;
+}
 
 bool SimpleTCP::isAckSignifier(uint8_t data)
 {
@@ -563,6 +715,16 @@ uint8_t SimpleTCP::CalculateAckChecksum(uint8_t * data)
     return checksum;
 }
 
+uint8_t SimpleTCP::CalculateCommandChecksum(uint8_t * data)
+{
+    uint8_t checksum = 0;
+    for(uint8_t i=0;i<11;i++)
+    {
+        checksum ^= data[i];
+    }
+    return checksum;
+}
+
 // To Do: Fix "7" magic number (Hint: don't use sizeof due to packing irregularities)
 uint8_t SimpleTCP::CalculateNackChecksum(uint8_t * data)
 {
@@ -578,6 +740,15 @@ uint8_t SimpleTCP::CalculateNackChecksum(uint8_t * data)
 // Result stored in packetOut of length packetLen bytes
 // Pass in nextByteNum which is the index of the first byte in dataIn to be sent out
 void SimpleTCP::MakePacket(uint8_t * dataIn, uint16_t len, uint8_t * packetOut, uint16_t * packetLen, uint32_t nextByteNo, bool resend)
+{
+    memcpy((void*) &packetOut[12], (void*) dataIn, len);
+    this->MakePacketHeader(&packetOut[12], len, packetOut, nextByteNo, resend);
+    *packetLen = len + SimpleTCP::packetHeaderSize;
+}
+
+// Write the 12-byte header for the len bytes at dataIn into packetOut[0..11]
+// dataIn may be &packetOut[12] already, nothing is copied here
+void SimpleTCP::MakePacketHeader(uint8_t * dataIn, uint16_t len, uint8_t * packetOut, uint32_t nextByteNo, bool resend)
 {
     // packetOut[0] will now be a packet Signifier 0xAA
     packetOut[0] = (uint8_t) 0xAA;
@@ -597,11 +768,7 @@ void SimpleTCP::MakePacket(uint8_t * dataIn, uint16_t len, uint8_t * packetOut,
     packetOut[9] = (uint8_t)((len     ) & 0x00FF);
 
     // Checksum take 2
-    uint8_t dataChecksum = 0;
-    for(uint16_t i=0;i<len;i++)
-    {
-        dataChecksum ^= dataIn[i];
-    }
+    uint8_t dataChecksum = XorChecksum(dataIn, len);
     packetOut[10] = (uint8_t)(dataChecksum & 0xFF);
 
     uint8_t headerChecksum = 0;
@@ -612,9 +779,6 @@ void SimpleTCP::MakePacket(uint8_t * dataIn, uint16_t len, uint8_t * packetOut,
 
     packetOut[11] = (uint8_t)(headerChecksum & 0xFF);
 
-    memcpy((void*) &packetOut[12], (void*) dataIn, len);
-
-    *packetLen = len + SimpleTCP::packetHeaderSize;
     // if this is not a retransmission of the packet, increment nextByteNum
     if(!resend) {this->nextByteNum += len;}
 }
@@ -659,20 +823,25 @@ void SimpleTCP::ResendPacketTimer(uint32_t sequenceNumber, uint16_t byteLength)
             //Serial.print(outputPtrSequenceBuffer[i]);
             //Serial.print("/");
             //Serial.println(outputPtrLenBuffer[i]);
-            AddToOutputPtrBuffer(outputPtrBuffer[i], outputPtrLenBuffer[i], outputPtrSequenceBuffer[i]);
-            // update firstByteLeftToRetransmit to be the byte after the last byte in the found packet
-            firstByteLeftToRetransmit = outputPtrSequenceBuffer[i] + outputPtrLenBuffer[i];
-            // mark the prior entry in the output buffer to be empty
+            uint16_t len = outputPtrLenBuffer[i];
+            uint32_t seq = outputPtrSequenceBuffer[i];
+            // mark the prior entry in the output buffer to be empty first, it may be the tail entry the packet is queued in
             outputPtrLenBuffer[i] = 0;
+            if(!AddToOutputPtrBuffer(outputPtrBuffer[i], len, seq))
+            { // queue full, the entry stays so its slot is still released once it goes stale
+              // and the host nacks the bytes again, nothing later fits either
+                outputPtrLenBuffer[i] = len;
+                return;
+            }
+            // update firstByteLeftToRetransmit to be the byte after the last byte in the found packet
+            firstByteLeftToRetransmit = seq + len;
 
             // check if we have retransmitted everything already
             if(firstByteLeftToRetransmit >= (sequenceNumber + byteLength)) {return;}
         }
     }
     // couldn't find the packet asked to retransmit, this must be handled in the future with SD storage
-    Serial.print("ERROR: Can't Find Nack Data - ");
-    Serial.println(firstByteLeftToRetransmit);
-    PrintBufferState();
+    CKLOG(LOGMSG_TCP_NACK_MISSING, firstByteLeftToRetransmit, outputPtrBufferHead, outputPtrBufferTail); // PrintBufferState() for the whole buffer
 }
 
 // Resend the data at sequenceNumber of length byteLength
@@ -706,11 +875,7 @@ void SimpleTCP::ResendPacket(uint32_t sequenceNumber, uint16_t byteLength, uint3
         // packetize the data and form the header
         this->MakePacket(&txBuf[0],(uint16_t)thisPacketLen,&packetBuf[0],(uint16_t*)&packetBufSize,currentByteIndex,true);
 
-        Serial.print("Rsnt Byt/Len: ");
-        //Serial.print(  "  ByteIndx : ");
-        Serial.print(currentByteIndex);
-        Serial.print("/");
-        Serial.println(thisPacketLen);
+        CKLOG(LOGMSG_TCP_RESENT, currentByteIndex, thisPacketLen);
 
         // send the packet out via serial4
         if( (micros() - this->lastBufSentMicros) < SimpleTCP::interBufferTimeMicros)
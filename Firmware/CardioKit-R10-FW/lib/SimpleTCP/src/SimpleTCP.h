@@ -8,6 +8,8 @@
 
 #include <Arduino.h>
 
+#define SIMPLE_TCP_COMMAND_QUEUE 16 // commands waiting for loop(), a batch can be up to one less
+
 class SimpleTCP
 {
     public:
@@ -15,13 +17,39 @@ class SimpleTCP
         SimpleTCP(bool usingIntervalTimer);
         bool Transmit();
         void HandleFindingStartAck();
+        bool PollStartAck(); // HandleFindingStartAck without waiting, true once the host's Start Ack arrived
         void HandleNacks();
         void HandleSendingSamples();
         void HandleSendingSamplesTimer(uint8_t * data, uint32_t len);
+        // Zero-copy path: fill the payload of a packet slot in place, then queue it
+        // AcquirePacketSlot returns the payload (4-byte aligned, txBufferLen bytes) or NULL when every slot is in use
+        static uint8_t * AcquirePacketSlot();
+        static void ReleasePacketSlot(uint8_t * payload); // give back an acquired slot that won't be sent
+        void SendPacketSlot(uint8_t * payload, uint32_t len); // writes the header in front of payload and queues it
         void EraseOldOutputBuffers();
-        uint32_t ReadAlternateCommand();
-        void ClearAlternateCommand();
+        uint32_t GetOutputBacklog(); // packets queued and not yet transmitted
+        bool HasPendingWork(); // Transmit, HandleNacks or a command would do something right now
+
+        // Host command, from a command frame or a legacy 0xFE nack (id 0, opcode and 16 bit value)
+        // Command frame, 12 bytes, big-endian like the nacks:
+        //   0xCD, uint16 id, uint8 opcode, uint8 argType, uint16 index, uint32 value, xor checksum of the first 11
+        // argType bit 7 (COMMAND_BATCH_MORE) holds the command back until a frame without it closes the batch.
+        // A batch becomes readable at once, or is dropped whole when it doesn't fit the queue
+        struct command
+        {
+            uint16_t id;             // echoed in the response, 0 for legacy commands
+            uint8_t  opcode;
+            uint8_t  argType;        // how value is to be read, the command space defines the types
+            uint16_t index;          // channel or parameter the command is about
+            uint32_t value;
+            uint32_t receivedMicros; // micros() when HandleNacks parsed it
+            uint8_t  droppedBefore;  // commands lost to a full queue since the one taken before, saturates
+            bool     batched;        // one of a batch of more than one command
+        };
+        bool TakeCommand(struct command * cmd); // false when no command is waiting
+        uint32_t GetDroppedCommands();          // since boot
         static uint32_t GetInterBufferTimeMicros();
+        static void SetInterBufferTimeMicros(uint32_t micros); // the IntervalTimer has to be updated by the caller
         static void SetTxReadyFlag(); // Called by IntervalTimer - sets txReadyFlag to true
 
     private:
@@ -52,6 +80,7 @@ class SimpleTCP
         } ack;
 
         void MakePacket(uint8_t * dataIn, uint16_t len, uint8_t * packetOut, uint16_t * packetLen, uint32_t nextByteNo, bool resend);
+        void MakePacketHeader(uint8_t * dataIn, uint16_t len, uint8_t * packetOut, uint32_t nextByteNo, bool resend);
         void ParsePacket(uint8_t * data,  uint16_t len);
         void ResendPacket(uint32_t sequenceNumber, uint16_t byteLength, uint32_t txBufLen);
         void ResendPacketTimer(uint32_t sequenceNumber, uint16_t byteLength);
@@ -62,6 +91,11 @@ class SimpleTCP
         bool isNackResetCommand(uint32_t NackSequenceNumber);
         bool isNackAlternateCommand(uint32_t NackSequenceNumber);
         void FlagNackAlternateCommand(uint32_t NackSequenceNumber);
+        uint32_t GetCommandLength();
+        bool isCommandSignifier(uint8_t data);
+        bool isCommand(uint8_t * data);
+        void ParseCommand(uint8_t * data);
+        uint8_t  CalculateCommandChecksum(uint8_t * data);
         void ResetTeensy();
         void ParseNack(uint8_t * data, uint32_t txBufLen, bool toPrint);
         void PrintNack();
@@ -82,7 +116,14 @@ class SimpleTCP
         uint8_t  CalculateAckChecksum(uint8_t * data);
         uint8_t  CalculateNackChecksum(uint8_t * data);
         bool     StartAckReceived;
-        uint32_t AltCommand;
+        void QueueCommand(const struct command * cmd, bool batchMore);
+        struct command commandQueue[SIMPLE_TCP_COMMAND_QUEUE];
+        uint8_t  commandHead;      // next taken
+        uint8_t  commandCommitted; // end of the closed batches, TakeCommand stops here
+        uint8_t  commandTail;      // end of the open batch
+        bool     commandDropping;  // the open batch overflowed, drop the rest of it
+        uint32_t commandsDropped;
+        uint32_t commandsDroppedTaken; // commandsDropped at the last TakeCommand
         uint32_t lastBufSentMicros; // time in microseconds when the last buffer was sent
         static uint32_t interBufferTimeMicros; // time that must elapse between two buffer sends in micros
         static volatile bool txReadyFlag; // When this is true -> ready to send next packet, else wait
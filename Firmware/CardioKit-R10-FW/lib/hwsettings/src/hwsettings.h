@@ -48,7 +48,9 @@ extern "C" {
 #define pinADXL_CS    30
 #define pinADXL_INT1  33
 #define pinADXL_INT2  41
-#define ADXL_FIFO_THR 31 // Must be less than 32
+#define ADXL_ODR_HZ   50 // ADXL345 output data rate, 6.25Hz * 2^n
+#define ADXL_RANGE_G  2  // ADXL345 range, 2, 4, 8 or 16g. CardioKitAccel's fixed point is sized for 2g
+#define ADXL_FIFO_THR 16 // FIFO watermark on INT2, 1 to 31. The FIFO is read at every frame end (~5 entries), this only fires if loop() stalls
 
 #define pinBAT_LO     18
 
@@ -68,18 +70,218 @@ extern "C" {
 #define NUM_ECG_CHANNELS   (5)    // Number of MUX Channels on DC ECG
 #define PCG_PRESENT        (1)    // 1 if PCG Stream present, 0 else
 #define ACCEL_PRESENT      (1)    // 1 if ACCEL Stream present, 0 else
-#define NUM_DATA_STREAMS   ((NUM_ECG_CHANNELS) + (PCG_PRESENT) + (ACCEL_PRESENT))
-#define PCG_STREAM_SLOT    (NUM_ECG_CHANNELS)    // buffer[PCG_STREAM_SLOT],   ECG 0-3 go into slots 0,1,2,3
-#define ACCEL_STREAM_SLOT  ((NUM_ECG_CHANNELS) + (PCG_PRESENT))    // buffer[ACCEL_STREAM_SLOT],   ECG 0-3 go into slots 0,1,2,3
+#define ACCEL_ORIENT_PRESENT (1)  // 1 adds the ORIENT stream, pitch, roll and magnitude from the accelerometer
+#if ACCEL_ORIENT_PRESENT && !ACCEL_PRESENT
+#error "ACCEL_ORIENT_PRESENT needs ACCEL_PRESENT"
+#endif
 
 #define ADC_RESOLUTION  (16)
 #define ADC_AVERAGING   (32)  // Can be 0, 4, 8, 16 or 32.
 #define CORE_SAMPLE_FREQ 400
-#define ADC_PDB_FREQ_HZ  ((CORE_SAMPLE_FREQ) * (NUM_ECG_CHANNELS)) //NUM_ECG_CHANNELS * 800 per channel   // 6000 just barely works over SimpleTCP, total sample rate for all ECG channels combined
+#define PDB_TICKS_PER_ECG_SLOT (2) // PDB ticks spent on each mux channel, the ECG ISR averages the conversions left after the lead's settle ticks
+#define MUX_SETTLE_TICKS ((PDB_TICKS_PER_ECG_SLOT) - 1) // default conversions discarded after a mux switch, set per lead with CKCMD_MUX_LEAD
+#define ADC_PDB_FREQ_HZ  ((CORE_SAMPLE_FREQ) * (NUM_ECG_CHANNELS) * (PDB_TICKS_PER_ECG_SLOT)) // 4000 PDB ticks/sec, each one ADC0 (ECG) and one ADC1 (PCG) conversion
+#define ECG_SCAN_TICKS   ((NUM_ECG_CHANNELS) * (PDB_TICKS_PER_ECG_SLOT)) // PDB ticks per scan of every channel
+#define DAC_BLOCK_CONTROL (1) // 1 runs the offset DAC loop once per frame in loop(), 0 slews on every sample in the ISR, see CardioKitDac.h
+#define DAC_PREDICTIVE    (1) // 1 steps a tracking channel ahead of its baseline trend, 0 only once a block nears the rails
+#define DAC_PREDICT_BLOCKS (6) // frames ahead the baseline trend is extrapolated
+#define DAC_HW_SEQUENCE   (1) // 1 steps DAC0 through its data buffer from the PDB, 0 writes it from the ECG ISR
+#define PDB_DAC_TRIGGER_PERCENT (75) // DAC0 steps this far into a PDB tick, after the ECG conversion and before the next one
+
+/*  *********************************************
+    PCG ACQUISITION
+    ADC1 converts on every PDB tick into DMA blocks of PCG_DMA_BLOCK samples
+    which are low-pass filtered and decimated to PCG_OUTPUT_FREQ_HZ, see CardioKitPcg.h
+    PCG_OUTPUT_FREQ_HZ is independent of CORE_SAMPLE_FREQ but must give a PCG_DECIMATION of 2, 4, 5 or 10
+ *  *********************************************/
+#define PCG_ACQ_FREQ_HZ    (ADC_PDB_FREQ_HZ)
+#define PCG_OUTPUT_FREQ_HZ (1000) // 400Hz passband for murmurs
+#define PCG_DECIMATION     ((PCG_ACQ_FREQ_HZ) / (PCG_OUTPUT_FREQ_HZ))
+#define PCG_DMA_BLOCK      (40)   // samples per ADC1 DMA half buffer, must be a multiple of PCG_DECIMATION
+
+/*  *********************************************
+    FRAME LAYOUT
+    Every buffer handed to SimpleTCP is one self-describing frame, see CardioKitFrame.h
+    Each stream declares its own sample count and decimation (in ADC_PDB_FREQ_HZ ticks)
+    so slow streams only take the bytes they need and the rest go to ECG/PCG
+ *  *********************************************/
+#define STREAM_ID_ECG      (0)    // width NUM_ECG_CHANNELS, one word per channel per scan
+#define STREAM_ID_PCG      (1)
+#define STREAM_ID_ACCEL    (2)    // tilt angle 0-359
+#define STREAM_ID_BATTERY  (3)    // pinBAT_LO level, 0 = battery low
+#define STREAM_ID_DAC      (4)    // width NUM_ECG_CHANNELS, DAC0 offset of each channel
+#define STREAM_ID_SCAN     (5)    // width NUM_ECG_CHANNELS, lead (mux table entry) each ECG slot scanned, see CardioKitScan.h
+#define STREAM_ID_ORIENT   (6)    // width 3, pitch, roll and magnitude, see CardioKitAccel.h
+#define STREAM_FLAG_FILTERED (0x80) // set on a stream id when CardioKitFilter replaced its raw samples
+#define STREAM_FLAG_MOTION   (0x40) // set on the ECG stream id when CardioKitMotion took the motion artifact out
+#define STREAM_ID_MASK       (0x3F)
+
+#define ACCEL_SAMPLES_PER_FRAME   (1) // posture changes on a scale of seconds, the FIFO bursts are averaged into one angle per frame
+#define BATTERY_SAMPLES_PER_FRAME (1)
+#define DAC_SAMPLES_PER_FRAME     (1)
+#define SCAN_SAMPLES_PER_FRAME    (1)    // the layout only changes on a frame boundary
+#define ORIENT_SAMPLES_PER_FRAME  (1)
+
+#define NUM_FRAME_STREAMS       ((4) + (PCG_PRESENT) + (ACCEL_PRESENT) + (ACCEL_ORIENT_PRESENT)) // ECG, BATTERY, DAC and SCAN are always sent
+#define FRAME_MAX_BYTES         (718) // Largest buffer SimpleTCP will packetize (txBufferLen)
+#define FRAME_HEADER_BYTES      (12)
+#define FRAME_DESCRIPTOR_BYTES  (6)
+#define FRAME_LAYOUT_BYTES      ((FRAME_HEADER_BYTES) + ((NUM_FRAME_STREAMS) * (FRAME_DESCRIPTOR_BYTES)))
+#define FRAME_SLOW_STREAM_BYTES (2 * (((ACCEL_PRESENT) * (ACCEL_SAMPLES_PER_FRAME)) + (3 * (ACCEL_ORIENT_PRESENT) * (ORIENT_SAMPLES_PER_FRAME)) + (BATTERY_SAMPLES_PER_FRAME) + ((NUM_ECG_CHANNELS) * ((DAC_SAMPLES_PER_FRAME) + (SCAN_SAMPLES_PER_FRAME)))))
 
-#define CHANNEL_BUFFER_LENGTH ((359)/(NUM_DATA_STREAMS)) //(89//179//359 // (718/2) because of 16 bit samples
+// Smallest number of ECG scans that holds a whole number of PCG samples
+#if   ((PCG_OUTPUT_FREQ_HZ) % (CORE_SAMPLE_FREQ)) == 0
+#define PCG_FRAME_GRANULE (1)
+#elif ((2 * (PCG_OUTPUT_FREQ_HZ)) % (CORE_SAMPLE_FREQ)) == 0
+#define PCG_FRAME_GRANULE (2)
+#elif ((4 * (PCG_OUTPUT_FREQ_HZ)) % (CORE_SAMPLE_FREQ)) == 0
+#define PCG_FRAME_GRANULE (4)
+#else
+#error "PCG_OUTPUT_FREQ_HZ must be a multiple of CORE_SAMPLE_FREQ / 4"
+#endif
+
+// ECG scans per frame, whatever is left after the layout and slow streams is split between ECG and PCG
+#define FRAME_SCAN_BUDGET         ((((FRAME_MAX_BYTES) - (FRAME_LAYOUT_BYTES) - (FRAME_SLOW_STREAM_BYTES)) * (CORE_SAMPLE_FREQ)) / (2 * (((NUM_ECG_CHANNELS) * (CORE_SAMPLE_FREQ)) + ((PCG_PRESENT) * (PCG_OUTPUT_FREQ_HZ)))))
+#define FRAME_SAMPLES_PER_CHANNEL ((FRAME_SCAN_BUDGET) - ((FRAME_SCAN_BUDGET) % (PCG_FRAME_GRANULE)))
+#define PCG_SAMPLES_PER_FRAME     (((FRAME_SAMPLES_PER_CHANNEL) * (PCG_OUTPUT_FREQ_HZ)) / (CORE_SAMPLE_FREQ))
+#define FRAME_TICKS               ((FRAME_SAMPLES_PER_CHANNEL) * (ECG_SCAN_TICKS)) // PDB ticks covered by one frame
 #define PINGPONG_BUFFER_COUNT 2
 
+/*  *********************************************
+    ON-DEVICE FILTERING
+    Default corners of the optional filter stage, see CardioKitFilter.h
+    Raw output is sent until a command selects the filtered output
+ *  *********************************************/
+#define MAINS_FREQ_HZ          (60.0f)  // 50.0f outside North America
+#define FILTER_MAX_STAGES      (4)      // biquads per chain
+#define FILTER_NOTCH_Q         (20.0)   // 3Hz wide notch at 60Hz
+#define FILTER_ECG_HIGHPASS_HZ (0.5f)   // baseline wander
+#define FILTER_ECG_LOWPASS_HZ  (100.0f)
+#define FILTER_PCG_HIGHPASS_HZ (20.0f)  // breathing and motion
+#define FILTER_PCG_LOWPASS_HZ  (0.0f)   // the decimator already band-limits PCG
+
+/*  *********************************************
+    MOTION ARTIFACT CANCELLATION
+    An NLMS filter per ECG slot predicts the motion artifact from the
+    accelerometer XYZ, resampled onto the ECG scan, and subtracts it
+    from the raw samples. Off until CKCMD_MOTION_MODE turns it on.
+    See CardioKitMotion.h
+ *  *********************************************/
+#define MOTION_CANCEL_ENABLE  (1)     // 1 builds the canceller, 0 leaves it out
+#define MOTION_TAPS           (4)     // taps per axis, 12 weights per slot
+#define MOTION_TAP_SCANS      (8)     // scans between taps, 4 taps span 60ms at 400Hz
+#define MOTION_HP_SHIFT       (7)     // one pole high-pass on ECG and reference, pole at 1 - 2^-7, ~0.5Hz at 400Hz
+#define MOTION_OUT_SHIFT      (10)    // the subtracted prediction keeps a high-pass at 1 - 2^-10, ~0.06Hz, so posture doesn't offset the ECG
+#define MOTION_MU_Q15         (256)   // NLMS step, 1/128. Larger learns faster but fits more of the ECG itself
+#define MOTION_EPS            (16384) // added to the reference power, ~3 counts rms per tap, keeps the step small when still
+#define MOTION_MIN_POWER      (65536) // reference power below which the filters don't adapt, ~20mg rms per tap
+#define MOTION_LEAK_SHIFT     (12)    // weights decay by 2^-12 per frame, ~7 minutes, so unused ones don't drift
+#define MOTION_REPORT_MS      (2000)  // EVENT_RECORD_MOTION interval while the canceller runs
+
+#if MOTION_CANCEL_ENABLE && !ACCEL_PRESENT
+#error "MOTION_CANCEL_ENABLE needs ACCEL_PRESENT"
+#endif
+
+/*  *********************************************
+    EVENT FRAMES
+    Small records (beats, ...) share the SimpleTCP stream with the sample
+    frames, see CardioKitFrame.h. Records are batched so they cost an
+    extra packet every EVENT_FLUSH_INTERVAL_MS at most, not one per record
+ *  *********************************************/
+#define EVENT_FRAME_MAX_BYTES   (256)  // one event frame per packet, fits ~25 beat records or 3 snippets
+#define EVENT_FLUSH_INTERVAL_MS (500)  // send queued records at least this often
+#define QRS_DETECT_ENABLE       (1)    // 1 to run the on-device QRS detector, 0 else
+
+/*  *********************************************
+    MONITORING MODE
+    When the SimpleTCP backlog shows the link can't keep up, raw frames
+    stop and only beats, a once a second summary (HR, lead quality,
+    posture) and compressed snippets around beats are sent.
+    See CardioKitMonitor.h
+ *  *********************************************/
+#define MONITOR_MODE_ENABLE       (1)     // 1 to fall back to monitoring on a bad link, 0 to always send raw frames
+#define MONITOR_ENTER_BACKLOG     (30)    // queued packets, ~1.7s behind at the SimpleTCP pacing
+#define MONITOR_EXIT_BACKLOG      (3)     // queued packets
+#define MONITOR_EXIT_HOLD_MS      (5000)  // backlog must stay low this long before raw frames resume
+#define MONITOR_EXIT_HOLD_MAX_MS  (80000) // the hold doubles up to this each time raw frames overwhelm the link again
+#define MONITOR_SUMMARY_MS        (1000)  // summary record interval, in either mode
+#define MONITOR_SNIPPET_PRE_MS    (100)   // snippet start before the R peak
+#define MONITOR_SNIPPET_POST_MS   (150)   // snippet end after the R peak
+#define MONITOR_SNIPPET_DECIMATION (2)    // snippets are sent at CORE_SAMPLE_FREQ / this
+#define MONITOR_SNIPPET_SHIFT     (4)     // LSBs dropped from snippet samples, 16-bit codes are ~0.06uV at the input
+
+#if MONITOR_MODE_ENABLE && !QRS_DETECT_ENABLE
+#error "MONITOR_MODE_ENABLE needs QRS_DETECT_ENABLE"
+#endif
+
+/*  *********************************************
+    ADAPTIVE SCAN
+    The NUM_ECG_CHANNELS slots of each scan are mapped to leads. Leads
+    that stay saturated are dropped and their slots go to the best live
+    leads, so those are sampled at a multiple of CORE_SAMPLE_FREQ in the
+    same ADC and radio budget. See CardioKitScan.h
+ *  *********************************************/
+#define SCAN_ADAPTIVE_ENABLE  (1)     // 1 lets CardioKitScan remap slots, 0 always scans every lead once
+#define SCAN_FOCUS_LEADS      (0)     // leads kept when the layout is focused, 0 keeps every live lead. CKCMD_SCAN_FOCUS at runtime
+#define SCAN_DEAD_FRAMES      (9)     // ~1s of frames more than half saturated before a lead is dropped
+#define SCAN_SETTLE_MS        (5000)  // full scan after boot or a probe before leads are ranked, the DAC and QRS detector need it
+#define SCAN_PROBE_MS         (60000) // a focused layout falls back to the full scan this often to recheck the dropped leads
+
+#if SCAN_ADAPTIVE_ENABLE && !DAC_BLOCK_CONTROL
+#error "SCAN_ADAPTIVE_ENABLE needs DAC_BLOCK_CONTROL to hand DAC state between slots"
+#endif
+
+#define PROFILE_ENABLE         (1)   // 1 to keep DWT cycle counts of ISRs and loop() stages, see CardioKitProfile.h. 0 compiles the probes out
+#define PROFILE_RECORDS_PER_FRAME (4) // profile records added to the event frame per sample frame while a dump is sent to the host
+
+/*  *********************************************
+    POWER
+    loop() sleeps (WFI) whenever nothing is pending, the DMA, PDB and
+    UART keep running and any interrupt wakes it. The awake share and an
+    estimated core current are reported per window, see CardioKitPower.h
+ *  *********************************************/
+#define POWER_IDLE_ENABLE      (1)    // 1 to sleep between interrupts, 0 to spin
+#define POWER_REPORT_MS        (5000) // EVENT_RECORD_POWER interval
+#define POWER_RUN_UA_PER_MHZ   (333)  // 180 -> 240MHz measured +20mA, see CardioKit_R10.cpp
+#define POWER_WAIT_UA_PER_MHZ  (120)  // rough, core clock gated in WAIT, only the bus side still toggles
+
+/*  *********************************************
+    LOG
+    Binary log entries from ISRs and loop() go to a ring that loop()
+    drains while idle, to USB Serial as text and in-band as
+    EVENT_RECORD_LOG. See CardioKitLog.h
+ *  *********************************************/
+#define LOG_LEVEL_NONE     (0)
+#define LOG_LEVEL_ERROR    (1)
+#define LOG_LEVEL_WARN     (2)
+#define LOG_LEVEL_INFO     (3)
+#define LOG_LEVEL_DEBUG    (4)
+#define LOG_LEVEL          (LOG_LEVEL_DEBUG) // messages above it are compiled out, LOG_LEVEL_NONE removes the ring
+#define LOG_INBAND_LEVEL   (LOG_LEVEL_WARN)  // messages at or below it are also sent to the host, nacks and resends stay on USB
+#define LOG_RING_ENTRIES   (64)   // power of two, 24 bytes each
+#define LOG_DRAIN_PER_LOOP (4)    // entries moved out per idle loop()
+
+/*  *********************************************
+    WARM START
+    The settled DAC offsets, the ADC calibration and the ADXL clock
+    period are cached in EEPROM and tried first after the next power-on
+    or reset. See CardioKitWarmStart.h
+ *  *********************************************/
+#define WARMSTART_ENABLE       (1)      // 0 for a cold start every time, the cache is neither read nor written
+#define WARMSTART_EEPROM_ADDR  (0)      // offset of the cache in the 4kB EEPROM
+#define WARMSTART_SAVE_MS      (30000)  // every slot settled this long before the first save
+#define WARMSTART_RESAVE_MS    (600000) // then at most this often, and only once a DAC moved more than WARMSTART_RESAVE_DAC
+#define WARMSTART_RESAVE_DAC   (64)
+#define WARMSTART_WRITE_BYTES  (16)     // EEPROM bytes written per frame, an unchanged byte costs nothing
+#define WARMSTART_REPORT_MS    (20000)  // EVENT_RECORD_WARMSTART goes out once every slot settled or this long after acquisition started
+
+/*  *********************************************
+    BOOT
+    setup() runs without fixed delays and acquisition starts before
+    the host's Start Ack. See CardioKitBoot.h
+ *  *********************************************/
+#define BOOT_PRINT_ADXL        (0)      // 1 to read the ADXL345 setup back over USB Serial, a bench check that holds up setup()
+
 #endif //HW_SETTINGS_H
 #ifdef __cplusplus
 }
@@ -15,6 +15,7 @@
  *  *********************************************/
 #include "qcepMux.h"
 #include "hwsettings.h"
+#include <string.h>
 
 typedef enum
 {
@@ -43,13 +44,13 @@ typedef enum
     U7 = 1
 } MUX;
 
-static uint8_t ChannelTableIndex = 0;
+#define MUX_ADDRESS_BITS 6
+
 // Stores the lead pairs as channels
-// Can access ChannelTable[channelNum][U6=0/U7=1]
 // "U6" entries are - and "U7" are + with regards to vector direction of signal
 // due to signal inversion in stage 2
 // Signals have vector U6 -> U7
-static MUX_LEADS ChannelTable[8][2] =
+static const MUX_LEADS DefaultChannelTable[MUX_TABLE_ENTRIES][2] =
 { // Both Bit 0's on the muxs cross all leads
     {U6_LEAD_THB,U7_LEAD_2},//{U6_LEAD_THB,U7_LEAD_2},
     {U6_LEAD_4,U7_LEAD_0},//{U6_LEAD_4,U7_LEAD_0},
@@ -61,19 +62,76 @@ static MUX_LEADS ChannelTable[8][2] =
     {U6_LEAD_1,U7_LEAD_7},
 };
 
-uint32_t SetMuxLead(MUX mux, MUX_LEADS lead)
+// The six address lines in the bit order of a table entry's address, U6 (MUX1) in bits 0-2, U7 (MUX0) in bits 3-5
+#define MUX_PIN_(p, field) CORE_PIN##p##_##field
+#define MUX_PIN(p, field) MUX_PIN_(p, field)
+#define MUX_ADDRESS_PIN(p) { &MUX_PIN(p, PORTSET), &MUX_PIN(p, PORTCLEAR), MUX_PIN(p, BITMASK) }
+typedef struct
+{
+    volatile uint32_t * set;
+    volatile uint32_t * clear;
+    uint32_t mask;
+} MuxAddressPin_t;
+static const MuxAddressPin_t MuxAddressPins[MUX_ADDRESS_BITS] =
+{
+    MUX_ADDRESS_PIN(pinMUX1_A0), MUX_ADDRESS_PIN(pinMUX1_A1), MUX_ADDRESS_PIN(pinMUX1_A2),
+    MUX_ADDRESS_PIN(pinMUX0_A0), MUX_ADDRESS_PIN(pinMUX0_A1), MUX_ADDRESS_PIN(pinMUX0_A2), // pins 0 are U4 on the right
+};
+
+// GPIO ports the address lines are spread over, filled in by initializeMux
+// On the R01 board they sit on PTA, PTB and PTD so a switch is one set and one clear write per port
+static volatile uint32_t * MuxPortSet[MUX_ADDRESS_BITS];
+static volatile uint32_t * MuxPortClear[MUX_ADDRESS_BITS];
+static uint8_t NumMuxPorts = 0;
+
+typedef struct
+{
+    uint8_t  negative;   // U6 lead
+    uint8_t  positive;   // U7 lead
+    uint8_t  settleTicks;
+    uint32_t setMask[MUX_ADDRESS_BITS];   // per MuxPortSet entry
+    uint32_t clearMask[MUX_ADDRESS_BITS];
+} MuxEntry_t;
+static MuxEntry_t ChannelTable[MUX_TABLE_ENTRIES];
+static volatile uint8_t CurrentMuxChannel = 0;
+
+static uint8_t GetMuxPort(volatile uint32_t * set)
+{
+    for(uint8_t p = 0; p < NumMuxPorts; p++)
+    {
+        if(MuxPortSet[p] == set) { return p; }
+    }
+    return NumMuxPorts;
+}
+
+// Turn a lead pair into set/clear masks for every port, so the ISR needs no per-pin work
+static void CompileMuxEntry(MuxEntry_t * entry, uint8_t negative, uint8_t positive, uint8_t settleTicks)
+{
+    uint8_t address = (negative & 0x7) | ((positive & 0x7) << 3);
+    entry->negative = negative;
+    entry->positive = positive;
+    entry->settleTicks = settleTicks;
+    memset(entry->setMask, 0, sizeof(entry->setMask));
+    memset(entry->clearMask, 0, sizeof(entry->clearMask));
+    for(uint8_t bit = 0; bit < MUX_ADDRESS_BITS; bit++)
+    {
+        uint8_t p = GetMuxPort(MuxAddressPins[bit].set);
+        if(address & (1 << bit))
+        {
+            entry->setMask[p] |= MuxAddressPins[bit].mask;
+        } else {
+            entry->clearMask[p] |= MuxAddressPins[bit].mask;
+        }
+    }
+}
+
+static inline void ApplyMuxEntry(const MuxEntry_t * entry)
 {
-    if(mux == U6)
+    for(uint8_t p = 0; p < NumMuxPorts; p++)
     {
-        digitalWriteFast(pinMUX1_A0, lead & 0x1);
-        digitalWriteFast(pinMUX1_A1, lead & 0x2);
-        digitalWriteFast(pinMUX1_A2, lead & 0x4);
-    } else {
-        digitalWriteFast(pinMUX0_A0, lead & 0x1); // pins 0 are U4 on the right
-        digitalWriteFast(pinMUX0_A1, lead & 0x2);
-        digitalWriteFast(pinMUX0_A2, lead & 0x4);
+        *MuxPortSet[p]   = entry->setMask[p];
+        *MuxPortClear[p] = entry->clearMask[p];
     }
-    return lead;
 }
 
 void initializeMux()
@@ -85,19 +143,50 @@ void initializeMux()
     pinMode(pinMUX1_A1 , OUTPUT);
     pinMode(pinMUX1_A2 , OUTPUT);
 
-    SetMuxLead(U6, ChannelTable[ChannelTableIndex][U6]);
-    SetMuxLead(U7, ChannelTable[ChannelTableIndex][U7]);
+    NumMuxPorts = 0;
+    for(uint8_t bit = 0; bit < MUX_ADDRESS_BITS; bit++)
+    {
+        if(GetMuxPort(MuxAddressPins[bit].set) == NumMuxPorts)
+        {
+            MuxPortSet[NumMuxPorts]   = MuxAddressPins[bit].set;
+            MuxPortClear[NumMuxPorts] = MuxAddressPins[bit].clear;
+            NumMuxPorts++;
+        }
+    }
+    for(uint8_t ch = 0; ch < MUX_TABLE_ENTRIES; ch++)
+    {
+        CompileMuxEntry(&ChannelTable[ch], DefaultChannelTable[ch][U6], DefaultChannelTable[ch][U7], MUX_SETTLE_TICKS);
+    }
+    CurrentMuxChannel = 0;
+    ApplyMuxEntry(&ChannelTable[CurrentMuxChannel]);
 }
 
-void switchNextMuxChannel(uint8_t channel)
+uint8_t switchNextMuxChannel(uint8_t channel)
 { // Switch MUXs to next channel
-    ChannelTableIndex = (ChannelTableIndex + 1) % (NUM_ECG_CHANNELS);
-    SetMuxLead(U6, ChannelTable[channel][U6]);
-    SetMuxLead(U7, ChannelTable[channel][U7]);
+    const MuxEntry_t * entry = &ChannelTable[channel];
+    ApplyMuxEntry(entry);
+    CurrentMuxChannel = channel;
+    return entry->settleTicks;
 }
 
 // Read the current Channel
 uint8_t GetCurrentMuxChannel()
 {
-    return ChannelTableIndex;
+    return CurrentMuxChannel;
+}
+
+uint8_t SetMuxChannelLeads(uint8_t channel, uint8_t negative, uint8_t positive, uint8_t settleTicks)
+{
+    if(channel >= MUX_TABLE_ENTRIES || negative > 7 || positive > 7 || settleTicks >= PDB_TICKS_PER_ECG_SLOT) { return 0; }
+    MuxEntry_t entry;
+    CompileMuxEntry(&entry, negative, positive, settleTicks);
+    __disable_irq(); // the ECG ISR may be switching to this entry
+    ChannelTable[channel] = entry;
+    __enable_irq();
+    return 1;
+}
+
+uint8_t GetMuxSettleTicks(uint8_t channel)
+{
+    return ChannelTable[channel].settleTicks;
 }
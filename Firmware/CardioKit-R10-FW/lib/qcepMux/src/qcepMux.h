@@ -20,16 +20,29 @@ extern "C" {
 #ifndef QCEP_MUX_H
 #define QCEP_MUX_H
 #include <WProgram.h>
+#include "hwsettings.h"
+
+#define MUX_TABLE_ENTRIES 8 // channels the lead table can hold, the first NUM_ECG_CHANNELS are scanned
 
 // Setup pins, enable MUXs, choose initial channel
 void initializeMux();
 
 // Switch MUXs to next channel
-void switchNextMuxChannel(uint8_t channel);
+// Each channel's lead pair is kept as precomputed port set/clear masks, the switch is one
+// PSOR and one PCOR write per GPIO port the address lines use
+// Returns the channel's settle ticks: conversions at the start of its slot the ECG ISR discards
+uint8_t switchNextMuxChannel(uint8_t channel);
 
 // Read the current Channel
 uint8_t GetCurrentMuxChannel();
 
+// Replace a channel's lead pair, U6 (-) and U7 (+) mux inputs 0-7, takes effect at its next slot
+// settleTicks must be below PDB_TICKS_PER_ECG_SLOT, the remaining conversions of the slot are averaged
+// Returns 0 if anything was out of range and the table was left alone
+uint8_t SetMuxChannelLeads(uint8_t channel, uint8_t negative, uint8_t positive, uint8_t settleTicks);
+
+uint8_t GetMuxSettleTicks(uint8_t channel);
+
 #endif //QCEP_MUX_H
 #ifdef __cplusplus
 }
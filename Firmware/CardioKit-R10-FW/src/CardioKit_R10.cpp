@@ -14,6 +14,8 @@
         Tested to stream properly at 240MHz fCPU
         Changed fCPU from 180MHz (default) to 240MHz consuming an extra 20mA
         Changed fCPU back to 180MHz, didn't need extra speed, not worth extra noise
+        loop() now sleeps between interrupts and reports its awake share,
+        see CardioKitPower.h
     Development Environment Specifics:
     Atom + PlatformIO
 
@@ -25,115 +27,119 @@
 #include <IntervalTimer.h>
 #include <ADC.h>
 #include <RingBufferDMA.h>
+#include <DMAChannel.h>
 #include "SimpleTCP.h"
 #include "hwsettings.h"
 #include "CardioKitDac.h"
 #include "qcepMux.h"
 #include "CardioKitLEDS.h"
 #include "CardioKitCommandSpace.h"
+#include "CardioKitFrame.h"
+#include "CardioKitPcg.h"
+#include "CardioKitFilter.h"
+#include "CardioKitQrs.h"
+#include "CardioKitMonitor.h"
+#include "CardioKitProfile.h"
+#include "CardioKitPower.h"
+#include "CardioKitScan.h"
+#include "CardioKitAccel.h"
+#include "CardioKitMotion.h"
+#include "CardioKitLog.h"
+#include "CardioKitWarmStart.h"
+#include "CardioKitBoot.h"
 #include <SparkFun_ADXL345.h>
-#include <math.h>
 
 ADC *adc = new ADC();
 
 const uint8_t adc_dma_buffer_size = 1; // 128 is hard max, aliases down for higher numbers
 DMAMEM static volatile int16_t __attribute__((aligned(adc_dma_buffer_size + 0))) bufferAdc0[adc_dma_buffer_size]; // allocate ADC0 DMA buffer
-DMAMEM static volatile int16_t __attribute__((aligned(adc_dma_buffer_size + 0))) bufferAdc1[adc_dma_buffer_size]; // allocate ADC1 DMA buffer
+DMAMEM static volatile int16_t __attribute__((aligned(32))) bufferAdc1[2 * PCG_DMA_BLOCK]; // allocate ADC1 DMA ping-pong halves
 RingBufferDMA *dmaBuffer0 = new RingBufferDMA(bufferAdc0, adc_dma_buffer_size, ADC_0); // use dma with ADC0
-RingBufferDMA *dmaBuffer1 = new RingBufferDMA(bufferAdc1, adc_dma_buffer_size, ADC_1); // use dma with ADC1
+DMAChannel dmaBuffer1; // ADC1 block DMA, interrupts each time half of bufferAdc1 fills
 
 //////////////////////////////////////////////
 ///////// INITIALIZE STATE VARIABLES /////////
 //////////////////////////////////////////////
-volatile static uint16_t samples[PINGPONG_BUFFER_COUNT][NUM_DATA_STREAMS][CHANNEL_BUFFER_LENGTH] = {0}; // Ping-pong Buffer 1 and 2
+// Ping-pong Buffer 1 and 2, see CardioKitFrame.h for layout. Each is the payload of a SimpleTCP packet slot
+// so the ISRs write samples straight into the packet that gets sent, loop() swaps in a fresh slot once one is queued
+volatile static SampleFrame_t * volatile frames[PINGPONG_BUFFER_COUNT];
 volatile static uint8_t  current_channel               =  0;     // Which ECG Channel is the ADC currently sampling
-volatile static uint16_t samples_idx[NUM_DATA_STREAMS] = {0};    // For each Channel, what is the index into 'samples[CURR_BUF][CH_N][]'
-volatile static uint8_t  buffer_num                    =  0;     // Which Ping-Pong Buffer is currently being used
-volatile static uint8_t  buffer_num_pcg                =  0;     // Which Ping-Pong Buffer is currently being used by pcg
-volatile static bool     buffer_ready_flag             =  false; // Signals that one of the Ping-Pong buffers is ready for processing
-volatile static bool     pcg_buffer_ready_flag         =  false; // Signals that one of the Ping-Pong buffers is ready for processing
-volatile static bool     accel_read_sample_flag        =  false; // Signals that the accelerometer should take another reading
+volatile static uint16_t samples_idx[NUM_ECG_CHANNELS] = {0};    // For each Channel, what is the index into 'frames[CURR_BUF].ecg[CH_N][]'
+volatile static uint16_t pcg_samples_idx               =  0;     // Index into 'frames[pcg_frame_seq % PINGPONG_BUFFER_COUNT].pcg[]'
+volatile static uint32_t ecg_frame_seq                 =  0;     // Frames the ECG has completed, it is filling frame number ecg_frame_seq
+volatile static uint32_t pcg_frame_seq                 =  0;     // Frames the PCG has completed, it is filling frame number pcg_frame_seq
+volatile static uint32_t processed_frame_seq           =  0;     // Frames loop() has handed off, a frame is ready once both ADCs are past it
+volatile static bool     accel_fifo_flag               =  false; // a frame ended or the ADXL345 FIFO reached its watermark, loop() burst reads it
+volatile static bool     accel_fifo_busy               =  false; // a burst is queued on the SPI DMA engine
+volatile static bool     accel_int_busy                =  false; // the INT1 source read is queued on the SPI DMA engine
+volatile static int8_t   accel_int_result              =  0;     // its bytes read, -1 if the queue was full, 0 while none has completed
 
 
 //////////////////////////////////////////////
 ////////// ACCELEROMETER VARIABLES ///////////
 //////////////////////////////////////////////
-int16_t ACCELx,ACCELy,ACCELz;
 ADXL345 adxl = ADXL345(pinADXL_CS); // SPI, ADXL345(CS_PIN);
+int16_t  accel_fifo_xyz[3 * 32];           // burst target, the SPI DMA engine owns it while accel_fifo_busy
+byte     accel_int_regs[6];                // ACT_TAP_STATUS to INT_SOURCE, the SPI DMA engine owns it while accel_int_busy
+uint8_t  accel_int_edges = 0;              // edges the running source read covers
 
-// returns 0 to 359 degrees with 0 degrees being towards left shoulder, 90 towards feet, 270 towards head
-FASTRUN uint16_t GetAxisAngle(int x, int y)
+// PDB ticks since acquisition started, to the scan. Only from ISRs at the ECG DMA priority (the default), which can't split its update
+static inline uint32_t GetAcquisitionTick()
 {
-    double theta = double(y)/double(x);
-    theta = atan(theta) * 180.0/ 3.14159265;
-    theta = abs(theta);
+    return ecg_frame_seq * FRAME_TICKS + samples_idx[NUM_ECG_CHANNELS - 1] * ECG_SCAN_TICKS;
+}
 
-    if( x >= 0 && y >= 0)
-    { // both +ve
-        theta = 180 + theta;
-    }
-    else if( x >= 0 && y <= 0)
-    { // x +ve, y -ve
-        theta = 180 - theta;
-    }
-    else if( x <= 0 && y <= 0)
-    { // both -ve
-        //theta = theta;
-    }
-    else
-    { // x -ve, y +ve
-        theta = 360 - theta;
-    }
-    uint16_t angle = (uint16_t) (theta);
-    return (angle % 360);
+// Burst done, from the SPI DMA interrupt
+FASTRUN void AccelFifoDone(void * context, int n)
+{
+    PROFILE_BEGIN(PROFILE_SITE_READ_ACCEL);
+    if(n == 32) { CKLOG(LOGMSG_ACCEL_FIFO_OVERRUN, GetAcquisitionTick()); } // stream mode dropped the oldest samples
+    if(n > 0) { AccelAddSamples(accel_fifo_xyz, n, GetAcquisitionTick()); }
+    accel_fifo_busy = false;
+    PROFILE_END(PROFILE_SITE_READ_ACCEL);
 }
 
-FASTRUN void ReadAccelIntoArray()
+// One burst of every queued sample in the background, in stream mode the FIFO keeps the newest 32 so nothing is read twice
+void DrainAccelFifo()
 {
-    adxl.readAccel(&ACCELx, &ACCELy, &ACCELz);
-    samples[buffer_num][ACCEL_STREAM_SLOT][samples_idx[ACCEL_STREAM_SLOT]] = GetAxisAngle(ACCELx,ACCELy);
-    samples_idx[ACCEL_STREAM_SLOT] = (samples_idx[ACCEL_STREAM_SLOT] + 1) % CHANNEL_BUFFER_LENGTH; // Move samples buffer indices
+    if(accel_fifo_busy) { return; } // INT2 stays high until the running burst has popped the entries
+    accel_fifo_flag = false; // before the burst, a watermark during it is serviced next time round
+    accel_fifo_busy = true;
+    adxl.readFifoAsync(accel_fifo_xyz, 32, AccelFifoDone, NULL); // a full queue calls back with -1
+}
+
+// Source read done, from the SPI DMA interrupt. loop() reports it
+FASTRUN void AccelIntSourceDone(void * context, int n)
+{
+    accel_int_result = (n < 0) ? -1 : (int8_t) n;
+    accel_int_busy = false;
+}
+
+// Read what raised INT1 in the background. The read clears the latch, INT1 drops and the next event makes a new edge
+void ReadAccelIntSource()
+{
+    if(accel_int_busy) { return; }
+    if(AccelInterruptsPending() == 0)
+    { // INT1 is high without a queued edge, it went up before the pin interrupt was attached
+        __disable_irq();
+        AccelQueueInterrupt(GetAcquisitionTick());
+        __enable_irq();
+    }
+    accel_int_edges = AccelInterruptsPending();
+    accel_int_result = 0;
+    accel_int_busy = true;
+    adxl.readAsync(ADXL345_ACT_TAP_STATUS, 6, accel_int_regs, AccelIntSourceDone, NULL); // a full queue calls back with -1
 }
 
 /********************* ISR *********************/
+// INT1, tap, double tap, activity or free fall. Only the time is kept, the source is read from loop()
 FASTRUN void ADXL_ISR() {
-    Serial.println("ADXL_ISR");
-  // getInterruptSource clears all triggered actions after returning value
-  // Do not call again until you need to recheck for triggered actions
-  byte interrupts = adxl.getInterruptSource();
-
-  // Free Fall Detection
-  if(adxl.triggered(interrupts, ADXL345_FREE_FALL)){
-    Serial.println("*** FREE FALL ***");
-    //add code here to do when free fall is sensed
-  }
-
-  // Inactivity
-  if(adxl.triggered(interrupts, ADXL345_INACTIVITY)){
-    Serial.println("*** INACTIVITY ***");
-     //add code here to do when inactivity is sensed
-  }
-
-  // Activity
-  if(adxl.triggered(interrupts, ADXL345_ACTIVITY)){
-    Serial.println("*** ACTIVITY ***");
-     //add code here to do when activity is sensed
-  }
-
-  // Double Tap Detection
-  if(adxl.triggered(interrupts, ADXL345_DOUBLE_TAP)){
-    Serial.println("*** DOUBLE TAP ***");
-     //add code here to do when a 2X tap is sensed
-  }
-
-  // Tap Detection
-  if(adxl.triggered(interrupts, ADXL345_SINGLE_TAP)){
-    Serial.println("*** TAP ***");
-     //add code here to do when a tap is sensed
-  }
+    PROFILE_BEGIN(PROFILE_SITE_ADXL_ISR);
+    AccelQueueInterrupt(GetAcquisitionTick());
+    PROFILE_END(PROFILE_SITE_ADXL_ISR);
 }
 
-FASTRUN void ADXL_ISR2() {}
+FASTRUN void ADXL_ISR2() { accel_fifo_flag = true; } // watermark, no SPI here, loop() may be mid transfer
 
 void InitADXL()
 {
@@ -141,8 +147,9 @@ void InitADXL()
     pinMode(pinADXL_INT2, INPUT); // Setup interrupt pins for ADXL
 
     adxl.powerOn();                     // Power on the ADXL345
+    adxl.beginConfig();                 // the settings below only go to the register shadow until commitConfig
 
-    adxl.setRangeSetting(2);            // Give the range settings
+    adxl.setRangeSetting(ADXL_RANGE_G); // Give the range settings
                                       // Accepted values are 2g, 4g, 8g or 16g
                                       // Higher Values = Wider Measurement Range
                                       // Lower Values = Greater Sensitivity (false, sensitivity is fixed at full resolution)
@@ -176,22 +183,24 @@ void InitADXL()
                                                         // This library may have a problem using INT2 pin. Default to INT1 pin.
 
     // Turn on Interrupts for each mode (1 == ON, 0 == OFF)
+    // all on INT1, they go into the event stream as EVENT_RECORD_ACCEL annotations
     adxl.InactivityINT(0);
-    adxl.ActivityINT(0);
-    adxl.FreeFallINT(0);
+    adxl.ActivityINT(1);
+    adxl.FreeFallINT(1);
     adxl.doubleTapINT(1);
-    adxl.singleTapINT(0);
-    adxl.watermarkINT(0); // enable watermark interrupt
+    adxl.singleTapINT(1);
+    adxl.watermarkINT(1); // enable watermark interrupt
     adxl.setInterruptMapping(ADXL345_INT_WATERMARK_BIT, ADXL345_INT2_PIN);
 
-    //attachInterrupt(digitalPinToInterrupt(pinADXL_INT2), ADXL_ISR2, RISING);   // Attach Interrupt
-    attachInterrupt(digitalPinToInterrupt(pinADXL_INT1), ADXL_ISR, RISING);   // Attach Interrupt
-    // put device in FIFO mode, attach an interrupt to watermark bit to service FIFO
-    // put FIFO servicing code into ISR
-    //adxl.setFifoMode(ADXL345_FIFO_FIFO, ADXL_FIFO_THR, ADXL345_FIFO_INT2);
-    //adxl.setRate(3200);//6.25);
+    // stream mode keeps the newest 32 samples, the watermark on INT2 asks loop() for a burst read
+    adxl.setRate(ADXL_ODR_HZ);
+    adxl.setFifoMode(ADXL345_FIFO_STREAM, ADXL_FIFO_THR, ADXL345_FIFO_INT2); // the trigger pin only matters in trigger mode
     adxl.setFullResBit(true); // seems not to do anything in 2G mode which makes sense given datasheet
-    delay(10);
+    adxl.commitConfig();      // one SPI burst per register block
+
+    attachInterrupt(digitalPinToInterrupt(pinADXL_INT2), ADXL_ISR2, RISING);   // Attach Interrupt
+    attachInterrupt(digitalPinToInterrupt(pinADXL_INT1), ADXL_ISR, RISING);   // Attach Interrupt
+#if BOOT_PRINT_ADXL
     Serial.print("Rate: ");
     Serial.println(adxl.getRate());
     Serial.print("FIFOMODE: ");
@@ -201,7 +210,6 @@ void InitADXL()
         Serial.println("ON");
     else
         Serial.println("OFF");
-    delay(10);
     if(adxl.isInterruptEnabled(ADXL345_INT_WATERMARK_BIT)){
         Serial.println("WATERMARK ENABLED");
     } else {
@@ -211,18 +219,12 @@ void InitADXL()
     Serial.println(adxl.getInterruptSource(),HEX);
     Serial.print("INT MAPPING: ");
     Serial.println(adxl.getInterruptMapping(ADXL345_INT_WATERMARK_BIT),HEX);
+#endif
     //adxl345 is by default in full power mode,
     //watermark interrupt is enabled on INT2
 
-    // read the ADXL345 FIFO until it's empty to prime the loop. Otherwise doesn't work
-    // due to rising edge Interrupt race condition
-    int16_t x_arr[32];
-    int16_t y_arr[32];
-    int16_t z_arr[32];
-
-    for(int i = 0; i < 32; i++){
-        adxl.readAccel(&x_arr[0], &y_arr[0], &z_arr[0]);
-    }
+    // empty the FIFO to prime the loop, INT2 would stay high without a rising edge otherwise
+    DrainAccelFifo();
 }
 
 //////////////////////////////////////////////
@@ -243,50 +245,108 @@ FASTRUN void pdb_isr()
     PDB0_SC &= ~PDB_SC_PDBIF; // clears interrupt
 }
 
+volatile static uint8_t  ecg_slot_tick = 0; // PDB ticks spent on the current mux channel
+volatile static uint8_t  ecg_slot_settle = MUX_SETTLE_TICKS; // conversions at the start of the slot discarded while the lead settles
+volatile static uint32_t ecg_slot_sum = 0;
 FASTRUN void dmaBuffer0_isr()
 {
-    if(current_channel == 0)
-    {
-        accel_read_sample_flag = true;
+    uint8_t tick = ecg_slot_tick;
+    ecg_slot_tick = (tick + 1) % PDB_TICKS_PER_ECG_SLOT;
+    if(tick >= ecg_slot_settle) { ecg_slot_sum += (uint16_t) dmaBuffer0->buffer()[0]; }
+    if(ecg_slot_tick != 0)
+    { // ADC0 converts on every PDB tick alongside ADC1, the settled conversions of each mux slot are averaged into one sample
+        dmaBuffer0->dmaChannel->clearInterrupt();
+        return;
     }
-    volatile uint16_t adc_sample_in = (uint16_t) dmaBuffer0->buffer()[0];
-    samples[buffer_num][current_channel][samples_idx[current_channel]] = adc_sample_in;// Store most recent ADC val into Ping-Pong Buffer
+    PROFILE_BEGIN(PROFILE_SITE_DMA0_ISR); // only the kept conversions, the skipped ones are a few cycles
+    volatile uint16_t adc_sample_in = (uint16_t) (ecg_slot_sum / (PDB_TICKS_PER_ECG_SLOT - ecg_slot_settle));
+    ecg_slot_sum = 0;
+    frames[ecg_frame_seq % PINGPONG_BUFFER_COUNT]->ecg[current_channel][samples_idx[current_channel]] = adc_sample_in;// Store most recent ADC val into Ping-Pong Buffer
+#if !DAC_BLOCK_CONTROL
     HandleNewEcgSampleDac(current_channel, adc_sample_in);
-    samples_idx[current_channel] = (samples_idx[current_channel] + 1) % CHANNEL_BUFFER_LENGTH; // Move samples buffer indices
+#endif
+    samples_idx[current_channel] = (samples_idx[current_channel] + 1) % FRAME_SAMPLES_PER_CHANNEL; // Move samples buffer indices
 
-    // If an entire buffer has just filled up then switch buffers and set the flag to process the full buffer
+    // If an entire buffer has just filled up then move on to the next one, loop() picks it up once the PCG is done too
     if ( (current_channel == (NUM_ECG_CHANNELS - 1)) && (samples_idx[current_channel] == 0))
     {
-        buffer_num = (buffer_num == 1) ? 0 : 1; // Switch buffer_num between 0 and 1
-        if(buffer_ready_flag){ Serial.println("BUFFER OVERRUN!"); }
-        buffer_ready_flag = true;
+        ecg_frame_seq++;
+        // the ISR now writes frame ecg_frame_seq, the slot of processed_frame_seq once it is PINGPONG_BUFFER_COUNT ahead
+        if((ecg_frame_seq - processed_frame_seq) >= PINGPONG_BUFFER_COUNT){ CKLOG(LOGMSG_ECG_OVERRUN, ecg_frame_seq, processed_frame_seq); }
+#if ACCEL_PRESENT
+        accel_fifo_flag = true; // every frame gets the samples up to its end, the watermark alone would leave most frames without one
+#endif
+        scanApplyPendingLayout((SampleFrame_t*) frames[ecg_frame_seq % PINGPONG_BUFFER_COUNT]); // before the DAC, a slot's new lead comes with its offset
+#if DAC_BLOCK_CONTROL
+        // offset steps from loop() take effect on a frame boundary, the frame records what it was taken with
+        dacApplyPendingValues();
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            frames[ecg_frame_seq % PINGPONG_BUFFER_COUNT]->dac[ch][0] = getDacValue(ch);
+        }
+#endif
     }
     current_channel = (current_channel + 1) % NUM_ECG_CHANNELS;
-    switchNextMuxChannel(current_channel); // this used to be at the end of dmaBuffer0_isr but don't know why it wasnt earlier
+    ecg_slot_settle = switchNextMuxChannel(GetScanSlotLead(current_channel)); // this used to be at the end of dmaBuffer0_isr but don't know why it wasnt earlier
+#if !DAC_HW_SEQUENCE
     dacWriteNextChannel(current_channel); // Write the drive value for the next channel to DAC0
+#endif
     dmaBuffer0->dmaChannel->clearInterrupt(); // Update the internal buffer positions
+    PROFILE_END(PROFILE_SITE_DMA0_ISR);
 }
 
-volatile static uint8_t  downsamplingCounter =  0; // only save every NUM_ECG_CHANNELS'th sample
-volatile static uint32_t downsampleAverage = 0;
 FASTRUN void dmaBuffer1_isr()
-{ // ISR for reading DMA from ADC1
-    downsampleAverage += (uint16_t) dmaBuffer1->buffer()[0];
-    if( downsamplingCounter == 0 )
+{ // ISR for a block of PCG_DMA_BLOCK samples from ADC1, runs below the ECG DMA priority
+    PROFILE_BEGIN(PROFILE_SITE_DMA1_ISR);
+    uint32_t daddr = (uint32_t) dmaBuffer1.TCD->DADDR;
+    dmaBuffer1.clearInterrupt();
+
+    // DMA is now filling the half DADDR points into, decimate the other one
+    const volatile int16_t * block = (daddr < (uint32_t) &bufferAdc1[PCG_DMA_BLOCK]) ? &bufferAdc1[PCG_DMA_BLOCK] : &bufferAdc1[0];
+    uint16_t pcg_out[PCG_SAMPLES_PER_DMA_BLOCK];
+    uint8_t numOut = DecimatePcgBlock(block, pcg_out); // fewer while the filter delay is dropped at startup
+
+    for(uint8_t i = 0; i < numOut; i++)
     {
-        samples[buffer_num_pcg][PCG_STREAM_SLOT][samples_idx[PCG_STREAM_SLOT]] = downsampleAverage/NUM_ECG_CHANNELS; // Store most recent ADC val into Ping-Pong Buffer
-        downsampleAverage = 0;
-        samples_idx[PCG_STREAM_SLOT] = (samples_idx[PCG_STREAM_SLOT] + 1) % CHANNEL_BUFFER_LENGTH;                   // Move samples buffer indices
-        // If an entire buffer has just filled up then switch buffers and set the flag to process the full buffer
-        if( samples_idx[PCG_STREAM_SLOT] == 0 )
+        frames[pcg_frame_seq % PINGPONG_BUFFER_COUNT]->pcg[pcg_samples_idx] = pcg_out[i]; // Store decimated PCG into Ping-Pong Buffer
+        pcg_samples_idx = (pcg_samples_idx + 1) % PCG_SAMPLES_PER_FRAME; // Move samples buffer indices
+        // If an entire buffer has just filled up then move on to the next one
+        if( pcg_samples_idx == 0 )
         {
-            buffer_num_pcg = (buffer_num_pcg == 1) ? 0 : 1; // Switch buffer_num_pcg between 0 and 1
-            //if(pcg_buffer_ready_flag){ Serial.println("BUFFER OVERRUN! PCG"); }
-            pcg_buffer_ready_flag = true;
+            pcg_frame_seq++;
         }
     }
-    downsamplingCounter = (downsamplingCounter + 1) % NUM_ECG_CHANNELS;
-    dmaBuffer1->dmaChannel->clearInterrupt(); // Update the internal buffer positions
+    PROFILE_END(PROFILE_SITE_DMA1_ISR);
+}
+
+#if ((F_BUS) / (ADC_PDB_FREQ_HZ)) > 65536
+#error "ADC_PDB_FREQ_HZ too low for the PDB modulus without a prescaler"
+#endif
+// Both ADCs are triggered from PDB0 so ECG and PCG share one tick counter.
+// ADC1 converts half a tick after ADC0, so the two never convert at the
+// same instant and the PCG filter delay comes out to a whole number of ticks
+void StartSharedPdb()
+{
+    const uint32_t mod = (F_BUS) / (ADC_PDB_FREQ_HZ);
+    ADC0_SC2 |= ADC_SC2_ADTRG; // hardware trigger, the conversions setup by startSingleRead now wait for the PDB
+    ADC1_SC2 |= ADC_SC2_ADTRG;
+    SIM_SCGC6 |= SIM_SCGC6_PDB;
+    PDB0_SC = 0;
+    PDB0_SC = PDB_SC_TRGSEL(15) | PDB_SC_PDBEN | PDB_SC_CONT; // software trigger, continuous, no prescaler
+    PDB0_MOD = mod - 1;
+    PDB0_IDLY = 1;
+    PDB0_CH0DLY0 = 0;       // ADC0 (ECG) at the start of the tick
+    PDB0_CH1DLY0 = mod / 2; // ADC1 (PCG) half a tick later
+#if DAC_HW_SEQUENCE
+    // DAC0 steps once per tick after the ECG conversion, entry channel * PDB_TICKS_PER_ECG_SLOT + slot tick is live during that tick
+    PDB0_DACINT0 = (mod * PDB_DAC_TRIGGER_PERCENT) / 100;
+    PDB0_DACINTC0 = PDB_DACINTC_TOE;
+    dacStartSequence(PDB_TICKS_PER_ECG_SLOT * current_channel + ecg_slot_tick); // the ISR's next tick
+#endif
+    PDB0_SC |= PDB_SC_LDOK;
+    PDB0_CH0C1 = PDB_CHnC1_TOS(1) | PDB_CHnC1_EN(1); // pre-trigger A from the channel delay
+    PDB0_CH1C1 = PDB_CHnC1_TOS(1) | PDB_CHnC1_EN(1);
+    PDB0_SC |= PDB_SC_SWTRIG; // start ticking
 }
 
 FASTRUN void batteryLow_isr()
@@ -297,35 +357,234 @@ FASTRUN void batteryLow_isr()
 
 SimpleTCP stcp;
 IntervalTimer tcpTimer;
+IntervalTimer ledTimer;
+bool link_started = false; // the host's Start Ack arrived, nothing goes out over the link before it
+bool boot_reported = false; // EVENT_RECORD_BOOT is queued
+
+// Startup LED display, stops its own timer once it is over
+void bootLed_isr()
+{
+    if(!StepCkLedSweep()) { ledTimer.end(); }
+}
+
+// The command space changes the link through these, see CardioKitCommandSpace.h
+extern "C" uint32_t SetLinkPacingMicros(uint32_t micros)
+{
+    SimpleTCP::SetInterBufferTimeMicros(micros);
+    tcpTimer.update(micros); // takes effect from the next tick
+    return SimpleTCP::GetInterBufferTimeMicros();
+}
+
+extern "C" uint32_t GetLinkPacingMicros()
+{
+    return SimpleTCP::GetInterBufferTimeMicros();
+}
+
+extern "C" uint32_t GetLinkBacklog()
+{
+    return stcp.GetOutputBacklog();
+}
+
+extern "C" uint32_t GetLinkDroppedCommands()
+{
+    return stcp.GetDroppedCommands();
+}
+
+// Queue the event frame in its own packet once it is due
+void SendEventFrame()
+{
+    if(!link_started) { return; } // records wait in the event frame, or are dropped once it's full
+    const uint8_t * events;
+    uint16_t eventBytes = TakeEventFrame(&events);
+    if(eventBytes > 0)
+    {
+        stcp.HandleSendingSamplesTimer((uint8_t*) events, eventBytes);
+    }
+}
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+// Move a few log entries out of the ring, never waits on USB or the link so entries stay queued instead
+void DrainLog()
+{
+    LogEntry_t entry;
+    char line[LOG_LINE_BYTES];
+    for(uint8_t n = 0; n < LOG_DRAIN_PER_LOOP; n++)
+    {
+        bool usb = Serial.dtr(); // a terminal is open
+        if(usb && Serial.availableForWrite() < LOG_LINE_BYTES) { return; }
+        if(!EventRecordFits(LOG_RECORD_BYTES)) { return; } // goes on after the next event frame is sent
+        if(!TakeLogEntry(&entry)) { return; }
+        if(usb) { Serial.write(line, FormatLogEntry(&entry, line, sizeof(line))); }
+        QueueLogRecord(&entry); // rides with the next event frame
+    }
+}
+#endif
+
+// Stage times since reset over USB Serial, the same as EVENT_RECORD_BOOT
+void PrintBootTimes()
+{
+    uint32_t last = 0;
+    for(uint8_t i = 0; i < NUM_BOOT_STAGES; i++)
+    {
+        BootStage_t stage = (BootStage_t) i;
+        Serial.print("Boot ");
+        Serial.print(GetBootStageName(stage));
+        Serial.print(": ");
+        Serial.print(GetBootMicros(stage));
+        Serial.print("us +");
+        Serial.print(GetBootMicros(stage) - last);
+        Serial.println("us");
+        last = GetBootMicros(stage);
+    }
+}
+
+#if PROFILE_ENABLE
+// Print every probe site with its headroom against its deadline and its share of the CPU over USB Serial
+void PrintProfile()
+{
+    Serial.print("Power mode ");
+    Serial.print(GetMonitorMode());
+    Serial.print(" core ");
+    Serial.print(F_CPU / 1000000);
+    Serial.print("MHz duty:");
+    Serial.print(GetPowerDutyPermille() / 10.0f, 1);
+    Serial.print("% est core:");
+    Serial.print(GetPowerCoreDeciMa() / 10.0f, 1);
+    Serial.println("mA");
+    for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+    { // compare DAC_BLOCK_CONTROL 0 and 1 on the same subject
+        Serial.print("DAC ch");
+        Serial.print(ch);
+        Serial.print(" value:");
+        Serial.print(getDacValue(ch));
+        Serial.print(" saturated samples:");
+        Serial.print(getDacSaturatedSamples(ch));
+        Serial.print(" reslews:");
+        Serial.println(getDacReslews(ch));
+    }
+
+    Serial.print("Profile at F_CPU ");
+    Serial.print(F_CPU / 1000000);
+    Serial.print("MHz over ");
+    Serial.print((uint32_t) (GetProfileElapsedCycles() / (F_CPU / 1000)));
+    Serial.println("ms");
+    for(uint8_t i = 0; i < NUM_PROFILE_SITES; i++)
+    {
+        ProfileSite_t site = (ProfileSite_t) i;
+        ProfileStats_t snapshot;
+        GetProfileSnapshot(site, &snapshot); // counted up to here, the ISRs go on while it prints
+        const ProfileStats_t * s = &snapshot;
+        Serial.print(GetProfileSiteName(site));
+        Serial.print(" n:");
+        Serial.print(s->count);
+        if(s->count == 0) { Serial.println(); continue; }
+        Serial.print(" min/mean/max:");
+        Serial.print(s->min);
+        Serial.print("/");
+        Serial.print((uint32_t) (s->total / s->count));
+        Serial.print("/");
+        Serial.print(s->max);
+        if(GetProfileBudget(site) > 0)
+        {
+            Serial.print(" budget:");
+            Serial.print(GetProfileBudget(site));
+            Serial.print(" headroom:");
+            Serial.print(GetProfileHeadroomPercent(site, s));
+            Serial.print("%");
+        }
+        Serial.print(" load:");
+        Serial.print(GetProfileLoadPermille(s) / 10.0f, 1);
+        Serial.println("%");
+        // log2 histogram, "b:n" is n runs of 2^b to 2^(b+1)-1 cycles
+        Serial.print("    ");
+        for(uint8_t b = 0; b < PROFILE_HIST_BUCKETS; b++)
+        {
+            if(s->hist[b] == 0) { continue; }
+            Serial.print(b);
+            Serial.print(":");
+            Serial.print(s->hist[b]);
+            Serial.print(" ");
+        }
+        Serial.println();
+    }
+}
+#endif
+
+// The ADC library starts calibrating when it is constructed, a cached calibration that passes its check replaces it
+void CalibrateAdc(ADC_Module * module, uint8_t n)
+{
+    if(WarmStartAbortAdcCal(n))
+    {
+        module->wait_for_cal(); // returns at once, but clears the library's calibrating state
+        if(WarmStartRestoreAdcCal(n))
+        {
+            module->resetError(); // the aborted calibration flagged CALF
+            return;
+        }
+        module->calibrate();
+    }
+    module->wait_for_cal();
+    WarmStartCaptureAdcCal(n);
+}
 
 void setup()
 {
+    BootMark(BOOT_STAGE_SETUP);
     Serial.begin(2000000);
     Serial4.begin(460800);
-
+    pinMode(pinESP_OFF, OUTPUT);
+    digitalWriteFast(pinESP_OFF, LOW); // Enable ESP12 first, it takes the longest to come up and boots while the rest is set up
+    BootMark(BOOT_STAGE_ESP);
+
+    InitializeCkLeds(); // the display goes on from ledTimer, setup() doesn't wait for it
+    ledTimer.begin(bootLed_isr, CKLED_SWEEP_MS * 1000);
+    ledTimer.priority(255); // lowest priority
+#if PROFILE_ENABLE
+    initializeProfile();
+#endif
+    initializePower();
+    initializeWarmStart(); // the cached calibration, before anything it seeds
+
+    initializeAccel();
+    WarmStartSeedAccel();
     InitADXL();
+    BootMark(BOOT_STAGE_ACCEL);
+#if MOTION_CANCEL_ENABLE
+    initializeMotion();
+#endif
+    initializeFilters();
+#if QRS_DETECT_ENABLE
+    initializeQrsDetector();
+#endif
+#if MONITOR_MODE_ENABLE
+    initializeMonitor();
+#endif
 
     stcp = SimpleTCP();
+    for(int i = 0; i < PINGPONG_BUFFER_COUNT; i++)
+    {
+        frames[i] = (SampleFrame_t*) SimpleTCP::AcquirePacketSlot();
+        InitializeFrame((SampleFrame_t*) frames[i]); // write the layout descriptor, only the samples change while a slot is reused
+    }
+
     tcpTimer.begin(SimpleTCP::SetTxReadyFlag, SimpleTCP::GetInterBufferTimeMicros());
     tcpTimer.priority(255); // lowest priority
 
-    InitializeCkLeds();
-    ControlCkLed(CKLED_STATUS, HIGH);
     pinMode(pinBAT_LO, INPUT);
     attachInterrupt(digitalPinToInterrupt(pinBAT_LO), batteryLow_isr, CHANGE); // Handle Vbat Low shutdown
 
     // ECG-Related
-    pinMode(pinESP_OFF, OUTPUT);
-    delay(5);
-    digitalWriteFast(pinESP_OFF, LOW); // Enable ESP12
-
     pinMode(pinADC_ECG, INPUT); // ECG ADC input pin
 
     initializeMux(); // Enable MUXs and set to initial channel
     initializeDac(); // Enable DAC0 pin and set resolution to 12-bits
+    WarmStartSeedDac(); // each slot starts where it settled before the reset, or slews as usual if that's off
+    initializeScan(); // every slot on its own lead until leads are ranked
+    BootMark(BOOT_STAGE_FRONTEND);
 
     // Setup ADC0 with PDB (Programmable Delay Block) and DMA (Direct Memory Access)
     //adc->setReference(ADC_REFERENCE::REF_EXT, ADC_0); // This dramatically increases noise, do not do it, leave on REF_3V3
+    CalibrateAdc(adc->adc0, 0);
     adc->setAveraging(ADC_AVERAGING); // set number of averages
     adc->setResolution(ADC_RESOLUTION); // set bits of resolution
     adc->setConversionSpeed(ADC_CONVERSION_SPEED::HIGH_SPEED_16BITS);//ADC_CONVERSION_SPEED::HIGH_SPEED_16BITS);
@@ -336,20 +595,32 @@ void setup()
     adc->adc0->startSingleRead(pinADC_ECG); // get 16-bit single-ended values 0x0 [0V] to 0xFFFF [3.3V]
         //adc->startSingleDifferential(pinADC_ECG, pinADC_n); // Call this to setup everything before the pdb starts
     adc->enableInterrupts(ADC_0);         // As in adc_pdb example
-    adc->adc0->startPDB(ADC_PDB_FREQ_HZ); // As in adc_pdb example
     //NVIC_ENABLE_IRQ(IRQ_PDB); // Enables pdb_isr, without this it doesn't get called, other effects unknown
 
     // Setup ADC1 with PDB (Programmable Delay Block) and DMA (Direct Memory Access)
+    CalibrateAdc(adc->adc1, 1);
     adc->setAveraging(ADC_AVERAGING, ADC_1); // set number of averages
     adc->setResolution(ADC_RESOLUTION, ADC_1); // set bits of resolution
     adc->setConversionSpeed(ADC_CONVERSION_SPEED::MED_SPEED, ADC_1); // change the conversion speed
     adc->setSamplingSpeed(ADC_SAMPLING_SPEED::MED_SPEED, ADC_1); // change the sampling speed
     adc->enableDMA(ADC_1); // Enable DMA on ADC1
-    dmaBuffer1->start(&dmaBuffer1_isr);
+    initializePcgDecimator();
+    dmaBuffer1.begin(true);
+    dmaBuffer1.source((volatile uint16_t &) ADC1_RA);
+    dmaBuffer1.destinationBuffer((volatile uint16_t *) bufferAdc1, sizeof(bufferAdc1));
+    dmaBuffer1.interruptAtHalf();
+    dmaBuffer1.interruptAtCompletion();
+    dmaBuffer1.triggerAtHardwareEvent(DMAMUX_SOURCE_ADC1);
+    dmaBuffer1.attachInterrupt(dmaBuffer1_isr);
+    NVIC_SET_PRIORITY(IRQ_DMA_CH0 + dmaBuffer1.channel, 160); // decimation must never delay the ECG mux/DAC ISR (128)
+    dmaBuffer1.enable();
     adc->adc1->stopPDB();
     adc->adc1->startSingleRead(pinADC_PCG); // call this to setup everything before the pdb starts
     adc->enableInterrupts(ADC_1);
-    adc->adc1->startPDB(ADC_PDB_FREQ_HZ);
+    BootMark(BOOT_STAGE_ADC);
+    StartSharedPdb(); // both ADCs start on the same tick
+    WarmStartAcquisitionStarted();
+    BootMark(BOOT_STAGE_ACQUISITION);
 
     adc->printError(); // Print errors, if any.
     adc->resetError(); // Print errors, if any.
@@ -359,42 +630,181 @@ void setup()
     //DAC0_C0 &= ~DAC_C0_DACRFS; // 1.2V
 	//DAC1_C0 &= ~DAC_C0_DACRFS;
 
-    // wait until Start Ack is received to send data
-    // Start Ack also synchronizes world time to internal micros() counter
-    // via stcp.microsecondOffset
-    stcp.HandleFindingStartAck();
-    // at this point, the start Ack has been received
-    // and stcp.microsecondOffset is established
-    // proceed with data transfer
-    //Serial.println("Code Proceeding to TX");
+    // the Start Ack is picked up by loop() while the frames already run the DAC loop, see PollLink
+    BootMark(BOOT_STAGE_SETUP_DONE);
+}
+
+// Look for the host's Start Ack until it arrives, it also synchronizes world time to the
+// internal micros() counter via stcp.microsecondOffset. Frames only go out from here on
+void PollLink()
+{
+    if(!link_started)
+    {
+        if(!stcp.PollStartAck()) { return; }
+        link_started = true;
+        BootMark(BOOT_STAGE_LINK);
+        SendEventFrame(); // the records queued while waiting (DAC steps, warm start) have likely filled it
+        if(Serial.dtr()) { PrintBootTimes(); } // a terminal is open
+    }
+    if(!boot_reported) { boot_reported = QueueBootRecord(); } // rides with the next event frame, tried again every loop until it fits
+}
+
+// Both ADCs have filled the frame and the FIFO burst started at its end is in
+bool FrameReady()
+{
+    if((ecg_frame_seq <= processed_frame_seq) || (pcg_frame_seq <= processed_frame_seq)) { return false; }
+#if ACCEL_PRESENT
+    if(accel_fifo_flag || accel_fifo_busy) { return false; } // ~5 entries, ~200us
+#endif
+    return true;
+}
+
+// Anything loop() would act on right now, it sleeps until the next interrupt otherwise
+// At most one PDB tick (250us), the ECG DMA interrupt wakes it on every tick
+bool WorkPending()
+{
+    if(ACCEL_PRESENT && !accel_fifo_busy && (accel_fifo_flag || digitalReadFast(pinADXL_INT2))) { return true; } // the level too, in case an edge was missed
+    if(ACCEL_PRESENT && !accel_int_busy && (accel_int_result != 0 || AccelInterruptsPending() || digitalReadFast(pinADXL_INT1))) { return true; }
+    if(FrameReady()) { return true; }
+#if PROFILE_ENABLE
+    if(Serial.available()) { return true; }
+#endif
+    if(!link_started) { return Serial4.available() > 0; } // the Start Ack, PollLink takes what has arrived
+    return stcp.HasPendingWork();
 }
 
 void loop()
 {
-    if(ACCEL_PRESENT && accel_read_sample_flag) {
-        ReadAccelIntoArray();
-        accel_read_sample_flag = false;
+    PollLink();
+#if PROFILE_ENABLE
+    if(Serial.available() && (Serial.read() == 'p'))
+    { // 'p' on USB Serial asks for a dump, same as CKCMD_PROFILE_DUMP
+        RequestProfileDump(0);
+    }
+    if(TakeProfileDumpRequest())
+    {
+        PrintProfile();
     }
+#endif
 
-    if(buffer_ready_flag && pcg_buffer_ready_flag)
-    { // A buffer is ready to transmit, add it to the outbound queue
-        buffer_ready_flag = false; // clear the flag
-        pcg_buffer_ready_flag = false; // clear the flag
+    if(ACCEL_PRESENT && (accel_fifo_flag || digitalReadFast(pinADXL_INT2))) {
+        DrainAccelFifo();
+    }
+    if(ACCEL_PRESENT && !accel_int_busy && accel_int_result != 0) {
+        if(accel_int_result > 0) { // a dropped read leaves its edges queued for the next one
+            AccelReportInterrupt(accel_int_edges, accel_int_regs[ADXL345_INT_SOURCE - ADXL345_ACT_TAP_STATUS],
+                accel_int_regs[0], accel_int_regs[ADXL345_INT_ENABLE - ADXL345_ACT_TAP_STATUS]);
+        }
+        accel_int_result = 0;
+    }
+    if(ACCEL_PRESENT && !accel_int_busy && (AccelInterruptsPending() || digitalReadFast(pinADXL_INT1))) {
+        ReadAccelIntSource();
+    }
 
-        // samples stores 16-bit values, send it a twice-as-long 8-bit buffer
-        // function can only handle sending max 718 bytes at a time currently
-        stcp.HandleSendingSamplesTimer((uint8_t*) &samples[(buffer_num + 1) % 2][0][0], CHANNEL_BUFFER_LENGTH * NUM_DATA_STREAMS * 2);
+    if(FrameReady())
+    { // add the frame to the outbound queue
+        uint32_t frame_seq = processed_frame_seq;
+
+        // slow streams are sampled once per frame here rather than at the ECG rate
+        SampleFrame_t * frame = (SampleFrame_t*) frames[frame_seq % PINGPONG_BUFFER_COUNT];
+        frame->battery[0] = digitalRead(pinBAT_LO);
+#if ACCEL_PRESENT
+        AccelFillFrame(frame);
+#endif
+#if DAC_BLOCK_CONTROL
+        PROFILE_BEGIN(PROFILE_SITE_DAC_CONTROL);
+        updateDacControlValues2(&frame->ecg[0][0], FRAME_SAMPLES_PER_CHANNEL); // raw ECG, before FilterFrame
+        PROFILE_END(PROFILE_SITE_DAC_CONTROL);
+#else
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            frame->dac[ch][0] = getDacValue(ch);
+        }
+#endif
+        QueueDacStepRecords(frame, frame_seq * FRAME_TICKS); // in-band even when the frame itself is dropped
+#if MOTION_CANCEL_ENABLE
+        MotionProcessFrame(frame, frame_seq * FRAME_TICKS); // after the DAC loop, which needs the raw ECG, QRS and the filters get the cleaned one
+#endif
+#if QRS_DETECT_ENABLE
+        BeatEvent_t beats[QRS_MAX_BEATS_PER_FRAME];
+        uint8_t numBeats = QrsProcessFrame(frame, beats); // has its own bandpass, runs on the ECG before FilterFrame
+        for(uint8_t i = 0; i < numBeats; i++)
+        {
+            QueueEventRecord(EVENT_RECORD_BEAT, &beats[i], sizeof(BeatEvent_t));
+        }
+#endif
+        ScanProcessFrame(frame); // after the DAC loop and QRS, a new layout goes live two frames on
+        WarmStartProcessFrame(); // times the first frame with every slot settled and saves what they settled on
+        bool sendFrame = link_started; // before the Start Ack a frame only runs the DAC loop, its slot is reused
+#if MONITOR_MODE_ENABLE
+        // on a backed up link only features go out until it recovers
+        sendFrame = (MonitorProcessFrame(frame, beats, numBeats, stcp.GetOutputBacklog()) == MONITOR_MODE_RAW) && link_started;
+        SetPowerMode(GetMonitorMode()); // the duty is reported per mode
+#endif
+        FilterFrame(frame); // replaces raw ECG/PCG if the host selected filtered output, keeps running so it is settled when raw frames resume
+
+        // the frame goes out in its own slot, a fresh one takes its place for frame_seq + PINGPONG_BUFFER_COUNT
+        // if every slot is still held for retransmits the frame is dropped and its slot reused
+        uint16_t frameBytes = FinalizeFrame(frame, frame_seq * FRAME_TICKS); // the counter and tick advance over dropped frames so the host sees the gap
+        SampleFrame_t * nextFrame = sendFrame ? (SampleFrame_t*) SimpleTCP::AcquirePacketSlot() : NULL;
+        if(nextFrame != NULL)
+        {
+            InitializeFrame(nextFrame);
+            PROFILE_BEGIN(PROFILE_SITE_SEND_SAMPLES);
+            stcp.SendPacketSlot((uint8_t*) frame, frameBytes); // header only, no copy
+            PROFILE_END(PROFILE_SITE_SEND_SAMPLES);
+            frames[frame_seq % PINGPONG_BUFFER_COUNT] = nextFrame;
+        }
+#if PROFILE_ENABLE
+        QueueProfileRecords(PROFILE_RECORDS_PER_FRAME); // a dump requested by the host goes out a few sites per frame
+#endif
+        HandlePowerReport();
+
+        // batched event records ride in their own packet after the samples
+        SendEventFrame();
+        processed_frame_seq = frame_seq + 1; // the ISRs may reuse the buffer now
+
+        // packets go stale over seconds, scanning the output buffer once a frame is plenty
+        PROFILE_BEGIN(PROFILE_SITE_ERASE_OLD);
+        stcp.EraseOldOutputBuffers(); // clean up output buffers that are stale
+        PROFILE_END(PROFILE_SITE_ERASE_OLD);
     }
 
-    // Check and handle an incoming command from cloud host
-    uint32_t cmd_in = stcp.ReadAlternateCommand();
-    if(cmd_in != 0)
+    // Handle every queued command from cloud host, a batch is always readable whole so it lands between two processed frames
+    SimpleTCP::command cmd_in;
+    bool handled = false;
+    while(link_started && stcp.TakeCommand(&cmd_in))
     {
-        stcp.ClearAlternateCommand();
-        HandleCloudCommand(cmd_in);
+        CkCommand_t cmd = { cmd_in.id, cmd_in.opcode, cmd_in.argType, cmd_in.index, cmd_in.value, cmd_in.receivedMicros, cmd_in.droppedBefore, cmd_in.batched };
+        if(!EventRecordFits(CKCMD_RESPONSE_BYTES)) { SendEventFrame(); } // a long batch answers in more than one packet
+        HandleCloudCommand(&cmd);
+        handled = true;
+    }
+    if(handled)
+    {
+        SendEventFrame(); // the responses go out now, not with the next frame
+    }
+    UpdateCkLeds();
+
+    if(link_started)
+    { // until then Serial4 belongs to PollLink
+        PROFILE_BEGIN(PROFILE_SITE_HANDLE_NACKS);
+        stcp.HandleNacks(); // process incoming nacks
+        PROFILE_END(PROFILE_SITE_HANDLE_NACKS);
+        PROFILE_BEGIN(PROFILE_SITE_TRANSMIT);
+        stcp.Transmit(); // try to send data out via stcp
+        PROFILE_END(PROFILE_SITE_TRANSMIT);
     }
 
-    stcp.HandleNacks(); // process incoming nacks
-    stcp.Transmit(); // try to send data out via stcp
-    stcp.EraseOldOutputBuffers(); // clean up output buffers that are stale
+#if LOG_LEVEL > LOG_LEVEL_NONE
+    if(!WorkPending()) { DrainLog(); } // only with time to spare, ISR entries wait in the ring until then
+#endif
+
+#if POWER_IDLE_ENABLE
+    // Checked with interrupts off so a flag set by an ISR after the check still wakes the WFI,
+    // the ISR then runs as soon as they are enabled again
+    __disable_irq();
+    if(!WorkPending()) { PowerWaitForInterrupt(); }
+    __enable_irq();
+#endif
 }
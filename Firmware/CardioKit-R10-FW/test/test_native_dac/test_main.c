@@ -0,0 +1,259 @@
+/*  *********************************************
+    test_main.c
+    CardioKitDacCore against a simulated ECG front end on the build host
+
+    pio test -e native
+
+    Each channel's input, in ADC counts before the offset DAC, is run
+    through the controller in every mode with the ADC modelled as
+        adc = clamp(input + gain * dac, 0, 65535)
+    and a gain the controller has to learn. The block modes are timed
+    like the device: loop() gets a frame SIM_LOOP_SCANS into the next
+    one, slew steps apply right there and tracking steps at the next
+    frame start. Per mode it counts
+        re-slews         DacChannel_t.reslews
+        saturated        samples outside SETTLED_RANGE_*
+        stepped frames   frames whose DAC value changed inside them,
+                         the host can't take their offset out
+    and prints them, so the modes can be compared on the same input.
+
+    The synthetic sessions always run: SIM_SESSIONS of SIM_SECONDS on
+    NUM_ECG_CHANNELS channels of 0.05Hz and 0.3Hz baseline wander, a
+    QRS train, noise, an electrode offset jump on every channel every
+    JUMP_SECONDS and gains of 10-40 counts per code. The scores are
+    summed over all of them, one session alone is at the mercy of where
+    its jumps land.
+
+    Recordings are CSV at CORE_SAMPLE_FREQ in test/data/dac (or
+    $DAC_RECORDINGS_DIR), one channel per file and one sample per line:
+    the absolute input the host writes to ck<time>_abs.csv
+    (AbsoluteEcgCounts). They are run with a gain of RECORDED_GAIN_Q4.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+ *  *********************************************/
+#include <unity.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CardioKitDacCore.h"
+
+#define SIM_SESSIONS     8
+#define SIM_SECONDS      300
+#define SIM_LOOP_SCANS   2    // scans into the next frame loop() has the last one processed
+#define JUMP_SECONDS     20
+#define JUMP_MAX_COUNTS  20000 // electrode offset after a jump, either way from where the slew left it
+#define RECORDED_GAIN_Q4 (24 << DAC_GAIN_SHIFT)
+#define N FRAME_SAMPLES_PER_CHANNEL
+
+enum { MODE_PER_SAMPLE, MODE_REACTIVE, MODE_PREDICTIVE, NUM_MODES };
+static const char * ModeNames[NUM_MODES] = { "per-sample", "block reactive", "block predictive" };
+
+typedef struct
+{
+    uint32_t reslews;
+    uint32_t saturated;
+    uint32_t samples;
+    uint32_t steppedFrames;
+    uint32_t frames;
+} Score_t;
+
+static uint32_t Lcg = 1;
+static double Uniform()
+{
+    Lcg = Lcg * 1664525u + 1013904223u;
+    return (Lcg >> 8) / 16777216.0;
+}
+
+static uint16_t Adc(int32_t input, uint16_t dac, int32_t gainQ4)
+{
+    int32_t v = input + (gainQ4 * dac) / (1 << DAC_GAIN_SHIFT);
+    return (uint16_t) ((v < 0) ? 0 : ((v > 65535) ? 65535 : v));
+}
+
+// The ISR's per sample slew, a step is used from the channel's next sample on
+static void RunPerSample(const int32_t * input, uint32_t length, int32_t gainQ4, Score_t * s)
+{
+    DacChannel_t c;
+    DacCoreReset(&c, 0);
+    for(uint32_t k = 0; (k + 1) * N <= length; k++)
+    {
+        uint16_t first = c.value;
+        uint8_t stepped = 0;
+        for(uint32_t i = 0; i < N; i++)
+        {
+            DacCoreSample(&c, Adc(input[k * N + i], c.value, gainQ4));
+            stepped |= (c.value != first);
+        }
+        s->steppedFrames += stepped;
+        s->frames++;
+    }
+    s->reslews   += c.reslews;
+    s->saturated += c.saturatedSamples;
+    s->samples   += (length / N) * N;
+}
+
+// The block controller, fed each frame while the next one is acquired
+static void RunBlock(const int32_t * input, uint32_t length, int32_t gainQ4, uint8_t predictive, Score_t * s)
+{
+    DacChannel_t c;
+    uint16_t prev[N];
+    uint16_t cur[N];
+    DacCoreReset(&c, predictive);
+    for(uint32_t k = 0; (k + 1) * N <= length; k++)
+    {
+        DacCoreLatch(&c); // the ECG ISR on the frame start
+        uint16_t drive = c.value;
+        uint8_t stepped = 0;
+        for(uint32_t i = 0; i < N; i++)
+        {
+            if(k > 0 && i == SIM_LOOP_SCANS)
+            {
+                DacCoreBlock(&c, prev, N);
+                stepped |= (c.value != drive);
+                drive = c.value;
+            }
+            cur[i] = Adc(input[k * N + i], drive, gainQ4);
+        }
+        DacCoreCountSaturated(&c, cur, N);
+        memcpy(prev, cur, sizeof(prev));
+        s->steppedFrames += stepped;
+        s->frames++;
+    }
+    s->reslews   += c.reslews;
+    s->saturated += c.saturatedSamples;
+    s->samples   += (length / N) * N;
+}
+
+static void RunModes(const int32_t * input, uint32_t length, int32_t gainQ4, Score_t scores[NUM_MODES])
+{
+    RunPerSample(input, length, gainQ4, &scores[MODE_PER_SAMPLE]);
+    RunBlock(input, length, gainQ4, 0, &scores[MODE_REACTIVE]);
+    RunBlock(input, length, gainQ4, 1, &scores[MODE_PREDICTIVE]);
+}
+
+static void PrintScores(const char * name, const Score_t scores[NUM_MODES])
+{
+    printf("%s:\n", name);
+    for(uint8_t m = 0; m < NUM_MODES; m++)
+    {
+        const Score_t * s = &scores[m];
+        printf("  %-17s re-slews %4u  saturated %.3f%%  stepped frames %.2f%%\n", ModeNames[m], s->reslews,
+               100.0 * s->saturated / s->samples, 100.0 * s->steppedFrames / s->frames);
+    }
+}
+
+// Wander, beats and noise on an electrode offset that jumps every JUMP_SECONDS, in counts before the DAC
+static void MakeChannel(int32_t * input, uint32_t length, int32_t gainQ4)
+{
+    double start = 800.0 + 2500.0 * Uniform(); // the DAC code that cancels the offset at first
+    double offset = 32768.0 - (gainQ4 * start) / (1 << DAC_GAIN_SHIFT);
+    double home = offset;
+    double slowPhase = 2.0 * M_PI * Uniform();
+    double breathPhase = 2.0 * M_PI * Uniform();
+    uint32_t jumpAt = (uint32_t) ((JUMP_SECONDS * Uniform()) * CORE_SAMPLE_FREQ);
+    double beatAt = Uniform();
+    for(uint32_t n = 0; n < length; n++)
+    {
+        double t = (double) n / CORE_SAMPLE_FREQ;
+        if(n == jumpAt)
+        {
+            offset = home + JUMP_MAX_COUNTS * (2.0 * Uniform() - 1.0);
+            jumpAt += JUMP_SECONDS * CORE_SAMPLE_FREQ;
+        }
+        if(t > beatAt + 0.5) { beatAt += 0.8 + 0.2 * Uniform(); }
+        double v = offset + 12000.0 * sin(2.0 * M_PI * 0.05 * t + slowPhase) + 3000.0 * sin(2.0 * M_PI * 0.3 * t + breathPhase)
+                 + 2500.0 * exp(-pow((t - beatAt) / 0.012, 2)) + 300.0 * (Uniform() + Uniform() + Uniform() - 1.5);
+        input[n] = (int32_t) lround(v);
+    }
+}
+
+static uint32_t LoadChannel(const char * path, int32_t ** input)
+{
+    FILE * f = fopen(path, "r");
+    if(f == NULL) { return 0; }
+    uint32_t capacity = 1 << 16;
+    uint32_t length = 0;
+    *input = malloc(capacity * sizeof(int32_t));
+    char line[64];
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        long v;
+        if(line[0] == '#' || sscanf(line, "%ld", &v) < 1) { continue; }
+        if(length == capacity)
+        {
+            capacity *= 2;
+            *input = realloc(*input, capacity * sizeof(int32_t));
+        }
+        (*input)[length++] = (int32_t) v;
+    }
+    fclose(f);
+    return length;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_synthetic_sessions()
+{
+    uint32_t length = SIM_SECONDS * CORE_SAMPLE_FREQ;
+    int32_t * input = malloc(length * sizeof(int32_t));
+    Score_t scores[NUM_MODES] = {{0}};
+    for(uint32_t session = 0; session < SIM_SESSIONS; session++)
+    {
+        Lcg = session + 1;
+        for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++)
+        {
+            int32_t gainQ4 = (int32_t) ((10.0 + 30.0 * Uniform()) * (1 << DAC_GAIN_SHIFT));
+            MakeChannel(input, length, gainQ4);
+            RunModes(input, length, gainQ4, scores);
+        }
+    }
+    free(input);
+    PrintScores("synthetic", scores);
+
+    // the block loop only re-slews when a whole block saturates, and keeps its steps on frame starts
+    TEST_ASSERT_TRUE(scores[MODE_REACTIVE].reslews < scores[MODE_PER_SAMPLE].reslews);
+    TEST_ASSERT_TRUE(scores[MODE_REACTIVE].steppedFrames < scores[MODE_PER_SAMPLE].steppedFrames);
+    // stepping ahead of the trend saturates and re-slews less than waiting for the rails
+    TEST_ASSERT_TRUE(scores[MODE_PREDICTIVE].saturated < scores[MODE_REACTIVE].saturated);
+    TEST_ASSERT_TRUE(scores[MODE_PREDICTIVE].reslews <= scores[MODE_REACTIVE].reslews);
+}
+
+void test_recorded_sessions()
+{
+    const char * dirName = getenv("DAC_RECORDINGS_DIR");
+    if(dirName == NULL) { dirName = "test/data/dac"; }
+    DIR * dir = opendir(dirName);
+    if(dir == NULL) { TEST_IGNORE_MESSAGE("no recordings directory"); }
+
+    Score_t scores[NUM_MODES] = {{0}};
+    uint32_t recordings = 0;
+    struct dirent * entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if(len < 5 || strcmp(entry->d_name + len - 4, ".csv") != 0) { continue; }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dirName, entry->d_name);
+        int32_t * input = NULL;
+        uint32_t length = LoadChannel(path, &input);
+        if(length >= N) { RunModes(input, length, RECORDED_GAIN_Q4, scores); recordings++; }
+        free(input);
+    }
+    closedir(dir);
+    if(recordings == 0) { TEST_IGNORE_MESSAGE("no recordings in the recordings directory"); }
+    PrintScores("all recordings", scores);
+    TEST_ASSERT_TRUE(scores[MODE_REACTIVE].steppedFrames <= scores[MODE_PER_SAMPLE].steppedFrames);
+    TEST_ASSERT_TRUE(scores[MODE_PREDICTIVE].saturated <= scores[MODE_REACTIVE].saturated);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_synthetic_sessions);
+    RUN_TEST(test_recorded_sessions);
+    return UNITY_END();
+}
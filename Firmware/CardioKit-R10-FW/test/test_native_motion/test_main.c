@@ -0,0 +1,350 @@
+/*  *********************************************
+    test_main.c
+    CardioKitMotionCore run over ECG with accelerometer on the build host
+
+    pio test -e native
+
+    The canceller runs frame by frame the way MotionProcessFrame drives
+    it, in MOTION_MODE_CANCEL, over one ECG slot and the accelerometer
+    interpolated onto its scans.
+
+    A synthetic session knows its clean ECG: the artifact is a filter of
+    the accelerometer over walking-like bursts with still stretches in
+    between. It has to come down by MOTION_MIN_DB_SYNTH once the filter
+    has learned, and the ECG of the still stretches must be left alone.
+
+    Recorded sessions in test/data/motion (or $MOTION_RECORDINGS_DIR) have no
+    clean ECG. Each is CSV at CORE_SAMPLE_FREQ, one scan per line:
+        ecg,x,y,z
+    ecg is the raw slot sample (offset binary, 32768 is 0V, before any
+    filter), x, y, z the reading at the middle of the scan in 1/16 count
+    like AccelSampleAt returns. Lines starting with # are skipped. The
+    artifact is taken as the high-passed ECG power of the moving frames
+    over that of the still ones, it has to come down by
+    MOTION_MIN_DB_RECORDED. Recordings need both.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+ *  *********************************************/
+#include <unity.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CardioKitMotionCore.h"
+
+#define MOTION_MIN_DB_SYNTH    10.0
+#define MOTION_MIN_DB_RECORDED 6.0
+#define MOTION_MAX_STILL_RMS   20.0 // counts left in the still stretches, the subtracted prediction's slow high-pass dies away there
+#define MOTION_LEARN_SECONDS   60   // not scored, the filter is still converging
+#define MOTION_ODR_HZ          50   // the ADXL rate the synthetic readings are interpolated from
+#define COUNTS_PER_G_Q4        4096 // 1/16 count per g, 2g full resolution
+#define SYNTH_SECONDS          600
+#define MOVE_SECONDS           40   // every minute, MOVE_SECONDS of walking then still
+#define HP_POLE                0.99 // scoring high-pass, ~0.6Hz at 400Hz
+
+typedef struct
+{
+    uint16_t * ecg;
+    int32_t  (*xyz)[3];
+    int32_t  * clean;   // synthetic only, the ECG without the artifact
+    uint32_t   length;
+} Session_t;
+
+static uint32_t Lcg = 1;
+static double Uniform()
+{
+    Lcg = Lcg * 1664525u + 1013904223u;
+    return (Lcg >> 8) / 16777216.0;
+}
+
+static double Gaussian()
+{
+    return Uniform() + Uniform() + Uniform() + Uniform() - 2.0;
+}
+
+// Beats like test_native_qrs over baseline wander, the artifact of the chest moving added on top.
+// The accelerometer is made at MOTION_ODR_HZ and interpolated onto the scans like AccelSampleAt does
+static void MakeSynthetic(Session_t * s)
+{
+    s->length = SYNTH_SECONDS * CORE_SAMPLE_FREQ;
+    s->ecg    = calloc(s->length, sizeof(uint16_t));
+    s->xyz    = calloc(s->length, sizeof(*s->xyz));
+    s->clean  = calloc(s->length, sizeof(int32_t));
+    double * v = calloc(s->length, sizeof(double));
+    Lcg = 4242;
+
+    for(double t = 0.4; t < SYNTH_SECONDS - 1.0; t += 0.7 + 0.2 * Uniform())
+    {
+        double amp = 3000.0 + 1000.0 * Uniform();
+        int32_t r = (int32_t) lround(t * CORE_SAMPLE_FREQ);
+        for(int32_t i = -(CORE_SAMPLE_FREQ / 2); i < (CORE_SAMPLE_FREQ / 2); i++)
+        {
+            if(r + i < 0 || (uint32_t) (r + i) >= s->length) { continue; }
+            double dt = (double) i / CORE_SAMPLE_FREQ;
+            v[r + i] += amp * (exp(-pow(dt / 0.012, 2)) + 0.12 * exp(-pow((dt + 0.16) / 0.025, 2))
+                             + 0.3 * exp(-pow((dt - 0.28) / 0.05, 2)));
+        }
+    }
+
+    // Walking: a step rate around 1.8Hz, each axis its own phase and harmonics, plus sway
+    uint32_t odrSamples = SYNTH_SECONDS * MOTION_ODR_HZ + 2;
+    double (*odr)[3] = calloc(odrSamples, sizeof(*odr));
+    double phase = 0.0, sway = 0.0;
+    for(uint32_t k = 0; k < odrSamples; k++)
+    {
+        double t = (double) k / MOTION_ODR_HZ;
+        uint8_t walking = fmod(t, 60.0) < MOVE_SECONDS;
+        phase += 2.0 * M_PI * (1.8 + 0.2 * sin(2.0 * M_PI * t / 17.0)) / MOTION_ODR_HZ;
+        sway  += 0.05 * Gaussian() - 0.02 * sway;
+        double g = walking ? 1.0 : 0.0;
+        odr[k][0] = g * (0.15 * sin(phase) + 0.05 * sin(2.0 * phase + 1.0) + 0.05 * sway);
+        odr[k][1] = g * (0.10 * sin(phase + 2.1) + 0.04 * sin(3.0 * phase) - 0.04 * sway);
+        odr[k][2] = 1.0 + g * (0.25 * sin(2.0 * phase + 0.7) + 0.06 * sway);
+        for(uint8_t a = 0; a < 3; a++)
+        {
+            odr[k][a] += 0.004 * Gaussian(); // ~1 count of sensor noise
+        }
+    }
+
+    // The electrode artifact follows the acceleration with a little lag, gravity only offsets it
+    static const double Coupling[3][3] = { { 1.0, 0.4, 0.0 }, { -0.6, 0.0, 0.3 }, { 0.7, -0.4, 0.0 } }; // counts per 1/16 count, lag 0, 8, 16 scans
+    double (*a)[3] = calloc(s->length, sizeof(*a));
+    for(uint32_t n = 0; n < s->length; n++)
+    {
+        double at = (double) n * MOTION_ODR_HZ / CORE_SAMPLE_FREQ + 0.5 * MOTION_ODR_HZ / CORE_SAMPLE_FREQ;
+        uint32_t k = (uint32_t) at;
+        double f = at - k;
+        for(uint8_t ax = 0; ax < 3; ax++)
+        {
+            a[n][ax] = (1.0 - f) * odr[k][ax] + f * odr[k + 1][ax];
+            s->xyz[n][ax] = (int32_t) lround(a[n][ax] * COUNTS_PER_G_Q4);
+        }
+    }
+    for(uint32_t n = 0; n < s->length; n++)
+    {
+        double artifact = 0.0;
+        for(uint8_t ax = 0; ax < 3; ax++)
+        {
+            for(uint8_t lag = 0; lag < 3; lag++)
+            {
+                uint32_t m = (n >= 8u * lag) ? n - 8u * lag : 0;
+                double dyn = a[m][ax] - ((ax == 2) ? 1.0 : 0.0);
+                artifact += Coupling[ax][lag] * dyn * COUNTS_PER_G_Q4;
+            }
+        }
+        double sec = (double) n / CORE_SAMPLE_FREQ;
+        double clean = v[n] + 1500.0 * sin(2.0 * M_PI * 0.2 * sec) + 20.0 * Gaussian();
+        s->clean[n] = (int32_t) lround(32768.0 + clean);
+        s->ecg[n]   = (uint16_t) lround(32768.0 + clean + artifact);
+    }
+    free(a);
+    free(odr);
+    free(v);
+}
+
+static uint8_t LoadSession(const char * path, Session_t * s)
+{
+    memset(s, 0, sizeof(*s));
+    FILE * f = fopen(path, "r");
+    if(f == NULL) { return 0; }
+    uint32_t capacity = 1 << 16;
+    s->ecg = malloc(capacity * sizeof(uint16_t));
+    s->xyz = malloc(capacity * sizeof(*s->xyz));
+    char line[96];
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        unsigned ecg;
+        int x, y, z;
+        if(line[0] == '#' || sscanf(line, "%u,%d,%d,%d", &ecg, &x, &y, &z) < 4) { continue; }
+        if(s->length == capacity)
+        {
+            capacity *= 2;
+            s->ecg = realloc(s->ecg, capacity * sizeof(uint16_t));
+            s->xyz = realloc(s->xyz, capacity * sizeof(*s->xyz));
+        }
+        s->ecg[s->length] = (ecg > 0xFFFF) ? 0xFFFF : ecg;
+        s->xyz[s->length][0] = x;
+        s->xyz[s->length][1] = y;
+        s->xyz[s->length][2] = z;
+        s->length++;
+    }
+    fclose(f);
+    return s->length >= FRAME_SAMPLES_PER_CHANNEL;
+}
+
+static void FreeSession(Session_t * s)
+{
+    free(s->ecg);
+    free(s->xyz);
+    free(s->clean);
+}
+
+// The session through the canceller a frame at a time, every slot fed the same samples. Returns the cancelled ECG
+static uint16_t * RunCanceller(const Session_t * s, uint32_t * frames)
+{
+    static MotionCore_t core;
+    static uint16_t ecg[NUM_ECG_CHANNELS][FRAME_SAMPLES_PER_CHANNEL];
+    static int32_t xyz[FRAME_SAMPLES_PER_CHANNEL][3];
+    const uint16_t dac[NUM_ECG_CHANNELS] = {0};
+    uint16_t * out = calloc(s->length, sizeof(uint16_t));
+    MotionCoreReset(&core);
+
+    *frames = s->length / FRAME_SAMPLES_PER_CHANNEL;
+    for(uint32_t fr = 0; fr < *frames; fr++)
+    {
+        uint32_t base = fr * FRAME_SAMPLES_PER_CHANNEL;
+        for(uint16_t i = 0; i < FRAME_SAMPLES_PER_CHANNEL; i++)
+        {
+            for(uint8_t ch = 0; ch < NUM_ECG_CHANNELS; ch++) { ecg[ch][i] = s->ecg[base + i]; }
+            memcpy(xyz[i], s->xyz[base + i], sizeof(xyz[i]));
+        }
+        MotionCoreFrame(&core, ecg, dac, xyz, 1);
+        memcpy(&out[base], ecg[0], sizeof(ecg[0]));
+    }
+    return out;
+}
+
+// Power of x through a one pole high-pass over [from, to), per scan
+static double HighPassedPower(const int32_t * x, uint32_t from, uint32_t to)
+{
+    double y = 0.0, sum = 0.0;
+    for(uint32_t n = from + 1; n < to; n++)
+    {
+        y = HP_POLE * y + x[n] - x[n - 1];
+        sum += y * y;
+    }
+    return sum / (to - from);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_synthetic_session()
+{
+    Session_t s;
+    uint32_t frames;
+    MakeSynthetic(&s);
+    uint16_t * out = RunCanceller(&s, &frames);
+    uint32_t scored = frames * FRAME_SAMPLES_PER_CHANNEL;
+
+    // artifact left over, as the difference to the clean ECG, on the walking and the still stretches
+    int32_t * before = calloc(scored, sizeof(int32_t));
+    int32_t * after  = calloc(scored, sizeof(int32_t));
+    for(uint32_t n = 0; n < scored; n++)
+    {
+        before[n] = (int32_t) s.ecg[n] - s.clean[n];
+        after[n]  = (int32_t) out[n] - s.clean[n];
+    }
+    double movingBefore = 0.0, movingAfter = 0.0, stillAfter = 0.0;
+    uint32_t movingRuns = 0, stillRuns = 0;
+    for(uint32_t start = MOTION_LEARN_SECONDS * CORE_SAMPLE_FREQ; start + 60 * CORE_SAMPLE_FREQ <= scored; start += 60 * CORE_SAMPLE_FREQ)
+    { // skip the first seconds of each stretch, the high-passes settle there
+        uint32_t moveFrom = start + 2 * CORE_SAMPLE_FREQ, moveTo = start + MOVE_SECONDS * CORE_SAMPLE_FREQ;
+        uint32_t stillFrom = moveTo + 5 * CORE_SAMPLE_FREQ, stillTo = start + 60 * CORE_SAMPLE_FREQ;
+        movingBefore += HighPassedPower(before, moveFrom, moveTo);
+        movingAfter  += HighPassedPower(after, moveFrom, moveTo);
+        stillAfter   += HighPassedPower(after, stillFrom, stillTo);
+        movingRuns++;
+        stillRuns++;
+    }
+    double reductionDb = 10.0 * log10(movingBefore / movingAfter);
+    double stillRms = sqrt(stillAfter / stillRuns);
+    printf("synthetic: %u frames, artifact %.0f counts rms walking, reduced by %.1fdB, %.1f counts rms left still\n",
+           frames, sqrt(movingBefore / movingRuns), reductionDb, stillRms);
+    free(before);
+    free(after);
+    free(out);
+    FreeSession(&s);
+    TEST_ASSERT_TRUE(movingRuns > 0);
+    TEST_ASSERT_TRUE(reductionDb >= MOTION_MIN_DB_SYNTH);
+    TEST_ASSERT_TRUE(stillRms <= MOTION_MAX_STILL_RMS);
+}
+
+void test_recorded_sessions()
+{
+    const char * dirName = getenv("MOTION_RECORDINGS_DIR");
+    if(dirName == NULL) { dirName = "test/data/motion"; }
+    DIR * dir = opendir(dirName);
+    if(dir == NULL) { TEST_IGNORE_MESSAGE("no motion recordings directory"); }
+
+    double powerBefore = 0.0, powerAfter = 0.0;
+    uint32_t sessions = 0;
+    struct dirent * entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if(len < 5 || strcmp(entry->d_name + len - 4, ".csv") != 0) { continue; }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dirName, entry->d_name);
+        Session_t s;
+        if(!LoadSession(path, &s)) { FreeSession(&s); continue; }
+        uint32_t frames;
+        uint16_t * out = RunCanceller(&s, &frames);
+        uint32_t scored = frames * FRAME_SAMPLES_PER_CHANNEL;
+        uint32_t from = MOTION_LEARN_SECONDS * CORE_SAMPLE_FREQ;
+        if(scored <= from) { from = 0; }
+
+        // the moving stretches are the ones where the reference would let the filter adapt
+        int32_t * in = calloc(scored, sizeof(int32_t));
+        int32_t * cancelled = calloc(scored, sizeof(int32_t));
+        int32_t * ref[3];
+        for(uint8_t ax = 0; ax < 3; ax++) { ref[ax] = calloc(scored, sizeof(int32_t)); }
+        for(uint32_t n = 0; n < scored; n++)
+        {
+            in[n] = s.ecg[n];
+            cancelled[n] = out[n];
+            for(uint8_t ax = 0; ax < 3; ax++) { ref[ax][n] = s.xyz[n][ax]; }
+        }
+        double before = 0.0, after = 0.0, still = 0.0;
+        uint32_t movingFrames = 0, stillFrames = 0;
+        for(uint32_t fr = from / FRAME_SAMPLES_PER_CHANNEL; fr < frames; fr++)
+        {
+            uint32_t a = fr * FRAME_SAMPLES_PER_CHANNEL, b = a + FRAME_SAMPLES_PER_CHANNEL;
+            double refPower = 0.0;
+            for(uint8_t ax = 0; ax < 3; ax++) { refPower += HighPassedPower(ref[ax], a, b) * MOTION_TAPS; }
+            if(refPower >= MOTION_MIN_POWER)
+            {
+                before += HighPassedPower(in, a, b);
+                after  += HighPassedPower(cancelled, a, b);
+                movingFrames++;
+            }
+            else if(refPower < MOTION_MIN_POWER / 16)
+            {
+                still += HighPassedPower(in, a, b);
+                stillFrames++;
+            }
+        }
+        if(movingFrames > 0 && stillFrames > 0)
+        { // what moving adds over the still ECG is the artifact
+            double excessBefore = before / movingFrames - still / stillFrames;
+            double excessAfter  = after / movingFrames - still / stillFrames;
+            printf("%s: %u frames, %u moving, artifact %.0f counts rms, %.0f left\n", entry->d_name, frames, movingFrames,
+                   sqrt(fmax(excessBefore, 0.0)), sqrt(fmax(excessAfter, 0.0)));
+            powerBefore += movingFrames * excessBefore;
+            powerAfter  += movingFrames * excessAfter;
+        }
+        free(in);
+        free(cancelled);
+        for(uint8_t ax = 0; ax < 3; ax++) { free(ref[ax]); }
+        free(out);
+        FreeSession(&s);
+        sessions++;
+    }
+    closedir(dir);
+    if(sessions == 0) { TEST_IGNORE_MESSAGE("no motion recordings in the recordings directory"); }
+    if(powerBefore <= 0.0) { TEST_IGNORE_MESSAGE("no recording has both moving and still stretches"); }
+    // an artifact cancelled below the scatter of the still ECG power leaves a negative excess
+    double reductionDb = (powerAfter > 0.0) ? 10.0 * log10(powerBefore / powerAfter) : 99.0;
+    printf("all recordings: artifact down %.1fdB\n", reductionDb);
+    TEST_ASSERT_TRUE(reductionDb >= MOTION_MIN_DB_RECORDED);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_synthetic_session);
+    RUN_TEST(test_recorded_sessions);
+    return UNITY_END();
+}
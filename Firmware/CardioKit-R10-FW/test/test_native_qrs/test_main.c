@@ -0,0 +1,284 @@
+/*  *********************************************
+    test_main.c
+    CardioKitQrsCore scored against annotated ECG on the build host
+
+    pio test -e native
+
+    Every recording in test/data (or $QRS_RECORDINGS_DIR) is run through
+    one detector lead and scored against its annotations: a detection
+    within QRS_MATCH_MS of an annotated R peak is a true positive, an
+    annotation without one a miss. Beats in the learning period are not
+    scored. Recordings are CSV at CORE_SAMPLE_FREQ, one scan per line:
+        sample,beat
+    sample is offset binary like the ADC (32768 is 0V), beat is 1 on the
+    annotated R peak and 0 otherwise. Lines starting with # are skipped.
+    MIT-BIH and similar databases convert to this by resampling to
+    CORE_SAMPLE_FREQ and marking the nearest scan of each beat label.
+
+    A synthetic record with its own annotations always runs, so the
+    test means something without any recordings. It runs a second time
+    with DAC sized offset steps added, told to the detector through
+    QrsOffsetStep the way CardioKitQrs does on a DAC change.
+
+    Development Environment Specifics:
+    Atom + PlatformIO
+ *  *********************************************/
+#include <unity.h>
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CardioKitQrsCore.h"
+
+#define QRS_MATCH_MS        150
+#define QRS_SCORE_FROM      ((QRS_LEARN_SCANS) + QRS_SCANS(500)) // the first beat after learning has no RR yet
+#define QRS_MIN_SE_RECORDED 0.97
+#define QRS_MIN_PP_RECORDED 0.97
+#define QRS_MIN_SE_SYNTH    0.99
+#define QRS_MIN_PP_SYNTH    0.99
+#define QRS_MAX_ERR_MS      25 // mean |detected - annotated| on the synthetic record
+#define SYNTH_SECONDS       300
+#define STEP_SECONDS        30    // a DAC step this often, tracking steps are far rarer
+#define STEP_MIN_COUNTS     4000  // offset change of one step
+#define STEP_MAX_COUNTS     12000
+#define QRS_MIN_SE_STEPS    0.98  // a beat under a step's QRS_STEP_SCANS is lost
+
+typedef struct
+{
+    uint16_t * samples;
+    uint8_t  * beats;
+    uint8_t  * steps;  // 1 on the scans the offset stepped on, NULL without steps
+    uint32_t   length;
+} Recording_t;
+
+typedef struct
+{
+    uint32_t annotated;
+    uint32_t truePositives;
+    uint32_t detected;
+    double   errorScansSum;
+} Score_t;
+
+static uint32_t Lcg = 1;
+static double Uniform()
+{
+    Lcg = Lcg * 1664525u + 1013904223u;
+    return (Lcg >> 8) / 16777216.0;
+}
+
+// Gaussian bumps for P, QRS and T over a wandering, noisy baseline with mains,
+// RR from 0.5s to 1.2s with an early wide beat every so often
+static void MakeSynthetic(Recording_t * rec)
+{
+    rec->length  = SYNTH_SECONDS * CORE_SAMPLE_FREQ;
+    rec->samples = calloc(rec->length, sizeof(uint16_t));
+    rec->beats   = calloc(rec->length, sizeof(uint8_t));
+    rec->steps   = NULL;
+    double * v   = calloc(rec->length, sizeof(double));
+    Lcg = 12345;
+
+    double t = 0.4;
+    double rr = 0.8;
+    while(t < SYNTH_SECONDS - 1.0)
+    {
+        uint8_t ectopic = Uniform() < 0.05;
+        double amp   = 3000.0 + 3000.0 * Uniform();
+        double width = ectopic ? 0.030 : 0.012;
+        uint32_t r = (uint32_t) lround(t * CORE_SAMPLE_FREQ);
+        rec->beats[r] = 1;
+        for(int32_t i = -QRS_SCANS(400); i < QRS_SCANS(600); i++)
+        {
+            int32_t k = (int32_t) r + i;
+            if(k < 0 || (uint32_t) k >= rec->length) { continue; }
+            double dt = (double) i / CORE_SAMPLE_FREQ;
+            v[k] += 0.12 * amp * exp(-pow((dt + 0.16) / 0.025, 2));              // P
+            v[k] += (ectopic ? -1.0 : 1.0) * amp * exp(-pow(dt / width, 2));    // QRS
+            v[k] -= 0.15 * amp * exp(-pow((dt - 0.02) / 0.008, 2));            // S
+            v[k] += 0.30 * amp * exp(-pow((dt - (ectopic ? 0.32 : 0.28)) / 0.05, 2)); // T
+        }
+        rr += 0.1 * (Uniform() - 0.5);
+        if(rr < 0.5) { rr = 0.5; }
+        if(rr > 1.2) { rr = 1.2; }
+        t += (Uniform() < 0.05) ? 0.6 * rr : rr; // the next one early now and then
+    }
+    for(uint32_t n = 0; n < rec->length; n++)
+    {
+        double s = (double) n / CORE_SAMPLE_FREQ;
+        double x = v[n] + 2500.0 * sin(2.0 * M_PI * 0.25 * s) + 400.0 * sin(2.0 * M_PI * 60.0 * s)
+                 + 600.0 * (Uniform() + Uniform() + Uniform() - 1.5);
+        rec->samples[n] = (uint16_t) lround(32768.0 + x);
+    }
+    free(v);
+}
+
+// Step the offset every STEP_SECONDS, up or down at random as far as the ADC range allows
+static void AddOffsetSteps(Recording_t * rec)
+{
+    rec->steps = calloc(rec->length, sizeof(uint8_t));
+    int32_t offset = 0;
+    for(uint32_t n = 0; n < rec->length; n++)
+    {
+        if(n > 0 && n % (STEP_SECONDS * CORE_SAMPLE_FREQ) == 0)
+        {
+            int32_t step = STEP_MIN_COUNTS + (int32_t) ((STEP_MAX_COUNTS - STEP_MIN_COUNTS) * Uniform());
+            offset += (offset > 0 || (offset == 0 && Uniform() < 0.5)) ? -step : step;
+            rec->steps[n] = 1;
+        }
+        int32_t v = (int32_t) rec->samples[n] + offset;
+        rec->samples[n] = (uint16_t) ((v < 0) ? 0 : ((v > 65535) ? 65535 : v));
+    }
+}
+
+static uint8_t LoadRecording(const char * path, Recording_t * rec)
+{
+    FILE * f = fopen(path, "r");
+    if(f == NULL) { return 0; }
+    uint32_t capacity = 1 << 16;
+    rec->samples = malloc(capacity * sizeof(uint16_t));
+    rec->beats   = malloc(capacity * sizeof(uint8_t));
+    rec->steps   = NULL;
+    rec->length  = 0;
+    char line[64];
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        unsigned sample, beat = 0;
+        if(line[0] == '#' || sscanf(line, "%u,%u", &sample, &beat) < 1) { continue; }
+        if(rec->length == capacity)
+        {
+            capacity *= 2;
+            rec->samples = realloc(rec->samples, capacity * sizeof(uint16_t));
+            rec->beats   = realloc(rec->beats, capacity * sizeof(uint8_t));
+        }
+        rec->samples[rec->length] = (sample > 0xFFFF) ? 0xFFFF : sample;
+        rec->beats[rec->length]   = beat != 0;
+        rec->length++;
+    }
+    fclose(f);
+    return rec->length > 0;
+}
+
+static void FreeRecording(Recording_t * rec)
+{
+    free(rec->samples);
+    free(rec->beats);
+    free(rec->steps);
+}
+
+// Run one lead over the recording and match its beats to the annotations, each annotation matches once
+static void ScoreRecording(const Recording_t * rec, Score_t * score)
+{
+    static QrsLead_t lead;
+    QrsResetLead(&lead);
+    uint8_t * matched = calloc(rec->length, sizeof(uint8_t));
+    const int32_t window = QRS_SCANS(QRS_MATCH_MS);
+    // the last beats may still be inside the detector's delay when the recording ends
+    uint32_t scoreUntil = (rec->length > (uint32_t) QRS_SCANS(1000)) ? rec->length - QRS_SCANS(1000) : 0;
+
+    for(uint32_t n = 0; n < rec->length; n++)
+    {
+        BeatEvent_t beat;
+        if(rec->steps != NULL && rec->steps[n]) { QrsOffsetStep(&lead); }
+        if(!QrsStepLead(&lead, 0, rec->samples[n], n, &beat)) { continue; }
+        if(beat.scan < QRS_SCORE_FROM || beat.scan >= scoreUntil) { continue; }
+        score->detected++;
+        int32_t best = -1;
+        for(int32_t k = (int32_t) beat.scan - window; k <= (int32_t) beat.scan + window; k++)
+        {
+            if(k < 0 || (uint32_t) k >= rec->length || !rec->beats[k] || matched[k]) { continue; }
+            if(best < 0 || abs(k - (int32_t) beat.scan) < abs(best - (int32_t) beat.scan)) { best = k; }
+        }
+        if(best >= 0)
+        {
+            matched[best] = 1;
+            score->truePositives++;
+            score->errorScansSum += abs(best - (int32_t) beat.scan);
+        }
+    }
+    for(uint32_t n = QRS_SCORE_FROM; n < scoreUntil; n++)
+    {
+        score->annotated += rec->beats[n];
+    }
+    free(matched);
+}
+
+static void PrintScore(const char * name, const Score_t * s)
+{
+    printf("%s: %u annotated, %u detected, Se %.4f +P %.4f, mean error %.1fms\n", name, s->annotated, s->detected,
+           (double) s->truePositives / s->annotated, (double) s->truePositives / s->detected,
+           1000.0 * s->errorScansSum / s->truePositives / CORE_SAMPLE_FREQ);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_synthetic_record()
+{
+    Recording_t rec;
+    Score_t score = {0};
+    MakeSynthetic(&rec);
+    ScoreRecording(&rec, &score);
+    FreeRecording(&rec);
+    PrintScore("synthetic", &score);
+    TEST_ASSERT_TRUE(score.annotated > 200);
+    TEST_ASSERT_TRUE((double) score.truePositives / score.annotated >= QRS_MIN_SE_SYNTH);
+    TEST_ASSERT_TRUE((double) score.truePositives / score.detected >= QRS_MIN_PP_SYNTH);
+    TEST_ASSERT_TRUE(1000.0 * score.errorScansSum / score.truePositives / CORE_SAMPLE_FREQ <= QRS_MAX_ERR_MS);
+}
+
+void test_offset_steps()
+{
+    Recording_t rec;
+    Score_t score = {0};
+    MakeSynthetic(&rec);
+    AddOffsetSteps(&rec);
+    ScoreRecording(&rec, &score);
+    FreeRecording(&rec);
+    PrintScore("synthetic with offset steps", &score);
+    TEST_ASSERT_TRUE((double) score.truePositives / score.annotated >= QRS_MIN_SE_STEPS);
+    TEST_ASSERT_TRUE((double) score.truePositives / score.detected >= QRS_MIN_PP_SYNTH);
+}
+
+void test_recorded_sessions()
+{
+    const char * dirName = getenv("QRS_RECORDINGS_DIR");
+    if(dirName == NULL) { dirName = "test/data"; }
+    DIR * dir = opendir(dirName);
+    if(dir == NULL) { TEST_IGNORE_MESSAGE("no recordings directory"); }
+
+    Score_t total = {0};
+    uint32_t recordings = 0;
+    struct dirent * entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if(len < 5 || strcmp(entry->d_name + len - 4, ".csv") != 0) { continue; }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dirName, entry->d_name);
+        Recording_t rec;
+        if(!LoadRecording(path, &rec)) { continue; }
+        Score_t score = {0};
+        ScoreRecording(&rec, &score);
+        FreeRecording(&rec);
+        PrintScore(entry->d_name, &score);
+        total.annotated     += score.annotated;
+        total.truePositives += score.truePositives;
+        total.detected      += score.detected;
+        total.errorScansSum += score.errorScansSum;
+        recordings++;
+    }
+    closedir(dir);
+    if(recordings == 0) { TEST_IGNORE_MESSAGE("no recordings in the recordings directory"); }
+    PrintScore("all recordings", &total);
+    TEST_ASSERT_TRUE((double) total.truePositives / total.annotated >= QRS_MIN_SE_RECORDED);
+    TEST_ASSERT_TRUE((double) total.truePositives / total.detected >= QRS_MIN_PP_RECORDED);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_synthetic_record);
+    RUN_TEST(test_offset_steps);
+    RUN_TEST(test_recorded_sessions);
+    return UNITY_END();
+}
@@ -37,6 +37,8 @@ class SimpleTCP {
 	int					resendRequestTail;
 	static final long	resendRequestMinimumGap = 350*1000*1000; // Minimum amount of time in nanoseconds between identical resend nacks
 																 // 350 seems to be sweet spot
+	int					nextCommandId;			// 0 is what legacy commands answer with, never sent
+	long[]				commandSentNanos;		// send time of each command id, for the round trip
 
 	SimpleTCP(PApplet p) {
 		parent			= p;
@@ -52,6 +54,8 @@ class SimpleTCP {
 		resendRequestEndBytes = new int[resendRequestBufLen];
 		resendRequestTimestamps = new long[resendRequestBufLen];
 		resendRequestTail = 0;
+		nextCommandId	= 1;
+		commandSentNanos = new long[65536];
 	}
 
 	long PrintStatus() {
@@ -305,6 +309,36 @@ class SimpleTCP {
 		}
 	}
 	
+	// Send a command frame, see CardioKitCommandSpace.h. Returns its id, the response carries it back
+	int SendCommand(Client c, int opcode, int argType, int index, int value) {
+		int id = this.nextCommandId;
+		this.nextCommandId = (this.nextCommandId % 65535) + 1;
+		SimpleTcpCommand cmd = new SimpleTcpCommand(id, opcode, argType, index, value);
+		this.commandSentNanos[id] = System.nanoTime();
+		c.write(cmd.PackCommand());
+		return id;
+	}
+	
+	// Send commands that must take effect together, each row is opcode, argType, index, value. Returns the first id
+	// Only settings the device reads between frames (filters, motion) batch, mux, scan focus, DAC and pacing are refused
+	int SendCommandBatch(Client c, int[][] commands) {
+		int first = -1;
+		for(int i = 0; i < commands.length; i++) {
+			int argType = commands[i][1] | ((i < commands.length - 1) ? SimpleTcpCommand.BATCH_MORE : 0);
+			int id = this.SendCommand(c, commands[i][0], argType, commands[i][2], commands[i][3]);
+			if(first < 0) { first = id; }
+		}
+		return first;
+	}
+	
+	// Nanoseconds since the command with this id was sent, -1 if it wasn't
+	long CommandRoundTripNanos(int id) {
+		if((id <= 0) || (this.commandSentNanos[id] == 0)) { return -1; }
+		long rtt = System.nanoTime() - this.commandSentNanos[id];
+		this.commandSentNanos[id] = 0;
+		return rtt;
+	}
+	
 	// Send the Teensy Host a RESET command
 	void RequestReset(Client c) {
 		SimpleTcpNacket	nack = new SimpleTcpNacket(0xFFFFDEAD, 1);
@@ -364,6 +398,49 @@ class SimpleTcpNacket {
 	}
 }
 
+// Use: c = SimpleTcpCommand(id, opcode, argType, index, value)
+//      client.write(c.PackCommand())
+class SimpleTcpCommand {
+	static final int ARG_UINT  = 0; // CKARG_* in CardioKitCommandSpace.h
+	static final int ARG_INT   = 1;
+	static final int ARG_FLOAT = 2;
+	static final int BATCH_MORE = 0x80; // or into argType, the device holds the command until one without it
+	int		id;
+	int		opcode;
+	int		argType;
+	int		index;
+	int		value;
+
+	SimpleTcpCommand(int id, int opcode, int argType, int index, int value) {
+		this.id			= id;
+		this.opcode		= opcode;
+		this.argType	= argType;
+		this.index		= index;
+		this.value		= value;
+	}
+
+	byte[] PackCommand() {
+		byte[] packed = new byte[12];
+		packed[0]	= (byte) 0xCD;
+		packed[1]	= (byte) ((this.id >>> 8) & 0xFF);
+		packed[2]	= (byte) ((this.id) & 0xFF);
+		packed[3]	= (byte) (this.opcode & 0xFF);
+		packed[4]	= (byte) (this.argType & 0xFF);
+		packed[5]	= (byte) ((this.index >>> 8) & 0xFF);
+		packed[6]	= (byte) ((this.index) & 0xFF);
+		packed[7]	= (byte) ((this.value >>> 24) & 0xFF);
+		packed[8]	= (byte) ((this.value >>> 16) & 0xFF);
+		packed[9]	= (byte) ((this.value >>> 8) & 0xFF);
+		packed[10]	= (byte) ((this.value) & 0xFF);
+		byte checksum = 0;
+		for(int i = 0; i < 11; i++) {
+			checksum ^= packed[i];
+		}
+		packed[11]	= checksum;
+		return packed;
+	}
+}
+
 class SimpleTcpAcket {
 	byte	ackSignifier;	// [0]
 	int		sequenceNumber;	// [1-4]
@@ -21,6 +21,8 @@ import java.io.FileWriter;
 import java.io.IOException;
 import java.time.format.DateTimeFormatter;  
 import java.time.LocalDateTime;    
+import java.util.ArrayList;
+import java.util.Arrays;
 import processing.core.*;
 import processing.net.*;
 import processing.sound.*;
@@ -57,15 +59,104 @@ public class UsingProcessing extends PApplet {
 	static final String[] CHANNEL_NAMES 		 	  = { "ECG0", "ECG1", "ECG2", "ECG3", "ECG4", "PCG", "ECG1", "ECG2", "ECG3", "ECG4", "ECG0", "ECG1", "ECG2", "ECG3", "ECG4", "AUSC", "ACCEL" };
 	static final int 	  PCG_CHANNEL			      = 5; // 0 indexed so if 3 channel, one is ecg and 2 is pcg set this to 1
 	static final int 	  ACCEL_CHANNEL			      = 6; // 0 indexed so if 3 channel, one is ecg and 2 is pcg set this to 2
-	static final int 	  CHANNEL_BUFFER_LENGTH 	  = 359/(NUM_DATA_STREAMS);
 	static final boolean  PCG_PRESENT                 = true;
 	static final boolean  ACCEL_PRESENT               = true;
+	static final int 	  PCG_SAMPLE_FREQ 			  = 1000; // PCG_OUTPUT_FREQ_HZ, only used for audio playback and the PCG csv
 	// END:   These variables must be identically set to those in the Teensy
 	
+	// Frame layout, see CardioKitFrame.h. Everything else about the layout is read from each frame's descriptors
+	static final int FRAME_TYPE_SAMPLES     = 0xCF;
+	static final int FRAME_TYPE_EVENTS      = 0xE5;
+	static final int FRAME_COMMON_BYTES     = 4; // type, count, frameBytes, shared by every frame type
+	static final int FRAME_HEADER_BYTES     = 12;
+	static final int EVENT_RECORD_HEADER_BYTES = 2;
+	static final int EVENT_RECORD_BEAT      = 0x01;
+	static final int EVENT_RECORD_SUMMARY   = 0x02;
+	static final int EVENT_RECORD_SNIPPET   = 0x03;
+	static final int EVENT_RECORD_PROFILE   = 0x04;
+	static final int EVENT_RECORD_POWER     = 0x05;
+	static final int EVENT_RECORD_DAC       = 0x06;
+	static final int EVENT_RECORD_SCAN      = 0x07;
+	static final int EVENT_RECORD_MOTION    = 0x08;
+	static final int EVENT_RECORD_ACCEL     = 0x09;
+	static final int EVENT_RECORD_RESPONSE  = 0x0A;
+	static final int EVENT_RECORD_LOG       = 0x0B;
+	static final int EVENT_RECORD_WARMSTART = 0x0C;
+	// WARMSTART_USED_* and _REJECT_* in CardioKitWarmStart.h, bit 0 up
+	static final String[] WARMSTART_PART_NAMES = { "DAC", "ADC0 cal", "ADC1 cal", "ADXL period", "ADC0 cal rejected", "ADC1 cal rejected" };
+	static final int EVENT_RECORD_BOOT      = 0x0D;
+	// BootStage_t in CardioKitBoot.h
+	static final String[] BOOT_STAGE_NAMES = { "setup", "ESP enable", "ADXL", "mux/DAC", "ADC", "acquisition", "setup done", "Start Ack" };
+	// HostCommand_t in CardioKitCommandSpace.c, the ones the keys below send
+	static final int CKCMD_FILTER_SELECT    = 0x04;
+	static final int CKCMD_FILTER_NOTCH     = 0x05;
+	static final int CKCMD_PROFILE_DUMP     = 0x06;
+	static final int CKCMD_MOTION_MODE      = 0x09;
+	static final int CKCMD_PING             = 0x0A;
+	static final int CKCMD_FILTER_COEF      = 0x0F;
+	static final int CKCMD_FILTER_LOAD      = 0x10;
+	static final int FILTER_CHAIN_ECG       = 0; // FilterChain_t in CardioKitFilter.h
+	static final String[] CKCMD_STATUS_NAMES = { "ok", "unknown opcode", "bad argument", "compiled out", "not allowed in a batch" };
+	static final long PING_INTERVAL_NANOS   = 2000000000L; // command round trip probe
+	// ACCEL_EVENT_* in CardioKitAccel.h, INT_SOURCE bit 6 down to 2
+	static final String[] ACCEL_EVENT_NAMES = { "free fall", "inactivity", "activity", "double tap", "tap" };
+	// ProfileSite_t order in CardioKitProfile.h
+	static final String[] PROFILE_SITE_NAMES = { "dmaBuffer0_isr", "dmaBuffer1_isr", "DecimatePcgBlock", "ADXL_ISR",
+		"AccelFifoDone", "updateDacControlValues2", "MotionProcessFrame", "QrsProcessFrame", "MonitorProcessFrame", "FilterFrame ECG", "FilterFrame PCG",
+		"SendPacketSlot", "HandleNacks", "Transmit", "EraseOldOutputBuffers", "AccelFillFrame angles" };
+	// LOG_MESSAGES in CardioKitLog.h by message id, level letter first. The device only sends the id and its arguments
+	static final String[] LOG_FORMATS = { "W ECG buffer overrun, frame %u with loop() at %u", "W ADXL FIFO overrun at tick %u, oldest samples lost",
+		"E Output buffer overflow, seq %u len %u not queued", "W Packet slots exhausted", "E Unsupported packet length %u", "D Nack seq %u len %u",
+		"W Can't find nack data at seq %u, output buffer head %u tail %u", "D Resent seq %u len %u" };
+	static final int LOG_ARGS               = 3;
+	static final int MONITOR_MODE_FEATURES  = 1; // the device dropped raw frames on a backed up link, see CardioKitMonitor.h
+	static final int SNIPPET_ESCAPE         = 0x80;
+	static final int FRAME_DESCRIPTOR_BYTES = 6;
+	static final int STREAM_ID_ECG          = 0;
+	static final int STREAM_ID_PCG          = 1;
+	static final int STREAM_ID_ACCEL        = 2;
+	static final int STREAM_ID_BATTERY      = 3;
+	static final int STREAM_ID_DAC          = 4;
+	static final int STREAM_ID_SCAN         = 5; // lead each ECG slot scanned, see CardioKitScan.h
+	static final int STREAM_ID_ORIENT       = 6; // pitch, roll (0.1 degree, signed) and magnitude (mg), see CardioKitAccel.h
+	static final int STREAM_FLAG_FILTERED   = 0x80; // the device already filtered this stream
+	static final int STREAM_FLAG_MOTION     = 0x40; // the device took the accelerometer predicted motion artifact out of the ECG
+	static final int STREAM_ID_MASK         = 0x3F;
+	boolean motionCancelled = false;
+	boolean[] channelFiltered = new boolean[NUM_DATA_STREAMS];
+	int[]   dacOffsets = new int[PCG_CHANNEL]; // latest DAC0 offset of each ECG channel
+	int[]   dacGains   = new int[PCG_CHANNEL]; // ADC counts per DAC code in Q4, from EVENT_RECORD_DAC
+	// ECG channels are scan slots, this is the lead each one scanned in the last frame. A lead on several
+	// slots is sampled that many times per scan, the slots are kept apart in channelBuffer and the csv
+	int[]   scanLayout     = new int[PCG_CHANNEL];
+	int[]   scanLayoutNext = new int[PCG_CHANNEL];
+	boolean batteryLow = false;
+	// Beats found on the device: scan, rrMillis, confidence, lead. See BeatEvent_t in CardioKitQrs.h
+	ArrayList<int[]> beats = new ArrayList<int[]>();
+	int heartRateBpm = 0;
+	int monitorMode  = 0;
+	int[] leadQuality = new int[PCG_CHANNEL]; // QRS signal to noise of each ECG channel in 1/16 steps
+	// Waveform snippets sent around beats in monitoring mode: scan of the first sample, lead, scans per sample, then samples
+	ArrayList<int[]> snippets = new ArrayList<int[]>();
+	// Command round trips, from the command frame leaving to its EVENT_RECORD_RESPONSE arriving
+	long lastPingNanos = 0;
+	long rttCount = 0, rttSumNanos = 0, rttMinNanos = Long.MAX_VALUE, rttMaxNanos = 0;
+	int  filterSelect = 0;
+	int  motionMode   = 0;
+	// Accelerometer interrupts: PDB tick, ACCEL_EVENT_* bits, ACT_TAP_STATUS. See CardioKitAccel.h
+	ArrayList<int[]> accelEvents = new ArrayList<int[]>();
+	
 	// Split buffers for each signal
 	int[][] channelBuffer     = new int[NUM_DATA_STREAMS][(secondsToRun+5) * CORE_SAMPLE_FREQ + 1000];
 	int[]   channelBufferTail = new int[NUM_DATA_STREAMS];
-	int 	stcpParseIndex 	  = 0;
+	int[]   channelPhase      = new int[NUM_DATA_STREAMS]; // resamples every stream to CORE_SAMPLE_FREQ for display and the csv
+	// ECG input level with the DAC offset added back, filled alongside channelBuffer and saved to its own csv
+	long[][] ecgAbsolute      = new long[PCG_CHANNEL][(secondsToRun+5) * CORE_SAMPLE_FREQ + 1000];
+	// Full-rate PCG for audio playback and its own csv
+	int[]   pcgBuffer         = new int[(secondsToRun+5) * PCG_SAMPLE_FREQ + 1000];
+	int     pcgBufferTail     = 0;
+	int 	stcpParseIndex 	  = 0; // byte index into stcp.rxData of the next frame to parse
+	long	nextStartTick	  = -1; // PDB tick the next sample frame should start at, -1 before the first one
 	//buffer valid indices and such, split the buffers and display them as theyre ready
 	
 	// Display Variables
@@ -107,7 +198,7 @@ public class UsingProcessing extends PApplet {
 	// Audio playback of PCG Variables, Implementing Double Buffering in one physical buffer
 	AudioSample audio;
 	static final int AUDIO_PLAYBACK_DELAY_MILLIS = 250; // buffer X milliseconds of audio before starting playback
-	static final int AUDIO_BUF_HALF_SIZE = (AUDIO_PLAYBACK_DELAY_MILLIS*CORE_SAMPLE_FREQ)/1000;
+	static final int AUDIO_BUF_HALF_SIZE = (AUDIO_PLAYBACK_DELAY_MILLIS*PCG_SAMPLE_FREQ)/1000;
 	static final int AUDIO_BUF_SIZE      = 2*AUDIO_BUF_HALF_SIZE;
 	float[] audioDoubleBuf 		 = new float[AUDIO_BUF_SIZE]; // playback buffer stores 1 second of samples
 	float[] audioDoubleBufShadow = new float[AUDIO_BUF_SIZE]; // buffer which is periodically copied into audioDoubleBuf
@@ -126,6 +217,7 @@ public class UsingProcessing extends PApplet {
 	static final int CardioKitHeight = 200;
 	static final int CardioKitWidth  = 200;
 	int angle = 0;
+	int[] orient = new int[3]; // pitch and roll in 0.1 degree, magnitude in mg
 	
 	public static void main(String[] args) {
 		PApplet.main("UsingProcessing");
@@ -184,20 +276,88 @@ public class UsingProcessing extends PApplet {
 	    pgCardioKit.textSize(32);
 	    pgCardioKit.fill(0, 102, 153, 204);
 	    pgCardioKit.text(angle, pgCardioKit.width/2, pgCardioKit.height/2);
+	    pgCardioKit.textSize(16);
+	    pgCardioKit.text("pitch " + (orient[0] / 10.0) + " roll " + (orient[1] / 10.0) + " " + orient[2] + "mg", pgCardioKit.width/2, pgCardioKit.height/2 + 32);
 	    pgCardioKit.endDraw();
 	}
 	
-	// gives the channel number corresponding to a 16-bit index in a channel packed like STCP
-	public int WhichChannel(int index) {
-		return Math.floorDiv(index, CHANNEL_BUFFER_LENGTH) % NUM_DATA_STREAMS;
+	// read the little-endian 16-bit word starting at byteIndex of stcp.rxData
+	public int ReadWord(int byteIndex) {
+		int val  = ((stcp.rxData[byteIndex + 1]) & 0x000000FF) << 8;
+		val     |= ((stcp.rxData[byteIndex    ]) & 0x000000FF);
+		return val;
+	}
+	
+	// read the little-endian unsigned 32-bit word starting at byteIndex of stcp.rxData
+	public long ReadLong(int byteIndex) {
+		return ((long) ReadWord(byteIndex)) | (((long) ReadWord(byteIndex + 2)) << 16);
+	}
+	
+	// gives the channelBuffer index a stream word belongs to, -1 if it isn't stored in channelBuffer
+	public int WhichChannel(int streamId, int word) {
+		switch(streamId) {
+			case STREAM_ID_ECG:   return word;
+			case STREAM_ID_PCG:   return PCG_CHANNEL;
+			case STREAM_ID_ACCEL: return ACCEL_CHANNEL;
+			default:              return -1;
+		}
+	}
+	
+	public void PrintCommandLatency() {
+		if(rttCount == 0) { System.out.println("No command responses received"); return; }
+		System.out.println("Command round trip over " + rttCount + " responses min/mean/max: " + (rttMinNanos / 1000000.0) + "/"
+			+ (rttSumNanos / rttCount / 1000000.0) + "/" + (rttMaxNanos / 1000000.0) + "ms");
 	}
 	
-	// gives the entry number corresponding to a 16-bit index in a channel packed like STCP
-	public int WhichEntry(int index) {
-		return Math.floorDiv(index, CHANNEL_BUFFER_LENGTH * NUM_DATA_STREAMS) * CHANNEL_BUFFER_LENGTH + (index % CHANNEL_BUFFER_LENGTH);
+	// Biquad b0, b1, b2, a1, a2 of a 2nd order Butterworth high-pass or low-pass, the RBJ cookbook design the device uses
+	public double[] DesignButterworth(boolean highpass, double f0, double fs) {
+		double w0    = 2.0 * Math.PI * f0 / fs;
+		double cs    = Math.cos(w0);
+		double alpha = Math.sin(w0) / (2.0 * 0.70710678);
+		double a0    = 1.0 + alpha;
+		double b1    = highpass ? -(1.0 + cs) : (1.0 - cs);
+		double b0    = highpass ? -b1 / 2.0 : b1 / 2.0;
+		return new double[] { b0 / a0, b1 / a0, b0 / a0, (-2.0 * cs) / a0, (1.0 - alpha) / a0 };
+	}
+	
+	// Stage every coefficient, at most 15 commands per batch to fit the device queue, then load the chain in one command
+	public void SendFilterCoefficients(int chain, double[][] stages) {
+		int[][] batch = new int[stages.length * 5][];
+		for(int s = 0; s < stages.length; s++) {
+			for(int c = 0; c < 5; c++) {
+				batch[5*s + c] = new int[] { CKCMD_FILTER_COEF, SimpleTcpCommand.ARG_FLOAT, c | (s << 4) | (chain << 8), Float.floatToIntBits((float) stages[s][c]) };
+			}
+		}
+		for(int start = 0; start < batch.length; start += 15) {
+			stcp.SendCommandBatch(myClient, java.util.Arrays.copyOfRange(batch, start, Math.min(start + 15, batch.length)));
+		}
+		stcp.SendCommand(myClient, CKCMD_FILTER_LOAD, SimpleTcpCommand.ARG_UINT, chain, stages.length);
+	}
+	
+	// f: filtered ECG on/off, n: filtered ECG on with a 50Hz notch in one batch, c: load a 0.5-40Hz ECG band-pass designed here
+	// m: next motion cancellation mode, p: profile dump
+	public void keyPressed() {
+		if(key == 'f') {
+			filterSelect ^= 0x1;
+			stcp.SendCommand(myClient, CKCMD_FILTER_SELECT, SimpleTcpCommand.ARG_UINT, 0, filterSelect);
+		} else if(key == 'n') {
+			filterSelect |= 0x1;
+			stcp.SendCommandBatch(myClient, new int[][] {
+				{ CKCMD_FILTER_NOTCH,  SimpleTcpCommand.ARG_FLOAT, 0, Float.floatToIntBits(50.0f) },
+				{ CKCMD_FILTER_SELECT, SimpleTcpCommand.ARG_UINT,  0, filterSelect } });
+		} else if(key == 'c') {
+			SendFilterCoefficients(FILTER_CHAIN_ECG, new double[][] {
+				DesignButterworth(true, 0.5, CORE_SAMPLE_FREQ), DesignButterworth(false, 40.0, CORE_SAMPLE_FREQ) });
+		} else if(key == 'm') {
+			motionMode = (motionMode + 1) % 3;
+			stcp.SendCommand(myClient, CKCMD_MOTION_MODE, SimpleTcpCommand.ARG_UINT, 0, motionMode);
+		} else if(key == 'p') {
+			stcp.SendCommand(myClient, CKCMD_PROFILE_DUMP, SimpleTcpCommand.ARG_UINT, 0, 0);
+		}
 	}
 	
 	public void HandleShutdownAndSave() {
+		PrintCommandLatency();
 		stcp.RequestReset(myClient);
 		
 		int index = 0;
@@ -209,9 +369,9 @@ public class UsingProcessing extends PApplet {
 			}
 		}
 		
+		DateTimeFormatter dtf = DateTimeFormatter.ofPattern("yyyy_MM_dd_HH_mm_ss");  
+		LocalDateTime now = LocalDateTime.now();  
 		try {
-			DateTimeFormatter dtf = DateTimeFormatter.ofPattern("yyyy_MM_dd_HH_mm_ss");  
-		    LocalDateTime now = LocalDateTime.now();  
 		    System.out.println(dtf.format(now));  
 		    StringBuilder filename = new StringBuilder();
 		    filename.append(folder);
@@ -251,37 +411,445 @@ public class UsingProcessing extends PApplet {
 		} catch (IOException e) {
 			e.printStackTrace();
 		}
+		if(PCG_PRESENT) { SavePcgAtFullRate(dtf.format(now)); }
+		SaveAbsoluteEcg(dtf.format(now));
+		SaveBeats(dtf.format(now));
+		SaveSnippets(dtf.format(now));
+		SaveAccelEvents(dtf.format(now));
 		System.out.println("Done Saving");
 		System.exit(0);
 	}
 	
-	public void SeparateStreamIntoChannels() {
-		int validUntil = Math.floorDiv(stcp.dataValidUntil, 2);
-		
-		// validUntil now stores the 16-bit index into stcp.rxData of the last contiguously valid 16-bit word
-		// while there are 16-bit words left to parse
-		while(stcpParseIndex < validUntil) {
-			int ch = WhichChannel(stcpParseIndex);
-			int entry = WhichEntry(stcpParseIndex);
-			int val  = ((stcp.rxData[stcpParseIndex*2 + 1]) & 0x000000FF) << 8;
-			val     |= ((stcp.rxData[stcpParseIndex*2    ]) & 0x000000FF);	
-			channelBuffer[ch][entry] = val;
-			if(PCG_PRESENT && (ch == PCG_CHANNEL)) { 
-				audioDoubleBufShadow[entry % AUDIO_BUF_SIZE] = (3.0f*((float)val)/65536f)-1.0f;
+	// Beats found on the device, one per line: scan (CORE_SAMPLE_FREQ ticks since device boot), rrMillis, confidence, lead
+	public void SaveBeats(String timestamp) {
+		StringBuilder beatSb = new StringBuilder();
+		for(int[] beat : beats) {
+			beatSb.append(beat[0]).append(",").append(beat[1]).append(",").append(beat[2]).append(",").append(beat[3]).append("\n");
+		}
+		try {
+			BufferedWriter beatBr = new BufferedWriter(new FileWriter(folder + "ck" + timestamp + "_beats.csv"));
+			beatBr.write(beatSb.toString());
+			beatBr.close();
+		} catch (IOException e) {
+			e.printStackTrace();
+		}
+	}
+	
+	// Accelerometer interrupts, one per line: PDB tick (same timebase as the frame start ticks), event bits, tap axes
+	public void SaveAccelEvents(String timestamp) {
+		if(accelEvents.isEmpty()) { return; }
+		StringBuilder eventSb = new StringBuilder();
+		for(int[] event : accelEvents) {
+			eventSb.append(event[0] & 0xFFFFFFFFL).append(",").append(event[1]).append(",").append(event[2]).append("\n");
+		}
+		try {
+			BufferedWriter eventBr = new BufferedWriter(new FileWriter(folder + "ck" + timestamp + "_accel_events.csv"));
+			eventBr.write(eventSb.toString());
+			eventBr.close();
+		} catch (IOException e) {
+			e.printStackTrace();
+		}
+	}
+	
+	// Snippets received in monitoring mode, one per line: scan, lead, decimation, samples
+	public void SaveSnippets(String timestamp) {
+		if(snippets.isEmpty()) { return; }
+		StringBuilder snippetSb = new StringBuilder();
+		for(int[] snippet : snippets) {
+			for(int i = 0; i < snippet.length; i++) {
+				snippetSb.append(snippet[i]).append((i == snippet.length - 1) ? "\n" : ",");
 			}
-			else if(ACCEL_PRESENT && (ch == ACCEL_CHANNEL)) {
-				// store the most recent device tilt angle for display
-				angle = channelBuffer[ch][entry];
-				System.out.println(angle);
+		}
+		try {
+			BufferedWriter snippetBr = new BufferedWriter(new FileWriter(folder + "ck" + timestamp + "_snippets.csv"));
+			snippetBr.write(snippetSb.toString());
+			snippetBr.close();
+		} catch (IOException e) {
+			e.printStackTrace();
+		}
+	}
+	
+	// ECG channels as absolute input counts (AbsoluteEcgCounts) in the main csv's format, filtered frames are saved as received
+	public void SaveAbsoluteEcg(String timestamp) {
+		int totalSamplesPerChannel = CORE_SAMPLE_FREQ*secondsToRun;
+		StringBuilder absSb = new StringBuilder();
+		absSb.append(CORE_SAMPLE_FREQ);
+		absSb.append(",");
+		absSb.append(PCG_CHANNEL);
+		absSb.append(",");
+		absSb.append(secondsToRun);
+		absSb.append(",");
+		for(int ch = 0; ch < PCG_CHANNEL; ch++) {
+			for(int entry = 0; entry < totalSamplesPerChannel; entry++) {
+				absSb.append(ecgAbsolute[ch][entry]);
+				absSb.append(",");
+			}
+		}
+		absSb.append("-1");
+		
+		try {
+			BufferedWriter absBr = new BufferedWriter(new FileWriter(folder + "ck" + timestamp + "_abs.csv"));
+			absBr.write(absSb.toString());
+			absBr.close();
+		} catch (IOException e) {
+			e.printStackTrace();
+		}
+	}
+	
+	// The main csv holds PCG at CORE_SAMPLE_FREQ, save it again at PCG_SAMPLE_FREQ in the same format with one channel
+	public void SavePcgAtFullRate(String timestamp) {
+		int totalSamples = Math.min(pcgBufferTail, PCG_SAMPLE_FREQ*secondsToRun);
+		StringBuilder pcgSb = new StringBuilder();
+		pcgSb.append(PCG_SAMPLE_FREQ);
+		pcgSb.append(",1,");
+		pcgSb.append(secondsToRun);
+		pcgSb.append(",");
+		for(int i = 0; i < totalSamples; i++) {
+			pcgSb.append(pcgBuffer[i]);
+			pcgSb.append(",");
+		}
+		pcgSb.append("-1");
+		
+		try {
+			BufferedWriter pcgBr = new BufferedWriter(new FileWriter(folder + "ck" + timestamp + "_pcg.csv"));
+			pcgBr.write(pcgSb.toString());
+			pcgBr.close();
+		} catch (IOException e) {
+			e.printStackTrace();
+		}
+	}
+	
+	public void SeparateStreamIntoChannels() {
+		int validUntil = stcp.dataValidUntil;
+		
+		// validUntil is the byte index into stcp.rxData of the first byte not yet received
+		// only parse frames that have fully arrived
+		while((stcpParseIndex + FRAME_COMMON_BYTES) <= validUntil) {
+			int frameType  = stcp.rxData[stcpParseIndex    ] & 0x000000FF;
+			int numStreams = stcp.rxData[stcpParseIndex + 1] & 0x000000FF;
+			int frameBytes = ReadWord(stcpParseIndex + 2);
+			if(frameBytes < FRAME_COMMON_BYTES) {
+				System.out.println("ERROR: Bad Frame Length " + frameBytes + " at " + stcpParseIndex);
+				HandleShutdownAndSave();
 			}
-			channelBufferTail[ch]++;
-			stcpParseIndex++;
+			if((stcpParseIndex + frameBytes) > validUntil) { break; }
+			
+			// unknown frame types are skipped using their length
+			if(frameType == FRAME_TYPE_SAMPLES) { DecodeSampleFrame(stcpParseIndex, numStreams); }
+			else if(frameType == FRAME_TYPE_EVENTS) { DecodeEventFrame(stcpParseIndex, numStreams); }
+			stcpParseIndex += frameBytes;
 		}
-		if(validUntil >= TotalSamplesToCollect) {
+		if(channelBufferTail[0] >= CORE_SAMPLE_FREQ*secondsToRun) {
 			HandleShutdownAndSave();
 		}
 	}
 	
+	// Split one sample frame into channelBuffer using its layout descriptors
+	public void DecodeSampleFrame(int frameStart, int numStreams) {
+		int baseRateHz = ReadWord(frameStart + 6);
+		long startTick = ReadLong(frameStart + 8);
+		int dataIndex  = frameStart + FRAME_HEADER_BYTES + numStreams*FRAME_DESCRIPTOR_BYTES;
+		if((nextStartTick >= 0) && (startTick > nextStartTick)) {
+			PadGap(startTick - nextStartTick, baseRateHz);
+		}
+		int[] ecgStart = Arrays.copyOf(channelBufferTail, PCG_CHANNEL);
+		long frameTicks = 0;
+		for(int s = 0; s < numStreams; s++) {
+			int descriptor = frameStart + FRAME_HEADER_BYTES + s*FRAME_DESCRIPTOR_BYTES;
+			int streamId   = stcp.rxData[descriptor    ] & STREAM_ID_MASK;
+			boolean filtered = (stcp.rxData[descriptor] & STREAM_FLAG_FILTERED) != 0;
+			if(streamId == STREAM_ID_ECG) {
+				boolean motion = (stcp.rxData[descriptor] & STREAM_FLAG_MOTION) != 0;
+				if(motion != motionCancelled) {
+					System.out.println("Motion artifact cancellation " + (motion ? "on" : "off") + " from tick " + startTick);
+				}
+				motionCancelled = motion;
+			}
+			int width      = stcp.rxData[descriptor + 1] & 0x000000FF;
+			int count      = ReadWord(descriptor + 2);
+			int decimation = ReadWord(descriptor + 4);
+			frameTicks = Math.max(frameTicks, (long) count * decimation);
+			for(int word = 0; word < width; word++) {
+				int ch = WhichChannel(streamId, word);
+				if(ch >= 0) { channelFiltered[ch] = filtered; }
+				for(int i = 0; i < count; i++) {
+					StoreStreamSample(streamId, word, ReadWord(dataIndex), decimation, baseRateHz);
+					dataIndex += 2;
+				}
+			}
+		}
+		nextStartTick = startTick + frameTicks;
+		// the DAC stream follows ECG in the frame, so the offsets are this frame's once every stream is decoded
+		for(int ch = 0; ch < PCG_CHANNEL; ch++) {
+			for(int i = ecgStart[ch]; i < channelBufferTail[ch]; i++) {
+				ecgAbsolute[ch][i] = channelFiltered[ch] ? channelBuffer[ch][i] : AbsoluteEcgCounts(ch, channelBuffer[ch][i]);
+			}
+		}
+		if(!Arrays.equals(scanLayout, scanLayoutNext)) {
+			System.arraycopy(scanLayoutNext, 0, scanLayout, 0, scanLayout.length);
+			System.out.println("Scan layout from tick " + startTick + ": slot leads " + Arrays.toString(scanLayout));
+		}
+	}
+	
+	// Walk the records of one event frame, unknown record types are skipped using their length
+	public void DecodeEventFrame(int frameStart, int numRecords) {
+		int recordIndex = frameStart + FRAME_COMMON_BYTES;
+		for(int r = 0; r < numRecords; r++) {
+			int recordType  = stcp.rxData[recordIndex    ] & 0x000000FF;
+			int recordBytes = stcp.rxData[recordIndex + 1] & 0x000000FF;
+			int payload     = recordIndex + EVENT_RECORD_HEADER_BYTES;
+			if(recordType == EVENT_RECORD_BEAT) {
+				int scan       = ReadWord(payload) | (ReadWord(payload + 2) << 16);
+				int rrMillis   = ReadWord(payload + 4);
+				int confidence = stcp.rxData[payload + 6] & 0x000000FF;
+				int lead       = stcp.rxData[payload + 7] & 0x000000FF;
+				beats.add(new int[] { scan, rrMillis, confidence, lead });
+				if(rrMillis > 0) { heartRateBpm = 60000 / rrMillis; }
+			} else if(recordType == EVENT_RECORD_SUMMARY) {
+				int mode = stcp.rxData[payload + 4] & 0x000000FF;
+				if(mode != monitorMode) {
+					System.out.println((mode == MONITOR_MODE_FEATURES) ? "Link degraded, monitoring mode" : "Link recovered, raw frames resumed");
+				}
+				monitorMode  = mode;
+				heartRateBpm = ReadWord(payload + 6);
+				angle        = ReadWord(payload + 8);
+				int numLeads = stcp.rxData[payload + 10] & 0x000000FF;
+				for(int lead = 0; lead < Math.min(numLeads, leadQuality.length); lead++) {
+					leadQuality[lead] = stcp.rxData[payload + 11 + lead] & 0x000000FF;
+				}
+			} else if(recordType == EVENT_RECORD_SNIPPET) {
+				DecodeSnippet(payload);
+			} else if(recordType == EVENT_RECORD_PROFILE) {
+				int site     = stcp.rxData[payload] & 0x000000FF;
+				int headroom = stcp.rxData[payload + 1]; // signed
+				int load     = ReadWord(payload + 2);
+				String name  = (site < PROFILE_SITE_NAMES.length) ? PROFILE_SITE_NAMES[site] : ("site " + site);
+				System.out.println("Profile " + name + " n:" + ReadLong(payload + 4) + " min/mean/max:" + ReadLong(payload + 8) + "/"
+					+ ReadLong(payload + 12) + "/" + ReadLong(payload + 16) + " headroom:" + headroom + "% load:" + (load / 10.0) + "%");
+			} else if(recordType == EVENT_RECORD_POWER) {
+				int mode    = stcp.rxData[payload + 4] & 0x000000FF;
+				int coreMHz = ReadWord(payload + 5);
+				int duty    = ReadWord(payload + 7);
+				int current = ReadWord(payload + 9); // estimated on the device, 0.1mA steps
+				System.out.println("Power " + ((mode == MONITOR_MODE_FEATURES) ? "monitoring" : "raw") + " over " + ReadLong(payload) + "ms core:"
+					+ coreMHz + "MHz duty:" + (duty / 10.0) + "% est core:" + (current / 10.0) + "mA");
+			} else if(recordType == EVENT_RECORD_SCAN) {
+				int focus    = stcp.rxData[payload] & 0x000000FF;
+				int numSlots = stcp.rxData[payload + 1] & 0x000000FF;
+				int deadMask = stcp.rxData[payload + 2 + numSlots] & 0x000000FF;
+				String leads = "";
+				for(int slot = 0; slot < numSlots; slot++) {
+					leads += (stcp.rxData[payload + 2 + slot] & 0x000000FF) + " ";
+				}
+				System.out.println("Scan layout chosen, focus:" + focus + " dead leads:0x" + Integer.toHexString(deadMask) + " slot leads: " + leads);
+			} else if(recordType == EVENT_RECORD_MOTION) {
+				int mode     = stcp.rxData[payload] & 0x000000FF;
+				int numSlots = stcp.rxData[payload + 1] & 0x000000FF;
+				String slots = "";
+				for(int slot = 0; slot < numSlots; slot++) {
+					int base      = payload + 2 + 7*slot;
+					int reduction = (short) ReadWord(base + 1); // 0.1dB, signed
+					slots += " lead " + (stcp.rxData[base] & 0x000000FF) + ": " + (reduction / 10.0) + "dB of " + ReadWord(base + 3)
+						+ " rms |w|:" + (ReadWord(base + 5) / 256.0) + ";";
+				}
+				System.out.println("Motion cancellation " + ((mode == 2) ? "cancelling" : "learning") + slots);
+			} else if(recordType == EVENT_RECORD_ACCEL) {
+				int tick    = (int) ReadLong(payload);
+				int events  = stcp.rxData[payload + 4] & 0x000000FF;
+				int tapAxes = stcp.rxData[payload + 5] & 0x000000FF;
+				int dropped = stcp.rxData[payload + 6] & 0x000000FF;
+				accelEvents.add(new int[] { tick, events, tapAxes });
+				String names = "";
+				for(int bit = 0; bit < ACCEL_EVENT_NAMES.length; bit++) {
+					if((events & (0x04 << bit)) != 0) { names += " " + ACCEL_EVENT_NAMES[bit]; }
+				}
+				System.out.println("Accelerometer" + names + " at tick " + tick + ((dropped > 0) ? (", " + dropped + " more lost") : ""));
+			} else if(recordType == EVENT_RECORD_RESPONSE) {
+				int id         = ReadWord(payload);
+				int opcode     = stcp.rxData[payload + 2] & 0x000000FF;
+				int status     = stcp.rxData[payload + 3] & 0x000000FF;
+				long value     = ReadLong(payload + 4);
+				int execMicros = ReadWord(payload + 8);
+				long waitMicros = ReadLong(payload + 10);
+				int dropped    = stcp.rxData[payload + 14] & 0x000000FF;
+				long rtt       = stcp.CommandRoundTripNanos(id);
+				if(dropped > 0) {
+					System.out.println(dropped + " commands dropped by the device before id " + id + ", its queue was full");
+				}
+				if(rtt >= 0) {
+					rttCount++;
+					rttSumNanos += rtt;
+					rttMinNanos  = Math.min(rttMinNanos, rtt);
+					rttMaxNanos  = Math.max(rttMaxNanos, rtt);
+				}
+				if((opcode != CKCMD_PING) || (status != 0)) {
+					String statusName = (status < CKCMD_STATUS_NAMES.length) ? CKCMD_STATUS_NAMES[status] : ("status " + status);
+					System.out.println("Command 0x" + Integer.toHexString(opcode) + " id " + id + ": " + statusName + " value:" + value
+						+ " queued:" + waitMicros + "us run:" + execMicros + "us" + ((rtt >= 0) ? (" round trip:" + (rtt / 1000000.0) + "ms") : ""));
+				}
+			} else if(recordType == EVENT_RECORD_LOG) {
+				long deviceMicros = ReadLong(payload);
+				int id            = ReadWord(payload + 4);
+				int dropped       = stcp.rxData[payload + 6] & 0x000000FF;
+				long[] args       = new long[LOG_ARGS];
+				for(int a = 0; a < LOG_ARGS; a++) {
+					args[a] = ReadLong(payload + 7 + 4*a);
+				}
+				String message = (id < LOG_FORMATS.length) ? FormatDeviceLog(LOG_FORMATS[id], args) : ("message " + id);
+				System.out.println("Device " + deviceMicros + "us " + message + ((dropped > 0) ? (" (" + dropped + " entries lost before)") : ""));
+			} else if(recordType == EVENT_RECORD_WARMSTART) {
+				long validMillis = ReadLong(payload);
+				long acqMillis   = ReadLong(payload + 4);
+				int powerOn      = stcp.rxData[payload + 8] & 0x000000FF;
+				int used         = stcp.rxData[payload + 9] & 0x000000FF;
+				int settled      = stcp.rxData[payload + 10] & 0x000000FF;
+				int misses       = stcp.rxData[payload + 11] & 0x000000FF;
+				String parts = "";
+				for(int bit = 0; bit < WARMSTART_PART_NAMES.length; bit++) {
+					if((used & (1 << bit)) != 0) { parts += " " + WARMSTART_PART_NAMES[bit] + ";"; }
+				}
+				System.out.println(((powerOn != 0) ? "Power-on" : "Reset") + " start, cached:" + ((used == 0) ? " none" : parts)
+					+ " acquisition at " + acqMillis + "ms, ECG valid " + ((validMillis > 0) ? ("at " + validMillis + "ms") : ("not yet, settled slots 0x" + Integer.toHexString(settled)))
+					+ ((misses != 0) ? (", DAC cache missed on slots 0x" + Integer.toHexString(misses)) : ""));
+			} else if(recordType == EVENT_RECORD_BOOT) {
+				int numStages = stcp.rxData[payload] & 0x000000FF;
+				String stages = "";
+				long last = 0;
+				for(int i = 0; i < numStages; i++) {
+					long stageMicros = ReadLong(payload + 1 + 4*i);
+					String name = (i < BOOT_STAGE_NAMES.length) ? BOOT_STAGE_NAMES[i] : ("stage " + i);
+					stages += " " + name + " " + (stageMicros / 1000.0) + "ms (+" + ((stageMicros - last) / 1000.0) + ");";
+					last = stageMicros;
+				}
+				System.out.println("Device boot, since reset:" + stages);
+			} else if(recordType == EVENT_RECORD_DAC) {
+				int ch = stcp.rxData[payload + 4] & 0x000000FF;
+				if(ch < dacOffsets.length) {
+					dacOffsets[ch] = ReadWord(payload + 6); // also arrives while sample frames are dropped
+					dacGains[ch]   = ReadWord(payload + 10);
+				}
+			}
+			recordIndex = payload + recordBytes;
+		}
+	}
+	
+	// printf of a device log message, %d, %u and %x each take one of the uint32 arguments in order
+	public String FormatDeviceLog(String format, long[] args) {
+		StringBuilder out = new StringBuilder();
+		int arg = 0;
+		for(int i = 0; i < format.length(); i++) {
+			char c = format.charAt(i);
+			if(c != '%' || i + 1 >= format.length()) { out.append(c); continue; }
+			char spec = format.charAt(++i);
+			long value = (arg < args.length) ? args[arg] : 0;
+			if(spec == 'd')      { out.append((int) value); arg++; }
+			else if(spec == 'u') { out.append(value); arg++; }
+			else if(spec == 'x') { out.append(Long.toHexString(value)); arg++; }
+			else                 { out.append(spec); } // %%
+		}
+		return out.toString();
+	}
+	
+	// Undo the delta coding and the dropped LSBs of one snippet record
+	public void DecodeSnippet(int payload) {
+		int scan       = ReadWord(payload) | (ReadWord(payload + 2) << 16);
+		int lead       = stcp.rxData[payload + 4] & 0x000000FF;
+		int decimation = stcp.rxData[payload + 5] & 0x000000FF;
+		int shift      = stcp.rxData[payload + 6] & 0x000000FF;
+		int count      = stcp.rxData[payload + 7] & 0x000000FF;
+		int[] snippet  = new int[3 + count];
+		snippet[0] = scan;
+		snippet[1] = lead;
+		snippet[2] = decimation;
+		int index = payload + 8;
+		int val   = 0;
+		for(int i = 0; i < count; i++) {
+			int b = stcp.rxData[index] & 0x000000FF;
+			if(i == 0 || b == SNIPPET_ESCAPE) {
+				if(i > 0) { index++; }
+				val = ReadWord(index);
+				index += 2;
+			} else {
+				val += (byte) b;
+				index++;
+			}
+			snippet[3 + i] = val << shift;
+		}
+		snippets.add(snippet);
+	}
+	
+	// Frames the device did not send (monitoring mode) leave a gap in the shared tick count
+	// Hold every channel at its last value over it so the buffers and csv files stay continuous in time
+	public void PadGap(long gapTicks, int baseRateHz) {
+		System.out.println("WARNING: " + (gapTicks * 1000 / baseRateHz) + "ms of samples missing, holding last values");
+		int channelSamples = (int) ((gapTicks * CORE_SAMPLE_FREQ) / baseRateHz);
+		for(int ch = 0; ch < NUM_DATA_STREAMS; ch++) {
+			int last = (channelBufferTail[ch] > 0) ? channelBuffer[ch][channelBufferTail[ch] - 1] : 0;
+			for(int i = 0; (i < channelSamples) && (channelBufferTail[ch] < channelBuffer[ch].length); i++) {
+				if(ch < PCG_CHANNEL) { ecgAbsolute[ch][channelBufferTail[ch]] = (channelBufferTail[ch] > 0) ? ecgAbsolute[ch][channelBufferTail[ch] - 1] : 0; }
+				channelBuffer[ch][channelBufferTail[ch]++] = last;
+			}
+		}
+		if(PCG_PRESENT) {
+			int pcgSamples = (int) ((gapTicks * PCG_SAMPLE_FREQ) / baseRateHz);
+			int last = (pcgBufferTail > 0) ? pcgBuffer[pcgBufferTail - 1] : 0;
+			for(int i = 0; (i < pcgSamples) && (pcgBufferTail < pcgBuffer.length); i++) {
+				pcgBuffer[pcgBufferTail] = last;
+				audioDoubleBufShadow[pcgBufferTail % AUDIO_BUF_SIZE] = (3.0f*((float)last)/65536f)-1.0f;
+				pcgBufferTail++;
+			}
+		}
+	}
+	
+	// Input DC level of an ECG channel in ADC counts, the DAC offset added back using the gain the device learned
+	public long AbsoluteEcgCounts(int ch, int adc) {
+		return (long) adc - ((long) dacGains[ch] * dacOffsets[ch]) / 16;
+	}
+	
+	// Slower streams are held and faster ones are dropped so every channelBuffer stays at CORE_SAMPLE_FREQ
+	public void StoreStreamSample(int streamId, int word, int val, int decimation, int baseRateHz) {
+		if(PCG_PRESENT && (streamId == STREAM_ID_PCG)) {
+			pcgBuffer[pcgBufferTail] = val;
+			audioDoubleBufShadow[pcgBufferTail % AUDIO_BUF_SIZE] = (3.0f*((float)val)/65536f)-1.0f;
+			pcgBufferTail++;
+		}
+		if(streamId == STREAM_ID_BATTERY) {
+			batteryLow = (val == 0);
+			return;
+		} else if(streamId == STREAM_ID_DAC) {
+			dacOffsets[word] = val;
+			return;
+		} else if(streamId == STREAM_ID_SCAN) {
+			if(word < scanLayoutNext.length) { scanLayoutNext[word] = val; }
+			return;
+		} else if(streamId == STREAM_ID_ORIENT) {
+			if(word < orient.length) { orient[word] = (word < 2) ? (short) val : val; }
+			return;
+		}
+		int ch = WhichChannel(streamId, word);
+		if(ch < 0) { return; }
+		// each sample covers decimation base-rate ticks, each channelBuffer entry covers baseRateHz/CORE_SAMPLE_FREQ
+		channelPhase[ch] += decimation * CORE_SAMPLE_FREQ;
+		while(channelPhase[ch] >= baseRateHz) {
+			channelBuffer[ch][channelBufferTail[ch]++] = val;
+			channelPhase[ch] -= baseRateHz;
+		}
+		if(ACCEL_PRESENT && (ch == ACCEL_CHANNEL)) {
+			// store the most recent device tilt angle for display
+			angle = val;
+			System.out.println(angle);
+		}
+	}
+	
+	// the number of samples available in every displayed channel
+	public int MinDisplayChannelTail() {
+		int minTail = channelBufferTail[0];
+		for(int ch = 1; ch < NUM_DATA_STREAMS_TO_DISPLAY; ch++) {
+			minTail = Math.min(minTail, channelBufferTail[ch]);
+		}
+		return minTail;
+	}
+	
 	public void MovingAverage() {
 		// Implement a single moving average filter
 		int WINDOW_SIZE = 5;
@@ -431,8 +999,10 @@ public class UsingProcessing extends PApplet {
 				acc = (int) map(acc, 0, 65535, traceHeight, 0); // this flips the waveforms to account for y=0 being top of display
 				acc *= CHANNEL_SCALING[ch];
 				
-				acc = HighPassRealtime(acc, ch); // The highpass corner is sample-rate dependent (for now)
-				acc = LowPassRealtime(acc, ch); // The lowpass corner is sample-rate dependent (for now)
+				if(!channelFiltered[ch]) {
+					acc = HighPassRealtime(acc, ch); // The highpass corner is sample-rate dependent (for now)
+					acc = LowPassRealtime(acc, ch); // The lowpass corner is sample-rate dependent (for now)
+				}
 				
 				// Offset this channel's trace by the desired amount for pretty display
 				acc += DisplayChannelOffsets[ch];
@@ -495,6 +1065,8 @@ public class UsingProcessing extends PApplet {
 		pgWaterfall.textSize(32);
 		pgWaterfall.text("1sec/div",10,40);
 		pgWaterfall.text("250uV/div",10,80);
+		pgWaterfall.text("HR " + heartRateBpm + " bpm",10,120);
+		if(monitorMode == MONITOR_MODE_FEATURES) { pgWaterfall.text("LINK DEGRADED - MONITORING",10,160); }
 		pgWaterfall.textSize(16);
 		for(int ch = 0; ch < NUM_DATA_STREAMS_TO_DISPLAY; ch++) {
 			int textY = DisplayBuffer[ch][0]+15;
@@ -515,7 +1087,7 @@ public class UsingProcessing extends PApplet {
 	public void HandleStartingAudioStream() {
 		// Fill the audioDoubleBuf
 		int audioDoubleBufStartIndex = audioChannelHead % AUDIO_BUF_SIZE;
-		int samplesToCopy =  channelBufferTail[PCG_CHANNEL] - audioChannelHead;
+		int samplesToCopy =  pcgBufferTail - audioChannelHead;
 		
 		if(samplesToCopy >= AUDIO_BUF_SIZE) { 
 			System.out.println("ERROR: AUDIO BUFFERING OVERFLOW" + samplesToCopy);
@@ -548,7 +1120,7 @@ public class UsingProcessing extends PApplet {
 			if(timeSinceStart >= timeToWait) {
 				// we've waiting the necessary amount of time to buffer audio samples, start playing the samples on loop
 				startedPlayback = true;
-				audio = new AudioSample(this, audioDoubleBuf, false, CORE_SAMPLE_FREQ);
+				audio = new AudioSample(this, audioDoubleBuf, false, PCG_SAMPLE_FREQ);
 				audio.rate(1);
 				audio.amp(1.0f);
 				audio.loop();
@@ -585,6 +1157,12 @@ public class UsingProcessing extends PApplet {
 			}
 		}
 		
+		// Probe the command round trip now and then
+		if(System.nanoTime() - lastPingNanos > PING_INTERVAL_NANOS) {
+			lastPingNanos = System.nanoTime();
+			stcp.SendCommand(myClient, CKCMD_PING, SimpleTcpCommand.ARG_UINT, 0, (int) rttCount);
+		}
+		
 		// Parse the incoming data
 		stcp.ParseStream(myClient);
 		stcp.RequestResend(myClient);
@@ -607,10 +1185,7 @@ public class UsingProcessing extends PApplet {
 		tLast = tNow;
 		
 		// handle case where not enough samples have arrived yet to display
-		// figure out last byte of packet in which the data we are trying to display is located
-		int packetNumberOfSample = 1 + ((samplesToDisplayPerCh + totalSamplesDisplayedPerCh)/CHANNEL_BUFFER_LENGTH);
-		int lastByteNeeded = (2*NUM_DATA_STREAMS*CHANNEL_BUFFER_LENGTH*packetNumberOfSample) - 1;
-		if( stcp.dataValidUntil <= lastByteNeeded) {
+		if( MinDisplayChannelTail() < (samplesToDisplayPerCh + totalSamplesDisplayedPerCh)) {
 			// there are not enough samples present yet to display so don't display any and save them for next frame
 			frameResidual += samplesToDisplayPerCh;
 			samplesToDisplayPerCh = 0;